@@ -4,6 +4,13 @@
 #include "lualib.h"
 #include "lauxlib.h"
 
+// Calls its argument with lua_pcall and returns the status
+static int pcall_status(lua_State *L) {
+    lua_settop(L, 1);
+    lua_pushinteger(L, lua_pcall(L, 0, 0, 0));
+    return 1;
+}
+
 int main(void) {
     printf("Running H2: test_call\n");
 
@@ -38,6 +45,22 @@ int main(void) {
 
     printf("call test passed\n");
 
+    // An error under lua_pcall is reported to its C caller, even when a
+    // Lua catch encloses the C function
+    lua_register(L, "pcall_status", pcall_status);
+    const char *nested =
+        "local ok, status = catch pcall_status(function() error('x') end)\n"
+        "assert(ok and status == 2, 'lua_pcall must catch the error')\n"
+        "assert(not catch error('again'))\n"
+        "return 'ok'";
+    if (luaL_dostring(L, nested) != LUA_OK) {
+        fprintf(stderr, "pcall under catch failed: %s\n", lua_tostring(L, -1));
+        return 1;
+    }
+    assert(lua_isstring(L, -1));
+
+    printf("pcall under catch test passed\n");
+
     lua_close(L);
     return 0;
 }
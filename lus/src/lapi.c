@@ -628,13 +628,14 @@ LUA_API void lua_pushenum(lua_State *L, int npairs) {
     api_check(L, ttisstring(str), "enum name must be a string");
     root->names[i] = tsvalue(str);
   }
+  luaE_indexroot(root);
   /* Replace the consumed pairs with an internal root anchor while creating the
   ** first enum value. */
   StkId rootslot = L->top.p - (npairs * 2);
   setgcovalue(L, s2v(rootslot), obj2gco(root));
   L->top.p = rootslot + 1;
   /* Create first enum value and push it */
-  e = luaE_new(L, root, 1);
+  e = luaE_getbyidx(L, root, 1);
   setenumvalue(L, s2v(rootslot), e);
   luaC_checkGC(L);
   lua_unlock(L);
@@ -1195,6 +1196,29 @@ LUA_API int lua_gc(lua_State *L, int what, ...) {
   return res;
 }
 
+/*
+** Regions run on the generational collector: opening the outermost
+** region switches an incremental collector to generational mode (once;
+** the collector stays there afterwards).
+*/
+LUA_API void lus_beginregion(lua_State *L) {
+  global_State *g = G(L);
+  lua_lock(L);
+  if (g->gcregions++ == 0 && g->gckind == KGC_INC &&
+      !(g->gcstp & (GCSTPGC | GCSTPCLS)))
+    luaC_changemode(L, KGC_GENMINOR);
+  lua_unlock(L);
+}
+
+LUA_API void lus_endregion(lua_State *L) {
+  global_State *g = G(L);
+  lua_lock(L);
+  api_check(L, g->gcregions > 0, "no open region");
+  if (--g->gcregions == 0)
+    luaC_endregion(L);
+  lua_unlock(L);
+}
+
 /*
 ** miscellaneous functions
 */
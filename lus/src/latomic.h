@@ -0,0 +1,95 @@
+/*
+** $Id: latomic.h $
+** Atomic operations
+** See Copyright Notice in lua.h
+*/
+
+#ifndef latomic_h
+#define latomic_h
+
+
+/*
+** Atomic operations on 64-bit ('lus_atomic_t') and 32-bit
+** ('lus_atomic32_t') integers, for memory shared between threads. They
+** are sequentially consistent, except the 'relaxed' ones, which are only
+** free of tearing and data races. 'fetchadd' and 'cmpxchg' return the
+** value found before the operation, 'addfetch' the new one; 'cas'
+** returns whether the exchange happened.
+*/
+#if defined(_MSC_VER)
+
+#include <intrin.h>
+
+typedef volatile __int64 lus_atomic_t;
+typedef volatile long lus_atomic32_t;
+
+#define lus_atomic_load(p) _InterlockedOr64((p), 0)
+#define lus_atomic_store(p, v) ((void)_InterlockedExchange64((p), (v)))
+#define lus_atomic_fetchadd(p, v) _InterlockedExchangeAdd64((p), (v))
+#define lus_atomic_addfetch(p, v) (_InterlockedExchangeAdd64((p), (v)) + (v))
+#define lus_atomic_cmpxchg(p, e, d) _InterlockedCompareExchange64((p), (d), (e))
+
+#define lus_atomic32_load(p) _InterlockedOr((p), 0)
+#define lus_atomic32_store(p, v) ((void)_InterlockedExchange((p), (v)))
+#define lus_atomic32_fetchadd(p, v) _InterlockedExchangeAdd((p), (v))
+#define lus_atomic32_cmpxchg(p, e, d) _InterlockedCompareExchange((p), (d), (e))
+
+/* MSVC compiles aligned volatile accesses to single loads and stores */
+#define lus_atomic32_loadrelaxed(p) (*(p))
+#define lus_atomic32_storerelaxed(p, v) ((void)(*(p) = (v)))
+
+#if defined(_M_ARM64) || defined(_M_ARM)
+#define lus_cpu_relax() __yield()
+#else
+#define lus_cpu_relax() _mm_pause()
+#endif
+
+#else
+
+typedef volatile long long lus_atomic_t;
+typedef volatile int lus_atomic32_t;
+
+#define lus_atomic_load(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define lus_atomic_store(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define lus_atomic_fetchadd(p, v) \
+  __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define lus_atomic_addfetch(p, v) \
+  __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+
+static __inline__ long long lus_atomic_cmpxchg(lus_atomic_t *p, long long e,
+                                               long long d) {
+  __atomic_compare_exchange_n(p, &e, d, 0, __ATOMIC_SEQ_CST,
+                              __ATOMIC_SEQ_CST);
+  return e; /* holds the value found when the exchange failed */
+}
+
+#define lus_atomic32_load(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define lus_atomic32_store(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define lus_atomic32_fetchadd(p, v) \
+  __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+
+static __inline__ int lus_atomic32_cmpxchg(lus_atomic32_t *p, int e, int d) {
+  __atomic_compare_exchange_n(p, &e, d, 0, __ATOMIC_SEQ_CST,
+                              __ATOMIC_SEQ_CST);
+  return e;
+}
+
+#define lus_atomic32_loadrelaxed(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define lus_atomic32_storerelaxed(p, v) \
+  __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define lus_cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define lus_cpu_relax() __asm__ __volatile__("yield")
+#else
+#define lus_cpu_relax() ((void)0)
+#endif
+
+#endif
+
+#define lus_atomic_add(p, v) ((void)lus_atomic_fetchadd(p, v))
+#define lus_atomic_cas(p, e, d) (lus_atomic_cmpxchg(p, e, d) == (e))
+
+
+#endif
@@ -7,6 +7,10 @@
 #define lauxlib_c
 #define LUA_LIB
 
+#if defined(LUA_USE_LINUX) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* for 'mremap' */
+#endif
+
 #include "lprefix.h"
 
 #include <errno.h>
@@ -985,9 +989,133 @@ LUALIB_API const char *luaL_gsub(lua_State *L, const char *s, const char *p,
   return lua_tostring(L, -1);
 }
 
+/*
+** {======================================================
+** Large-object space
+** =======================================================
+** Blocks of at least LUAL_LARGEBLOCK bytes (big vector buffers, long
+** strings, table arrays) are mapped straight from the kernel instead of
+** living in the malloc heap: they do not fragment it, 'mremap' grows
+** them without copying, and freeing one returns its pages at once.
+** Lua always passes the exact old size of a block, so the size alone
+** tells which space a block lives in.
+*/
+
+#if defined(LUA_USE_LINUX) && !defined(LUAL_NOLARGEOBJ)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(MREMAP_MAYMOVE)
+#define LUAL_LARGEOBJ
+#endif
+
+#endif
+
+
+#if defined(LUAL_LARGEOBJ) /* { */
+
+#if !defined(LUAL_LARGEBLOCK)
+#define LUAL_LARGEBLOCK (256 * 1024)
+#endif
+
+/* mappings at least this big are offered to transparent huge pages */
+#define HUGEPAGE (2 * 1024 * 1024)
+
+#define islarge(sz) ((sz) >= LUAL_LARGEBLOCK)
+
+
+static size_t pageround(size_t sz) {
+  static size_t pagesize = 0;
+  if (pagesize == 0) { /* first call? (racing threads store the same value) */
+    long ps = sysconf(_SC_PAGESIZE);
+    pagesize = (ps > 0) ? (size_t)ps : 4096;
+  }
+  return (sz + pagesize - 1) & ~(pagesize - 1);
+}
+
+
+static void hugehint(void *p, size_t sz) {
+#if defined(MADV_HUGEPAGE)
+  if (sz >= HUGEPAGE)
+    madvise(p, sz, MADV_HUGEPAGE); /* only a hint; ignore failures */
+#else
+  (void)p;
+  (void)sz;
+#endif
+}
+
+
+static void *largemap(size_t sz) {
+  void *p;
+  sz = pageround(sz);
+#if defined(LUAL_USEHUGETLB) && defined(MAP_HUGETLB)
+  /* explicit huge pages must be reserved by the administrator */
+  if (sz % HUGEPAGE == 0) {
+    p = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED)
+      return p;
+  }
+#endif
+  p = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+           0);
+  if (p == MAP_FAILED)
+    return NULL;
+  hugehint(p, sz);
+  return p;
+}
+
+
+static void *largerealloc(void *ptr, size_t osize, size_t nsize) {
+  void *np;
+  if (nsize == 0) { /* free a large block */
+    munmap(ptr, pageround(osize));
+    return NULL;
+  }
+  else if (!islarge(osize)) { /* small (or new) block becoming large */
+    np = largemap(nsize);
+    if (np != NULL && ptr != NULL) {
+      memcpy(np, ptr, osize);
+      free(ptr);
+    }
+    return np;
+  }
+  else if (!islarge(nsize)) { /* large block becoming small */
+    np = malloc(nsize);
+    if (np != NULL) {
+      memcpy(np, ptr, nsize);
+      munmap(ptr, pageround(osize));
+    }
+    return np;
+  }
+  else if (pageround(osize) == pageround(nsize)) /* same pages? */
+    return ptr;
+  else { /* large to large: let the kernel move the pages */
+    np = mremap(ptr, pageround(osize), pageround(nsize), MREMAP_MAYMOVE);
+    if (np == MAP_FAILED)
+      return NULL;
+    if (nsize > osize)
+      hugehint(np, pageround(nsize));
+    return np;
+  }
+}
+
+#endif /* } */
+
+/* }====================================================== */
+
+
 void *luaL_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
   UNUSED(ud);
+#if defined(LUAL_LARGEOBJ)
+  if (ptr == NULL)
+    osize = 0; /* 'osize' encodes the kind of object being created */
+  if (islarge(osize) || islarge(nsize))
+    return largerealloc(ptr, osize, nsize);
+#else
   UNUSED(osize);
+#endif
   if (nsize == 0) {
     free(ptr);
     return NULL;
@@ -204,14 +204,34 @@ static int pushmode(lua_State *L, int oldmode) {
       break;             \
   }
 
+/*
+** collectgarbage("region", f, ...): call 'f' inside a GC region and
+** return its results. Errors propagate after the region is closed.
+*/
+static int gcregion(lua_State *L) {
+  int status;
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  lus_beginregion(L);
+  status = lua_pcall(L, lua_gettop(L) - 2, LUA_MULTRET, 0);
+  lus_endregion(L);
+  if (status != LUA_OK)
+    return lua_error(L);
+  return lua_gettop(L) - 1; /* all but the option */
+}
+
 static int luaB_collectgarbage(lua_State *L) {
   static const char *const opts[] = {
       "stop",      "restart",      "collect",     "count", "step",
-      "isrunning", "generational", "incremental", "param", NULL};
+      "isrunning", "generational", "incremental", "param", "region",
+      NULL};
   static const char optsnum[] = {LUA_GCSTOP,  LUA_GCRESTART, LUA_GCCOLLECT,
                                  LUA_GCCOUNT, LUA_GCSTEP,    LUA_GCISRUNNING,
                                  LUA_GCGEN,   LUA_GCINC,     LUA_GCPARAM};
-  int o = optsnum[luaL_checkoption(L, 1, "collect", opts)];
+  int i = luaL_checkoption(L, 1, "collect", opts);
+  int o;
+  if (i == (int)sizeof(optsnum)) /* "region" is not a 'lua_gc' option */
+    return gcregion(L);
+  o = optsnum[i];
   switch (o) {
     case LUA_GCCOUNT: {
       int k = lua_gc(L, o);
@@ -19,9 +19,11 @@
 #include "lauxlib.h"
 #include "ldo.h"
 #include "lformat.h"
+#include "lheap.h"
 #include "llimits.h"
 #include "lmem.h"
 #include "lparser.h"
+#include "lpledge.h"
 #include "lstring.h"
 #include "lualib.h"
 #include "lzio.h"
@@ -663,6 +665,58 @@ static int db_format(lua_State *L) {
   return 1;
 }
 
+/*
+** debug.heapprofile(option [, rate])
+** Control the allocation-site profiler: "start" (sampling once every
+** 'rate' bytes on average), "stop", "reset" (drop all samples), or
+** "report" (return the sampled sites, largest first).
+*/
+static int db_heapprofile(lua_State *L) {
+  static const char *const opts[] = {"start", "stop", "reset", "report", NULL};
+  switch (luaL_checkoption(L, 1, NULL, opts)) {
+    case 0: {
+      lua_Integer rate = luaL_optinteger(L, 2, LUSH_DEFAULTRATE);
+      luaL_argcheck(L, rate > 0, 2, "rate must be positive");
+      if (!lusH_start(L, cast_sizet(rate)))
+        return luaL_error(L, "not enough memory");
+      break;
+    }
+    case 1: lusH_stop(L); break;
+    case 2: lusH_free(L); break;
+    default: lusH_pushreport(L); return 1;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static int snapwriter(lua_State *L, const void *p, size_t sz, void *ud) {
+  (void)L;
+  return (fwrite(p, 1, sz, cast(FILE *, ud)) != sz);
+}
+
+/*
+** debug.heapsnapshot(path)
+** Collect garbage, then write the graph of all reachable objects to
+** 'path'. Returns the number of objects written.
+*/
+static int db_heapsnapshot(lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  FILE *f;
+  l_mem n;
+  int ok;
+  lus_checkfsperm(L, "fs:write", path);
+  lua_gc(L, LUA_GCCOLLECT);
+  f = fopen(path, "w");
+  if (f == NULL)
+    return luaL_fileresult(L, 0, path);
+  n = lusH_snapshot(L, snapwriter, f);
+  ok = (fclose(f) == 0);
+  if (n < 0 || !ok)
+    return luaL_fileresult(L, 0, path);
+  lua_pushinteger(L, cast(lua_Integer, n));
+  return 1;
+}
+
 static const luaL_Reg dblib[] = {{"debug", db_debug},
                                  {"format", db_format},
                                  {"getuservalue", db_getuservalue},
@@ -672,6 +726,8 @@ static const luaL_Reg dblib[] = {{"debug", db_debug},
                                  {"getregistry", db_getregistry},
                                  {"getmetatable", db_getmetatable},
                                  {"getupvalue", db_getupvalue},
+                                 {"heapprofile", db_heapprofile},
+                                 {"heapsnapshot", db_heapsnapshot},
                                  {"parse", db_parse},
                                  {"upvaluejoin", db_upvaluejoin},
                                  {"upvalueid", db_upvalueid},
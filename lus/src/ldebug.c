@@ -954,6 +954,13 @@ int luaG_traceexec(lua_State *L, const Instruction *pc) {
   lu_byte mask = cast_byte(L->hookmask);
   const Proto *p = ci_func(ci)->p;
   int counthook;
+  if (l_unlikely(lus_atomic32_loadrelaxed(&L->preempt))) {
+    /* another thread asked for preemption: a hook installed with an empty
+       mask (as the worker pool does) fires now as a count hook */
+    lus_atomic32_storerelaxed(&L->preempt, 0);
+    if (mask == 0 && L->hook != NULL)
+      L->hookmask = mask = LUA_MASKCOUNT;
+  }
   if (!(mask & (LUA_MASKLINE | LUA_MASKCOUNT))) { /* no hooks? */
     ci->u.l.trap = 0;                             /* don't need to stop again */
     return 0;                                     /* turn off 'trap' */
@@ -70,8 +70,9 @@ void luaD_seterrorobj(lua_State *L, TStatus errcode, StkId oldtop) {
 
 l_noret luaD_throw(lua_State *L, TStatus errcode) {
   /* O(1) check for active Lua catch block: L->activeCatch is the innermost
-  ** active catch node (or NULL). */
-  if (L->activeCatch != NULL) {
+  ** active catch node (or NULL). A yield is not an error: it unwinds to
+  ** lua_resume, and the catch body carries on when the coroutine resumes. */
+  if (L->activeCatch != NULL && errcode != LUA_YIELD) {
     CatchInfo *cinfo = L->activeCatch;
     lua_assert(isLua(cinfo->ci));
     /* Save the error object by copying it to a safe location.
@@ -84,6 +85,18 @@ l_noret luaD_throw(lua_State *L, TStatus errcode) {
     cinfo->status = errcode;
     longjmp(cinfo->jmpbuf, 1);
   }
+  if (errcode == LUA_YIELD) {
+    /* The yield takes down the C stack holding the jmpbufs of the open
+    ** catches. Cut their 'prev' links, so that a catch finishing after the
+    ** resume does not hand a stale catch back to L->activeCatch; errors
+    ** then reach them through 'findpcall'. */
+    CatchInfo *cinfo = L->activeCatch;
+    while (cinfo != NULL) {
+      CatchInfo *prev = cinfo->prev;
+      cinfo->prev = NULL;
+      cinfo = prev;
+    }
+  }
   /* Check for C-level catch */
   if (L->cCatch != NULL) {
     CCatchInfo *cinfo = L->cCatch;
@@ -826,12 +839,14 @@ static void unroll(lua_State *L, void *ud) {
 
 /*
 ** Try to find a suspended protected call (a "recover point") for the
-** given thread.
+** given thread: a 'lua_pcallk' or a Lua frame with an open catch. (A
+** catch that is still armed would have caught the error itself.)
 */
 static CallInfo *findpcall(lua_State *L) {
   CallInfo *ci;
   for (ci = L->ci; ci != NULL; ci = ci->previous) { /* search for a pcall */
-    if (ci->callstatus & CIST_YPCALL)
+    if (isLua(ci) ? ci->u.l.catchlist != NULL
+                  : (ci->callstatus & CIST_YPCALL) != 0)
       return ci;
   }
   return NULL; /* no pending pcall */
@@ -901,8 +916,12 @@ static TStatus precover(lua_State *L, TStatus status) {
   CallInfo *ci;
   while (errorstatus(status) && (ci = findpcall(L)) != NULL) {
     CCatchInfo cinfo;
-    L->ci = ci;               /* go down to recovery functions */
-    setcistrecst(ci, status); /* status to finish 'pcall' */
+    if (isLua(ci))                       /* catch expression? */
+      luaV_catchresume(L, ci, status);   /* continue after it */
+    else {
+      L->ci = ci;               /* go down to recovery functions */
+      setcistrecst(ci, status); /* status to finish 'pcall' */
+    }
     CPROTECT_BEGIN(L, &cinfo)
     unroll(L, NULL);
     CPROTECT_END(L, &cinfo);
@@ -1043,6 +1062,9 @@ TStatus luaD_closeprotected(lua_State *L, ptrdiff_t level, TStatus status) {
 ** thread information ('allowhook', etc.) and in particular
 ** its stack level in case of errors.
 ** Uses the new CPROTECT mechanism instead of luaD_rawrunprotected.
+** Lua catch blocks enclosing the call are disabled while it runs: this
+** is the innermost handler, and letting an outer catch longjmp past it
+** would skip the caller's recovery and leave 'L->cCatch' dangling.
 */
 TStatus luaD_pcall(lua_State *L, Pfunc func, void *u, ptrdiff_t old_top,
                    ptrdiff_t ef) {
@@ -1051,10 +1073,13 @@ TStatus luaD_pcall(lua_State *L, Pfunc func, void *u, ptrdiff_t old_top,
   CallInfo *old_ci = L->ci;
   lu_byte old_allowhooks = L->allowhook;
   ptrdiff_t old_errfunc = L->errfunc;
+  CatchInfo *oldActiveCatch = L->activeCatch;
   L->errfunc = ef;
+  L->activeCatch = NULL; /* disable enclosing Lua catch blocks */
   CPROTECT_BEGIN(L, &cinfo)
   func(L, u);
   CPROTECT_END(L, &cinfo);
+  L->activeCatch = oldActiveCatch; /* restore Lua catch blocks */
   status = cinfo.status;
   if (l_unlikely(status != LUA_OK)) { /* an error occurred? */
     L->ci = old_ci;
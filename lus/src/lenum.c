@@ -21,23 +21,78 @@
 #include "lstring.h"
 
 
+/* enums with more names than this get a name index */
+#define MAXLINEARENUM 8
+
+
+/*
+** Size of the name index for an enum with 'size' names: a power of 2
+** at least twice 'size', so that probe sequences stay short.
+*/
+static unsigned int indexsize(int size) {
+  if (size <= MAXLINEARENUM)
+    return 0;
+  return 1u << luaO_ceillog2(cast_uint(size) * 2);
+}
+
+
+/*
+** Names are compared by identity (short strings are interned), so the
+** index hashes their addresses.
+*/
+static unsigned int namehash(const TString *name) {
+  unsigned int h = point2uint(name) * 2654435769u;
+  return h ^ (h >> 16);
+}
+
+
 /*
 ** Create a new EnumRoot with 'size' names.
 ** The names array is uninitialized and should be filled by the caller.
 */
 EnumRoot *luaE_newroot(lua_State *L, int size) {
-  size_t sz = sizeenumroot(size);
+  unsigned int hsize = indexsize(size);
+  size_t sz = sizeenumroot(size, hsize);
   GCObject *o = luaC_newobjdt(L, LUA_VENUMROOT, sz, 0);
   EnumRoot *root = gco2enumroot(o);
+  Enum **values;
+  int *index;
   root->size = size;
+  root->hsize = hsize;
   root->gclist = NULL;
+  values = enumvalues(root);
+  index = enumindex(root);
   /* Initialize names to NULL (caller will fill them in) */
-  for (int i = 0; i < size; i++)
+  for (int i = 0; i < size; i++) {
     root->names[i] = NULL;
+    values[i] = NULL;
+  }
+  for (unsigned int i = 0; i < hsize; i++)
+    index[i] = 0;
   return root;
 }
 
 
+/*
+** Build the name index. When a name repeats, the first occurrence
+** wins, as with a linear search.
+*/
+void luaE_indexroot(EnumRoot *root) {
+  int *index = enumindex(root);
+  unsigned int mask = root->hsize - 1;
+  int i;
+  if (root->hsize == 0)
+    return; /* small enum: linear search */
+  for (i = 0; i < root->size; i++) {
+    unsigned int h = namehash(root->names[i]) & mask;
+    while (index[h] != 0 && root->names[index[h] - 1] != root->names[i])
+      h = (h + 1) & mask;
+    if (index[h] == 0) /* not a repeated name? */
+      index[h] = i + 1;
+  }
+}
+
+
 /*
 ** Create a new Enum value with the given root and 1-based index.
 */
@@ -55,10 +110,23 @@ Enum *luaE_new(lua_State *L, EnumRoot *root, int idx) {
 ** Returns the 1-based index if found, 0 if not found.
 */
 int luaE_findname(EnumRoot *root, TString *name) {
-  int i;
-  for (i = 0; i < root->size; i++) {
-    if (root->names[i] == name) /* short strings are interned */
-      return i + 1;             /* 1-based index */
+  if (root->hsize == 0) {
+    int i;
+    for (i = 0; i < root->size; i++) {
+      if (root->names[i] == name) /* short strings are interned */
+        return i + 1;             /* 1-based index */
+    }
+  }
+  else {
+    const int *index = enumindex(root);
+    unsigned int mask = root->hsize - 1;
+    unsigned int h = namehash(name) & mask;
+    int idx;
+    while ((idx = index[h]) != 0) {
+      if (root->names[idx - 1] == name)
+        return idx;
+      h = (h + 1) & mask;
+    }
   }
   return 0; /* not found */
 }
@@ -66,24 +134,31 @@ int luaE_findname(EnumRoot *root, TString *name) {
 
 /*
 ** Get an enum value from the root by string key.
-** Creates and returns a new Enum value, or returns NULL if key not found.
+** Returns the member's canonical Enum value, or NULL if key not found.
 */
 Enum *luaE_getbyname(lua_State *L, EnumRoot *root, TString *key) {
   int idx = luaE_findname(root, key);
   if (idx == 0)
     return NULL; /* not found */
-  return luaE_new(L, root, idx);
+  return luaE_getbyidx(L, root, idx);
 }
 
 
 /*
 ** Get an enum value from the root by integer index.
-** Creates and returns a new Enum value, or returns NULL if index out of bounds.
+** Returns the member's canonical Enum value, creating it on first use,
+** or NULL if index out of bounds.
 */
 Enum *luaE_getbyidx(lua_State *L, EnumRoot *root, int idx) {
+  Enum **values = enumvalues(root);
   if (idx < 1 || idx > root->size)
     return NULL; /* out of bounds */
-  return luaE_new(L, root, idx);
+  if (l_unlikely(values[idx - 1] == NULL)) { /* first use? */
+    Enum *e = luaE_new(L, root, idx);
+    values[idx - 1] = e;
+    luaC_objbarrier(L, root, e);
+  }
+  return values[idx - 1];
 }
 
 
@@ -91,7 +166,7 @@ Enum *luaE_getbyidx(lua_State *L, EnumRoot *root, int idx) {
 ** Free an EnumRoot.
 */
 void luaE_freeroot(lua_State *L, EnumRoot *root) {
-  luaM_freemem(L, root, sizeenumroot(root->size));
+  luaM_freemem(L, root, sizeenumroot(root->size, root->hsize));
 }
 
 
@@ -107,5 +182,5 @@ void luaE_free(lua_State *L, Enum *e) {
 ** Get the size (in bytes) of an EnumRoot.
 */
 lu_mem luaE_rootsize(EnumRoot *root) {
-  return cast(lu_mem, sizeenumroot(root->size));
+  return cast(lu_mem, sizeenumroot(root->size, root->hsize));
 }
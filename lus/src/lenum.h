@@ -16,6 +16,12 @@
 */
 LUAI_FUNC EnumRoot *luaE_newroot(lua_State *L, int size);
 
+/*
+** Build the name index of 'root'. Must be called once, after all its
+** names are filled in and before any lookup.
+*/
+LUAI_FUNC void luaE_indexroot(EnumRoot *root);
+
 /*
 ** Create a new Enum value with the given root and 1-based index.
 */
@@ -29,13 +35,14 @@ LUAI_FUNC int luaE_findname(EnumRoot *root, TString *name);
 
 /*
 ** Get an enum value from the root by string key.
-** Creates and returns a new Enum value, or returns NULL if key not found.
+** Returns the member's canonical Enum value, or NULL if key not found.
 */
 LUAI_FUNC Enum *luaE_getbyname(lua_State *L, EnumRoot *root, TString *key);
 
 /*
 ** Get an enum value from the root by integer index.
-** Creates and returns a new Enum value, or returns NULL if index out of bounds.
+** Returns the member's canonical Enum value (created on first use), or
+** NULL if index out of bounds.
 */
 LUAI_FUNC Enum *luaE_getbyidx(lua_State *L, EnumRoot *root, int idx);
 
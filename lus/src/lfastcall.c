@@ -1091,7 +1091,7 @@ int luaV_dofastcall(lua_State *L, int fc_id, StkId ra) {
       if (!ttisvector(arg1) || !ttisinteger(arg2))
         return 0;
       lua_Integer newsize = ivalue(arg2);
-      if (newsize < 0)
+      if (newsize < 0 || luaV_isshared(vecvalue(arg1)))
         return 0;
       luaV_resize(L, vecvalue(arg1), (size_t)newsize);
       setnilvalue2s(ra);
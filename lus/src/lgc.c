@@ -128,7 +128,7 @@ static void entersweep(lua_State *L);
 #define gnodelast(h) gnode(h, cast_sizet(sizenode(h)))
 
 
-static l_mem objsize(GCObject *o) {
+l_mem luaC_objsize(GCObject *o) {
   lu_mem res;
   switch (o->tt) {
     case LUA_VTABLE: {
@@ -370,7 +370,7 @@ GCObject *luaC_newobj(lua_State *L, lu_byte tt, size_t sz) {
 ** (only closures can), and a userdata's metatable must be a table.
 */
 static void reallymarkobject(global_State *g, GCObject *o) {
-  g->GCmarked += objsize(o);
+  g->GCmarked += luaC_objsize(o);
   switch (o->tt) {
     case LUA_VSHRSTR:
     case LUA_VLNGSTR: {
@@ -771,12 +771,15 @@ static l_mem traversethread(global_State *g, lua_State *th) {
 
 
 /*
-** Traverse an enum root: mark all name strings.
+** Traverse an enum root: mark all name strings and canonical values.
 */
 static l_mem traverseenumroot(global_State *g, EnumRoot *root) {
+  Enum **values = enumvalues(root);
   int i;
-  for (i = 0; i < root->size; i++)
+  for (i = 0; i < root->size; i++) {
     markobjectN(g, root->names[i]);
+    markobjectN(g, values[i]);
+  }
   return 1 + root->size;
 }
 
@@ -896,7 +899,7 @@ static void freeupval(lua_State *L, UpVal *uv) {
 
 
 static void freeobj(lua_State *L, GCObject *o) {
-  assert_code(l_mem newmem = gettotalbytes(G(L)) - objsize(o));
+  assert_code(l_mem newmem = gettotalbytes(G(L)) - luaC_objsize(o));
   switch (o->tt) {
     case LUA_VPROTO: luaF_freeproto(L, gco2p(o)); break;
     case LUA_VUPVAL: freeupval(L, gco2upv(o)); break;
@@ -1269,7 +1272,7 @@ static GCObject **sweepgen(lua_State *L, global_State *g, GCObject **p,
         lua_assert(age != G_OLD1); /* advanced in 'markold' */
         setage(curr, nextage[age]);
         if (getage(curr) == G_OLD1) {
-          addedold += objsize(curr); /* bytes becoming old */
+          addedold += luaC_objsize(curr); /* bytes becoming old */
           if (*pfirstold1 == NULL)
             *pfirstold1 = curr; /* first OLD1 object in the list */
         }
@@ -1528,6 +1531,25 @@ void luaC_changemode(lua_State *L, int newmode) {
 }
 
 
+/*
+** End of the outermost GC region. Every object created inside the
+** region is young, and the generational barriers already account for
+** the ones that escaped: storing one into an old table marks the table
+** as touched (so it is traversed again), and storing one anywhere else
+** old promotes it. A young collection therefore reclaims the region's
+** garbage at a cost proportional to what the region allocated plus
+** what it touched, not to the size of the heap. In any other mode the
+** region's garbage is left to the regular collection.
+*/
+void luaC_endregion(lua_State *L) {
+  global_State *g = G(L);
+  if (gcrunning(g) && g->gckind == KGC_GENMINOR) {
+    youngcollection(L, g);
+    setminordebt(g);
+  }
+}
+
+
 /*
 ** Does a full collection in generational mode.
 */
@@ -273,6 +273,8 @@ LUAI_FUNC void luaC_barrier_(lua_State *L, GCObject *o, GCObject *v);
 LUAI_FUNC void luaC_barrierback_(lua_State *L, GCObject *o);
 LUAI_FUNC void luaC_checkfinalizer(lua_State *L, GCObject *o, Table *mt);
 LUAI_FUNC void luaC_changemode(lua_State *L, int newmode);
+LUAI_FUNC l_mem luaC_objsize(GCObject *o);
+LUAI_FUNC void luaC_endregion(lua_State *L);
 
 
 #endif
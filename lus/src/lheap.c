@@ -0,0 +1,682 @@
+/*
+** $Id: lheap.c $
+** Heap introspection: allocation-site sampling and heap snapshots
+** See Copyright Notice in lua.h
+*/
+
+#define lheap_c
+#define LUA_CORE
+
+#include "lprefix.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua.h"
+
+#include "ldebug.h"
+#include "lfunc.h"
+#include "lgc.h"
+#include "lheap.h"
+#include "lobject.h"
+#include "lstate.h"
+#include "lstring.h"
+#include "ltable.h"
+#include "ltm.h"
+
+
+/*
+** The profiler and the snapshot walker keep their bookkeeping outside
+** the Lua heap: they call the state's allocation function directly, so
+** their own memory is neither counted as GC debt nor sampled.
+*/
+#define rawrealloc(g, b, os, ns) ((*(g)->frealloc)((g)->ud, (b), (os), (ns)))
+
+
+/*
+** Names for every collectable type tag (indexed by 'novariant'); tag 0
+** is used for untyped blocks such as table arrays and vector buffers.
+*/
+static const char *const heaptypenames[] = {
+    "memory",   "boolean", "lightuserdata", "number",  "string",
+    "table",    "function", "userdata",     "thread",  "enum",
+    "vector",   "upvalue", "proto",         "deadkey", "enumroot"};
+
+#define heaptypename(t) \
+  (cast_uint(t) < sizeof(heaptypenames) / sizeof(heaptypenames[0]) \
+       ? heaptypenames[t]                                           \
+       : "?")
+
+
+/*
+** {======================================================
+** Allocation-site profiler
+** =======================================================
+*/
+
+typedef struct HeapSite {
+  const Proto *p;      /* Lua function that allocated (NULL for host code) */
+  int linedefined;     /* 'p->linedefined', to tell recycled protos apart */
+  int line;            /* current line in 'p' (-1 if unknown) */
+  int tag;             /* type tag of the allocation (0: untyped block) */
+  lu_mem samples;      /* number of samples taken at this site */
+  lu_mem bytes;        /* estimated bytes allocated at this site */
+  char src[LUA_IDSIZE]; /* chunk id of 'p->source' */
+} HeapSite;
+
+
+typedef struct HeapProfile {
+  l_mem rate;          /* average bytes between two samples */
+  l_mem countdown;     /* bytes left before the next sample */
+  int running;         /* true while sampling */
+  unsigned int nsites; /* number of used entries in 'sites' */
+  unsigned int size;   /* size of 'sites' (0 or a power of 2) */
+  HeapSite *sites;     /* open-addressing hash of sites */
+} HeapProfile;
+
+
+int lusH_start(lua_State *L, size_t rate) {
+  global_State *g = G(L);
+  HeapProfile *hp = g->heapprof;
+  if (hp == NULL) {
+    hp = cast(HeapProfile *, rawrealloc(g, NULL, 0, sizeof(HeapProfile)));
+    if (hp == NULL)
+      return 0;
+    hp->nsites = hp->size = 0;
+    hp->sites = NULL;
+    g->heapprof = hp;
+  }
+  hp->rate = (rate > 1 && rate <= cast_sizet(MAX_LMEM)) ? cast(l_mem, rate) : 1;
+  hp->countdown = hp->rate;
+  hp->running = 1;
+  return 1;
+}
+
+
+void lusH_stop(lua_State *L) {
+  HeapProfile *hp = G(L)->heapprof;
+  if (hp != NULL)
+    hp->running = 0;
+}
+
+
+void lusH_free(lua_State *L) {
+  global_State *g = G(L);
+  HeapProfile *hp = g->heapprof;
+  if (hp != NULL) {
+    g->heapprof = NULL;
+    if (hp->sites != NULL)
+      rawrealloc(g, hp->sites, hp->size * sizeof(HeapSite), 0);
+    rawrealloc(g, hp, sizeof(HeapProfile), 0);
+  }
+}
+
+
+static unsigned int hashsite(const Proto *p, int line, int tag) {
+  size_t h = cast_sizet(p) >> 4;
+  h ^= cast_sizet(cast_uint(line)) * 0x9E3779B1u;
+  h ^= cast_sizet(cast_uint(tag)) << 24;
+  return cast_uint(h ^ (h >> 16));
+}
+
+
+/*
+** Double the site table. Fails (keeping the old table) when the host
+** allocator has no memory; the sample is then simply dropped.
+*/
+static int growsites(global_State *g, HeapProfile *hp) {
+  unsigned int i;
+  unsigned int nsize = (hp->size == 0) ? 64 : hp->size * 2;
+  HeapSite *ns =
+      cast(HeapSite *, rawrealloc(g, NULL, 0, nsize * sizeof(HeapSite)));
+  if (ns == NULL)
+    return 0;
+  for (i = 0; i < nsize; i++)
+    ns[i].samples = 0; /* empty slot */
+  for (i = 0; i < hp->size; i++) {
+    HeapSite *s = &hp->sites[i];
+    if (s->samples > 0) {
+      unsigned int j = hashsite(s->p, s->line, s->tag) & (nsize - 1);
+      while (ns[j].samples > 0)
+        j = (j + 1) & (nsize - 1);
+      ns[j] = *s;
+    }
+  }
+  if (hp->sites != NULL)
+    rawrealloc(g, hp->sites, hp->size * sizeof(HeapSite), 0);
+  hp->sites = ns;
+  hp->size = nsize;
+  return 1;
+}
+
+
+/*
+** Attribute an allocation to the innermost active Lua function, so that
+** memory allocated inside C functions (string.rep, table.concat, ...) is
+** charged to the Lua line that called them.
+*/
+static const Proto *allocsite(lua_State *L, int *line) {
+  CallInfo *ci;
+  for (ci = L->ci; ci != NULL && ci != &L->base_ci; ci = ci->previous) {
+    if (isLua(ci)) {
+      const Proto *p = ci_func(ci)->p;
+      *line = luaG_getfuncline(p, pcRel(ci->u.l.savedpc, p));
+      return p;
+    }
+  }
+  *line = -1;
+  return NULL;
+}
+
+
+static HeapSite *findsite(global_State *g, HeapProfile *hp, const Proto *p,
+                          int line, int tag) {
+  unsigned int i;
+  int linedefined = (p != NULL) ? p->linedefined : 0;
+  if (hp->size == 0 || (hp->nsites + 1) * 2 > hp->size) { /* too full? */
+    if (!growsites(g, hp) && hp->nsites == hp->size)
+      return NULL;
+  }
+  i = hashsite(p, line, tag) & (hp->size - 1);
+  while (hp->sites[i].samples > 0) {
+    HeapSite *s = &hp->sites[i];
+    if (s->p == p && s->line == line && s->tag == tag &&
+        s->linedefined == linedefined)
+      return s;
+    i = (i + 1) & (hp->size - 1);
+  }
+  /* new site */
+  {
+    HeapSite *s = &hp->sites[i];
+    s->p = p;
+    s->linedefined = linedefined;
+    s->line = line;
+    s->tag = tag;
+    s->bytes = 0;
+    if (p != NULL && p->source != NULL) {
+      size_t len;
+      const char *src = getlstr(p->source, len);
+      luaO_chunkid(s->src, src, len);
+    }
+    else
+      strcpy(s->src, (p != NULL) ? "?" : "[C]");
+    hp->nsites++;
+    return s;
+  }
+}
+
+
+/*
+** Sampling is byte-based: every allocation decrements a countdown, and
+** the allocation that takes it to zero is recorded, weighted by the
+** number of whole intervals it covers. Large allocations are therefore
+** always seen, and the sum of weights is an unbiased estimate of the
+** bytes allocated at each site.
+*/
+void lusH_sample(lua_State *L, size_t size, int tag) {
+  global_State *g = G(L);
+  HeapProfile *hp = g->heapprof;
+  l_mem n;
+  int line;
+  const Proto *p;
+  HeapSite *s;
+  if (!hp->running)
+    return;
+  hp->countdown -= cast(l_mem, size);
+  if (hp->countdown > 0)
+    return;
+  n = 1 + (-hp->countdown) / hp->rate; /* intervals covered */
+  hp->countdown += n * hp->rate;
+  p = allocsite(L, &line);
+  s = findsite(g, hp, p, line, tag);
+  if (s != NULL) {
+    s->samples++;
+    s->bytes += cast(lu_mem, n * hp->rate);
+  }
+}
+
+
+static int sitecmp(const void *a, const void *b) {
+  const HeapSite *s1 = cast(const HeapSite *, a);
+  const HeapSite *s2 = cast(const HeapSite *, b);
+  if (s1->bytes != s2->bytes)
+    return (s1->bytes < s2->bytes) ? 1 : -1;
+  return (s1->samples < s2->samples) - (s1->samples > s2->samples);
+}
+
+
+/*
+** The sites are first copied into a userdata: building the result
+** allocates, which keeps feeding (and possibly rehashing) the live
+** table, and the userdata is collected even if a memory error
+** interrupts the report.
+*/
+void lusH_pushreport(lua_State *L) {
+  HeapProfile *hp = G(L)->heapprof;
+  HeapSite *copy;
+  unsigned int i, n = 0;
+  if (hp == NULL) {
+    lua_pushnil(L);
+    return;
+  }
+  copy = cast(HeapSite *,
+              lua_newuserdatauv(L, (hp->nsites + 1) * sizeof(HeapSite), 0));
+  for (i = 0; i < hp->size && n < hp->nsites; i++) {
+    if (hp->sites[i].samples > 0)
+      copy[n++] = hp->sites[i];
+  }
+  qsort(copy, n, sizeof(HeapSite), sitecmp);
+  lua_createtable(L, cast_int(n), 0);
+  for (i = 0; i < n; i++) {
+    HeapSite *s = &copy[i];
+    lua_createtable(L, 0, 5);
+    lua_pushstring(L, s->src);
+    lua_setfield(L, -2, "source");
+    lua_pushinteger(L, s->line);
+    lua_setfield(L, -2, "line");
+    lua_pushstring(L, heaptypename(s->tag));
+    lua_setfield(L, -2, "type");
+    lua_pushinteger(L, cast(lua_Integer, s->samples));
+    lua_setfield(L, -2, "samples");
+    lua_pushinteger(L, cast(lua_Integer, s->bytes));
+    lua_setfield(L, -2, "bytes");
+    lua_rawseti(L, -2, cast(lua_Integer, i) + 1);
+  }
+  lua_remove(L, -2); /* remove copy */
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Heap snapshot
+** =======================================================
+**
+** The snapshot is a line-oriented text file:
+**
+**   lusheap 1
+**   r <id> <root name>
+**   o <id> <type> <self size> <n> <edge 1> ... <edge n> <label>
+**
+** Object ids are assigned in discovery order starting at 1; edges are
+** ids of the objects directly referenced (the same references the
+** collector follows in 'propagatemark', minus weak ones). The label is
+** the rest of the line: a string prefix, 'source:line' for functions
+** and prototypes, or '-'. 'tools/heapsnap.lus' turns the graph into
+** retained sizes.
+*/
+
+#define SNAPBUFF 8192
+#define LABELMAX 48
+
+
+typedef struct SnapState {
+  lua_State *L;
+  global_State *g;
+  lua_Writer writer;
+  void *data;
+  int status;        /* nonzero after a memory or write error */
+  l_mem nobjs;       /* ids assigned so far */
+  GCObject **keys;   /* visited set (open addressing) */
+  l_mem *ids;        /* id of each key */
+  size_t size;       /* size of 'keys'/'ids' (power of 2) */
+  GCObject **work;   /* objects discovered but not yet written */
+  size_t nwork;
+  size_t capwork;
+  l_mem *edges;      /* edges of the object being written */
+  size_t nedges;
+  size_t capedges;
+  size_t nbuff;
+  char buff[SNAPBUFF];
+} SnapState;
+
+
+static void snapflush(SnapState *S) {
+  if (S->nbuff > 0 && S->status == 0) {
+    if (S->writer(S->L, S->buff, S->nbuff, S->data) != 0)
+      S->status = 1;
+  }
+  S->nbuff = 0;
+}
+
+
+static void snapaddlstr(SnapState *S, const char *s, size_t l) {
+  while (l > 0) {
+    size_t n = SNAPBUFF - S->nbuff;
+    if (n == 0) {
+      snapflush(S);
+      n = SNAPBUFF;
+    }
+    if (n > l)
+      n = l;
+    memcpy(S->buff + S->nbuff, s, n);
+    S->nbuff += n;
+    s += n;
+    l -= n;
+  }
+}
+
+#define snapaddstr(S, s) snapaddlstr(S, s, strlen(s))
+
+
+static void snapaddint(SnapState *S, lua_Integer i) {
+  char b[LUA_N2SBUFFSZ];
+  int len = lua_integer2str(b, sizeof(b), i);
+  snapaddlstr(S, b, cast_sizet(len));
+}
+
+
+static void *snapgrow(SnapState *S, void *block, size_t *cap, size_t esize) {
+  size_t ncap = (*cap == 0) ? 256 : *cap * 2;
+  void *nb = rawrealloc(S->g, block, *cap * esize, ncap * esize);
+  if (nb == NULL) {
+    S->status = 1;
+    return block;
+  }
+  *cap = ncap;
+  return nb;
+}
+
+
+static size_t snapslot(SnapState *S, GCObject *o) {
+  size_t h = (cast_sizet(o) >> 4) * 0x9E3779B1u;
+  size_t i = (h ^ (h >> 16)) & (S->size - 1);
+  while (S->keys[i] != NULL && S->keys[i] != o)
+    i = (i + 1) & (S->size - 1);
+  return i;
+}
+
+
+static int snapgrowset(SnapState *S) {
+  GCObject **okeys = S->keys;
+  l_mem *oids = S->ids;
+  size_t osize = S->size, i;
+  size_t nsize = (osize == 0) ? 1024 : osize * 2;
+  GCObject **nkeys =
+      cast(GCObject **, rawrealloc(S->g, NULL, 0, nsize * sizeof(GCObject *)));
+  l_mem *nids = cast(l_mem *, rawrealloc(S->g, NULL, 0, nsize * sizeof(l_mem)));
+  if (nkeys == NULL || nids == NULL) {
+    if (nkeys != NULL)
+      rawrealloc(S->g, nkeys, nsize * sizeof(GCObject *), 0);
+    if (nids != NULL)
+      rawrealloc(S->g, nids, nsize * sizeof(l_mem), 0);
+    S->status = 1;
+    return 0;
+  }
+  memset(nkeys, 0, nsize * sizeof(GCObject *));
+  S->keys = nkeys;
+  S->ids = nids;
+  S->size = nsize;
+  for (i = 0; i < osize; i++) {
+    if (okeys[i] != NULL) {
+      size_t j = snapslot(S, okeys[i]);
+      S->keys[j] = okeys[i];
+      S->ids[j] = oids[i];
+    }
+  }
+  if (okeys != NULL) {
+    rawrealloc(S->g, okeys, osize * sizeof(GCObject *), 0);
+    rawrealloc(S->g, oids, osize * sizeof(l_mem), 0);
+  }
+  return 1;
+}
+
+
+/*
+** Return the id of object 'o', assigning a new one (and queueing the
+** object to be written) on its first sighting. Returns 0 on errors.
+*/
+static l_mem snapid(SnapState *S, GCObject *o) {
+  size_t i;
+  if (S->status != 0)
+    return 0;
+  if (cast_sizet(S->nobjs + 1) * 2 > S->size && !snapgrowset(S))
+    return 0;
+  i = snapslot(S, o);
+  if (S->keys[i] == NULL) { /* first time seen? */
+    if (S->nwork == S->capwork) {
+      S->work = cast(GCObject **, snapgrow(S, S->work, &S->capwork,
+                                           sizeof(GCObject *)));
+      if (S->status != 0)
+        return 0;
+    }
+    S->keys[i] = o;
+    S->ids[i] = ++S->nobjs;
+    S->work[S->nwork++] = o;
+  }
+  return S->ids[i];
+}
+
+
+static void snapedge(SnapState *S, GCObject *o) {
+  l_mem id;
+  if (o == NULL || (id = snapid(S, o)) == 0)
+    return;
+  if (S->nedges == S->capedges) {
+    S->edges = cast(l_mem *, snapgrow(S, S->edges, &S->capedges,
+                                      sizeof(l_mem)));
+    if (S->status != 0)
+      return;
+  }
+  S->edges[S->nedges++] = id;
+}
+
+#define snapedgevalue(S, v) \
+  { if (iscollectable(v)) snapedge(S, gcvalue(v)); }
+
+#define snapedgeobj(S, o) snapedge(S, (o) ? obj2gco(o) : NULL)
+
+
+/*
+** Same weak-mode test as the collector: weak references do not retain.
+*/
+static int snapmode(global_State *g, Table *h) {
+  const TValue *mode = gfasttm(g, h->metatable, TM_MODE);
+  if (mode == NULL || !ttisstring(mode))
+    return 0;
+  else {
+    const char *smode = getstr(tsvalue(mode));
+    return ((strchr(smode, 'k') != NULL) << 1) | (strchr(smode, 'v') != NULL);
+  }
+}
+
+
+static void snaptable(SnapState *S, Table *h) {
+  int mode = snapmode(S->g, h);
+  unsigned int i;
+  snapedgeobj(S, h->metatable);
+  if (!(mode & 1)) { /* strong values? */
+    for (i = 0; i < h->asize; i++) {
+      if (*getArrTag(h, i) & BIT_ISCOLLECTABLE)
+        snapedge(S, getArrVal(h, i)->gc);
+    }
+  }
+  for (i = 0; i < sizenode(h); i++) {
+    Node *n = gnode(h, i);
+    if (isempty(gval(n)) || keyisdead(n))
+      continue;
+    if (!(mode & 2) && keyiscollectable(n)) /* strong keys? */
+      snapedge(S, gckey(n));
+    if (!(mode & 1))
+      snapedgevalue(S, gval(n));
+  }
+}
+
+
+static void snapchildren(SnapState *S, GCObject *o) {
+  int i;
+  switch (o->tt) {
+    case LUA_VTABLE: snaptable(S, gco2t(o)); break;
+    case LUA_VUSERDATA: {
+      Udata *u = gco2u(o);
+      snapedgeobj(S, u->metatable);
+      for (i = 0; i < u->nuvalue; i++)
+        snapedgevalue(S, &u->uv[i].uv);
+      break;
+    }
+    case LUA_VLCL: {
+      LClosure *cl = gco2lcl(o);
+      snapedgeobj(S, cl->p);
+      for (i = 0; i < cl->nupvalues; i++)
+        snapedgeobj(S, cl->upvals[i]);
+      break;
+    }
+    case LUA_VCCL: {
+      CClosure *cl = gco2ccl(o);
+      for (i = 0; i < cl->nupvalues; i++)
+        snapedgevalue(S, &cl->upvalue[i]);
+      break;
+    }
+    case LUA_VPROTO: {
+      Proto *f = gco2p(o);
+      snapedgeobj(S, f->source);
+      for (i = 0; i < f->sizek; i++)
+        snapedgevalue(S, &f->k[i]);
+      for (i = 0; i < f->sizeupvalues; i++)
+        snapedgeobj(S, f->upvalues[i].name);
+      for (i = 0; i < f->sizep; i++)
+        snapedgeobj(S, f->p[i]);
+      for (i = 0; i < f->sizelocvars; i++)
+        snapedgeobj(S, f->locvars[i].varname);
+      break;
+    }
+    case LUA_VTHREAD: {
+      lua_State *th = gco2th(o);
+      UpVal *uv;
+      StkId p;
+      if (th->stack.p == NULL)
+        break;
+      for (p = th->stack.p; p < th->top.p; p++)
+        snapedgevalue(S, s2v(p));
+      for (uv = th->openupval; uv != NULL; uv = uv->u.open.next)
+        snapedgeobj(S, uv);
+      break;
+    }
+    case LUA_VUPVAL: snapedgevalue(S, gco2upv(o)->v.p); break;
+    case LUA_VENUM: snapedgeobj(S, gco2enum(o)->root); break;
+    case LUA_VENUMROOT: {
+      EnumRoot *root = gco2enumroot(o);
+      for (i = 0; i < root->size; i++) {
+        snapedgeobj(S, root->names[i]);
+        snapedgeobj(S, enumvalues(root)[i]);
+      }
+      break;
+    }
+    default: break; /* strings and vectors reference nothing */
+  }
+}
+
+
+static void snaplabel(SnapState *S, GCObject *o) {
+  char buff[LUA_IDSIZE + LABELMAX];
+  const Proto *p = NULL;
+  switch (novariant(o->tt)) {
+    case LUA_TSTRING: {
+      size_t len, i;
+      const char *s = getlstr(gco2ts(o), len);
+      if (len > LABELMAX)
+        len = LABELMAX;
+      for (i = 0; i < len; i++) /* keep the label on one line */
+        buff[i] = (cast_uchar(s[i]) < ' ' || s[i] == 127) ? '.' : s[i];
+      buff[len] = '\0';
+      snapaddstr(S, (len > 0) ? buff : "\"\"");
+      return;
+    }
+    case LUA_TFUNCTION:
+      if (o->tt == LUA_VLCL)
+        p = gco2lcl(o)->p;
+      break;
+    case LUA_TPROTO: p = gco2p(o); break;
+    default: break;
+  }
+  if (p != NULL && p->source != NULL) {
+    size_t len;
+    const char *src = getlstr(p->source, len);
+    luaO_chunkid(buff, src, len);
+    snapaddstr(S, buff);
+    snapaddstr(S, ":");
+    snapaddint(S, p->linedefined);
+  }
+  else
+    snapaddstr(S, "-");
+}
+
+
+static void snapobject(SnapState *S, GCObject *o) {
+  size_t i;
+  l_mem id = snapid(S, o); /* already assigned */
+  S->nedges = 0;
+  snapchildren(S, o);
+  snapaddstr(S, "o ");
+  snapaddint(S, id);
+  snapaddstr(S, " ");
+  snapaddstr(S, heaptypename(novariant(o->tt)));
+  snapaddstr(S, " ");
+  snapaddint(S, luaC_objsize(o));
+  snapaddstr(S, " ");
+  snapaddint(S, cast(lua_Integer, S->nedges));
+  for (i = 0; i < S->nedges; i++) {
+    snapaddstr(S, " ");
+    snapaddint(S, S->edges[i]);
+  }
+  snapaddstr(S, " ");
+  snaplabel(S, o);
+  snapaddstr(S, "\n");
+}
+
+
+static void snaproot(SnapState *S, GCObject *o, const char *name) {
+  l_mem id;
+  if (o == NULL || (id = snapid(S, o)) == 0)
+    return;
+  snapaddstr(S, "r ");
+  snapaddint(S, id);
+  snapaddstr(S, " ");
+  snapaddstr(S, name);
+  snapaddstr(S, "\n");
+}
+
+
+l_mem lusH_snapshot(lua_State *L, lua_Writer writer, void *data) {
+  global_State *g = G(L);
+  SnapState *S;
+  l_mem res;
+  int i;
+  /* the state is too big for the C stack (it holds the output buffer) */
+  S = cast(SnapState *, rawrealloc(g, NULL, 0, sizeof(SnapState)));
+  if (S == NULL)
+    return -1;
+  memset(S, 0, offsetof(SnapState, buff));
+  S->L = L;
+  S->g = g;
+  S->writer = writer;
+  S->data = data;
+  snapaddstr(S, "lusheap 1\n");
+  /* the collector's roots ('restartcollection' and 'atomic') */
+  snaproot(S, obj2gco(mainthread(g)), "mainthread");
+  snaproot(S, obj2gco(L), "thread");
+  if (iscollectable(&g->l_registry))
+    snaproot(S, gcvalue(&g->l_registry), "registry");
+  for (i = 0; i < LUA_NUMTYPES; i++) {
+    if (g->mt[i] != NULL)
+      snaproot(S, obj2gco(g->mt[i]), "metatable");
+  }
+  while (S->nwork > 0 && S->status == 0)
+    snapobject(S, S->work[--S->nwork]);
+  snapflush(S);
+  res = (S->status == 0) ? S->nobjs : -1;
+  if (S->keys != NULL) {
+    rawrealloc(g, S->keys, S->size * sizeof(GCObject *), 0);
+    rawrealloc(g, S->ids, S->size * sizeof(l_mem), 0);
+  }
+  if (S->work != NULL)
+    rawrealloc(g, S->work, S->capwork * sizeof(GCObject *), 0);
+  if (S->edges != NULL)
+    rawrealloc(g, S->edges, S->capedges * sizeof(l_mem), 0);
+  rawrealloc(g, S, sizeof(SnapState), 0);
+  return res;
+}
+
+/* }====================================================== */
@@ -0,0 +1,60 @@
+/*
+** $Id: lheap.h $
+** Heap introspection: allocation-site sampling and heap snapshots
+** See Copyright Notice in lua.h
+*/
+
+#ifndef lheap_h
+#define lheap_h
+
+#include "lobject.h"
+
+
+/*
+** Default sampling interval of the allocation profiler: on average one
+** allocation is recorded per this many allocated bytes.
+*/
+#define LUSH_DEFAULTRATE (64 * 1024)
+
+
+/*
+** Start sampling allocations made by the state, one sample per 'rate'
+** allocated bytes ('rate' <= 1 records every allocation). Restarting a
+** running profiler changes its rate and keeps the samples collected so
+** far. Returns 0 if the profiler could not be allocated.
+*/
+LUAI_FUNC int lusH_start(lua_State *L, size_t rate);
+
+/*
+** Stop sampling. Collected samples are kept until 'lusH_free'.
+*/
+LUAI_FUNC void lusH_stop(lua_State *L);
+
+/*
+** Release the profiler and all its samples.
+*/
+LUAI_FUNC void lusH_free(lua_State *L);
+
+/*
+** Record an allocation of 'size' bytes with type tag 'tag' (0 for
+** untyped blocks). Called by 'luaM_malloc_' when a profiler exists.
+*/
+LUAI_FUNC void lusH_sample(lua_State *L, size_t size, int tag);
+
+/*
+** Push an array with one entry per allocation site (sorted by
+** estimated bytes, largest first), or nil if nothing was profiled.
+*/
+LUAI_FUNC void lusH_pushreport(lua_State *L);
+
+/*
+** Walk every object reachable from the roots and emit the object graph
+** through 'writer' in the 'lusheap' text format. Does not allocate
+** collectable objects, so the collector cannot run during the walk.
+** Returns the number of objects written, or -1 on a memory or write
+** error.
+*/
+LUAI_FUNC l_mem lusH_snapshot(lua_State *L, lua_Writer writer, void *data);
+
+
+#endif
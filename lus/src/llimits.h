@@ -383,6 +383,20 @@ typedef union __attribute__((packed)) {
 #define l_noinline /* empty */
 #endif
 
+/*
+** Attribute for the layout of tagged values. With LUAI_PACKEDVALUES
+** (meson -Dpacked_values=true) a 'TValue' drops the padding after its
+** one-byte tag: 9 bytes instead of 16, so stack slots, upvalues, closure
+** upvalue arrays, and constants take about half the memory. Fields are
+** then read unaligned, which is cheap on x86-64 and AArch64 but slow or
+** unsupported on other targets.
+*/
+#if defined(LUAI_PACKEDVALUES) && (defined(__GNUC__) || defined(__clang__))
+#define l_packed __attribute__((packed))
+#else
+#define l_packed /* empty */
+#endif
+
 /* }================================================================== */
 
 /* Give these macros simpler names for internal use */
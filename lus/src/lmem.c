@@ -16,6 +16,7 @@
 #include "ldebug.h"
 #include "ldo.h"
 #include "lgc.h"
+#include "lheap.h"
 #include "lmem.h"
 #include "lobject.h"
 #include "lstate.h"
@@ -167,6 +168,8 @@ void *luaM_realloc_(lua_State *L, void *block, size_t osize, size_t nsize) {
   }
   lua_assert((nsize == 0) == (newblock == NULL));
   g->GCdebt -= cast(l_mem, nsize) - cast(l_mem, osize);
+  if (l_unlikely(g->heapprof != NULL) && nsize > osize)
+    lusH_sample(L, nsize - osize, 0); /* count only the growth */
   return newblock;
 }
 
@@ -189,6 +192,8 @@ void *luaM_malloc_(lua_State *L, size_t size, int tag) {
         luaM_error(L);
     }
     g->GCdebt -= cast(l_mem, size);
+    if (l_unlikely(g->heapprof != NULL))
+      lusH_sample(L, size, tag);
     return newblock;
   }
 }
@@ -16,13 +16,17 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "lauxlib.h"
 #include "lglob.h"
 #include "lmem.h"
+#include "lobject.h"
 #include "lpledge.h"
+#include "lstate.h"
 #include "lua.h"
 #include "lualib.h"
+#include "lvector.h"
 
 /* OpenSSL headers */
 #include <openssl/err.h>
@@ -49,6 +53,7 @@ typedef SSIZE_T ssize_t; /* POSIX type not defined on MSVC */
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/time.h>
@@ -63,9 +68,33 @@ typedef int socket_t;
 #define sock_close close
 #endif
 
+#if defined(LUS_PLATFORM_LINUX)
+#include <sys/epoll.h>
+#define NETLOOP_EPOLL
+#endif
+
+#if defined(LUS_PLATFORM_WINDOWS)
+typedef WSAPOLLFD net_pollfd;
+#define net_poll WSAPoll
+#define sock_wouldblock(err) ((err) == WSAEWOULDBLOCK)
+#else
+typedef struct pollfd net_pollfd;
+#define net_poll poll
+#define sock_wouldblock(err) ((err) == EWOULDBLOCK || (err) == EAGAIN)
+#endif
+
+/* Writes to a reset peer report EPIPE instead of raising SIGPIPE */
+#if defined(MSG_NOSIGNAL)
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
 /* c-ares headers - needs fd_set from above */
 #include <ares.h>
 
+#include "lworkerlib.h" /* threading primitives */
+
 /*
 ** {======================================================
 ** Constants and Type Definitions
@@ -208,33 +237,6 @@ static void init_winsock(lua_State *L) {
 #endif
 }
 
-static void init_ssl(lua_State *L) {
-  if (ssl_ctx == NULL) {
-    SSL_library_init();
-    SSL_load_error_strings();
-    OpenSSL_add_all_algorithms();
-
-    ssl_ctx = SSL_CTX_new(TLS_client_method());
-    if (ssl_ctx == NULL) {
-      luaL_error(L, "failed to create SSL context");
-    }
-
-    /* Load system CA certificates */
-    SSL_CTX_set_default_verify_paths(ssl_ctx);
-    SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_PEER, NULL);
-  }
-}
-
-static void init_cares(lua_State *L) {
-  if (!cares_initialized) {
-    int status = ares_library_init(ARES_LIB_INIT_ALL);
-    if (status != ARES_SUCCESS) {
-      luaL_error(L, "c-ares initialization failed: %s", ares_strerror(status));
-    }
-    cares_initialized = 1;
-  }
-}
-
 /* }====================================================== */
 
 /*
@@ -312,24 +314,560 @@ static void set_nonblocking(socket_t fd, int nonblock) {
 /* Wait for socket to become readable/writable with timeout (blocking version)
  */
 static int wait_socket(socket_t fd, int for_write, int timeout_ms) {
-  fd_set fds;
-  struct timeval tv, *tvp = NULL;
+  net_pollfd pfd;
+  int ready;
+
+  pfd.fd = fd;
+  pfd.events = for_write ? POLLOUT : POLLIN;
+  pfd.revents = 0;
+  do {
+    ready = net_poll(&pfd, 1, timeout_ms);
+  } while (ready < 0 && SOCKET_ERRNO == EINTR);
+  return ready;
+}
+
+/* Monotonic clock in milliseconds */
+static double net_now(void) {
+#if defined(LUS_PLATFORM_WINDOWS)
+  return (double)GetTickCount64();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+#endif
+}
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Event Loop
+** =======================================================
+*/
+
+/*
+** network.spawn turns a function into a task: a coroutine owned by the
+** per-state loop that network.run drives. When a socket operation inside
+** a task would block, the task registers interest in the socket and
+** yields; the loop resumes it once the socket is ready or its timeout
+** expires, and the operation picks up in its continuation. Anywhere else
+** (main thread, plain coroutines, non-yieldable C calls) operations keep
+** blocking the calling thread as before.
+**
+** Sockets are waited on with epoll on Linux and with poll elsewhere.
+*/
+
+#define NETLOOP_KEY "network.loop"
+#define NETTASKS_KEY "network.tasks"
+#define NETLOOP_METATABLE "network.eventloop"
+
+#define NET_READ 1
+#define NET_WRITE 2
+
+typedef struct NetTask {
+  lua_State *co;
+  struct NetTask *next; /* run queue link */
+  socket_t fd;          /* socket being waited on, or SOCKET_INVALID */
+  int events;           /* NET_READ/NET_WRITE awaited on 'fd' */
+  int waiting;          /* parked in the loop */
+  int timedout;         /* woken by its deadline rather than its socket */
+  int nargs;            /* values to resume with; -1 after a wake-up */
+  int heapidx;          /* position in the timer heap, -1 if none */
+  int slot;             /* position in 'waiters' (poll backend) */
+  double deadline;      /* absolute, in net_now() milliseconds */
+} NetTask;
+
+#if defined(NETLOOP_EPOLL)
+typedef struct NetFd {
+  NetTask *reader;
+  NetTask *writer;
+} NetFd;
+#endif
+
+typedef struct NetLoop {
+#if defined(NETLOOP_EPOLL)
+  int epfd;
+  NetFd *fds; /* indexed by file descriptor */
+  int sizefds;
+#else
+  NetTask **waiters; /* tasks parked on a socket */
+  net_pollfd *pfds;
+  int nwaiters;
+  int sizewaiters;
+#endif
+  NetTask **timers; /* min-heap on deadline */
+  int ntimers;
+  int sizetimers;
+  NetTask *runhead, *runtail;
+  NetTask *current; /* task being resumed */
+  int ntasks;       /* spawned tasks that have not finished */
+  int running;
+  int closed;
+} NetLoop;
+
+static void runq_push(NetLoop *loop, NetTask *t) {
+  t->next = NULL;
+  if (loop->runtail)
+    loop->runtail->next = t;
+  else
+    loop->runhead = t;
+  loop->runtail = t;
+}
+
+static NetTask *runq_pop(NetLoop *loop) {
+  NetTask *t = loop->runhead;
+  if (t) {
+    loop->runhead = t->next;
+    if (loop->runhead == NULL)
+      loop->runtail = NULL;
+  }
+  return t;
+}
+
+/*
+** Timer heap
+*/
+
+static void heap_set(NetLoop *loop, int i, NetTask *t) {
+  loop->timers[i] = t;
+  t->heapidx = i;
+}
+
+static void heap_up(NetLoop *loop, int i) {
+  NetTask *t = loop->timers[i];
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (loop->timers[parent]->deadline <= t->deadline)
+      break;
+    heap_set(loop, i, loop->timers[parent]);
+    i = parent;
+  }
+  heap_set(loop, i, t);
+}
+
+static void heap_down(NetLoop *loop, int i) {
+  NetTask *t = loop->timers[i];
+  for (;;) {
+    int child = 2 * i + 1;
+    if (child >= loop->ntimers)
+      break;
+    if (child + 1 < loop->ntimers &&
+        loop->timers[child + 1]->deadline < loop->timers[child]->deadline)
+      child++;
+    if (t->deadline <= loop->timers[child]->deadline)
+      break;
+    heap_set(loop, i, loop->timers[child]);
+    i = child;
+  }
+  heap_set(loop, i, t);
+}
+
+static void heap_reserve(lua_State *L, NetLoop *loop) {
+  if (loop->ntimers == loop->sizetimers) {
+    int newsize = loop->sizetimers ? loop->sizetimers * 2 : 16;
+    loop->timers = luaM_reallocvector(L, loop->timers, loop->sizetimers,
+                                      newsize, NetTask *);
+    loop->sizetimers = newsize;
+  }
+}
+
+static void heap_push(NetLoop *loop, NetTask *t) {
+  heap_set(loop, loop->ntimers++, t);
+  heap_up(loop, t->heapidx);
+}
+
+static void heap_remove(NetLoop *loop, NetTask *t) {
+  int i = t->heapidx;
+  NetTask *last = loop->timers[--loop->ntimers];
+  t->heapidx = -1;
+  if (last != t) {
+    heap_set(loop, i, last);
+    heap_up(loop, i);
+    heap_down(loop, last->heapidx);
+  }
+}
+
+/*
+** Socket interest
+*/
+
+#if defined(NETLOOP_EPOLL)
+
+static void fd_update(NetLoop *loop, socket_t fd, int registered) {
+  NetFd *s = &loop->fds[fd];
+  struct epoll_event ev;
+  ev.events = (s->reader ? EPOLLIN : 0) | (s->writer ? EPOLLOUT : 0);
+  ev.data.fd = fd;
+  if (ev.events == 0)
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+  else
+    epoll_ctl(loop->epfd, registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void loop_watch(lua_State *L, NetLoop *loop, NetTask *t) {
+  NetFd *s;
+  if (t->fd >= loop->sizefds) {
+    int newsize = loop->sizefds ? loop->sizefds : 64;
+    while (newsize <= t->fd)
+      newsize *= 2;
+    loop->fds =
+        luaM_reallocvector(L, loop->fds, loop->sizefds, newsize, NetFd);
+    memset(loop->fds + loop->sizefds, 0,
+           (size_t)(newsize - loop->sizefds) * sizeof(NetFd));
+    loop->sizefds = newsize;
+  }
+  s = &loop->fds[t->fd];
+  if (((t->events & NET_READ) && s->reader) ||
+      ((t->events & NET_WRITE) && s->writer))
+    luaL_error(L, "socket is already being waited on by another task");
+  int registered = (s->reader || s->writer);
+  if (t->events & NET_READ)
+    s->reader = t;
+  if (t->events & NET_WRITE)
+    s->writer = t;
+  fd_update(loop, t->fd, registered);
+}
+
+static void loop_unwatch(NetLoop *loop, NetTask *t) {
+  NetFd *s = &loop->fds[t->fd];
+  if (s->reader == t)
+    s->reader = NULL;
+  if (s->writer == t)
+    s->writer = NULL;
+  fd_update(loop, t->fd, 1);
+}
+
+#else
+
+static void loop_watch(lua_State *L, NetLoop *loop, NetTask *t) {
+  int i;
+  for (i = 0; i < loop->nwaiters; i++) {
+    NetTask *w = loop->waiters[i];
+    if (w->fd == t->fd && (w->events & t->events))
+      luaL_error(L, "socket is already being waited on by another task");
+  }
+  if (loop->nwaiters == loop->sizewaiters) {
+    int newsize = loop->sizewaiters ? loop->sizewaiters * 2 : 16;
+    loop->waiters = luaM_reallocvector(L, loop->waiters, loop->sizewaiters,
+                                       newsize, NetTask *);
+    loop->pfds = luaM_reallocvector(L, loop->pfds, loop->sizewaiters,
+                                    newsize, net_pollfd);
+    loop->sizewaiters = newsize;
+  }
+  t->slot = loop->nwaiters++;
+  loop->waiters[t->slot] = t;
+}
+
+static void loop_unwatch(NetLoop *loop, NetTask *t) {
+  NetTask *last = loop->waiters[--loop->nwaiters];
+  loop->waiters[t->slot] = last;
+  last->slot = t->slot;
+}
+
+#endif
+
+static void task_wake(NetLoop *loop, NetTask *t, int timedout) {
+  if (t->fd != SOCKET_INVALID) {
+    loop_unwatch(loop, t);
+    t->fd = SOCKET_INVALID;
+  }
+  if (t->heapidx >= 0)
+    heap_remove(loop, t);
+  t->waiting = 0;
+  t->timedout = timedout;
+  t->nargs = -1;
+  runq_push(loop, t);
+}
+
+/*
+** Wait up to 'timeout_ms' (-1 for no limit) for parked sockets and make
+** the tasks whose sockets became ready runnable.
+*/
+static void loop_poll(NetLoop *loop, int timeout_ms) {
+#if defined(NETLOOP_EPOLL)
+  struct epoll_event evs[64];
+  int i, n = epoll_wait(loop->epfd, evs, 64, timeout_ms);
+  for (i = 0; i < n; i++) {
+    NetFd *s = &loop->fds[evs[i].data.fd];
+    uint32_t e = evs[i].events;
+    NetTask *w = s->writer;
+    if (s->reader && (e & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+      task_wake(loop, s->reader, 0);
+    if (w && s->writer == w && (e & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+      task_wake(loop, w, 0);
+  }
+#else
+  int i, n;
+  for (i = 0; i < loop->nwaiters; i++) {
+    NetTask *w = loop->waiters[i];
+    loop->pfds[i].fd = w->fd;
+    loop->pfds[i].events = (short)(((w->events & NET_READ) ? POLLIN : 0) |
+                                   ((w->events & NET_WRITE) ? POLLOUT : 0));
+    loop->pfds[i].revents = 0;
+  }
+  n = net_poll(loop->pfds, (unsigned)loop->nwaiters, timeout_ms);
+  /* backwards, so that unwatching (which moves the last waiter into the
+  ** freed slot) never moves a waiter that is still to be checked */
+  for (i = loop->nwaiters - 1; n > 0 && i >= 0; i--) {
+    if (loop->pfds[i].revents != 0) {
+      task_wake(loop, loop->waiters[i], 0);
+      n--;
+    }
+  }
+#endif
+}
+
+static int loop_gc(lua_State *L) {
+  NetLoop *loop = (NetLoop *)lua_touserdata(L, 1);
+  if (!loop->closed) {
+#if defined(NETLOOP_EPOLL)
+    close(loop->epfd);
+    luaM_freearray(L, loop->fds, (size_t)loop->sizefds);
+    loop->fds = NULL;
+    loop->sizefds = 0;
+#else
+    luaM_freearray(L, loop->waiters, (size_t)loop->sizewaiters);
+    luaM_freearray(L, loop->pfds, (size_t)loop->sizewaiters);
+    loop->waiters = NULL;
+    loop->pfds = NULL;
+    loop->nwaiters = loop->sizewaiters = 0;
+#endif
+    luaM_freearray(L, loop->timers, (size_t)loop->sizetimers);
+    loop->timers = NULL;
+    loop->ntimers = loop->sizetimers = 0;
+    loop->closed = 1;
+  }
+  return 0;
+}
+
+/* Return the state's loop, or NULL if none was created yet */
+static NetLoop *find_loop(lua_State *L) {
+  NetLoop *loop;
+  lua_getfield(L, LUA_REGISTRYINDEX, NETLOOP_KEY);
+  loop = (NetLoop *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return (loop != NULL && !loop->closed) ? loop : NULL;
+}
 
-  FD_ZERO(&fds);
-  FD_SET(fd, &fds);
+static NetLoop *get_loop(lua_State *L) {
+  NetLoop *loop = find_loop(L);
+  if (loop == NULL) {
+    loop = (NetLoop *)lua_newuserdatauv(L, sizeof(NetLoop), 0);
+    memset(loop, 0, sizeof(NetLoop));
+#if defined(NETLOOP_EPOLL)
+    loop->epfd = -1;
+#endif
+    loop->closed = 1; /* until fully initialized */
+    if (luaL_newmetatable(L, NETLOOP_METATABLE)) {
+      lua_pushcfunction(L, loop_gc);
+      lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+#if defined(NETLOOP_EPOLL)
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0)
+      luaL_error(L, "cannot create event loop: %s", strerror(errno));
+#endif
+    loop->closed = 0;
+    lua_setfield(L, LUA_REGISTRYINDEX, NETLOOP_KEY);
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, NETTASKS_KEY);
+  }
+  return loop;
+}
 
+/*
+** Park the running task until 'fd' (SOCKET_INVALID for none) is ready for
+** 'events' or 'timeout_ms' (-1 for no limit) elapses. Returns 0 without
+** parking when 'L' is not a task being run by the loop; otherwise the task
+** yields and this does not return. The continuation 'k' later finds a
+** boolean on top of the stack: false if the timeout expired.
+*/
+static int net_park(lua_State *L, socket_t fd, int events, int timeout_ms,
+                    lua_KContext ctx, lua_KFunction k) {
+  NetLoop *loop = find_loop(L);
+  NetTask *t;
+  if (loop == NULL || (t = loop->current) == NULL || t->co != L ||
+      !lua_isyieldable(L))
+    return 0;
+  if (timeout_ms >= 0)
+    heap_reserve(L, loop);
+  if (fd != SOCKET_INVALID) {
+    t->fd = fd;
+    t->events = events;
+    loop_watch(L, loop, t);
+  }
   if (timeout_ms >= 0) {
-    tv.tv_sec = timeout_ms / 1000;
-    tv.tv_usec = (timeout_ms % 1000) * 1000;
-    tvp = &tv;
+    t->deadline = net_now() + timeout_ms;
+    heap_push(loop, t);
   }
+  t->waiting = 1;
+  return lua_yieldk(L, 0, ctx, k);
+}
 
-  if (for_write) {
-    return select((int)fd + 1, NULL, &fds, NULL, tvp);
+/*
+** Wait for 'fd' after an operation on it would have blocked. Inside a task
+** this yields and does not return (see net_park); otherwise it blocks.
+** Returns 1 when the socket is ready, 0 on timeout and -1 on error.
+*/
+static int net_await(lua_State *L, socket_t fd, int events, int timeout_ms,
+                     lua_KContext ctx, lua_KFunction k) {
+  if (timeout_ms != 0)
+    net_park(L, fd, events, timeout_ms, ctx, k);
+  return wait_socket(fd, events & NET_WRITE, timeout_ms);
+}
+
+/* Wake every task waiting on 'fd', which is about to be closed */
+static void net_forget(lua_State *L, socket_t fd) {
+  NetLoop *loop = find_loop(L);
+  if (loop == NULL)
+    return;
+#if defined(NETLOOP_EPOLL)
+  if (fd < loop->sizefds) {
+    NetFd *s = &loop->fds[fd];
+    if (s->reader)
+      task_wake(loop, s->reader, 0);
+    if (s->writer)
+      task_wake(loop, s->writer, 0);
   }
-  else {
-    return select((int)fd + 1, &fds, NULL, NULL, tvp);
+#else
+  int i;
+  for (i = loop->nwaiters - 1; i >= 0; i--) {
+    if (loop->waiters[i]->fd == fd)
+      task_wake(loop, loop->waiters[i], 0);
+  }
+#endif
+}
+
+/*
+** Resume task 't'. Errors raised by the task are propagated to the caller
+** of network.run.
+*/
+static void task_resume(lua_State *L, NetLoop *loop, NetTask *t) {
+  lua_State *co = t->co;
+  int nres, status;
+  int nargs = t->nargs;
+  if (nargs < 0) { /* tell the continuation why it was woken */
+    lua_pushboolean(co, !t->timedout);
+    nargs = 1;
+  }
+  t->nargs = 0;
+  loop->current = t;
+  status = lua_resume(co, L, nargs, &nres);
+  loop->current = NULL;
+  if (status == LUA_YIELD) {
+    lua_pop(co, nres);
+    if (!t->waiting) /* plain coroutine.yield: run again next round */
+      runq_push(loop, t);
+    return;
+  }
+  /* finished: drop the task */
+  loop->ntasks--;
+  if (status != LUA_OK)
+    lua_xmove(co, L, 1); /* error object */
+  else
+    lua_pop(co, nres);
+  lua_getfield(L, LUA_REGISTRYINDEX, NETTASKS_KEY);
+  lua_pushthread(co);
+  lua_xmove(co, L, 1);
+  lua_pushnil(L);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+  if (status != LUA_OK) {
+    lua_closethread(co, L);
+    loop->running = 0;
+    lua_error(L);
+  }
+}
+
+static int net_spawn(lua_State *L) {
+  int n = lua_gettop(L);
+  NetLoop *loop;
+  NetTask *t;
+  lua_State *co;
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  loop = get_loop(L);
+  lua_getfield(L, LUA_REGISTRYINDEX, NETTASKS_KEY);
+  co = lua_newthread(L);
+  t = (NetTask *)lua_newuserdatauv(L, sizeof(NetTask), 0);
+  memset(t, 0, sizeof(NetTask));
+  t->co = co;
+  t->fd = SOCKET_INVALID;
+  t->heapidx = -1;
+  t->nargs = n - 1;
+  lua_rawset(L, -3); /* tasks[co] = t */
+  lua_pop(L, 1);
+  lua_xmove(L, co, n); /* function and arguments */
+  loop->ntasks++;
+  runq_push(loop, t);
+  return 0;
+}
+
+static int net_run(lua_State *L) {
+  lua_Number secs = luaL_optnumber(L, 1, -1);
+  NetLoop *loop = get_loop(L);
+  double deadline = (secs >= 0) ? net_now() + secs * 1e3 : -1;
+  if (loop->running)
+    return luaL_error(L, "network.run is already running");
+  loop->running = 1;
+  while (loop->ntasks > 0) {
+    NetTask *last = loop->runtail;
+    NetTask *t;
+    int timeout = -1;
+    double now;
+    /* run what is runnable now; tasks made runnable meanwhile wait for the
+    ** next round so a yielding task cannot starve the sockets */
+    while (last != NULL && (t = runq_pop(loop)) != NULL) {
+      task_resume(L, loop, t);
+      if (t == last)
+        break;
+    }
+    if (loop->ntasks == 0)
+      break;
+    now = net_now();
+    if (deadline >= 0 && now >= deadline)
+      break;
+    if (loop->runhead != NULL)
+      timeout = 0;
+    else if (loop->ntimers > 0) {
+      double wait = loop->timers[0]->deadline - now;
+      timeout = (wait > 0) ? (int)(wait + 0.999) : 0;
+    }
+    if (deadline >= 0) {
+      double left = deadline - now;
+      int cap = (left > 0) ? (int)(left + 0.999) : 0;
+      if (timeout < 0 || cap < timeout)
+        timeout = cap;
+    }
+    loop_poll(loop, timeout);
+    now = net_now();
+    while (loop->ntimers > 0 && loop->timers[0]->deadline <= now)
+      task_wake(loop, loop->timers[0], 1);
+  }
+  loop->running = 0;
+  lua_pushinteger(L, loop->ntasks);
+  return 1;
+}
+
+static int net_sleep_k(lua_State *L, int status, lua_KContext ctx) {
+  (void)status;
+  (void)ctx;
+  lua_pop(L, 1);
+  return 0;
+}
+
+static int net_sleep(lua_State *L) {
+  lua_Number secs = luaL_checknumber(L, 1);
+  int ms = (secs > 0) ? (int)(secs * 1e3) : 0;
+  net_park(L, SOCKET_INVALID, 0, ms, 0, net_sleep_k);
+  if (ms > 0) {
+#if defined(LUS_PLATFORM_WINDOWS)
+    Sleep((DWORD)ms);
+#else
+    poll(NULL, 0, ms);
+#endif
   }
+  return 0;
 }
 
 /* }====================================================== */
@@ -340,13 +878,183 @@ static int wait_socket(socket_t fd, int for_write, int timeout_ms) {
 ** =======================================================
 */
 
+/*
+** Names are resolved through one c-ares channel shared by every state in
+** the process, and answers are cached process-wide until their TTL runs
+** out. Failed lookups (no such name, or no address) are cached for
+** 'negative_ms'; other failures, such as timeouts, are not cached, so the
+** next lookup tries again. Entries loaded from a hosts file never expire
+** and do not count against 'max'. The cache, the 'queries' on the wire and
+** the counters are guarded by 'lock', which is never held while waiting
+** for the network and must be released before raising an error. The
+** channel is guarded by 'chlock', held only while c-ares runs.
+*/
+#define DNS_BUCKETS 256
+#define DNS_MAX 1024
+#define DNS_NEGATIVE_MS 5000
+#define DNS_MAXTTL_MS 86400000 /* a day */
+#define DNS_SLICE_MS 20        /* wait slice while lookups share the channel */
+
+typedef struct DnsEntry {
+  struct DnsEntry *next;          /* hash chain */
+  struct DnsEntry *older, *newer; /* LRU list; unused when pinned */
+  double expires;                 /* net_now() milliseconds */
+  int pinned;                     /* from a hosts file: never expires */
+  int status;                     /* ARES_SUCCESS or the cached failure */
+  socklen_t addrlen;
+  struct sockaddr_storage addr; /* port not set */
+  char host[1];
+} DnsEntry;
+
 typedef struct {
   int done;
   int status;
+  int ttl; /* seconds */
   struct sockaddr_storage addr;
   socklen_t addrlen;
 } DnsResult;
 
+/* A lookup on the wire; other threads missing the same name wait for it */
+typedef struct DnsQuery {
+  struct DnsQuery *next;
+  int waiters; /* threads to hand the result to, the querying one included */
+  DnsResult result;
+  char host[256];
+} DnsQuery;
+
+typedef struct DnsCache {
+  lus_atomic_t ready; /* 0, 1 while initializing, 2 */
+  lus_mutex_t lock;
+  lus_cond_t answered; /* signaled when a query in 'queries' is done */
+  DnsQuery *queries;
+  lus_mutex_t chlock;
+  ares_channel_t *channel;
+  int inflight; /* lookups using the channel */
+  struct ares_addr_port_node *sysservers; /* saved when servers are set */
+  int servers_set;
+  DnsEntry *buckets[DNS_BUCKETS];
+  DnsEntry *oldest, *newest;
+  int count;  /* entries on the LRU list */
+  int pinned; /* entries from hosts files */
+  int max;
+  int negative_ms;
+  lua_Integer lookups, hits, negative, shared, misses, expired, evicted;
+} DnsCache;
+
+static DnsCache dns_cache;
+
+static void dns_init(void) {
+  if (lus_atomic_load(&dns_cache.ready) == 2)
+    return;
+  if (lus_atomic_cas(&dns_cache.ready, 0, 1)) {
+    lus_mutex_init(&dns_cache.lock);
+    lus_cond_init(&dns_cache.answered);
+    lus_mutex_init(&dns_cache.chlock);
+    dns_cache.max = DNS_MAX;
+    dns_cache.negative_ms = DNS_NEGATIVE_MS;
+    lus_atomic_store(&dns_cache.ready, 2);
+  }
+  else {
+    while (lus_atomic_load(&dns_cache.ready) != 2)
+      lus_cpu_relax();
+  }
+}
+
+static unsigned int dns_hash(const char *host) {
+  unsigned int h = 2166136261u;
+  for (; *host; host++)
+    h = (h ^ (unsigned char)*host) * 16777619u;
+  return h % DNS_BUCKETS;
+}
+
+static DnsEntry *dns_find(const char *host) {
+  DnsEntry *e = dns_cache.buckets[dns_hash(host)];
+  while (e != NULL && strcmp(e->host, host) != 0)
+    e = e->next;
+  return e;
+}
+
+static void lru_unlink(DnsEntry *e) {
+  if (e->older)
+    e->older->newer = e->newer;
+  else
+    dns_cache.oldest = e->newer;
+  if (e->newer)
+    e->newer->older = e->older;
+  else
+    dns_cache.newest = e->older;
+  e->older = e->newer = NULL;
+}
+
+static void lru_append(DnsEntry *e) {
+  e->older = dns_cache.newest;
+  e->newer = NULL;
+  if (dns_cache.newest)
+    dns_cache.newest->newer = e;
+  else
+    dns_cache.oldest = e;
+  dns_cache.newest = e;
+}
+
+static void dns_remove(DnsEntry *e) {
+  DnsEntry **p = &dns_cache.buckets[dns_hash(e->host)];
+  while (*p != e)
+    p = &(*p)->next;
+  *p = e->next;
+  if (e->pinned) {
+    dns_cache.pinned--;
+  }
+  else {
+    lru_unlink(e);
+    dns_cache.count--;
+  }
+  free(e);
+}
+
+static void dns_trim(int max) {
+  while (dns_cache.count > max) {
+    dns_remove(dns_cache.oldest);
+    dns_cache.evicted++;
+  }
+}
+
+/* Cache an answer for 'host'; pinned entries are only replaced by pinned */
+static void dns_store(const char *host, int status,
+                      const struct sockaddr_storage *addr, socklen_t addrlen,
+                      double expires, int pinned) {
+  DnsEntry *e = dns_find(host);
+  if (e != NULL) {
+    if (e->pinned && !pinned)
+      return;
+    dns_remove(e);
+  }
+  if (!pinned && dns_cache.max == 0)
+    return;
+  size_t len = strlen(host);
+  e = (DnsEntry *)malloc(sizeof(DnsEntry) + len);
+  if (e == NULL)
+    return; /* a cache miss later is harmless */
+  memcpy(e->host, host, len + 1);
+  e->expires = expires;
+  e->pinned = pinned;
+  e->status = status;
+  e->addrlen = addrlen;
+  if (addrlen > 0)
+    memcpy(&e->addr, addr, addrlen);
+  e->older = e->newer = NULL;
+  unsigned int h = dns_hash(host);
+  e->next = dns_cache.buckets[h];
+  dns_cache.buckets[h] = e;
+  if (pinned) {
+    dns_cache.pinned++;
+  }
+  else {
+    lru_append(e);
+    dns_cache.count++;
+    dns_trim(dns_cache.max);
+  }
+}
+
 static void addrinfo_callback(void *arg, int status, int timeouts,
                               struct ares_addrinfo *result) {
   DnsResult *res = (DnsResult *)arg;
@@ -359,117 +1067,476 @@ static void addrinfo_callback(void *arg, int status, int timeouts,
     struct ares_addrinfo_node *node = result->nodes;
     memcpy(&res->addr, node->ai_addr, node->ai_addrlen);
     res->addrlen = (socklen_t)node->ai_addrlen;
-    ares_freeaddrinfo(result);
+    res->ttl = node->ai_ttl;
+  }
+  else if (status == ARES_SUCCESS) {
+    res->status = ARES_ENODATA;
   }
+  if (result != NULL)
+    ares_freeaddrinfo(result);
 }
 
-static int resolve_hostname(lua_State *L, const char *hostname, int port,
-                            struct sockaddr_storage *addr, socklen_t *addrlen) {
-  ares_channel_t *channel;
-  DnsResult result = {0};
-  int status;
-  struct ares_options opts;
-  struct ares_addrinfo_hints hints;
-  char port_str[16];
-
-  init_cares(L);
+static int dns_channel(void);
 
-  memset(&opts, 0, sizeof(opts));
-  opts.timeout = 5000; /* 5 second timeout */
-  opts.tries = 3;
-
-  status =
-      ares_init_options(&channel, &opts, ARES_OPT_TIMEOUTMS | ARES_OPT_TRIES);
-  if (status != ARES_SUCCESS) {
-    return luaL_error(L, "DNS resolver init failed: %s", ares_strerror(status));
-  }
+/*
+** Look 'host' up through the shared channel. Called without the cache
+** lock; 'chlock' is released while waiting for the network, so other
+** threads can run their own queries on the channel meanwhile.
+*/
+static void dns_query(const char *host, DnsResult *result) {
+  struct ares_addrinfo_hints hints;
 
   /* Prepare hints for getaddrinfo */
   memset(&hints, 0, sizeof(hints));
   hints.ai_family = AF_UNSPEC; /* Allow IPv4 or IPv6 */
   hints.ai_socktype = SOCK_STREAM;
 
-  snprintf(port_str, sizeof(port_str), "%d", port);
+  lus_mutex_lock(&dns_cache.chlock);
+  result->status = dns_channel();
+  if (result->status != ARES_SUCCESS) {
+    lus_mutex_unlock(&dns_cache.chlock);
+    return;
+  }
+  result->status = ARES_ETIMEOUT; /* unless the query completes */
 
-  /* Start async lookup */
-  ares_getaddrinfo(channel, hostname, port_str, &hints, addrinfo_callback,
-                   &result);
+  /* Start async lookup; the port is filled in by the caller */
+  dns_cache.inflight++;
+  ares_getaddrinfo(dns_cache.channel, host, NULL, &hints, addrinfo_callback,
+                   result);
 
   /* Process events until done */
-  while (!result.done) {
+  while (!result->done) {
     ares_socket_t socks[ARES_GETSOCK_MAXNUM];
-    int bitmask;
-    int i, nfds = 0;
-    fd_set read_fds, write_fds;
-    struct timeval tv, *tvp;
+    net_pollfd pfds[ARES_GETSOCK_MAXNUM];
+    struct timeval tv, maxtv, *tvp;
+    int bitmask, timeout_ms;
+    int i, n = 0;
 
-    FD_ZERO(&read_fds);
-    FD_ZERO(&write_fds);
-
-    bitmask = ares_getsock(channel, socks, ARES_GETSOCK_MAXNUM);
+    bitmask = ares_getsock(dns_cache.channel, socks, ARES_GETSOCK_MAXNUM);
     for (i = 0; i < ARES_GETSOCK_MAXNUM; i++) {
+      short events = 0;
       /* Use unsigned literal to avoid UBSan "left shift of 1 by 31" error */
-      if (bitmask & (1U << i)) { /* readable */
-        FD_SET(socks[i], &read_fds);
-        if ((int)socks[i] + 1 > nfds)
-          nfds = (int)socks[i] + 1;
-      }
-      if (bitmask & (1U << (i + ARES_GETSOCK_MAXNUM))) { /* writable */
-        FD_SET(socks[i], &write_fds);
-        if ((int)socks[i] + 1 > nfds)
-          nfds = (int)socks[i] + 1;
+      if (bitmask & (1U << i)) /* readable */
+        events |= POLLIN;
+      if (bitmask & (1U << (i + ARES_GETSOCK_MAXNUM))) /* writable */
+        events |= POLLOUT;
+      if (events != 0) {
+        pfds[n].fd = socks[i];
+        pfds[n].events = events;
+        pfds[n].revents = 0;
+        n++;
       }
     }
 
-    if (nfds == 0)
+    /* Another thread may process our answer: do not sleep through it.
+    ** With no socket open the query is between tries, but still pending:
+    ** c-ares writes 'result' when it ends, so keep waiting for that. */
+    maxtv.tv_sec = 0;
+    maxtv.tv_usec = DNS_SLICE_MS * 1000;
+    tvp = ares_timeout(dns_cache.channel,
+                       (dns_cache.inflight > 1 || n == 0) ? &maxtv : NULL,
+                       &tv);
+    timeout_ms = (tvp == NULL) ? -1
+                               : (int)(tvp->tv_sec * 1000 +
+                                       (tvp->tv_usec + 999) / 1000);
+    lus_mutex_unlock(&dns_cache.chlock);
+    if (n > 0)
+      net_poll(pfds, (unsigned)n, timeout_ms);
+    else {
+#if defined(LUS_PLATFORM_WINDOWS)
+      Sleep((DWORD)timeout_ms);
+#else
+      poll(NULL, 0, timeout_ms);
+#endif
+    }
+    lus_mutex_lock(&dns_cache.chlock);
+    if (result->done)
       break;
-
-    tvp = ares_timeout(channel, NULL, &tv);
-    select(nfds, &read_fds, &write_fds, NULL, tvp);
-    ares_process_fd(channel, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
+    ares_process_fd(dns_cache.channel, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
 
     /* Process all ready sockets */
-    for (i = 0; i < ARES_GETSOCK_MAXNUM; i++) {
+    for (i = 0; i < n; i++) {
       ares_socket_t rfd = ARES_SOCKET_BAD, wfd = ARES_SOCKET_BAD;
-      if ((bitmask & (1U << i)) && FD_ISSET(socks[i], &read_fds)) {
-        rfd = socks[i];
-      }
-      if ((bitmask & (1U << (i + ARES_GETSOCK_MAXNUM))) &&
-          FD_ISSET(socks[i], &write_fds)) {
-        wfd = socks[i];
-      }
+      if (pfds[i].revents & (POLLIN | POLLERR | POLLHUP))
+        rfd = pfds[i].fd;
+      if (pfds[i].revents & POLLOUT)
+        wfd = pfds[i].fd;
       if (rfd != ARES_SOCKET_BAD || wfd != ARES_SOCKET_BAD) {
-        ares_process_fd(channel, rfd, wfd);
+        ares_process_fd(dns_cache.channel, rfd, wfd);
       }
     }
   }
+  dns_cache.inflight--;
+  lus_mutex_unlock(&dns_cache.chlock);
+}
 
-  ares_destroy(channel);
+/* Create the shared channel; returns a c-ares status. Call with 'chlock'. */
+static int dns_channel(void) {
+  struct ares_options opts;
+  int status;
 
-  if (result.status != ARES_SUCCESS) {
-    return luaL_error(L, "cannot resolve '%s': %s", hostname,
-                      ares_strerror(result.status));
+  if (dns_cache.channel != NULL)
+    return ARES_SUCCESS;
+  if (!cares_initialized) {
+    status = ares_library_init(ARES_LIB_INIT_ALL);
+    if (status != ARES_SUCCESS)
+      return status;
+    cares_initialized = 1;
   }
 
-  memcpy(addr, &result.addr, result.addrlen);
-  *addrlen = result.addrlen;
-
-  return 0;
+  memset(&opts, 0, sizeof(opts));
+  opts.timeout = 5000; /* 5 second timeout */
+  opts.tries = 3;
+  return ares_init_options(&dns_cache.channel, &opts,
+                           ARES_OPT_TIMEOUTMS | ARES_OPT_TRIES);
 }
 
-/* }====================================================== */
-
 /*
-** {======================================================
-** TCP Socket Methods
-** =======================================================
+** Send queries to 'servers' ("host[:port],..."), or back to the servers of
+** the system configuration when NULL. Returns a c-ares status.
 */
+static int dns_setservers(const char *servers) {
+  int status;
+  lus_mutex_lock(&dns_cache.chlock);
+  status = dns_channel();
+  if (status == ARES_SUCCESS && !dns_cache.servers_set) {
+    status = ares_get_servers_ports(dns_cache.channel, &dns_cache.sysservers);
+    dns_cache.servers_set = (status == ARES_SUCCESS);
+  }
+  if (status == ARES_SUCCESS) {
+    if (servers != NULL)
+      status = ares_set_servers_ports_csv(dns_cache.channel, servers);
+    else
+      status = ares_set_servers_ports(dns_cache.channel, dns_cache.sysservers);
+  }
+  lus_mutex_unlock(&dns_cache.chlock);
+  return status;
+}
 
-static LSocket *check_socket(lua_State *L, int idx) {
-  LSocket *sock = (LSocket *)luaL_checkudata(L, idx, SOCKET_METATABLE);
-  if (sock->closed) {
-    luaL_error(L, "attempt to use a closed socket");
-  }
+static void set_port(struct sockaddr_storage *addr, int port) {
+  if (addr->ss_family == AF_INET6)
+    ((struct sockaddr_in6 *)addr)->sin6_port = htons((unsigned short)port);
+  else
+    ((struct sockaddr_in *)addr)->sin_port = htons((unsigned short)port);
+}
+
+static int resolve_hostname(lua_State *L, const char *hostname, int port,
+                            struct sockaddr_storage *addr, socklen_t *addrlen) {
+  DnsResult result;
+  char host[256];
+  size_t i, len = strlen(hostname);
+
+  /* Literal addresses need no lookup (and must not block a task on one) */
+  memset(addr, 0, sizeof(*addr));
+  struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+  struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr;
+  if (inet_pton(AF_INET, hostname, &sin->sin_addr) == 1) {
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons((unsigned short)port);
+    *addrlen = sizeof(*sin);
+    return 0;
+  }
+  if (inet_pton(AF_INET6, hostname, &sin6->sin6_addr) == 1) {
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons((unsigned short)port);
+    *addrlen = sizeof(*sin6);
+    return 0;
+  }
+
+  /* Names are case-insensitive: cache them in lowercase */
+  if (len == 0 || len >= sizeof(host))
+    return luaL_error(L, "cannot resolve '%s': invalid host name", hostname);
+  for (i = 0; i <= len; i++)
+    host[i] = (char)tolower((unsigned char)hostname[i]);
+
+  dns_init();
+  lus_mutex_lock(&dns_cache.lock);
+  dns_cache.lookups++;
+  DnsEntry *e = dns_find(host);
+  if (e != NULL && !e->pinned && net_now() >= e->expires) {
+    dns_remove(e);
+    dns_cache.expired++;
+    e = NULL;
+  }
+  memset(&result, 0, sizeof(result));
+  if (e != NULL) {
+    if (e->status == ARES_SUCCESS)
+      dns_cache.hits++;
+    else
+      dns_cache.negative++;
+    if (!e->pinned) { /* most recently used */
+      lru_unlink(e);
+      lru_append(e);
+    }
+    result.status = e->status;
+    result.addrlen = e->addrlen;
+    memcpy(&result.addr, &e->addr, e->addrlen);
+  }
+  else {
+    DnsQuery *q = dns_cache.queries;
+    while (q != NULL && strcmp(q->host, host) != 0)
+      q = q->next;
+    if (q != NULL) { /* already on the wire: wait for its answer */
+      dns_cache.shared++;
+      q->waiters++;
+      while (!q->result.done)
+        lus_cond_wait(&dns_cache.answered, &dns_cache.lock);
+      result = q->result;
+      if (--q->waiters == 0)
+        free(q);
+    }
+    else if ((q = (DnsQuery *)malloc(sizeof(DnsQuery))) == NULL) {
+      result.status = ARES_ENOMEM;
+    }
+    else {
+      dns_cache.misses++;
+      memcpy(q->host, host, len + 1);
+      q->waiters = 1;
+      q->result.done = 0;
+      q->next = dns_cache.queries;
+      dns_cache.queries = q;
+      lus_mutex_unlock(&dns_cache.lock);
+      dns_query(host, &result);
+      lus_mutex_lock(&dns_cache.lock);
+      if (result.status == ARES_SUCCESS && result.ttl > 0) {
+        double ttl = (double)result.ttl * 1e3;
+        dns_store(host, ARES_SUCCESS, &result.addr, result.addrlen,
+                  net_now() + (ttl < DNS_MAXTTL_MS ? ttl : DNS_MAXTTL_MS), 0);
+      }
+      else if ((result.status == ARES_ENOTFOUND ||
+                result.status == ARES_ENODATA) &&
+               dns_cache.negative_ms > 0) {
+        dns_store(host, result.status, NULL, 0,
+                  net_now() + dns_cache.negative_ms, 0);
+      }
+      /* hand the answer to the waiters, the last one out frees the query */
+      DnsQuery **p = &dns_cache.queries;
+      while (*p != q)
+        p = &(*p)->next;
+      *p = q->next;
+      q->result = result;
+      q->result.done = 1;
+      if (--q->waiters == 0)
+        free(q);
+      else
+        lus_cond_broadcast(&dns_cache.answered);
+    }
+  }
+  lus_mutex_unlock(&dns_cache.lock);
+
+  if (result.status != ARES_SUCCESS) {
+    return luaL_error(L, "cannot resolve '%s': %s", hostname,
+                      ares_strerror(result.status));
+  }
+
+  memcpy(addr, &result.addr, result.addrlen);
+  *addrlen = result.addrlen;
+  set_port(addr, port);
+
+  return 0;
+}
+
+/* Next blank-separated field of a hosts file line, or NULL */
+static char *hosts_token(char **rest) {
+  char *p = *rest, *tok;
+  while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+    p++;
+  if (*p == '\0')
+    return NULL;
+  tok = p;
+  while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+    p++;
+  if (*p)
+    *p++ = '\0';
+  *rest = p;
+  return tok;
+}
+
+/*
+** Pin the names of a hosts file ("address name [aliases...]" lines, '#'
+** comments) in the cache. The first address listed for a name wins, as
+** with the system resolver. Returns the number of names, or -1 if the
+** file cannot be read.
+*/
+static int dns_loadhosts(const char *path) {
+  char line[1024];
+  int n = 0;
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+    return -1;
+  lus_mutex_lock(&dns_cache.lock);
+  while (fgets(line, sizeof(line), f) != NULL) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    char *p, *tok, *rest = line;
+    if ((p = strchr(line, '#')) != NULL)
+      *p = '\0';
+    tok = hosts_token(&rest);
+    if (tok == NULL)
+      continue;
+    memset(&addr, 0, sizeof(addr));
+    if (inet_pton(AF_INET, tok, &((struct sockaddr_in *)&addr)->sin_addr) ==
+        1) {
+      addr.ss_family = AF_INET;
+      addrlen = sizeof(struct sockaddr_in);
+    }
+    else if (inet_pton(AF_INET6, tok,
+                       &((struct sockaddr_in6 *)&addr)->sin6_addr) == 1) {
+      addr.ss_family = AF_INET6;
+      addrlen = sizeof(struct sockaddr_in6);
+    }
+    else {
+      continue;
+    }
+    while ((tok = hosts_token(&rest)) != NULL) {
+      DnsEntry *e;
+      if (strlen(tok) >= 256)
+        continue;
+      for (p = tok; *p; p++)
+        *p = (char)tolower((unsigned char)*p);
+      e = dns_find(tok);
+      if (e != NULL && e->pinned)
+        continue;
+      dns_store(tok, ARES_SUCCESS, &addr, addrlen, 0, 1);
+      n++;
+    }
+  }
+  lus_mutex_unlock(&dns_cache.lock);
+  fclose(f);
+  return n;
+}
+
+static void dns_clear(void) {
+  int i;
+  lus_mutex_lock(&dns_cache.lock);
+  for (i = 0; i < DNS_BUCKETS; i++) {
+    while (dns_cache.buckets[i] != NULL)
+      dns_remove(dns_cache.buckets[i]);
+  }
+  lus_mutex_unlock(&dns_cache.lock);
+}
+
+/*
+** network.dns.configure{max = n, negative = seconds, hosts = true|path,
+**                       servers = true|list}
+*/
+static int net_dns_configure(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  if (!lus_haspledge(L, "network", NULL))
+    return luaL_error(L, "permission \"network\" denied");
+  dns_init();
+  if (lua_getfield(L, 1, "max") != LUA_TNIL) {
+    lua_Integer n = luaL_checkinteger(L, -1);
+    luaL_argcheck(L, n >= 0 && n <= 1048576, 1, "max out of range");
+    lus_mutex_lock(&dns_cache.lock);
+    dns_cache.max = (int)n;
+    dns_trim(dns_cache.max);
+    lus_mutex_unlock(&dns_cache.lock);
+  }
+  if (lua_getfield(L, 1, "negative") != LUA_TNIL) {
+    lua_Number secs = luaL_checknumber(L, -1);
+    luaL_argcheck(L, secs >= 0 && secs <= 86400, 1, "negative out of range");
+    lus_mutex_lock(&dns_cache.lock);
+    dns_cache.negative_ms = (int)(secs * 1000);
+    lus_mutex_unlock(&dns_cache.lock);
+  }
+  if (lua_getfield(L, 1, "hosts") != LUA_TNIL) {
+    const char *path;
+    if (lua_isstring(L, -1)) {
+      path = lua_tostring(L, -1);
+      lus_checkfsperm(L, "fs:read", path);
+    }
+    else {
+      luaL_argcheck(L, lua_toboolean(L, -1), 1, "hosts must be true or a path");
+#if defined(LUS_PLATFORM_WINDOWS)
+      char sysdir[MAX_PATH];
+      UINT n = GetSystemDirectoryA(sysdir, MAX_PATH);
+      if (n == 0 || n >= MAX_PATH)
+        return luaL_error(L, "cannot locate the hosts file");
+      lua_pushfstring(L, "%s\\drivers\\etc\\hosts", sysdir);
+      path = lua_tostring(L, -1);
+#else
+      path = "/etc/hosts";
+#endif
+    }
+    if (dns_loadhosts(path) < 0)
+      return luaL_error(L, "cannot read hosts file '%s'", path);
+  }
+  if (lua_getfield(L, 1, "servers") != LUA_TNIL) {
+    const char *servers = NULL;
+    int status;
+    if (lua_type(L, -1) == LUA_TSTRING)
+      servers = lua_tostring(L, -1);
+    else
+      luaL_argcheck(L, lua_toboolean(L, -1), 1,
+                    "servers must be true or a string");
+    status = dns_setservers(servers);
+    if (status != ARES_SUCCESS)
+      return luaL_error(L, "cannot set DNS servers: %s",
+                        ares_strerror(status));
+  }
+  return 0;
+}
+
+static int net_dns_stats(lua_State *L) {
+  dns_init();
+  lus_mutex_lock(&dns_cache.lock);
+  lua_Integer lookups = dns_cache.lookups, hits = dns_cache.hits,
+              negative = dns_cache.negative, shared = dns_cache.shared,
+              misses = dns_cache.misses,
+              expired = dns_cache.expired, evicted = dns_cache.evicted,
+              entries = dns_cache.count + dns_cache.pinned;
+  lus_mutex_unlock(&dns_cache.lock);
+  lua_createtable(L, 0, 9);
+  lua_pushinteger(L, lookups);
+  lua_setfield(L, -2, "lookups");
+  lua_pushinteger(L, hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushinteger(L, negative);
+  lua_setfield(L, -2, "negative");
+  lua_pushinteger(L, shared);
+  lua_setfield(L, -2, "shared");
+  lua_pushinteger(L, misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushinteger(L, expired);
+  lua_setfield(L, -2, "expired");
+  lua_pushinteger(L, evicted);
+  lua_setfield(L, -2, "evicted");
+  lua_pushinteger(L, entries);
+  lua_setfield(L, -2, "entries");
+  lua_pushnumber(L, lookups > 0 ? (lua_Number)(hits + negative) /
+                                      (lua_Number)lookups
+                                : 0);
+  lua_setfield(L, -2, "hitrate");
+  return 1;
+}
+
+static int net_dns_clear(lua_State *L) {
+  if (!lus_haspledge(L, "network", NULL))
+    return luaL_error(L, "permission \"network\" denied");
+  dns_init();
+  dns_clear();
+  return 0;
+}
+
+static const luaL_Reg dns_funcs[] = {{"configure", net_dns_configure},
+                                     {"stats", net_dns_stats},
+                                     {"clear", net_dns_clear},
+                                     {NULL, NULL}};
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** TCP Socket Methods
+** =======================================================
+*/
+
+static LSocket *check_socket(lua_State *L, int idx) {
+  LSocket *sock = (LSocket *)luaL_checkudata(L, idx, SOCKET_METATABLE);
+  if (sock->closed) {
+    luaL_error(L, "attempt to use a closed socket");
+  }
   return sock;
 }
 
@@ -487,50 +1554,50 @@ static LSocket *new_socket(lua_State *L) {
 }
 
 /*
-** Synchronous socket send implementation
+** Socket send. Sockets are non-blocking: when the kernel buffer is full
+** the send waits (or yields, inside a task) and carries on from 'total'.
 */
 
-static int socket_send(lua_State *L) {
+static int socket_send_k(lua_State *L, int status, lua_KContext ctx);
+
+static int send_from(lua_State *L, size_t total) {
   LSocket *sock = check_socket(L, 1);
   size_t len;
   const char *data = luaL_checklstring(L, 2, &len);
-  size_t total = 0;
   ssize_t sent;
 
   while (total < len) {
     size_t chunk = len - total;
+    int events = NET_WRITE;
     if (chunk > (size_t)INT_MAX)
       chunk = (size_t)INT_MAX;
 
-    if (sock->timeout_ms >= 0) {
-      int ready = wait_socket(sock->fd, 1, sock->timeout_ms);
-      if (ready <= 0) {
-        if (ready == 0) {
-          return luaL_error(L, "send timeout");
-        }
-        return push_socket_error(L, "send");
-      }
-    }
-
     if (sock->ssl) {
       sent = SSL_write(sock->ssl, data + total, (int)chunk);
       if (sent <= 0) {
         int ssl_err = SSL_get_error(sock->ssl, (int)sent);
-        if (ssl_err == SSL_ERROR_WANT_WRITE || ssl_err == SSL_ERROR_WANT_READ) {
-          continue;
-        }
-        return push_ssl_error(L, "SSL send");
+        if (ssl_err == SSL_ERROR_WANT_READ)
+          events = NET_READ;
+        else if (ssl_err != SSL_ERROR_WANT_WRITE)
+          return push_ssl_error(L, "SSL send");
       }
     }
     else {
-      sent = send(sock->fd, data + total, (int)chunk, 0);
-      if (sent == SOCKET_ERROR_VAL) {
-        int err = SOCKET_ERRNO;
-        if (err == SOCKET_EWOULDBLOCK || err == SOCKET_EINPROGRESS) {
-          continue;
+      sent = send(sock->fd, data + total, (int)chunk, SEND_FLAGS);
+      if (sent == SOCKET_ERROR_VAL && !sock_wouldblock(SOCKET_ERRNO))
+        return push_socket_error(L, "send");
+    }
+
+    if (sent <= 0) {
+      int ready = net_await(L, sock->fd, events, sock->timeout_ms,
+                            (lua_KContext)total, socket_send_k);
+      if (ready <= 0) {
+        if (ready == 0) {
+          return luaL_error(L, "send timeout");
         }
         return push_socket_error(L, "send");
       }
+      continue;
     }
     total += (size_t)sent;
   }
@@ -539,9 +1606,22 @@ static int socket_send(lua_State *L) {
   return 1;
 }
 
+static int socket_send_k(lua_State *L, int status, lua_KContext ctx) {
+  int ready = lua_toboolean(L, -1);
+  (void)status;
+  lua_pop(L, 1);
+  if (!ready)
+    return luaL_error(L, "send timeout");
+  return send_from(L, (size_t)ctx);
+}
+
+static int socket_send(lua_State *L) {
+  return send_from(L, 0);
+}
+
 /*
 ** ========================================================
-** Synchronous receive implementation
+** Receive implementation
 ** ========================================================
 */
 
@@ -562,212 +1642,142 @@ static void sock_buffer_ensure(lua_State *L, LSocket *sock, size_t additional) {
   }
 }
 
-/* Helper: append data to socket buffer */
-static void sock_buffer_append(lua_State *L, LSocket *sock, const char *data,
-                               size_t len) {
-  sock_buffer_ensure(L, sock, len);
-  memcpy(sock->buffer + sock->buflen, data, len);
-  sock->buflen += len;
+/* Helper: push the first 'n' buffered bytes as a string and drop them */
+static void sock_buffer_push(lua_State *L, LSocket *sock, size_t n) {
+  if (n > sock->buflen)
+    n = sock->buflen;
+  lua_pushlstring(L, sock->buffer, n);
+  sock->buflen -= n;
+  if (sock->buflen > 0) {
+    memmove(sock->buffer, sock->buffer + n, sock->buflen);
+  }
 }
 
-/* Helper: push socket buffer as string and clear it */
-static void sock_buffer_push_and_clear(lua_State *L, LSocket *sock) {
-  lua_pushlstring(L, sock->buffer, sock->buflen);
-  sock->buflen = 0;
-}
-/* Read exactly n bytes - synchronous implementation */
-static int recv_bytes(lua_State *L, LSocket *sock, size_t n) {
-  char buf[DEFAULT_RECV_SIZE];
+static int socket_receive_k(lua_State *L, int status, lua_KContext ctx);
 
-  /* Read until we have enough data */
-  while (sock->buflen < n) {
+/*
+** Read up to 'max' more bytes into the socket buffer, waiting (or
+** yielding, inside a task) while none are available. Returns the number
+** of bytes read, 0 at end of stream, or -1 with nil and an error message
+** pushed.
+*/
+static ssize_t sock_fill(lua_State *L, LSocket *sock, size_t max) {
+  if (max > (size_t)INT_MAX)
+    max = (size_t)INT_MAX;
+  for (;;) {
+    char *dst;
     ssize_t got;
-    size_t want = n - sock->buflen;
-    if (want > sizeof(buf))
-      want = sizeof(buf);
-
-    /* Wait for data with timeout */
-    if (sock->timeout_ms >= 0) {
-      int ready = wait_socket(sock->fd, 0, sock->timeout_ms);
-      if (ready <= 0) {
-        if (ready == 0)
-          return luaL_error(L, "receive timeout");
-        return push_socket_error(L, "receive");
-      }
-    }
+    int events = NET_READ;
+    int ready;
 
-    /* Read data */
+    sock_buffer_ensure(L, sock, max);
+    dst = sock->buffer + sock->buflen;
     if (sock->ssl) {
-      got = SSL_read(sock->ssl, buf, (int)want);
+      got = SSL_read(sock->ssl, dst, (int)max);
       if (got <= 0) {
         int ssl_err = SSL_get_error(sock->ssl, (int)got);
-        if (ssl_err == SSL_ERROR_ZERO_RETURN) {
-          /* EOF - return what we have */
-          sock_buffer_push_and_clear(L, sock);
-          return 1;
+        if (ssl_err == SSL_ERROR_ZERO_RETURN)
+          return 0;
+        if (ssl_err == SSL_ERROR_WANT_WRITE)
+          events = NET_WRITE;
+        else if (ssl_err != SSL_ERROR_WANT_READ) {
+          push_ssl_error(L, "SSL receive");
+          return -1;
         }
-        if (ssl_err == SSL_ERROR_WANT_READ || ssl_err == SSL_ERROR_WANT_WRITE) {
-          continue;
-        }
-        return push_ssl_error(L, "SSL receive");
       }
     }
     else {
-      got = recv(sock->fd, buf, (int)want, 0);
-      if (got == SOCKET_ERROR_VAL) {
-        int err = SOCKET_ERRNO;
-        if (err == SOCKET_EWOULDBLOCK || err == SOCKET_EINPROGRESS) {
-          continue;
-        }
-        return push_socket_error(L, "receive");
-      }
-      if (got == 0) {
-        /* EOF - return what we have */
-        sock_buffer_push_and_clear(L, sock);
-        return 1;
+      got = recv(sock->fd, dst, (int)max, 0);
+      if (got == SOCKET_ERROR_VAL && !sock_wouldblock(SOCKET_ERRNO)) {
+        push_socket_error(L, "receive");
+        return -1;
       }
+      if (got == 0)
+        return 0;
+    }
+    if (got > 0) {
+      sock->buflen += (size_t)got;
+      return got;
     }
 
-    /* Append received data to buffer */
-    sock_buffer_append(L, sock, buf, (size_t)got);
+    ready = net_await(L, sock->fd, events, sock->timeout_ms, 0,
+                      socket_receive_k);
+    if (ready == 0)
+      luaL_error(L, "receive timeout");
+    if (ready < 0) {
+      push_socket_error(L, "receive");
+      return -1;
+    }
   }
+}
 
-  sock_buffer_push_and_clear(L, sock);
+/* Read exactly n bytes (fewer at end of stream) */
+static int recv_bytes(lua_State *L, LSocket *sock, size_t n) {
+  while (sock->buflen < n) {
+    ssize_t got = sock_fill(L, sock, n - sock->buflen);
+    if (got < 0)
+      return 2;
+    if (got == 0)
+      break; /* EOF - return what we have */
+  }
+  sock_buffer_push(L, sock, n);
   return 1;
 }
 
-/* Read until newline - synchronous implementation */
+/* Read until newline */
 static int recv_line(lua_State *L, LSocket *sock) {
-  char buf[DEFAULT_RECV_SIZE];
+  size_t scanned = 0;
 
   for (;;) {
-    /* Check if buffer already contains a newline */
-    if (sock->buflen > 0) {
-      char *nl = memchr(sock->buffer, '\n', sock->buflen);
-      if (nl) {
-        size_t linelen = (size_t)(nl - sock->buffer);
-        size_t pushlen = linelen;
-
-        /* Strip \r if present */
-        if (pushlen > 0 && sock->buffer[pushlen - 1] == '\r') {
-          pushlen--;
-        }
-
-        /* Push the line (without \r\n) */
-        lua_pushlstring(L, sock->buffer, pushlen);
-
-        /* Remove line + newline from buffer */
-        size_t consumed = linelen + 1;
-        if (consumed < sock->buflen) {
-          memmove(sock->buffer, sock->buffer + consumed,
-                  sock->buflen - consumed);
-        }
-        sock->buflen -= consumed;
-
-        return 1;
+    /* Check if the new data contains a newline */
+    char *nl = (sock->buflen > scanned)
+                   ? memchr(sock->buffer + scanned, '\n',
+                            sock->buflen - scanned)
+                   : NULL;
+    if (nl) {
+      size_t linelen = (size_t)(nl - sock->buffer);
+      size_t pushlen = linelen;
+
+      /* Strip \r if present */
+      if (pushlen > 0 && sock->buffer[pushlen - 1] == '\r') {
+        pushlen--;
       }
-    }
 
-    /* No newline found, read more data */
-    ssize_t got;
-
-    /* Wait for data with timeout */
-    if (sock->timeout_ms >= 0) {
-      int ready = wait_socket(sock->fd, 0, sock->timeout_ms);
-      if (ready <= 0) {
-        if (ready == 0)
-          return luaL_error(L, "receive timeout");
-        return push_socket_error(L, "receive");
+      /* Push the line (without \r\n) and drop line + newline */
+      lua_pushlstring(L, sock->buffer, pushlen);
+      sock->buflen -= linelen + 1;
+      if (sock->buflen > 0) {
+        memmove(sock->buffer, nl + 1, sock->buflen);
       }
+      return 1;
     }
+    scanned = sock->buflen;
 
-    /* Read data */
-    if (sock->ssl) {
-      got = SSL_read(sock->ssl, buf, sizeof(buf));
-      if (got <= 0) {
-        int ssl_err = SSL_get_error(sock->ssl, (int)got);
-        if (ssl_err == SSL_ERROR_ZERO_RETURN) {
-          /* EOF - return what we have */
-          sock_buffer_push_and_clear(L, sock);
-          return 1;
-        }
-        if (ssl_err == SSL_ERROR_WANT_READ || ssl_err == SSL_ERROR_WANT_WRITE) {
-          continue;
-        }
-        return push_ssl_error(L, "SSL receive");
-      }
-    }
-    else {
-      got = recv(sock->fd, buf, sizeof(buf), 0);
-      if (got == SOCKET_ERROR_VAL) {
-        int err = SOCKET_ERRNO;
-        if (err == SOCKET_EWOULDBLOCK || err == SOCKET_EINPROGRESS) {
-          continue;
-        }
-        return push_socket_error(L, "receive");
-      }
-      if (got == 0) {
-        /* EOF - return what we have */
-        sock_buffer_push_and_clear(L, sock);
-        return 1;
-      }
+    /* No newline found, read more data */
+    ssize_t got = sock_fill(L, sock, DEFAULT_RECV_SIZE);
+    if (got < 0)
+      return 2;
+    if (got == 0) {
+      /* EOF - return what we have */
+      sock_buffer_push(L, sock, sock->buflen);
+      return 1;
     }
-
-    /* Append received data to buffer */
-    sock_buffer_append(L, sock, buf, (size_t)got);
   }
 }
-/* Read until connection closed - synchronous implementation */
-static int recv_all(lua_State *L, LSocket *sock) {
-  char buf[DEFAULT_RECV_SIZE];
 
+/* Read until connection closed */
+static int recv_all(lua_State *L, LSocket *sock) {
   for (;;) {
-    ssize_t got;
-
-    /* Wait for data with timeout */
-    if (sock->timeout_ms >= 0) {
-      int ready = wait_socket(sock->fd, 0, sock->timeout_ms);
-      if (ready <= 0) {
-        if (ready == 0)
-          return luaL_error(L, "receive timeout");
-        return push_socket_error(L, "receive");
-      }
-    }
-
-    /* Read data */
-    if (sock->ssl) {
-      got = SSL_read(sock->ssl, buf, sizeof(buf));
-      if (got <= 0) {
-        int ssl_err = SSL_get_error(sock->ssl, (int)got);
-        if (ssl_err == SSL_ERROR_ZERO_RETURN) {
-          /* EOF - return all accumulated data */
-          sock_buffer_push_and_clear(L, sock);
-          return 1;
-        }
-        if (ssl_err == SSL_ERROR_WANT_READ || ssl_err == SSL_ERROR_WANT_WRITE) {
-          continue;
-        }
-        return push_ssl_error(L, "SSL receive");
-      }
-    }
-    else {
-      got = recv(sock->fd, buf, sizeof(buf), 0);
-      if (got == SOCKET_ERROR_VAL) {
-        int err = SOCKET_ERRNO;
-        if (err == SOCKET_EWOULDBLOCK || err == SOCKET_EINPROGRESS) {
-          continue;
-        }
-        return push_socket_error(L, "receive");
-      }
-      if (got == 0) {
-        /* EOF - return all accumulated data */
-        sock_buffer_push_and_clear(L, sock);
-        return 1;
-      }
+    size_t room = sock->bufcap - sock->buflen;
+    ssize_t got =
+        sock_fill(L, sock, room > DEFAULT_RECV_SIZE ? room : DEFAULT_RECV_SIZE);
+    if (got < 0)
+      return 2;
+    if (got == 0) {
+      /* EOF - return all accumulated data */
+      sock_buffer_push(L, sock, sock->buflen);
+      return 1;
     }
-
-    /* Append received data to buffer */
-    sock_buffer_append(L, sock, buf, (size_t)got);
   }
 }
 
@@ -795,8 +1805,17 @@ static int socket_receive(lua_State *L) {
   }
 }
 
-static int socket_close(lua_State *L) {
-  LSocket *sock = (LSocket *)luaL_checkudata(L, 1, SOCKET_METATABLE);
+static int socket_receive_k(lua_State *L, int status, lua_KContext ctx) {
+  int ready = lua_toboolean(L, -1);
+  (void)status;
+  (void)ctx;
+  lua_pop(L, 1);
+  if (!ready)
+    return luaL_error(L, "receive timeout");
+  return socket_receive(L);
+}
+
+static void sock_release(lua_State *L, LSocket *sock) {
   if (!sock->closed) {
     if (sock->ssl) {
       SSL_shutdown(sock->ssl);
@@ -804,6 +1823,7 @@ static int socket_close(lua_State *L) {
       sock->ssl = NULL;
     }
     if (sock->fd != SOCKET_INVALID) {
+      net_forget(L, sock->fd);
       /* Graceful shutdown: send FIN, wait for remaining data to be sent */
       shutdown(sock->fd, SHUT_WR);
       /* Set non-blocking to drain without blocking forever */
@@ -823,6 +1843,10 @@ static int socket_close(lua_State *L) {
     }
     sock->closed = 1;
   }
+}
+
+static int socket_close(lua_State *L) {
+  sock_release(L, (LSocket *)luaL_checkudata(L, 1, SOCKET_METATABLE));
   return 0;
 }
 
@@ -892,38 +1916,53 @@ static LServer *new_server(lua_State *L) {
   return srv;
 }
 
+static int server_accept_k(lua_State *L, int status, lua_KContext ctx);
+
 static int server_accept(lua_State *L) {
   LServer *srv = check_server(L, 1);
   struct sockaddr_storage addr;
   socklen_t addrlen = sizeof(addr);
   socket_t client_fd;
 
-  /* Blocking mode with timeout */
-  if (srv->timeout_ms >= 0) {
-    int ready = wait_socket(srv->fd, 0, srv->timeout_ms);
+  /* The listening socket is non-blocking: wait while nobody is queued */
+  while ((client_fd = accept(srv->fd, (struct sockaddr *)&addr, &addrlen)) ==
+         SOCKET_INVALID) {
+    if (!sock_wouldblock(SOCKET_ERRNO)) {
+      return push_socket_error(L, "accept");
+    }
+    int ready =
+        net_await(L, srv->fd, NET_READ, srv->timeout_ms, 0, server_accept_k);
     if (ready <= 0) {
       if (ready == 0) {
         return luaL_error(L, "accept timeout");
       }
       return push_socket_error(L, "accept");
     }
-  }
-
-  client_fd = accept(srv->fd, (struct sockaddr *)&addr, &addrlen);
-  if (client_fd == SOCKET_INVALID) {
-    return push_socket_error(L, "accept");
+    addrlen = sizeof(addr);
   }
 
   LSocket *sock = new_socket(L);
   sock->fd = client_fd;
+  set_nonblocking(client_fd, 1);
 
   return 1;
 }
 
+static int server_accept_k(lua_State *L, int status, lua_KContext ctx) {
+  int ready = lua_toboolean(L, -1);
+  (void)status;
+  (void)ctx;
+  lua_pop(L, 1);
+  if (!ready)
+    return luaL_error(L, "accept timeout");
+  return server_accept(L);
+}
+
 static int server_close(lua_State *L) {
   LServer *srv = (LServer *)luaL_checkudata(L, 1, SERVER_METATABLE);
   if (!srv->closed) {
     if (srv->fd != SOCKET_INVALID) {
+      net_forget(L, srv->fd);
       sock_close(srv->fd);
       srv->fd = SOCKET_INVALID;
     }
@@ -998,7 +2037,11 @@ static LUDPSocket *new_udpsocket(lua_State *L) {
   return sock;
 }
 
+static int udp_sendto_k(lua_State *L, int status, lua_KContext ctx);
+static int udp_receive_k(lua_State *L, int status, lua_KContext ctx);
+
 static int udp_sendto(lua_State *L) {
+  int top = lua_gettop(L);
   LUDPSocket *sock = check_udpsocket(L, 1);
   size_t len;
   const char *data = luaL_checklstring(L, 2, &len);
@@ -1021,8 +2064,15 @@ static int udp_sendto(lua_State *L) {
 
   resolve_hostname(L, address, port, &addr, &addrlen);
 
-  if (sock->timeout_ms >= 0) {
-    int ready = wait_socket(sock->fd, 1, sock->timeout_ms);
+  ssize_t sent;
+  while ((sent = sendto(sock->fd, data, (int)len, SEND_FLAGS,
+                        (struct sockaddr *)&addr, addrlen)) ==
+         SOCKET_ERROR_VAL) {
+    if (!sock_wouldblock(SOCKET_ERRNO)) {
+      return push_socket_error(L, "sendto");
+    }
+    int ready = net_await(L, sock->fd, NET_WRITE, sock->timeout_ms,
+                          (lua_KContext)top, udp_sendto_k);
     if (ready <= 0) {
       if (ready == 0) {
         return luaL_error(L, "sendto timeout");
@@ -1031,17 +2081,21 @@ static int udp_sendto(lua_State *L) {
     }
   }
 
-  ssize_t sent =
-      sendto(sock->fd, data, (int)len, 0, (struct sockaddr *)&addr, addrlen);
-  if (sent == SOCKET_ERROR_VAL) {
-    return push_socket_error(L, "sendto");
-  }
-
   lua_pushinteger(L, (lua_Integer)sent);
   return 1;
 }
 
+static int udp_sendto_k(lua_State *L, int status, lua_KContext ctx) {
+  int ready = lua_toboolean(L, -1);
+  (void)status;
+  lua_settop(L, (int)ctx);
+  if (!ready)
+    return luaL_error(L, "sendto timeout");
+  return udp_sendto(L);
+}
+
 static int udp_receive(lua_State *L) {
+  int top = lua_gettop(L);
   LUDPSocket *sock = check_udpsocket(L, 1);
   lua_Integer size = luaL_optinteger(L, 2, DEFAULT_UDP_SIZE);
 
@@ -1053,20 +2107,21 @@ static int udp_receive(lua_State *L) {
   struct sockaddr_storage addr;
   socklen_t addrlen = sizeof(addr);
 
-  if (sock->timeout_ms >= 0) {
-    int ready = wait_socket(sock->fd, 0, sock->timeout_ms);
+  ssize_t got;
+  while ((got = recvfrom(sock->fd, buf, (int)size, 0, (struct sockaddr *)&addr,
+                         &addrlen)) == SOCKET_ERROR_VAL) {
+    if (!sock_wouldblock(SOCKET_ERRNO)) {
+      return push_socket_error(L, "recvfrom");
+    }
+    int ready = net_await(L, sock->fd, NET_READ, sock->timeout_ms,
+                          (lua_KContext)top, udp_receive_k);
     if (ready <= 0) {
       if (ready == 0) {
         return luaL_error(L, "receive timeout");
       }
       return push_socket_error(L, "recvfrom");
     }
-  }
-
-  ssize_t got =
-      recvfrom(sock->fd, buf, (int)size, 0, (struct sockaddr *)&addr, &addrlen);
-  if (got == SOCKET_ERROR_VAL) {
-    return push_socket_error(L, "recvfrom");
+    addrlen = sizeof(addr);
   }
 
   lua_pushlstring(L, buf, (size_t)got);
@@ -1092,6 +2147,15 @@ static int udp_receive(lua_State *L) {
   return 3; /* data, ip, port */
 }
 
+static int udp_receive_k(lua_State *L, int status, lua_KContext ctx) {
+  int ready = lua_toboolean(L, -1);
+  (void)status;
+  lua_settop(L, (int)ctx); /* drop the receive buffer too */
+  if (!ready)
+    return luaL_error(L, "receive timeout");
+  return udp_receive(L);
+}
+
 static int udp_setsockname(lua_State *L) {
   LUDPSocket *sock = check_udpsocket(L, 1);
   const char *address = luaL_checkstring(L, 2);
@@ -1121,6 +2185,7 @@ static int udp_close(lua_State *L) {
   LUDPSocket *sock = (LUDPSocket *)luaL_checkudata(L, 1, UDPSOCKET_METATABLE);
   if (!sock->closed) {
     if (sock->fd != SOCKET_INVALID) {
+      net_forget(L, sock->fd);
       sock_close(sock->fd);
       sock->fd = SOCKET_INVALID;
     }
@@ -1161,6 +2226,31 @@ static const luaL_Reg udpsocket_methods[] = {{"sendto", udp_sendto},
 ** =======================================================
 */
 
+static int tcp_connect_k(lua_State *L, int status, lua_KContext ctx);
+
+/* Check the outcome of the connect started by tcp_connect */
+static int tcp_connected(lua_State *L, int ready) {
+  const char *address = lua_tostring(L, 1);
+  int port = (int)lua_tointeger(L, 2);
+  LSocket *sock = (LSocket *)lua_touserdata(L, 3);
+  int err = 0;
+  socklen_t errlen = sizeof(err);
+
+  if (ready < 0)
+    err = SOCKET_ERRNO;
+  else if (getsockopt(sock->fd, SOL_SOCKET, SO_ERROR, (char *)&err,
+                      &errlen) == SOCKET_ERROR_VAL)
+    err = SOCKET_ERRNO;
+  if (err != 0) {
+    sock_close(sock->fd);
+    sock->fd = SOCKET_INVALID;
+    sock->closed = 1;
+    return luaL_error(L, "cannot connect to %s:%d: %s", address, port,
+                      sock_strerror(err));
+  }
+  return 1;
+}
+
 static int tcp_connect(lua_State *L) {
   const char *address = luaL_checkstring(L, 1);
   int port = check_port(L, 2, 0);
@@ -1182,25 +2272,38 @@ static int tcp_connect(lua_State *L) {
 
   resolve_hostname(L, address, port, &addr, &addrlen);
 
+  lua_settop(L, 2);
+  LSocket *sock = new_socket(L); /* owns the fd from here on */
   socket_t fd = socket(addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
   if (fd == SOCKET_INVALID) {
     return luaL_error(L, "cannot create socket: %s",
                       sock_strerror(SOCKET_ERRNO));
   }
+  sock->fd = fd;
+  set_nonblocking(fd, 1);
 
   if (connect(fd, (struct sockaddr *)&addr, addrlen) == SOCKET_ERROR_VAL) {
     int err = SOCKET_ERRNO;
-    sock_close(fd);
-    return luaL_error(L, "cannot connect to %s:%d: %s", address, port,
-                      sock_strerror(err));
+    if (err != SOCKET_EINPROGRESS && !sock_wouldblock(err)) {
+      sock_close(fd);
+      sock->fd = SOCKET_INVALID;
+      sock->closed = 1;
+      return luaL_error(L, "cannot connect to %s:%d: %s", address, port,
+                        sock_strerror(err));
+    }
+    return tcp_connected(L, net_await(L, fd, NET_WRITE, -1, 0, tcp_connect_k));
   }
 
-  LSocket *sock = new_socket(L);
-  sock->fd = fd;
-
   return 1;
 }
 
+static int tcp_connect_k(lua_State *L, int status, lua_KContext ctx) {
+  (void)status;
+  (void)ctx;
+  lua_pop(L, 1); /* no timeout, so always ready */
+  return tcp_connected(L, 1);
+}
+
 static int tcp_bind(lua_State *L) {
   const char *address = luaL_checkstring(L, 1);
   int port = check_port(L, 2, 1);
@@ -1250,6 +2353,7 @@ static int tcp_bind(lua_State *L) {
 
   LServer *srv = new_server(L);
   srv->fd = fd;
+  set_nonblocking(fd, 1);
 
   return 1;
 }
@@ -1318,6 +2422,7 @@ static int udp_open(lua_State *L) {
 
   LUDPSocket *sock = new_udpsocket(L);
   sock->fd = fd;
+  set_nonblocking(fd, 1);
   sock->bound = (port > 0 || address != NULL);
 
   return 1;
@@ -1329,41 +2434,386 @@ static const luaL_Reg udp_funcs[] = {{"open", udp_open}, {NULL, NULL}};
 
 /*
 ** {======================================================
-** network.fetch (HTTP/HTTPS client)
+** TLS Client
 ** =======================================================
 */
 
-/* URL parsing helper */
-typedef struct {
-  char scheme[16];
-  char host[256];
-  int port;
-  char path[2048];
-} ParsedURL;
-
-static int parse_url(const char *url, ParsedURL *parsed) {
-  memset(parsed, 0, sizeof(*parsed));
-  strcpy(parsed->path, "/");
+/*
+** One client SSL_CTX serves the whole process. Sessions (TLS 1.3 tickets
+** included) are saved per origin as servers hand them out and offered on
+** the next connection to that origin, so that reconnecting skips the full
+** handshake. A TLS 1.3 ticket is used once; a TLS 1.2 session is put back
+** after each resumption. network.tls.configure changes apply to new
+** connections. 'lock' guards the context settings, the session cache and
+** the counters.
+*/
+#define TLS_SESSIONS 256    /* cached sessions, all origins */
+#define TLS_PERORIGIN 4     /* tickets kept for one origin */
+#define TLS_ALPN "\x08http/1.1"
+
+typedef struct TlsSession {
+  char key[288]; /* scheme://host:port */
+  SSL_SESSION *session;
+} TlsSession;
+
+typedef struct TlsState {
+  lus_atomic_t ready; /* 0, 1 while initializing, 2 */
+  lus_mutex_t lock;
+  int keyidx;           /* SSL ex_data slot holding the origin key */
+  TlsSession *sessions; /* oldest first */
+  int nsessions;
+  int maxsessions;
+  lua_Integer handshakes, resumed, failures;
+  double fullms, resumedms; /* total handshake times */
+} TlsState;
+
+static TlsState tls_state;
+
+static void tls_freekey(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx,
+                        long argl, void *argp) {
+  (void)parent;
+  (void)ad;
+  (void)idx;
+  (void)argl;
+  (void)argp;
+  free(ptr);
+}
 
-  /* Extract scheme */
-  const char *p = strstr(url, "://");
-  if (!p)
-    return -1;
+static void tls_drop(int i) {
+  SSL_SESSION_free(tls_state.sessions[i].session);
+  tls_state.nsessions--;
+  memmove(&tls_state.sessions[i], &tls_state.sessions[i + 1],
+          (size_t)(tls_state.nsessions - i) * sizeof(TlsSession));
+}
 
-  size_t scheme_len = (size_t)(p - url);
-  if (scheme_len >= sizeof(parsed->scheme))
-    return -1;
-  memcpy(parsed->scheme, url, scheme_len);
-  parsed->scheme[scheme_len] = '\0';
+static void tls_trim(int max) {
+  while (tls_state.nsessions > max)
+    tls_drop(0);
+}
 
-  /* Set default port based on scheme */
-  if (strcmp(parsed->scheme, "http") == 0) {
-    parsed->port = 80;
+/* Save 'session' (whose reference is taken over) for 'key'. Call locked. */
+static void tls_save(const char *key, SSL_SESSION *session) {
+  int i, same = 0, first = -1;
+  for (i = 0; i < tls_state.nsessions; i++) {
+    if (strcmp(tls_state.sessions[i].key, key) == 0) {
+      if (first < 0)
+        first = i;
+      same++;
+    }
   }
-  else if (strcmp(parsed->scheme, "https") == 0) {
-    parsed->port = 443;
+  if (tls_state.maxsessions == 0 || !SSL_SESSION_is_resumable(session)) {
+    SSL_SESSION_free(session);
+    return;
   }
-  else {
+  if (same >= TLS_PERORIGIN)
+    tls_drop(first);
+  tls_trim(tls_state.maxsessions - 1);
+  TlsSession *s = &tls_state.sessions[tls_state.nsessions++];
+  snprintf(s->key, sizeof(s->key), "%s", key);
+  s->session = session;
+}
+
+/* Remove and return the newest usable session for 'key'. Call locked. */
+static SSL_SESSION *tls_take(const char *key) {
+  int i;
+  long now = (long)time(NULL);
+  for (i = tls_state.nsessions - 1; i >= 0; i--) {
+    SSL_SESSION *session = tls_state.sessions[i].session;
+    if (strcmp(tls_state.sessions[i].key, key) != 0)
+      continue;
+    if (now >= SSL_SESSION_get_time(session) +
+                   SSL_SESSION_get_timeout(session)) {
+      tls_drop(i); /* expired */
+      continue;
+    }
+    SSL_SESSION_up_ref(session);
+    tls_drop(i);
+    return session;
+  }
+  return NULL;
+}
+
+/* OpenSSL hands over new sessions here, during handshakes and reads */
+static int tls_newsession(SSL *ssl, SSL_SESSION *session) {
+  const char *key = (const char *)SSL_get_ex_data(ssl, tls_state.keyidx);
+  if (key == NULL)
+    return 0;
+  lus_mutex_lock(&tls_state.lock);
+  tls_save(key, session);
+  lus_mutex_unlock(&tls_state.lock);
+  return 1; /* the reference is ours */
+}
+
+static void init_ssl(lua_State *L) {
+  if (lus_atomic_load(&tls_state.ready) != 2) {
+    if (lus_atomic_cas(&tls_state.ready, 0, 1)) {
+      SSL_library_init();
+      SSL_load_error_strings();
+      OpenSSL_add_all_algorithms();
+
+      lus_mutex_init(&tls_state.lock);
+      tls_state.keyidx =
+          SSL_get_ex_new_index(0, NULL, NULL, NULL, tls_freekey);
+      tls_state.sessions =
+          (TlsSession *)malloc(TLS_SESSIONS * sizeof(TlsSession));
+      tls_state.maxsessions = (tls_state.sessions != NULL) ? TLS_SESSIONS : 0;
+      ssl_ctx = SSL_CTX_new(TLS_client_method());
+      if (ssl_ctx != NULL) {
+        /* Load system CA certificates */
+        SSL_CTX_set_default_verify_paths(ssl_ctx);
+        SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_PEER, NULL);
+        SSL_CTX_set_session_cache_mode(ssl_ctx,
+                                       SSL_SESS_CACHE_CLIENT |
+                                           SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ssl_ctx, tls_newsession);
+        SSL_CTX_set_alpn_protos(ssl_ctx, (const unsigned char *)TLS_ALPN,
+                                sizeof(TLS_ALPN) - 1);
+      }
+      lus_atomic_store(&tls_state.ready, 2);
+    }
+    else {
+      while (lus_atomic_load(&tls_state.ready) != 2)
+        lus_cpu_relax();
+    }
+  }
+  if (ssl_ctx == NULL) {
+    luaL_error(L, "failed to create SSL context");
+  }
+}
+
+/*
+** Create a client SSL for origin 'key', offering a saved session for it.
+** Returns NULL if OpenSSL fails.
+*/
+static SSL *tls_new(const char *key) {
+  size_t len = strlen(key);
+  char *k = (char *)malloc(len + 1);
+  SSL *ssl;
+  SSL_SESSION *session = NULL;
+  lus_mutex_lock(&tls_state.lock);
+  ssl = SSL_new(ssl_ctx);
+  if (ssl != NULL && k != NULL)
+    session = tls_take(key);
+  lus_mutex_unlock(&tls_state.lock);
+  if (ssl == NULL) {
+    free(k);
+    return NULL;
+  }
+  if (k != NULL) {
+    memcpy(k, key, len + 1);
+    SSL_set_ex_data(ssl, tls_state.keyidx, k); /* freed with 'ssl' */
+  }
+  if (session != NULL) {
+    SSL_set_session(ssl, session);
+    SSL_SESSION_free(session);
+  }
+  return ssl;
+}
+
+/*
+** Account for a handshake of 'ms' milliseconds ('ok' if it succeeded).
+** TLS 1.2 servers hand out no new session when one is resumed, so the
+** session just used is saved again.
+*/
+static void tls_handshaken(SSL *ssl, int ok, double ms) {
+  int resumed = ok && SSL_session_reused(ssl);
+  SSL_SESSION *again = NULL;
+  if (resumed && SSL_version(ssl) < TLS1_3_VERSION &&
+      SSL_get_ex_data(ssl, tls_state.keyidx) != NULL)
+    again = SSL_get1_session(ssl);
+  lus_mutex_lock(&tls_state.lock);
+  if (!ok) {
+    tls_state.failures++;
+  }
+  else {
+    tls_state.handshakes++;
+    if (resumed) {
+      tls_state.resumed++;
+      tls_state.resumedms += ms;
+    }
+    else {
+      tls_state.fullms += ms;
+    }
+  }
+  if (again != NULL)
+    tls_save((const char *)SSL_get_ex_data(ssl, tls_state.keyidx), again);
+  lus_mutex_unlock(&tls_state.lock);
+}
+
+/* Encode a list of protocol names in ALPN wire format onto the stack */
+static void tls_pushalpn(lua_State *L, int idx) {
+  luaL_Buffer b;
+  lua_Integer i, n;
+  luaL_argcheck(L, lua_istable(L, idx), 1, "alpn must be a list of strings");
+  n = luaL_len(L, idx);
+  luaL_buffinit(L, &b);
+  for (i = 1; i <= n; i++) {
+    size_t len;
+    const char *proto;
+    lua_geti(L, idx, i);
+    proto = lua_tolstring(L, -1, &len);
+    luaL_argcheck(L, proto != NULL && len > 0 && len <= 255, 1,
+                  "alpn protocol names must be 1 to 255 bytes");
+    luaL_addchar(&b, (char)len);
+    luaL_addlstring(&b, proto, len);
+    lua_pop(L, 1);
+  }
+  luaL_pushresult(&b);
+}
+
+/*
+** network.tls.configure{ciphers = s, ciphersuites = s, alpn = {...},
+** sessions = n, cafile = path}
+*/
+static int net_tls_configure(lua_State *L) {
+  const char *ciphers = NULL, *suites = NULL, *cafile = NULL;
+  const char *alpn = NULL;
+  size_t alpnlen = 0;
+  lua_Integer sessions = -1;
+  int err = 0;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  if (!lus_haspledge(L, "network", NULL))
+    return luaL_error(L, "permission \"network\" denied");
+  init_ssl(L);
+
+  /* Check everything before changing anything */
+  if (lua_getfield(L, 1, "ciphers") != LUA_TNIL)
+    ciphers = luaL_checkstring(L, -1);
+  if (lua_getfield(L, 1, "ciphersuites") != LUA_TNIL)
+    suites = luaL_checkstring(L, -1);
+  if (lua_getfield(L, 1, "cafile") != LUA_TNIL) {
+    cafile = luaL_checkstring(L, -1);
+    lus_checkfsperm(L, "fs:read", cafile);
+  }
+  if (lua_getfield(L, 1, "sessions") != LUA_TNIL) {
+    sessions = luaL_checkinteger(L, -1);
+    luaL_argcheck(L, sessions >= 0 && sessions <= TLS_SESSIONS, 1,
+                  "sessions out of range");
+  }
+  if (lua_getfield(L, 1, "alpn") != LUA_TNIL) {
+    tls_pushalpn(L, lua_gettop(L));
+    alpn = lua_tolstring(L, -1, &alpnlen);
+  }
+
+  /* A rejected cipher list would still clear the context's: try it on a
+  ** scratch connection first */
+  lus_mutex_lock(&tls_state.lock);
+  SSL *scratch = SSL_new(ssl_ctx);
+  if (scratch == NULL)
+    err = 5;
+  else if (ciphers && SSL_set_cipher_list(scratch, ciphers) != 1)
+    err = 1;
+  else if (suites && SSL_set_ciphersuites(scratch, suites) != 1)
+    err = 2;
+  SSL_free(scratch);
+  if (err == 0) {
+    if (ciphers && SSL_CTX_set_cipher_list(ssl_ctx, ciphers) != 1)
+      err = 1;
+    else if (suites && SSL_CTX_set_ciphersuites(ssl_ctx, suites) != 1)
+      err = 2;
+    else if (cafile &&
+             SSL_CTX_load_verify_locations(ssl_ctx, cafile, NULL) != 1)
+      err = 3;
+    else if (alpn && SSL_CTX_set_alpn_protos(ssl_ctx,
+                                             (const unsigned char *)alpn,
+                                             (unsigned int)alpnlen) != 0)
+      err = 4;
+  }
+  if (err == 0 && sessions >= 0 && tls_state.sessions != NULL) {
+    tls_state.maxsessions = (int)sessions;
+    tls_trim(tls_state.maxsessions);
+  }
+  lus_mutex_unlock(&tls_state.lock);
+
+  switch (err) {
+    case 1:
+      return luaL_error(L, "invalid TLS cipher list '%s'", ciphers);
+    case 2:
+      return luaL_error(L, "invalid TLS 1.3 cipher suites '%s'", suites);
+    case 3:
+      return luaL_error(L, "cannot load CA file '%s'", cafile);
+    case 4:
+      return luaL_error(L, "cannot set ALPN protocols");
+    case 5:
+      return luaL_error(L, "SSL_new failed");
+    default:
+      return 0;
+  }
+}
+
+static int net_tls_stats(lua_State *L) {
+  init_ssl(L);
+  lus_mutex_lock(&tls_state.lock);
+  lua_Integer handshakes = tls_state.handshakes, resumed = tls_state.resumed,
+              failures = tls_state.failures, cached = tls_state.nsessions;
+  double fullms = tls_state.fullms, resumedms = tls_state.resumedms;
+  lus_mutex_unlock(&tls_state.lock);
+  lua_createtable(L, 0, 7);
+  lua_pushinteger(L, handshakes);
+  lua_setfield(L, -2, "handshakes");
+  lua_pushinteger(L, resumed);
+  lua_setfield(L, -2, "resumed");
+  lua_pushinteger(L, failures);
+  lua_setfield(L, -2, "failures");
+  lua_pushinteger(L, cached);
+  lua_setfield(L, -2, "sessions");
+  lua_pushnumber(L, handshakes > resumed
+                        ? fullms / (double)(handshakes - resumed) / 1e3
+                        : 0);
+  lua_setfield(L, -2, "fulltime");
+  lua_pushnumber(L, resumed > 0 ? resumedms / (double)resumed / 1e3 : 0);
+  lua_setfield(L, -2, "resumedtime");
+  lua_pushnumber(L, handshakes > 0
+                        ? (lua_Number)resumed / (lua_Number)handshakes
+                        : 0);
+  lua_setfield(L, -2, "resumerate");
+  return 1;
+}
+
+static const luaL_Reg tls_funcs[] = {{"configure", net_tls_configure},
+                                     {"stats", net_tls_stats},
+                                     {NULL, NULL}};
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** network.fetch (HTTP/HTTPS client)
+** =======================================================
+*/
+
+/* URL parsing helper */
+typedef struct {
+  char scheme[16];
+  char host[256];
+  int port;
+  char path[2048];
+} ParsedURL;
+
+static int parse_url(const char *url, ParsedURL *parsed) {
+  memset(parsed, 0, sizeof(*parsed));
+  strcpy(parsed->path, "/");
+
+  /* Extract scheme */
+  const char *p = strstr(url, "://");
+  if (!p)
+    return -1;
+
+  size_t scheme_len = (size_t)(p - url);
+  if (scheme_len >= sizeof(parsed->scheme))
+    return -1;
+  memcpy(parsed->scheme, url, scheme_len);
+  parsed->scheme[scheme_len] = '\0';
+
+  /* Set default port based on scheme */
+  if (strcmp(parsed->scheme, "http") == 0) {
+    parsed->port = 80;
+  }
+  else if (strcmp(parsed->scheme, "https") == 0) {
+    parsed->port = 443;
+  }
+  else {
     return -1; /* unsupported scheme */
   }
 
@@ -1406,270 +2856,606 @@ static int parse_url(const char *url, ParsedURL *parsed) {
   return 0;
 }
 
-/* Read HTTP response line by line */
-static int read_http_line(LSocket *sock, char *buf, size_t bufsize) {
-  size_t pos = 0;
+/*
+** Keep-alive connection pool. Each state keeps the connections left open
+** by finished fetches, keyed by scheme, host and port, and hands the most
+** recently used one to the next fetch for the same origin. Entries are
+** stored oldest first, so the expired ones are always a prefix.
+*/
+#define FETCHPOOL_KEY "network.fetchpool"
+#define FETCHPOOL_METATABLE "network.connpool"
+#define FETCHPOOL_IDLE_MS 30000
+#define FETCHPOOL_PERHOST 8
+#define FETCHPOOL_MAX 64
 
-  /* First check buffered data */
-  while (sock->buflen > 0 && pos < bufsize - 1) {
-    char c = sock->buffer[0];
+typedef struct {
+  char key[288]; /* scheme://host:port */
+  socket_t fd;
+  SSL *ssl;
+  double since; /* net_now() when the connection went idle */
+} PoolConn;
 
-    /* Shift buffer */
-    sock->buflen--;
-    if (sock->buflen > 0) {
-      memmove(sock->buffer, sock->buffer + 1, sock->buflen);
-    }
+typedef struct {
+  PoolConn *conns;
+  int nconns;
+  int sizeconns;
+  int idle_ms;
+  int perhost; /* idle connections kept per origin; 0 disables keep-alive */
+  int max;     /* idle connections kept in total */
+  lua_Integer requests, reused, connects, retries, expired;
+  lua_Integer reads; /* socket reads made while receiving responses */
+} FetchPool;
+
+static void pool_drop(FetchPool *pool, int i) {
+  PoolConn *c = &pool->conns[i];
+  if (c->ssl) {
+    SSL_shutdown(c->ssl);
+    SSL_free(c->ssl);
+  }
+  sock_close(c->fd);
+  pool->nconns--;
+  memmove(c, c + 1, (size_t)(pool->nconns - i) * sizeof(PoolConn));
+}
 
-    if (c == '\n') {
-      /* Strip trailing \r if present */
-      if (pos > 0 && buf[pos - 1] == '\r') {
-        pos--;
-      }
-      buf[pos] = '\0';
-      return (int)pos;
-    }
-    buf[pos++] = c;
+static void pool_expire(FetchPool *pool) {
+  double now = net_now();
+  while (pool->nconns > 0 && now - pool->conns[0].since >= pool->idle_ms) {
+    pool_drop(pool, 0);
+    pool->expired++;
   }
+}
 
-  /* Continue reading from socket */
-  while (pos < bufsize - 1) {
-    char c;
-    ssize_t got;
+static void pool_trim(FetchPool *pool, int max) {
+  while (pool->nconns > max)
+    pool_drop(pool, 0);
+}
 
-    if (sock->ssl) {
-      got = SSL_read(sock->ssl, &c, 1);
-      if (got <= 0) {
-        buf[pos] = '\0';
-        return (got == 0) ? (int)pos : -1;
-      }
-    }
-    else {
-      got = recv(sock->fd, &c, 1, 0);
-      if (got <= 0) {
-        buf[pos] = '\0';
-        return (got == 0) ? (int)pos : -1;
-      }
-    }
+static int pool_gc(lua_State *L) {
+  FetchPool *pool = (FetchPool *)lua_touserdata(L, 1);
+  pool_trim(pool, 0);
+  luaM_freearray(L, pool->conns, (size_t)pool->sizeconns);
+  pool->conns = NULL;
+  pool->sizeconns = 0;
+  return 0;
+}
 
-    if (c == '\n') {
-      if (pos > 0 && buf[pos - 1] == '\r') {
-        pos--;
-      }
-      buf[pos] = '\0';
-      return (int)pos;
+static FetchPool *get_pool(lua_State *L) {
+  FetchPool *pool;
+  lua_getfield(L, LUA_REGISTRYINDEX, FETCHPOOL_KEY);
+  pool = (FetchPool *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  if (pool == NULL) {
+    pool = (FetchPool *)lua_newuserdatauv(L, sizeof(FetchPool), 0);
+    memset(pool, 0, sizeof(FetchPool));
+    pool->idle_ms = FETCHPOOL_IDLE_MS;
+    pool->perhost = FETCHPOOL_PERHOST;
+    pool->max = FETCHPOOL_MAX;
+    if (luaL_newmetatable(L, FETCHPOOL_METATABLE)) {
+      lua_pushcfunction(L, pool_gc);
+      lua_setfield(L, -2, "__gc");
     }
-    buf[pos++] = c;
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, FETCHPOOL_KEY);
   }
+  return pool;
+}
 
-  buf[pos] = '\0';
-  return (int)pos;
+/*
+** Move an idle connection for 'key' into 'sock'. A connection that became
+** readable while idle was closed by the server (or sent something it
+** should not have) and is discarded.
+*/
+static int pool_take(FetchPool *pool, const char *key, LSocket *sock) {
+  int i;
+  pool_expire(pool);
+  for (i = pool->nconns - 1; i >= 0; i--) {
+    PoolConn *c = &pool->conns[i];
+    if (strcmp(c->key, key) != 0)
+      continue;
+    if ((c->ssl && SSL_pending(c->ssl) > 0) || wait_socket(c->fd, 0, 0) != 0) {
+      pool_drop(pool, i);
+      pool->expired++;
+      continue;
+    }
+    sock->fd = c->fd;
+    sock->ssl = c->ssl;
+    c->ssl = NULL;
+    pool->nconns--;
+    memmove(c, c + 1, (size_t)(pool->nconns - i) * sizeof(PoolConn));
+    return 1;
+  }
+  return 0;
 }
 
-static int net_fetch(lua_State *L) {
-  const char *url = luaL_checkstring(L, 1);
-  const char *method = luaL_optstring(L, 2, "GET");
-  /* headers table at index 3 (optional) */
-  size_t body_len = 0;
-  const char *body = luaL_optlstring(L, 4, NULL, &body_len);
+/* Park the connection of 'sock' in the pool, or close it if it is full */
+static void pool_put(lua_State *L, FetchPool *pool, const char *key,
+                     LSocket *sock) {
+  int i, same = 0;
+  pool_expire(pool);
+  for (i = 0; i < pool->nconns; i++) {
+    if (strcmp(pool->conns[i].key, key) == 0)
+      same++;
+  }
+  if (same >= pool->perhost || pool->max == 0) {
+    sock_release(L, sock);
+    return;
+  }
+  if (pool->nconns == pool->sizeconns) {
+    int newsize = pool->sizeconns ? pool->sizeconns * 2 : 8;
+    pool->conns = luaM_reallocvector(L, pool->conns, pool->sizeconns,
+                                     newsize, PoolConn);
+    pool->sizeconns = newsize;
+  }
+  pool_trim(pool, pool->max - 1);
+  PoolConn *c = &pool->conns[pool->nconns++];
+  strcpy(c->key, key);
+  c->fd = sock->fd;
+  c->ssl = sock->ssl;
+  c->since = net_now();
+  sock->fd = SOCKET_INVALID;
+  sock->ssl = NULL;
+  sock_release(L, sock);
+}
 
-  if (strpbrk(method, "\r\n"))
-    return luaL_error(L, "invalid characters in HTTP method");
-  if (strpbrk(url, "\r\n"))
-    return luaL_error(L, "invalid characters in URL");
+static int pool_configure(lua_State *L) {
+  FetchPool *pool = get_pool(L);
+  luaL_checktype(L, 1, LUA_TTABLE);
+  if (lua_getfield(L, 1, "idle") != LUA_TNIL) {
+    lua_Number secs = luaL_checknumber(L, -1);
+    luaL_argcheck(L, secs >= 0 && secs <= 86400, 1, "idle out of range");
+    pool->idle_ms = (int)(secs * 1000);
+  }
+  if (lua_getfield(L, 1, "perhost") != LUA_TNIL) {
+    lua_Integer n = luaL_checkinteger(L, -1);
+    luaL_argcheck(L, n >= 0 && n <= 1024, 1, "perhost out of range");
+    pool->perhost = (int)n;
+  }
+  if (lua_getfield(L, 1, "max") != LUA_TNIL) {
+    lua_Integer n = luaL_checkinteger(L, -1);
+    luaL_argcheck(L, n >= 0 && n <= 65536, 1, "max out of range");
+    pool->max = (int)n;
+  }
+  lua_pop(L, 3);
+  pool_expire(pool);
+  pool_trim(pool, pool->perhost > 0 ? pool->max : 0);
+  return 0;
+}
 
-  /* Check network:http permission */
-  if (!lus_haspledge(L, "network:http", url)) {
-    return luaL_error(L, "permission \"network:http\" denied for '%s'", url);
-  }
+static int pool_stats(lua_State *L) {
+  FetchPool *pool = get_pool(L);
+  pool_expire(pool);
+  lua_createtable(L, 0, 8);
+  lua_pushinteger(L, pool->requests);
+  lua_setfield(L, -2, "requests");
+  lua_pushinteger(L, pool->reused);
+  lua_setfield(L, -2, "reused");
+  lua_pushinteger(L, pool->connects);
+  lua_setfield(L, -2, "connects");
+  lua_pushinteger(L, pool->retries);
+  lua_setfield(L, -2, "retries");
+  lua_pushinteger(L, pool->expired);
+  lua_setfield(L, -2, "expired");
+  lua_pushinteger(L, pool->nconns);
+  lua_setfield(L, -2, "idle");
+  lua_pushinteger(L, pool->reads);
+  lua_setfield(L, -2, "reads");
+  lua_pushnumber(L, pool->requests > 0 ? (lua_Number)pool->reused /
+                                             (lua_Number)pool->requests
+                                       : 0);
+  lua_setfield(L, -2, "reuse");
+  return 1;
+}
 
-  ParsedURL parsed;
-  if (parse_url(url, &parsed) != 0) {
-    return luaL_error(L, "invalid URL: %s", url);
-  }
+static int pool_close(lua_State *L) {
+  pool_trim(get_pool(L), 0);
+  return 0;
+}
 
-  init_winsock(L);
+static const luaL_Reg pool_funcs[] = {{"configure", pool_configure},
+                                      {"stats", pool_stats},
+                                      {"close", pool_close},
+                                      {NULL, NULL}};
 
-  /* Resolve hostname */
+/*
+** Open a new connection for 'parsed' (origin 'key') into 'sock'; errors on
+** failure
+*/
+static void fetch_connect(lua_State *L, const ParsedURL *parsed,
+                          const char *key, LSocket *sock) {
   struct sockaddr_storage addr;
   socklen_t addrlen;
-  resolve_hostname(L, parsed.host, parsed.port, &addr, &addrlen);
+  resolve_hostname(L, parsed->host, parsed->port, &addr, &addrlen);
 
-  /* Create socket */
-  socket_t fd = socket(addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
-  if (fd == SOCKET_INVALID) {
-    return luaL_error(L, "cannot create socket: %s",
-                      sock_strerror(SOCKET_ERRNO));
+  sock->fd = socket(addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+  if (sock->fd == SOCKET_INVALID) {
+    luaL_error(L, "cannot create socket: %s", sock_strerror(SOCKET_ERRNO));
   }
-  if (!set_socket_timeouts(fd, FETCH_TIMEOUT_MS)) {
+  if (!set_socket_timeouts(sock->fd, FETCH_TIMEOUT_MS)) {
     int err = SOCKET_ERRNO;
-    sock_close(fd);
-    return luaL_error(L, "cannot set socket timeout: %s", sock_strerror(err));
+    sock_release(L, sock);
+    luaL_error(L, "cannot set socket timeout: %s", sock_strerror(err));
   }
-
-  /* Connect */
-  if (connect(fd, (struct sockaddr *)&addr, addrlen) == SOCKET_ERROR_VAL) {
+  if (connect(sock->fd, (struct sockaddr *)&addr, addrlen) ==
+      SOCKET_ERROR_VAL) {
     int err = SOCKET_ERRNO;
-    sock_close(fd);
-    return luaL_error(L, "cannot connect to %s:%d: %s", parsed.host,
-                      parsed.port, sock_strerror(err));
+    sock_release(L, sock);
+    luaL_error(L, "cannot connect to %s:%d: %s", parsed->host, parsed->port,
+               sock_strerror(err));
   }
 
-  /* Create socket userdata for cleanup */
-  LSocket sock;
-  memset(&sock, 0, sizeof(sock));
-  sock.fd = fd;
-  sock.timeout_ms = FETCH_TIMEOUT_MS;
-
   /* SSL handshake for HTTPS */
-  if (strcmp(parsed.scheme, "https") == 0) {
+  if (strcmp(parsed->scheme, "https") == 0) {
     init_ssl(L);
 
-    sock.ssl = SSL_new(ssl_ctx);
-    if (!sock.ssl) {
-      sock_close(fd);
-      return luaL_error(L, "SSL_new failed");
+    sock->ssl = tls_new(key);
+    if (!sock->ssl) {
+      sock_release(L, sock);
+      luaL_error(L, "SSL_new failed");
     }
 
-    SSL_set_fd(sock.ssl, (int)fd);
-    if (SSL_set_tlsext_host_name(sock.ssl, parsed.host) != 1) {
-      SSL_free(sock.ssl);
-      sock_close(fd);
-      return luaL_error(L, "SSL SNI setup failed");
+    SSL_set_fd(sock->ssl, (int)sock->fd);
+    if (SSL_set_tlsext_host_name(sock->ssl, parsed->host) != 1) {
+      sock_release(L, sock);
+      luaL_error(L, "SSL SNI setup failed");
     }
 
-    if (SSL_connect(sock.ssl) != 1) {
-      SSL_free(sock.ssl);
-      sock_close(fd);
-      return push_ssl_error(L, "SSL handshake failed");
+    double start = net_now();
+    int ok = SSL_connect(sock->ssl) == 1;
+    tls_handshaken(sock->ssl, ok, net_now() - start);
+    if (!ok) {
+      SSL_free(sock->ssl);
+      sock->ssl = NULL;
+      sock_release(L, sock);
+      push_ssl_error(L, "SSL handshake failed");
+      lua_error(L);
     }
 
-    long verify = SSL_get_verify_result(sock.ssl);
-    X509 *cert = SSL_get_peer_certificate(sock.ssl);
+    /* Only HTTP/1.1 is spoken, whatever ALPN was configured */
+    const unsigned char *proto;
+    unsigned int protolen;
+    SSL_get0_alpn_selected(sock->ssl, &proto, &protolen);
+    if (protolen > 0 && (protolen != 8 || memcmp(proto, "http/1.1", 8) != 0)) {
+      const char *name = lua_pushlstring(L, (const char *)proto, protolen);
+      sock_release(L, sock);
+      luaL_error(L, "server selected unsupported protocol '%s'", name);
+    }
+
+    long verify = SSL_get_verify_result(sock->ssl);
+    X509 *cert = SSL_get_peer_certificate(sock->ssl);
     if (verify != X509_V_OK || cert == NULL ||
-        X509_check_host(cert, parsed.host, 0, 0, NULL) != 1) {
+        X509_check_host(cert, parsed->host, 0, 0, NULL) != 1) {
       if (cert != NULL)
         X509_free(cert);
-      SSL_free(sock.ssl);
-      sock_close(fd);
-      return luaL_error(L, "SSL certificate verification failed for %s",
-                        parsed.host);
+      SSL_free(sock->ssl);
+      sock->ssl = NULL;
+      sock_release(L, sock);
+      luaL_error(L, "SSL certificate verification failed for %s",
+                 parsed->host);
     }
     X509_free(cert);
   }
+}
 
-  /* Build request */
-  luaL_Buffer req;
-  luaL_buffinit(L, &req);
+/* Case-insensitive search for the lowercase 'word' in 's' */
+static int ci_contains(const char *s, const char *word) {
+  size_t n = strlen(word);
+  for (; *s; s++) {
+    size_t i = 0;
+    while (i < n && tolower((unsigned char)s[i]) == word[i])
+      i++;
+    if (i == n)
+      return 1;
+  }
+  return 0;
+}
 
-  /* Request line */
-  lua_pushfstring(L, "%s %s HTTP/1.1\r\n", method, parsed.path);
-  luaL_addvalue(&req);
+/*
+** Buffered response reader. Responses are read through the socket's
+** receive buffer in blocks of up to FETCH_READ_SIZE bytes, and lines are
+** located with memchr, which the C library scans a word or a vector at a
+** time. The status line and headers of a small response thus cost a
+** single read, instead of one recv per byte.
+*/
+#define FETCH_READ_SIZE 16384
+#define FETCH_MAX_HEADERS 65536 /* status line plus header fields */
+
+/* One read from the connection: bytes read, 0 at end of stream, -1 */
+static ssize_t fetch_recv(FetchPool *pool, LSocket *sock, char *dst,
+                          size_t len) {
+  ssize_t got;
+  if (len > (size_t)INT_MAX)
+    len = (size_t)INT_MAX;
+  pool->reads++;
+  if (sock->ssl) {
+    got = SSL_read(sock->ssl, dst, (int)len);
+    if (got <= 0)
+      return (SSL_get_error(sock->ssl, (int)got) == SSL_ERROR_ZERO_RETURN)
+                 ? 0
+                 : -1;
+    return got;
+  }
+  do {
+    got = recv(sock->fd, dst, (int)len, 0);
+  } while (got < 0 && SOCKET_ERRNO == EINTR);
+  return got;
+}
 
-  /* Host header */
-  if ((strcmp(parsed.scheme, "http") == 0 && parsed.port != 80) ||
-      (strcmp(parsed.scheme, "https") == 0 && parsed.port != 443)) {
-    lua_pushfstring(L, "Host: %s:%d\r\n", parsed.host, parsed.port);
+/* Append what the connection has ready, with room for 'size' bytes */
+static ssize_t fetch_fill(lua_State *L, FetchPool *pool, LSocket *sock,
+                          size_t size) {
+  ssize_t got;
+  sock_buffer_ensure(L, sock, size);
+  got = fetch_recv(pool, sock, sock->buffer + sock->buflen,
+                   sock->bufcap - sock->buflen);
+  if (got > 0)
+    sock->buflen += (size_t)got;
+  return got;
+}
+
+/* Drop the first 'n' buffered bytes */
+static void fetch_consume(LSocket *sock, size_t n) {
+  sock->buflen -= n;
+  if (sock->buflen > 0)
+    memmove(sock->buffer, sock->buffer + n, sock->buflen);
+}
+
+/*
+** Find the line starting at offset 'from' of the buffer, reading more as
+** needed, and terminate it in place (without its CR LF). Returns the
+** offset just past the line, or 0 if the stream ended first.
+*/
+static size_t fetch_line(lua_State *L, FetchPool *pool, LSocket *sock,
+                         size_t from, size_t *len) {
+  size_t scanned = from;
+  for (;;) {
+    char *nl = (sock->buflen > scanned)
+                   ? memchr(sock->buffer + scanned, '\n',
+                            sock->buflen - scanned)
+                   : NULL;
+    if (nl) {
+      size_t end = (size_t)(nl - sock->buffer);
+      *len = end - from;
+      if (*len > 0 && sock->buffer[end - 1] == '\r')
+        (*len)--;
+      sock->buffer[from + *len] = '\0';
+      return end + 1;
+    }
+    scanned = sock->buflen;
+    if (scanned > FETCH_MAX_HEADERS) {
+      sock_release(L, sock);
+      luaL_error(L, "response headers too large");
+    }
+    if (fetch_fill(L, pool, sock, FETCH_READ_SIZE) <= 0)
+      return 0;
   }
-  else {
-    lua_pushfstring(L, "Host: %s\r\n", parsed.host);
+}
+
+/*
+** Streamed bodies. A request body given as a function is pulled from it
+** piece by piece and sent with chunked transfer encoding (or as is, when
+** the caller set Content-Length). A response body is read into a string,
+** or handed as it arrives to a sink function, in a fresh string or in a
+** vector reused for every piece.
+*/
+#define FETCH_STREAM_SIZE 65536 /* read size while streaming a response */
+
+typedef struct FetchIO {
+  int reader;   /* stack index of the request body function, or 0 */
+  int sized;    /* the caller set Content-Length for the streamed body */
+  int pulled;   /* the reader was called, so the body cannot be resent */
+  int sink;     /* stack index of the response sink, or 0 */
+  int vec;      /* stack index of the sink's vector, or 0 */
+  int stop;     /* the sink wants no more */
+  size_t total; /* response body bytes so far */
+  luaL_Buffer b; /* the response body, without a sink */
+} FetchIO;
+
+/* Send all of 'data'; returns 0 on failure */
+static int fetch_send(LSocket *sock, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n;
+    size_t tosend = (len > (size_t)INT_MAX) ? (size_t)INT_MAX : len;
+    if (sock->ssl)
+      n = SSL_write(sock->ssl, data, (int)tosend);
+    else
+      n = send(sock->fd, data, (int)tosend, SEND_FLAGS);
+    if (n <= 0)
+      return 0;
+    data += n;
+    len -= (size_t)n;
   }
-  luaL_addvalue(&req);
+  return 1;
+}
 
-  /* Connection header */
-  luaL_addstring(&req, "Connection: close\r\n");
+/* Queue 'len' bytes in the socket buffer, which is idle while sending */
+static void fetch_stage(lua_State *L, LSocket *sock, const char *data,
+                        size_t len) {
+  sock_buffer_ensure(L, sock, len);
+  memcpy(sock->buffer + sock->buflen, data, len);
+  sock->buflen += len;
+}
 
-  /* User-Agent */
-  luaL_addstring(&req, "User-Agent: Lus/1.0\r\n");
+static int fetch_flush(LSocket *sock) {
+  int ok = fetch_send(sock, sock->buffer, sock->buflen);
+  sock->buflen = 0;
+  return ok;
+}
 
-  /* Custom headers */
-  if (lua_istable(L, 3)) {
-    lua_pushnil(L);
-    while (lua_next(L, 3) != 0) {
-      const char *key = lua_tostring(L, -2);
-      const char *val = lua_tostring(L, -1);
-      if (key && val) {
-        if (strpbrk(key, "\r\n") || strpbrk(val, "\r\n")) {
-          lua_pop(L, 1);
-          return luaL_error(L, "invalid characters in HTTP header");
-        }
-        lua_pushfstring(L, "%s: %s\r\n", key, val);
-        luaL_addvalue(&req);
-      }
+/*
+** Send the request head 'head' and then the body pulled from the reader.
+** Small pieces are gathered into one write of at least FETCH_READ_SIZE
+** bytes. Returns 0 if sending failed.
+*/
+static int fetch_upload(lua_State *L, LSocket *sock, FetchIO *io,
+                        const char *head, size_t headlen) {
+  fetch_stage(L, sock, head, headlen);
+  for (;;) {
+    const char *data;
+    size_t len;
+    lua_pushvalue(L, io->reader);
+    io->pulled = 1;
+    lua_call(L, 0, 1);
+    if (lua_isnil(L, -1)) {
+      data = NULL;
+      len = 0;
+    }
+    else if (lua_type(L, -1) == LUA_TSTRING) {
+      data = lua_tolstring(L, -1, &len);
+    }
+    else if (lua_isvector(L, -1)) {
+      Vector *v = vecvalue(s2v(L->top.p - 1));
+      data = v->data;
+      len = v->len;
+    }
+    else {
+      sock_release(L, sock);
+      return luaL_error(L, "request body function returned %s "
+                           "(string or vector expected)",
+                        luaL_typename(L, -1));
+    }
+    if (len == 0) {
       lua_pop(L, 1);
+      break;
     }
-  }
+    if (!io->sized) {
+      char size[24];
+      int n = snprintf(size, sizeof(size), "%zx\r\n", len);
+      fetch_stage(L, sock, size, (size_t)n);
+    }
+    fetch_stage(L, sock, data, len);
+    if (!io->sized)
+      fetch_stage(L, sock, "\r\n", 2);
+    lua_pop(L, 1);
+    if (sock->buflen >= FETCH_READ_SIZE && !fetch_flush(sock))
+      return 0;
+  }
+  if (!io->sized)
+    fetch_stage(L, sock, "0\r\n\r\n", 5);
+  return fetch_flush(sock);
+}
 
-  /* Content-Length if body present */
-  if (body && body_len > 0) {
-    char lenhdr[64];
-    snprintf(lenhdr, sizeof(lenhdr), "Content-Length: %zu\r\n", body_len);
-    lua_pushstring(L, lenhdr);
-    luaL_addvalue(&req);
+/* Hand 'n' body bytes to the sink */
+static void fetch_deliver(lua_State *L, FetchIO *io, const char *data,
+                          size_t n) {
+  lua_pushvalue(L, io->sink);
+  if (io->vec) {
+    Vector *v = vecvalue(s2v(L->ci->func.p + io->vec));
+    if (n > v->alloc)
+      luaV_resize(L, v, n);
+    memcpy(v->data, data, n);
+    v->len = n;
+    lua_pushvalue(L, io->vec);
   }
+  else {
+    lua_pushlstring(L, data, n);
+  }
+  lua_call(L, 1, 1);
+  if (lua_type(L, -1) == LUA_TBOOLEAN && !lua_toboolean(L, -1))
+    io->stop = 1;
+  lua_pop(L, 1);
+  io->total += n;
+}
 
-  /* End of headers */
-  luaL_addstring(&req, "\r\n");
-
-  /* Body */
-  if (body && body_len > 0) {
-    luaL_addlstring(&req, body, body_len);
+/*
+** Take 'n' body bytes: first those already buffered, then the rest read
+** straight into the result buffer so that they are copied only once, or
+** read through the socket buffer and handed to the sink.
+*/
+static int fetch_body(lua_State *L, FetchPool *pool, LSocket *sock,
+                      FetchIO *io, size_t n) {
+  if (io->sink) {
+    while (n > 0 && !io->stop) {
+      size_t have;
+      if (sock->buflen == 0 &&
+          fetch_fill(L, pool, sock, FETCH_STREAM_SIZE) <= 0)
+        return 0;
+      have = (sock->buflen < n) ? sock->buflen : n;
+      fetch_deliver(L, io, sock->buffer, have);
+      fetch_consume(sock, have);
+      n -= have;
+    }
+    return 1;
+  }
+  size_t have = (sock->buflen < n) ? sock->buflen : n;
+  io->total += n;
+  if (have > 0) {
+    luaL_addlstring(&io->b, sock->buffer, have);
+    fetch_consume(sock, have);
+    n -= have;
+  }
+  while (n > 0) {
+    size_t want = (n < MAX_RECV_SIZE) ? n : MAX_RECV_SIZE;
+    ssize_t got =
+        fetch_recv(pool, sock, luaL_prepbuffsize(&io->b, want), want);
+    if (got <= 0)
+      return 0;
+    luaL_addsize(&io->b, (size_t)got);
+    n -= (size_t)got;
   }
+  return 1;
+}
+
+/* fetch_exchange results; the failures leave nothing on the stack */
+#define FETCH_OK 0
+#define FETCH_NOSEND 1     /* the request could not be sent */
+#define FETCH_NORESPONSE 2 /* the connection closed before any response */
 
-  luaL_pushresult(&req);
+/*
+** Send the request at the top of the stack over 'sock' (followed by the
+** body from 'io->reader', if any) and read the response, leaving status,
+** body and headers on the stack. '*keep' is set when the connection can
+** serve another request.
+*/
+static int fetch_exchange(lua_State *L, FetchPool *pool, LSocket *sock,
+                          int nobody, FetchIO *io, int *keep) {
   size_t req_len;
   const char *req_data = lua_tolstring(L, -1, &req_len);
 
   /* Send request */
-  size_t sent = 0;
-  while (sent < req_len) {
-    ssize_t n;
-    size_t tosend = req_len - sent;
-    if (tosend > (size_t)INT_MAX)
-      tosend = (size_t)INT_MAX;
-    if (sock.ssl) {
-      n = SSL_write(sock.ssl, req_data + sent, (int)tosend);
-    }
-    else {
-      n = send(fd, req_data + sent, (int)tosend, 0);
-    }
-    if (n <= 0) {
-      if (sock.ssl)
-        SSL_free(sock.ssl);
-      sock_close(fd);
-      return luaL_error(L, "failed to send request");
-    }
-    sent += (size_t)n;
-  }
-  lua_pop(L, 1); /* pop request string */
+  if (io->reader ? !fetch_upload(L, sock, io, req_data, req_len)
+                 : !fetch_send(sock, req_data, req_len))
+    return FETCH_NOSEND;
 
   /* Read status line */
-  char line[4096];
-  if (read_http_line(&sock, line, sizeof(line)) < 0) {
-    if (sock.ssl)
-      SSL_free(sock.ssl);
-    sock_close(fd);
-    return luaL_error(L, "failed to read response");
+  size_t len;
+  size_t pos = fetch_line(L, pool, sock, 0, &len);
+  if (pos == 0) {
+    if (sock->buflen == 0)
+      return FETCH_NORESPONSE;
+    sock_buffer_ensure(L, sock, 1);
+    sock->buffer[sock->buflen] = '\0';
+    lua_pushstring(L, sock->buffer);
+    sock_release(L, sock);
+    return luaL_error(L, "invalid HTTP response: %s", lua_tostring(L, -1));
   }
 
   /* Parse status code */
-  int status = 0;
-  if (sscanf(line, "HTTP/%*d.%*d %d", &status) != 1) {
-    if (sock.ssl)
-      SSL_free(sock.ssl);
-    sock_close(fd);
-    return luaL_error(L, "invalid HTTP response: %s", line);
+  int major = 0, minor = 0, status = 0;
+  if (sscanf(sock->buffer, "HTTP/%d.%d %d", &major, &minor, &status) != 3) {
+    lua_pushstring(L, sock->buffer);
+    sock_release(L, sock);
+    return luaL_error(L, "invalid HTTP response: %s", lua_tostring(L, -1));
   }
+  *keep = (major > 1 || (major == 1 && minor >= 1));
 
-  /* Read headers */
+  /* Read headers; they are parsed in place in the buffer */
   lua_newtable(L);                 /* response headers table */
   int headers_idx = lua_gettop(L); /* save absolute index */
   size_t content_length = 0;
   int has_content_length = 0;
   int chunked = 0;
 
-  int linelen;
-  while ((linelen = read_http_line(&sock, line, sizeof(line))) > 0) {
-    char *colon = strchr(line, ':');
+  for (;;) {
+    size_t next = fetch_line(L, pool, sock, pos, &len);
+    if (next == 0) {
+      sock_release(L, sock);
+      return luaL_error(L, "failed to read response headers");
+    }
+    char *line = sock->buffer + pos;
+    pos = next;
+    if (len == 0)
+      break;
+    char *colon = memchr(line, ':', len);
     if (colon) {
       *colon = '\0';
       char *value = colon + 1;
@@ -1682,13 +3468,11 @@ static int net_fetch(lua_State *L) {
       lua_pushstring(L, value);
       lua_setfield(L, headers_idx, line);
 
-      /* Check for Content-Length and Transfer-Encoding */
+      /* Check for Content-Length, Transfer-Encoding and Connection */
       if (strcmp(line, "content-length") == 0) {
         if (!parse_content_length(value, &content_length) ||
-            content_length > FETCH_MAX_BODY) {
-          if (sock.ssl)
-            SSL_free(sock.ssl);
-          sock_close(fd);
+            (!io->sink && content_length > FETCH_MAX_BODY)) {
+          sock_release(L, sock);
           return luaL_error(L, "invalid Content-Length");
         }
         has_content_length = 1;
@@ -1697,168 +3481,295 @@ static int net_fetch(lua_State *L) {
         if (strstr(value, "chunked"))
           chunked = 1;
       }
+      else if (strcmp(line, "connection") == 0) {
+        if (ci_contains(value, "close"))
+          *keep = 0;
+        else if (ci_contains(value, "keep-alive"))
+          *keep = 1;
+      }
     }
   }
-  if (linelen < 0) {
-    if (sock.ssl)
-      SSL_free(sock.ssl);
-    sock_close(fd);
-    return luaL_error(L, "failed to read response headers");
-  }
+  fetch_consume(sock, pos);
 
   /* Read body */
-  luaL_Buffer resp_body;
-  luaL_buffinit(L, &resp_body);
-  size_t body_total = 0;
+  if (!io->sink)
+    luaL_buffinit(L, &io->b);
+  size_t limit = io->sink ? SIZE_MAX : FETCH_MAX_BODY;
 
-  if (chunked) {
+  if (nobody || (status >= 100 && status < 200) || status == 204 ||
+      status == 304) {
+    /* No body, whatever the headers say */
+  }
+  else if (chunked) {
     /* Chunked transfer encoding */
     for (;;) {
-      if (read_http_line(&sock, line, sizeof(line)) < 0) {
-        if (sock.ssl)
-          SSL_free(sock.ssl);
-        sock_close(fd);
+      pos = fetch_line(L, pool, sock, 0, &len);
+      if (pos == 0) {
+        sock_release(L, sock);
         return luaL_error(L, "truncated chunked response");
       }
 
       size_t chunk_size;
-      if (!parse_chunk_size(line, &chunk_size) ||
-          chunk_size > FETCH_MAX_BODY - body_total) {
-        if (sock.ssl)
-          SSL_free(sock.ssl);
-        sock_close(fd);
+      if (!parse_chunk_size(sock->buffer, &chunk_size) ||
+          chunk_size > limit - io->total) {
+        sock_release(L, sock);
         return luaL_error(L, "invalid chunk size");
       }
+      fetch_consume(sock, pos);
       if (chunk_size == 0)
         break;
 
-      /* Read chunk data */
-      size_t remaining = chunk_size;
-      char buf[4096];
-      while (remaining > 0) {
-        size_t to_read = remaining;
-        if (to_read > sizeof(buf))
-          to_read = sizeof(buf);
-
-        ssize_t got;
-        if (sock.ssl) {
-          got = SSL_read(sock.ssl, buf, (int)to_read);
-        }
-        else {
-          got = recv(fd, buf, (int)to_read, 0);
-        }
-        if (got <= 0) {
-          if (sock.ssl)
-            SSL_free(sock.ssl);
-          sock_close(fd);
-          return luaL_error(L, "truncated chunked response");
-        }
-
-        luaL_addlstring(&resp_body, buf, (size_t)got);
-        body_total += (size_t)got;
-        remaining -= (size_t)got;
+      if (!fetch_body(L, pool, sock, io, chunk_size)) {
+        sock_release(L, sock);
+        return luaL_error(L, "truncated chunked response");
       }
+      if (io->stop)
+        break;
 
       /* Read trailing CRLF */
-      linelen = read_http_line(&sock, line, sizeof(line));
-      if (linelen != 0) {
-        if (sock.ssl)
-          SSL_free(sock.ssl);
-        sock_close(fd);
+      pos = fetch_line(L, pool, sock, 0, &len);
+      if (pos == 0 || len != 0) {
+        sock_release(L, sock);
         return luaL_error(L, "invalid chunk terminator");
       }
+      fetch_consume(sock, pos);
+    }
+    /* Skip trailer fields up to the blank line ending the message */
+    if (!io->stop) {
+      do {
+        pos = fetch_line(L, pool, sock, 0, &len);
+        fetch_consume(sock, pos);
+      } while (pos != 0 && len != 0);
+      if (pos == 0)
+        *keep = 0;
     }
   }
   else if (has_content_length) {
     /* Fixed Content-Length */
-    size_t remaining = content_length;
-    char buf[4096];
-    while (remaining > 0) {
-      size_t to_read = remaining;
-      if (to_read > sizeof(buf))
-        to_read = sizeof(buf);
-
-      ssize_t got;
-      if (sock.ssl) {
-        got = SSL_read(sock.ssl, buf, (int)to_read);
+    if (!fetch_body(L, pool, sock, io, content_length)) {
+      sock_release(L, sock);
+      return luaL_error(L, "truncated response body");
+    }
+  }
+  else {
+    /* Read until connection close */
+    *keep = 0;
+    while (!io->stop) {
+      size_t have = sock->buflen;
+      if (have == 0) {
+        ssize_t got = fetch_fill(L, pool, sock,
+                                 io->sink ? FETCH_STREAM_SIZE
+                                          : FETCH_READ_SIZE);
+        if (got <= 0)
+          break;
+        have = (size_t)got;
       }
-      else {
-        got = recv(fd, buf, (int)to_read, 0);
+      if (have > limit - io->total) {
+        sock_release(L, sock);
+        return luaL_error(L, "response body too large");
       }
-      if (got <= 0) {
-        if (sock.ssl)
-          SSL_free(sock.ssl);
-        sock_close(fd);
-        return luaL_error(L, "truncated response body");
+      if (io->sink) {
+        fetch_deliver(L, io, sock->buffer, have);
+      }
+      else {
+        luaL_addlstring(&io->b, sock->buffer, have);
+        io->total += have;
       }
+      fetch_consume(sock, have);
+    }
+  }
+
+  /*
+  ** A body the sink stopped early is left unread, and bytes past the end
+  ** of the response mean the connection is confused
+  */
+  if (io->stop || sock->buflen > 0)
+    *keep = 0;
+
+  /* Push the body string, or the size of the body the sink took */
+  if (io->sink)
+    lua_pushinteger(L, (lua_Integer)io->total);
+  else
+    luaL_pushresult(&io->b); /* body is now at top, headers at headers_idx */
+
+  /* Reorder to status, body, headers */
+  lua_pushinteger(L, status);
+  lua_insert(L, headers_idx);     /* [..., status, headers, body] */
+  lua_insert(L, headers_idx + 1); /* [..., status, body, headers] */
+  return FETCH_OK;
+}
 
-      luaL_addlstring(&resp_body, buf, (size_t)got);
-      body_total += (size_t)got;
-      remaining -= (size_t)got;
+/* Methods safe to send again when a reused connection turns out dead */
+static int fetch_idempotent(const char *method) {
+  static const char *const safe[] = {"GET",    "HEAD", "OPTIONS", "TRACE",
+                                     "PUT", "DELETE", NULL};
+  int i;
+  for (i = 0; safe[i]; i++) {
+    if (strcmp(method, safe[i]) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+static int net_fetch(lua_State *L) {
+  const char *url = luaL_checkstring(L, 1);
+  const char *method = luaL_optstring(L, 2, "GET");
+  /* headers table at index 3 (optional) */
+  size_t body_len = 0;
+  const char *body = NULL;
+  FetchIO io = {0};
+  if (lua_isfunction(L, 4))
+    io.reader = 4;
+  else
+    body = luaL_optlstring(L, 4, NULL, &body_len);
+  if (!lua_isnoneornil(L, 5)) {
+    luaL_checktype(L, 5, LUA_TFUNCTION);
+    io.sink = 5;
+    if (!lua_isnoneornil(L, 6)) {
+      luaL_checktype(L, 6, LUA_TVECTOR);
+      luaL_argcheck(L, !luaV_isshared(vecvalue(s2v(L->ci->func.p + 6))), 6,
+                    "shared vectors cannot be resized");
+      io.vec = 6;
     }
   }
+
+  if (strpbrk(method, "\r\n"))
+    return luaL_error(L, "invalid characters in HTTP method");
+  if (strpbrk(url, "\r\n"))
+    return luaL_error(L, "invalid characters in URL");
+
+  /* Check network:http permission */
+  if (!lus_haspledge(L, "network:http", url)) {
+    return luaL_error(L, "permission \"network:http\" denied for '%s'", url);
+  }
+
+  ParsedURL parsed;
+  if (parse_url(url, &parsed) != 0) {
+    return luaL_error(L, "invalid URL: %s", url);
+  }
+
+  init_winsock(L);
+  lua_settop(L, 6);
+
+  FetchPool *pool = get_pool(L);
+  char key[sizeof(((PoolConn *)0)->key)];
+  snprintf(key, sizeof(key), "%s://%s:%d", parsed.scheme, parsed.host,
+           parsed.port);
+  int reusable = pool->perhost > 0;
+
+  /* Build request */
+  luaL_Buffer req;
+  luaL_buffinit(L, &req);
+
+  /* Request line */
+  lua_pushfstring(L, "%s %s HTTP/1.1\r\n", method, parsed.path);
+  luaL_addvalue(&req);
+
+  /* Host header */
+  if ((strcmp(parsed.scheme, "http") == 0 && parsed.port != 80) ||
+      (strcmp(parsed.scheme, "https") == 0 && parsed.port != 443)) {
+    lua_pushfstring(L, "Host: %s:%d\r\n", parsed.host, parsed.port);
+  }
   else {
-    /* Read until connection close */
-    char buf[4096];
-    for (;;) {
-      ssize_t got;
-      if (sock.ssl) {
-        got = SSL_read(sock.ssl, buf, sizeof(buf));
-        if (got <= 0) {
-          int ssl_err = SSL_get_error(sock.ssl, (int)got);
-          if (ssl_err == SSL_ERROR_ZERO_RETURN)
-            break;
-          if (got < 0)
-            break;
+    lua_pushfstring(L, "Host: %s\r\n", parsed.host);
+  }
+  luaL_addvalue(&req);
+
+  /* User-Agent */
+  luaL_addstring(&req, "User-Agent: Lus/1.0\r\n");
+
+  /* Custom headers */
+  int has_connection = 0;
+  if (lua_istable(L, 3)) {
+    lua_pushnil(L);
+    while (lua_next(L, 3) != 0) {
+      const char *key = lua_tostring(L, -2);
+      const char *val = lua_tostring(L, -1);
+      if (key && val) {
+        if (strpbrk(key, "\r\n") || strpbrk(val, "\r\n")) {
+          lua_pop(L, 1);
+          return luaL_error(L, "invalid characters in HTTP header");
         }
-      }
-      else {
-        got = recv(fd, buf, sizeof(buf), 0);
-        if (got <= 0)
-          break;
-      }
-      if (got > 0) {
-        if ((size_t)got > FETCH_MAX_BODY - body_total) {
-          if (sock.ssl)
-            SSL_free(sock.ssl);
-          sock_close(fd);
-          return luaL_error(L, "response body too large");
+        if (strlen(key) == 10 && ci_contains(key, "connection")) {
+          has_connection = 1;
+          if (ci_contains(val, "close"))
+            reusable = 0;
+        }
+        else if (strlen(key) == 14 && ci_contains(key, "content-length")) {
+          io.sized = 1;
         }
-        luaL_addlstring(&resp_body, buf, (size_t)got);
-        body_total += (size_t)got;
+        lua_pushfstring(L, "%s: %s\r\n", key, val);
+        luaL_addvalue(&req);
       }
+      lua_pop(L, 1);
     }
   }
 
-  /* Cleanup */
-  if (sock.ssl) {
-    SSL_shutdown(sock.ssl);
-    SSL_free(sock.ssl);
+  /* Connection header */
+  if (!has_connection) {
+    luaL_addstring(&req, reusable ? "Connection: keep-alive\r\n"
+                                  : "Connection: close\r\n");
   }
-  sock_close(fd);
 
-  /* Push the result body string */
-  luaL_pushresult(&resp_body); /* body is now at top, headers at headers_idx */
-
-  /* At this point: headers at headers_idx, body at top */
-  /* We need to return: status, body, headers in that order */
+  /* Content-Length if body present; a streamed body is sent in chunks */
+  if (io.reader && !io.sized) {
+    luaL_addstring(&req, "Transfer-Encoding: chunked\r\n");
+  }
+  else if (body && body_len > 0) {
+    char lenhdr[64];
+    snprintf(lenhdr, sizeof(lenhdr), "Content-Length: %zu\r\n", body_len);
+    lua_pushstring(L, lenhdr);
+    luaL_addvalue(&req);
+  }
 
-  /* Step 1: Push status and headers */
-  lua_pushinteger(L, status);    /* [..., headers@idx, body, status] */
-  lua_pushvalue(L, headers_idx); /* [..., headers@idx, body, status, headers] */
+  /* End of headers */
+  luaL_addstring(&req, "\r\n");
 
-  /* Step 2: Remove original headers */
-  lua_remove(L, headers_idx); /* [..., body, status, headers] */
+  /* Body */
+  if (body && body_len > 0) {
+    luaL_addlstring(&req, body, body_len);
+  }
 
-  /* Step 3: Stack top 3 = body(-3), status(-2), headers(-1) */
-  /*         Want       = status(-3), body(-2), headers(-1) */
-  /* Rotate elements at -3 and -2 using lua_rotate on just those 2 */
-  lua_rotate(L, -3, -1); /* Rotate 3 elements: ABC -> BCA, so
-                            body,status,headers -> status,headers,body */
-  lua_rotate(L, -2, -1); /* Rotate bottom 2 of top 3: status,headers,body ->
-                            status,body,headers */
+  luaL_pushresult(&req); /* index 7 */
 
-  return 3;
+  /*
+  ** A pooled connection may have been closed by the server after it was
+  ** checked; when it fails before any response arrives the request is
+  ** sent again once on a fresh connection, if that is safe (and its body
+  ** is not a stream already partly consumed).
+  */
+  pool->requests++;
+  int nobody = strcmp(method, "HEAD") == 0;
+  for (;;) {
+    LSocket *sock = new_socket(L); /* index 8, closes on error */
+    sock->timeout_ms = FETCH_TIMEOUT_MS;
+    int reused = reusable && pool_take(pool, key, sock);
+    if (!reused) {
+      fetch_connect(L, &parsed, key, sock);
+      pool->connects++;
+    }
+    lua_pushvalue(L, 7);
+    int keep = 0;
+    int res = fetch_exchange(L, pool, sock, nobody, &io, &keep);
+    if (res != FETCH_OK) {
+      sock_release(L, sock);
+      if (reused && fetch_idempotent(method) && !io.pulled) {
+        pool->retries++;
+        lua_settop(L, 7);
+        continue;
+      }
+      return luaL_error(L, res == FETCH_NOSEND ? "failed to send request"
+                                               : "failed to read response");
+    }
+    /* stack: ..., sock, request, status, body, headers */
+    if (reused)
+      pool->reused++;
+    if (reusable && keep)
+      pool_put(L, pool, key, sock);
+    else
+      sock_release(L, sock);
+    return 3;
+  }
 }
 
 /* }====================================================== */
@@ -1878,7 +3789,11 @@ static void create_metatable(lua_State *L, const char *name,
   lua_pop(L, 1);
 }
 
-static const luaL_Reg network_funcs[] = {{"fetch", net_fetch}, {NULL, NULL}};
+static const luaL_Reg network_funcs[] = {{"fetch", net_fetch},
+                                         {"spawn", net_spawn},
+                                         {"run", net_run},
+                                         {"sleep", net_sleep},
+                                         {NULL, NULL}};
 
 /*
 ** Network granter: handles network permission requests and checks.
@@ -1955,6 +3870,18 @@ LUAMOD_API int luaopen_network(lua_State *L) {
   luaL_newlib(L, udp_funcs);
   lua_setfield(L, -2, "udp");
 
+  /* Create network.dns subtable */
+  luaL_newlib(L, dns_funcs);
+  lua_setfield(L, -2, "dns");
+
+  /* Create network.tls subtable */
+  luaL_newlib(L, tls_funcs);
+  lua_setfield(L, -2, "tls");
+
+  /* Create network.pool subtable */
+  luaL_newlib(L, pool_funcs);
+  lua_setfield(L, -2, "pool");
+
   return 1;
 }
 
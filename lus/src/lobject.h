@@ -65,7 +65,7 @@ typedef union Value {
   Value value_;      \
   lu_byte tt_
 
-typedef struct TValue {
+typedef struct l_packed TValue {
   TValuefields;
 } TValue;
 
@@ -154,7 +154,7 @@ typedef struct TValue {
 */
 typedef union StackValue {
   TValue val;
-  struct {
+  struct l_packed {
     TValuefields;
     unsigned short delta;
   } tbclist;
@@ -925,14 +925,25 @@ typedef struct Table {
 /*
 ** EnumRoot: Internal structure holding the name-to-index mapping.
 ** The names array is a flexible array member storing TString pointers.
+** It is followed in the same block by the canonical value of each
+** member (created on first access, so indexing an enum does not
+** allocate) and, for larger enums, an open-addressing index from name
+** to 1-based position.
 */
 typedef struct EnumRoot {
   CommonHeader;
-  int size;          /* number of enum values */
-  GCObject *gclist;  /* for GC traversal */
-  TString *names[1]; /* flexible array: names[0..size-1] */
+  int size;            /* number of enum values */
+  unsigned int hsize;  /* size of the name index (0 = linear search) */
+  GCObject *gclist;    /* for GC traversal */
+  TString *names[1];   /* flexible array: names[0..size-1] */
 } EnumRoot;
 
+/* canonical values: values[0..size-1] (NULL until first used) */
+#define enumvalues(r) (cast(struct Enum **, (r)->names + (r)->size))
+
+/* name index: index[0..hsize-1] (0 = empty slot) */
+#define enumindex(r) (cast(int *, enumvalues(r) + (r)->size))
+
 
 /*
 ** Enum: User-visible enum value.
@@ -945,8 +956,10 @@ typedef struct Enum {
 } Enum;
 
 
-/* size of an EnumRoot with n names */
-#define sizeenumroot(n) (offsetof(EnumRoot, names) + (n) * sizeof(TString *))
+/* size of an EnumRoot with n names and a name index of size h */
+#define sizeenumroot(n, h)                                        \
+  (offsetof(EnumRoot, names) +                                    \
+   (n) * (sizeof(TString *) + sizeof(Enum *)) + (h) * sizeof(int))
 
 /* size of an Enum value */
 #define sizeenum (sizeof(Enum))
@@ -962,13 +975,16 @@ typedef struct Enum {
 
 /*
 ** Vector: A mutable byte buffer.
-** Data is stored separately to allow efficient resizing.
+** Data is stored separately to allow efficient resizing. A shared
+** vector's data lives in a 'VecShared' (see lvector.c) that vectors in
+** other states may use too.
 */
 typedef struct Vector {
   CommonHeader;
   size_t len;   /* current buffer length in bytes */
-  size_t alloc; /* allocated buffer size */
+  size_t alloc; /* allocated buffer size (0 for a shared vector) */
   char *data;   /* pointer to buffer data */
+  struct VecShared *shared; /* shared buffer holding 'data', or NULL */
 } Vector;
 
 
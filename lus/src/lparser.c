@@ -2101,13 +2101,14 @@ static void enumexpr(LexState *ls, expdesc *v) {
     for (int i = 0; i < nnames; i++) {
       root->names[i] = names[i];
     }
+    luaE_indexroot(root);
 
     /* Anchor the root while allocating the first enum value. */
     setgcovalue(L, s2v(L->top.p), obj2gco(root));
     L->top.p++;
 
     /* Create the first enum value (index 1) */
-    e = luaE_new(L, root, 1);
+    e = luaE_getbyidx(L, root, 1);
     L->top.p--;
 
     /* Add the enum value as a constant */
@@ -20,6 +20,7 @@
 #include "lfastcall.h"
 #include "lfunc.h"
 #include "lgc.h"
+#include "lheap.h"
 #include "llex.h"
 #include "lmem.h"
 #include "lpledge.h"
@@ -253,6 +254,7 @@ static void preinit_thread(lua_State *L, global_State *g) {
   L->activeCatch = NULL; /* no active Lua catch handler */
   L->hook = NULL;
   L->hookmask = 0;
+  L->preempt = 0;
   L->basehookcount = 0;
   L->allowhook = 1;
   resethookcount(L);
@@ -280,6 +282,7 @@ LUA_API void lus_worker_pool_shutdown(void);
 static void close_state(lua_State *L) {
   global_State *g = G(L);
   lus_worker_pool_shutdown(); /* join pool threads before freeing anything */
+  lusH_free(L);               /* stop profiling the teardown */
   if (!completestate(g))    /* closing a partially built state? */
     luaC_freeallobjects(L); /* just collect its objects */
   else {                    /* closing a fully built state */
@@ -407,7 +410,9 @@ LUA_API lua_State *lua_newstate(lua_Alloc f, void *ud, unsigned seed) {
   g->no_fastcall = 0;
   g->readonly_env = 0;
   g->pedantic = 0;
+  g->gcregions = 0;
   g->stripdebug = 0;
+  g->heapprof = NULL;
   g->iter_next = NULL;
   g->iter_ipairsaux = NULL;
   for (i = 0; i < LUA_NUMTYPES; i++)
@@ -16,6 +16,7 @@ typedef struct CCatchInfo
 
 #include <setjmp.h> /* for jmp_buf in CatchInfo */
 
+#include "latomic.h"
 #include "lfastcall.h"
 #include "lobject.h"
 #include "ltm.h"
@@ -189,7 +190,8 @@ typedef struct stringtable {
 **  - the global throwable chain via 'prev', rooted at L->activeCatch, used by
 **    luaD_throw for O(1) lookup of the catch to longjmp into. lua_resume
 **    clears this root so a coroutine cannot longjmp into a pre-yield catch
-**    whose jmpbuf is now stale.
+**    whose jmpbuf is now stale, and a yield cuts the links of the catches
+**    it leaves open, for the same reason.
 **  - the per-frame chain via 'frameprev', rooted at ci->u.l.catchlist, used by
 **    OP_ENDCATCH/recovery to find the node being closed. This is reached
 **    through the CallInfo, so it survives a yield (which unwinds the C stack
@@ -327,6 +329,7 @@ struct lua_State {
   int basehookcount;
   int hookcount;
   volatile l_signalT hookmask;
+  lus_atomic32_t preempt; /* another thread asks a disarmed hook to fire */
   struct {         /* info about transferred values (for call/return hooks) */
     int ftransfer; /* offset of first value transferred */
     int ntransfer; /* number of values transferred */
@@ -363,6 +366,7 @@ typedef struct global_State {
   lu_byte gcstopem;    /* stops emergency collections */
   lu_byte gcstp;       /* control whether GC is running */
   lu_byte gcemergency; /* true if this is an emergency collection */
+  int gcregions;       /* number of open GC regions */
   GCObject *allgc;     /* list of all collectable objects */
   GCObject **sweepgc;  /* current position of sweep in list */
   GCObject *finobj;    /* list of collectable objects with finalizers */
@@ -393,6 +397,7 @@ typedef struct global_State {
   lu_byte no_fastcall;                       /* disable fastcall emission */
   lu_byte readonly_env;                      /* environment is immutable */
   lu_byte stripdebug;          /* strip debug info from loaded prototypes */
+  struct HeapProfile *heapprof; /* allocation profiler (NULL if none) */
   TString *fc_names[FC_COUNT]; /* interned fastcall func names */
   TString *fc_modules[FC_NMODULES + 1]; /* [0] = NULL (base library) */
   lu_byte fc_ready[FC_COUNT];           /* entry registered/enabled here */
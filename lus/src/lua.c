@@ -59,6 +59,8 @@ static int no_fastcall = 0;                /* --no-fastcall flag */
 static int readonly_env = 0;               /* --readonly-env flag */
 static int gc_pause = 0;                   /* --gc-pause value (0 = default) */
 static int strip_debug = 0;                /* --strip-debug flag */
+static int worker_threads = 0; /* --worker-threads value (0 = default) */
+static int worker_pin = -1;    /* --worker-pin mode (-1 = default) */
 static void mark_env_readonly(lua_State *L);
 
 static int parse_positive_int_arg(const char *s, int *result) {
@@ -175,6 +177,10 @@ static void print_usage(const char *badoption) {
       "  --strip-debug  drop debug info (line numbers, local/upvalue\n"
       "                 names, source) from loaded code to save memory;\n"
       "                 tracebacks and the debug library lose detail\n"
+      "  --worker-threads N  run workers on N pool threads (default:\n"
+      "                 usable CPUs, or LUS_WORKER_THREADS)\n"
+      "  --worker-pin mode   pin pool threads: none, cores or numa\n"
+      "                 (default: none, or LUS_WORKER_PIN)\n"
       "  --        stop handling options\n"
       "  -         stop handling options and execute stdin\n",
       progname);
@@ -1460,6 +1466,28 @@ static int collectargs(char **argv, int *first) {
             strip_debug = 1;
             break;
           }
+          if (strcmp(argv[i] + 2, "worker-threads") == 0) {
+            i++; /* skip to argument */
+            if (argv[i] == NULL || argv[i][0] == '-')
+              return has_error; /* no argument */
+            if (!parse_positive_int_arg(argv[i], &worker_threads))
+              return has_error; /* not a positive number */
+            break;
+          }
+          if (strcmp(argv[i] + 2, "worker-pin") == 0) {
+            i++; /* skip to argument */
+            if (argv[i] == NULL)
+              return has_error; /* no argument */
+            if (strcmp(argv[i], "none") == 0)
+              worker_pin = LUS_WORKER_PIN_NONE;
+            else if (strcmp(argv[i], "cores") == 0)
+              worker_pin = LUS_WORKER_PIN_CORES;
+            else if (strcmp(argv[i], "numa") == 0)
+              worker_pin = LUS_WORKER_PIN_NUMA;
+            else
+              return has_error; /* unknown mode */
+            break;
+          }
           return has_error; /* invalid option */
         }
         /* if there is a script name, it comes after '--' */
@@ -2034,6 +2062,10 @@ static int pmain(lua_State *L) {
   }
   else
     l_getenv = &getenv;
+  if (worker_threads > 0) /* size the pool before any worker starts */
+    lus_worker_threads(worker_threads);
+  if (worker_pin >= 0)
+    lus_worker_pinning(worker_pin);
   luai_openlibs(L); /* open standard libraries */
   if (no_fastcall)
     G(L)->no_fastcall = 1;
@@ -325,6 +325,14 @@ LUA_API void(lua_warning)(lua_State *L, const char *msg, int tocont);
 
 LUA_API int(lua_gc)(lua_State *L, int what, ...);
 
+/*
+** GC regions: objects created between 'lus_beginregion' and the matching
+** 'lus_endregion' that are no longer reachable are reclaimed when the
+** outermost region ends. Regions nest.
+*/
+LUA_API void(lus_beginregion)(lua_State *L);
+LUA_API void(lus_endregion)(lua_State *L);
+
 /*
 ** miscellaneous functions
 */
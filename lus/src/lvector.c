@@ -9,10 +9,14 @@
 
 #include "lprefix.h"
 
+#include <stdlib.h>
 #include <string.h>
 
 #include "lua.h"
 
+#include "latomic.h"
+#include "ldebug.h"
+#include "ldo.h"
 #include "lgc.h"
 #include "lmem.h"
 #include "lobject.h"
@@ -30,6 +34,7 @@ Vector *luaV_newvec(lua_State *L, size_t len, int fast) {
   v->data = NULL;
   v->len = 0;
   v->alloc = 0;
+  v->shared = NULL;
   if (len > 0) {
     char *data = luaM_newblock(L, len);
     if (!fast)
@@ -57,6 +62,8 @@ Vector *luaV_clone(lua_State *L, Vector *src) {
 ** Resize a vector. New bytes are zero-initialized.
 */
 void luaV_resize(lua_State *L, Vector *v, size_t newlen) {
+  if (luaV_isshared(v))
+    luaG_runerror(L, "cannot resize a shared vector");
   if (newlen > v->alloc) {
     /* Need to grow allocation */
     v->data = luaM_reallocvchar(L, v->data, v->alloc, newlen);
@@ -70,18 +77,147 @@ void luaV_resize(lua_State *L, Vector *v, size_t newlen) {
 }
 
 
+/*
+** Take the buffer out of a vector. The buffer is not freed, so for the
+** collector it is as if it were.
+*/
+char *luaV_detach(lua_State *L, Vector *v, size_t *len, size_t *alloc) {
+  char *data = v->data;
+  lua_assert(!luaV_isshared(v));
+  *len = v->len;
+  *alloc = v->alloc;
+  G(L)->GCdebt += cast(l_mem, v->alloc);
+  v->data = NULL;
+  v->len = 0;
+  v->alloc = 0;
+  return data;
+}
+
+
+/*
+** Create a vector over a buffer detached from another state.
+*/
+Vector *luaV_adopt(lua_State *L, char *data, size_t len, size_t alloc) {
+  Vector *v = luaV_newvec(L, 0, 0);
+  v->data = data;
+  v->len = len;
+  v->alloc = alloc;
+  G(L)->GCdebt -= cast(l_mem, alloc);
+  return v;
+}
+
+
+/*
+** {======================================================
+** Shared buffers
+** =======================================================
+*/
+
+/*
+** The buffer follows the header, which keeps it aligned for 8-byte
+** integers. Every access to it from C that may race with another thread
+** goes through the atomic operations of latomic.h.
+*/
+struct VecShared {
+  lus_atomic_t refcount;
+  size_t len;
+};
+
+#define shareddata(s) cast_charp((s) + 1)
+
+
+Vector *luaV_newshared(lua_State *L, size_t len) {
+  Vector *v = luaV_newvec(L, 0, 0); /* first: an error cannot leak 's' */
+  VecShared *s;
+  if (len > MAX_SIZE - sizeof(VecShared))
+    luaM_toobig(L);
+  s = (VecShared *)malloc(sizeof(VecShared) + len);
+  if (s == NULL)
+    luaM_error(L);
+  memset(shareddata(s), 0, len);
+  lus_atomic_store(&s->refcount, 1);
+  s->len = len;
+  v->shared = s;
+  v->data = shareddata(s);
+  v->len = len;
+  return v;
+}
+
+
+Vector *luaV_openshared(lua_State *L, VecShared *s) {
+  Vector *v = luaV_newvec(L, 0, 0);
+  luaV_increfshared(s);
+  v->shared = s;
+  v->data = shareddata(s);
+  v->len = s->len;
+  return v;
+}
+
+
+void luaV_increfshared(VecShared *s) {
+  lus_atomic_add(&s->refcount, 1);
+}
+
+
+void luaV_decrefshared(VecShared *s) {
+  if (lus_atomic_addfetch(&s->refcount, -1) == 0)
+    free(s);
+}
+
+
+lua_Integer luaV_atomicload(const char *p, int size) {
+  if (size == 4)
+    return cast(lua_Integer, lus_atomic32_load((lus_atomic32_t *)p));
+  return cast(lua_Integer, lus_atomic_load((lus_atomic_t *)p));
+}
+
+
+void luaV_atomicstore(char *p, int size, lua_Integer v) {
+  if (size == 4)
+    lus_atomic32_store((lus_atomic32_t *)p, cast_int(v));
+  else
+    lus_atomic_store((lus_atomic_t *)p, cast(long long, v));
+}
+
+
+lua_Integer luaV_atomicadd(char *p, int size, lua_Integer delta) {
+  if (size == 4) /* wraps around like the 32-bit integer it is */
+    return cast(lua_Integer,
+                lus_atomic32_fetchadd((lus_atomic32_t *)p, cast_int(delta)));
+  return cast(lua_Integer,
+              lus_atomic_fetchadd((lus_atomic_t *)p, cast(long long, delta)));
+}
+
+
+lua_Integer luaV_atomiccas(char *p, int size, lua_Integer expected,
+                           lua_Integer desired) {
+  if (size == 4)
+    return cast(lua_Integer,
+                lus_atomic32_cmpxchg((lus_atomic32_t *)p, cast_int(expected),
+                                     cast_int(desired)));
+  return cast(lua_Integer, lus_atomic_cmpxchg((lus_atomic_t *)p,
+                                              cast(long long, expected),
+                                              cast(long long, desired)));
+}
+
+/* }====================================================== */
+
+
 /*
 ** Free a vector.
 */
 void luaV_freevec(lua_State *L, Vector *v) {
-  if (v->alloc > 0)
+  if (luaV_isshared(v))
+    luaV_decrefshared(v->shared);
+  else if (v->alloc > 0)
     luaM_freemem(L, v->data, v->alloc);
   luaM_freemem(L, v, sizeof(Vector));
 }
 
 
 /*
-** Get total memory size of a vector.
+** Get total memory size of a vector. A shared buffer belongs to no
+** state, so it does not count.
 */
 lu_mem luaV_vecsize(Vector *v) {
   return cast(lu_mem, sizeof(Vector) + v->alloc);
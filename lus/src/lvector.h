@@ -31,6 +31,63 @@ LUAI_FUNC Vector *luaV_clone(lua_State *L, Vector *v);
 */
 LUAI_FUNC void luaV_resize(lua_State *L, Vector *v, size_t newlen);
 
+/*
+** Take the buffer out of a vector, leaving it empty; the buffer no longer
+** counts towards L's heap. Returns the buffer (NULL if it was empty) and
+** its length and allocation size.
+*/
+LUAI_FUNC char *luaV_detach(lua_State *L, Vector *v, size_t *len,
+                            size_t *alloc);
+
+/*
+** Create a vector whose contents are 'data', a buffer of 'alloc' bytes
+** ('len' in use) obtained from the same allocator as L's, typically by
+** 'luaV_detach' in another state.
+*/
+LUAI_FUNC Vector *luaV_adopt(lua_State *L, char *data, size_t len,
+                             size_t alloc);
+
+/*
+** Shared buffers: a buffer outside every state, which vectors in any
+** number of states (and threads) use at once. It lives as long as some
+** vector or other holder keeps a reference to it. Shared vectors cannot
+** be resized.
+*/
+typedef struct VecShared VecShared;
+
+#define luaV_isshared(v) ((v)->shared != NULL)
+
+/*
+** Create a vector over a new zero-initialized shared buffer of 'len'
+** bytes.
+*/
+LUAI_FUNC Vector *luaV_newshared(lua_State *L, size_t len);
+
+/*
+** Create a vector over the shared buffer 's', with a reference of its
+** own.
+*/
+LUAI_FUNC Vector *luaV_openshared(lua_State *L, VecShared *s);
+
+/*
+** Add or drop a reference to a shared buffer. They are safe to call from
+** any thread; the last 'luaV_decrefshared' frees the buffer.
+*/
+LUAI_FUNC void luaV_increfshared(VecShared *s);
+LUAI_FUNC void luaV_decrefshared(VecShared *s);
+
+/*
+** Atomic, sequentially consistent operations on the 'size'-byte (4 or
+** 8) signed integer at 'p', which must be aligned to 'size'. 'add'
+** returns the previous value; 'cas' stores 'desired' if the value is
+** 'expected' and returns the value it found either way.
+*/
+LUAI_FUNC lua_Integer luaV_atomicload(const char *p, int size);
+LUAI_FUNC void luaV_atomicstore(char *p, int size, lua_Integer v);
+LUAI_FUNC lua_Integer luaV_atomicadd(char *p, int size, lua_Integer delta);
+LUAI_FUNC lua_Integer luaV_atomiccas(char *p, int size, lua_Integer expected,
+                                     lua_Integer desired);
+
 /*
 ** Free a vector.
 */
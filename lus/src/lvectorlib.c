@@ -329,11 +329,109 @@ static int vec_resize(lua_State *L) {
   Vector *v = checkvector(L, 1);
   lua_Integer newsize = luaL_checkinteger(L, 2);
   luaL_argcheck(L, newsize >= 0, 2, "size must be non-negative");
+  luaL_argcheck(L, !luaV_isshared(v), 1, "cannot resize a shared vector");
   luaV_resize(L, v, (size_t)newsize);
   return 0;
 }
 
 
+/*
+** vector.shared(size)
+*/
+static int vec_shared(lua_State *L) {
+  lua_Integer size = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, size >= 0, 1, "size must be non-negative");
+  Vector *v = luaV_newshared(L, (size_t)size);
+  setvecvalue(L, s2v(L->top.p), v);
+  L->top.p++;
+  return 1;
+}
+
+
+/* ===================================================================
+** Atomic operations on 4- or 8-byte integer slots
+** =================================================================== */
+
+
+/*
+** Check the slot at the offset in argument 'arg', whose size is in
+** argument 'sizearg' (default 8), and return its address.
+*/
+static char *checkslot(lua_State *L, Vector *v, int arg, int sizearg,
+                       int *size) {
+  lua_Integer offset = luaL_checkinteger(L, arg);
+  lua_Integer sz = luaL_optinteger(L, sizearg, 8);
+  luaL_argcheck(L, sz == 4 || sz == 8, sizearg, "size must be 4 or 8");
+  luaL_argcheck(L, offset >= 0 && (size_t)offset <= v->len &&
+                   v->len - (size_t)offset >= (size_t)sz, arg,
+                "offset out of bounds");
+  luaL_argcheck(L, offset % sz == 0, arg, "offset is not aligned");
+  *size = (int)sz;
+  return v->data + offset;
+}
+
+
+/* Check an integer that goes into a slot of 'size' bytes */
+static lua_Integer checkslotvalue(lua_State *L, int arg, int size) {
+  lua_Integer n = luaL_checkinteger(L, arg);
+  luaL_argcheck(L, size == 8 || (n >= INT_MIN && n <= INT_MAX), arg,
+                "integer overflow");
+  return n;
+}
+
+
+/*
+** vector.load(v, offset [, size])
+*/
+static int vec_load(lua_State *L) {
+  Vector *v = checkvector(L, 1);
+  int size;
+  char *p = checkslot(L, v, 2, 3, &size);
+  lua_pushinteger(L, luaV_atomicload(p, size));
+  return 1;
+}
+
+
+/*
+** vector.store(v, offset, value [, size])
+*/
+static int vec_store(lua_State *L) {
+  Vector *v = checkvector(L, 1);
+  int size;
+  char *p = checkslot(L, v, 2, 4, &size);
+  luaV_atomicstore(p, size, checkslotvalue(L, 3, size));
+  return 0;
+}
+
+
+/*
+** vector.add(v, offset, delta [, size])
+*/
+static int vec_add(lua_State *L) {
+  Vector *v = checkvector(L, 1);
+  int size;
+  char *p = checkslot(L, v, 2, 4, &size);
+  lua_pushinteger(L, luaV_atomicadd(p, size, checkslotvalue(L, 3, size)));
+  return 1;
+}
+
+
+/*
+** vector.cas(v, offset, expected, desired [, size])
+*/
+static int vec_cas(lua_State *L) {
+  Vector *v = checkvector(L, 1);
+  int size;
+  char *p = checkslot(L, v, 2, 5, &size);
+  lua_Integer expected = checkslotvalue(L, 3, size);
+  lua_Integer old = luaV_atomiccas(p, size, expected,
+                                   checkslotvalue(L, 4, size));
+  lua_pushboolean(L, old == expected);
+  lua_pushinteger(L, old);
+  return 2;
+}
+
+
 /*
 ** Iterator function for vector.unpackmany
 */
@@ -484,7 +582,10 @@ static int vec_unpackmany(lua_State *L) {
 static const luaL_Reg veclib[] = {
     {"create", vec_create},         {"pack", vec_pack}, {"unpack", vec_unpack},
     {"clone", vec_clone},           {"size", vec_size}, {"resize", vec_resize},
-    {"unpackmany", vec_unpackmany}, {NULL, NULL}};
+    {"unpackmany", vec_unpackmany}, {"shared", vec_shared},
+    {"load", vec_load},             {"store", vec_store},
+    {"add", vec_add},               {"cas", vec_cas},
+    {NULL, NULL}};
 
 
 #ifndef LUS_NO_ARCHIVE
@@ -302,7 +302,9 @@ lu_byte luaV_finishget(lua_State *L, const TValue *t, TValue *key, StkId val,
         }
         else if (ttisinteger(key)) { /* index by integer */
           lua_Integer idx = ivalue(key);
-          result = luaE_getbyidx(L, root, (int)idx);
+          result = (idx >= 1 && idx <= root->size)
+                       ? luaE_getbyidx(L, root, cast_int(idx))
+                       : NULL;
           if (result == NULL)
             luaG_runerror(L, "enum index %I out of range", (LUAI_UACINT)idx);
         }
@@ -1411,6 +1413,14 @@ void luaV_finishOp(lua_State *L) {
 
 #define updatetrap(ci) (trap = ci->u.l.trap)
 
+/*
+** Refresh 'trap' at a jump. Besides the frame's own 'trap', it picks
+** up preemption requests, which the worker pool makes from another
+** thread without going through the thread's frames.
+*/
+#define updatetrapjump(ci) \
+  (trap = ci->u.l.trap | lus_atomic32_loadrelaxed(&L->preempt))
+
 #define updatebase(ci) (base = ci->func.p + 1)
 
 #define updatestack(ci)     \
@@ -1422,13 +1432,14 @@ void luaV_finishOp(lua_State *L) {
   }
 
 /*
-** Execute a jump instruction. The 'updatetrap' allows signals to stop
-** tight loops. (Without it, the local copy of 'trap' could never change.)
+** Execute a jump instruction. The 'updatetrapjump' allows signals to
+** stop tight loops. (Without it, the local copy of 'trap' could never
+** change.)
 */
 #define dojump(ci, i, e)    \
   {                         \
     pc += GETARG_sJ(i) + e; \
-    updatetrap(ci);         \
+    updatetrapjump(ci);     \
   }
 
 /* for test instructions, execute the jump instruction that follows it */
@@ -1604,6 +1615,26 @@ catchErrorRecovery(lua_State *L, CallInfo **pci, LClosure **pcl, TValue **pk,
   return resumepc;
 }
 
+/*
+** Recover, on behalf of 'lua_resume', from an error raised inside a catch
+** whose body yielded. The catch's jmpbuf died with the C stack it was set
+** on, so the error unwound to 'lua_resume' instead; 'ci' is the innermost
+** frame with an open catch, and it resumes after that catch.
+*/
+void luaV_catchresume(lua_State *L, CallInfo *ci, TStatus status) {
+  CatchInfo *cinfo = ci->u.l.catchlist;
+  LClosure *cl;
+  TValue *k;
+  StkId base;
+  int trap;
+  cinfo->status = status;
+  cinfo->erroffset = savestack(L, L->top.p - 1);
+  cinfo->prev = NULL; /* enclosing catches are stale too; found the same way */
+  cinfo->savednCcalls = L->nCcalls;
+  L->activeCatch = cinfo;
+  ci->u.l.savedpc = catchErrorRecovery(L, &ci, &cl, &k, &base, &trap);
+}
+
 #define vmdispatch(o) switch (o)
 #define vmcase(l) case l:
 #define vmbreak break
@@ -2270,7 +2301,7 @@ returning: /* trap already set */
         }
         else if (floatforloop(L, ra)) /* float loop */
           pc -= GETARG_Bx(i);      /* jump back */
-        updatetrap(ci);            /* allows a signal to break the loop */
+        updatetrapjump(ci);        /* allows a signal to break the loop */
         vmbreak;
       }
       vmcase(OP_FORPREP) {
@@ -2368,8 +2399,10 @@ returning: /* trap already set */
       vmcase(OP_TFORLOOP) {
       l_tforloop: {
         StkId ra = RA(i);
-        if (!ttisnil(s2v(ra + 3))) /* continue loop? */
-          pc -= GETARG_Bx(i);      /* jump back */
+        if (!ttisnil(s2v(ra + 3))) { /* continue loop? */
+          pc -= GETARG_Bx(i);        /* jump back */
+          updatetrapjump(ci);        /* allows a signal to break the loop */
+        }
         vmbreak;
       }
       }
@@ -6,30 +6,56 @@
 #define lworkerlib_c
 #define LUA_LIB
 
+#if defined(LUS_PLATFORM_LINUX) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* for 'pthread_setaffinity_np' */
+#endif
+
 #include "lprefix.h"
 
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "larena.h"
 #include "lauxlib.h"
+#include "lenum.h"
 #include "lpledge.h"
 #include "lstate.h"
+#include "lstring.h"
+#include "ltable.h"
 #include "lua.h"
 #include "lualib.h"
+#include "lvector.h"
 #include "lworkerlib.h"
 
 /* Metatable name for worker userdata */
 #define WORKER_METATABLE "worker.state"
 
+/* Metatable name for channel userdata, and the registry table of handles */
+#define CHANNEL_METATABLE "worker.channel"
+#define CHANNEL_CACHE "worker.channelcache"
+
 /* Global worker pool (single instance) */
 static WorkerPool g_pool = {0};
 
 /* Global worker setup callback */
 static lus_WorkerSetup g_worker_setup = NULL;
 
+#if defined(_MSC_VER)
+#define l_threadlocal __declspec(thread)
+#else
+#define l_threadlocal __thread
+#endif
+
+/* Nonzero while closing a worker's state (finalizers can nest closes):
+** 'lua_close' shuts the pool down when the host closes its state, but
+** not for a worker's own state */
+static l_threadlocal int t_closingworker = 0;
+
 /*
 ** {======================================================
 ** Platform-specific helpers
@@ -44,7 +70,79 @@ static int get_cpu_count(void) {
 }
 #else
 #include <unistd.h>
-#if defined(_SC_NPROCESSORS_ONLN)
+#if defined(LUS_PLATFORM_LINUX)
+#include <sched.h>
+
+/* Read the first line of file 'path' into 'buf'; returns 0 on failure */
+static int read_line(const char *path, char *buf, size_t size) {
+  FILE *f = fopen(path, "r");
+  int ok;
+  if (f == NULL)
+    return 0;
+  ok = (fgets(buf, (int)size, f) != NULL);
+  fclose(f);
+  return ok;
+}
+
+/* CPUs granted by a cgroup 'cpu.max' file (v2); 0 = no limit */
+static int cgroup2_limit(const char *path) {
+  char buf[64];
+  long long quota, period;
+  if (!read_line(path, buf, sizeof(buf)) ||
+      sscanf(buf, "%lld %lld", &quota, &period) != 2 || quota <= 0 ||
+      period <= 0)
+    return 0; /* no file or "max" */
+  return (int)((quota + period - 1) / period);
+}
+
+/*
+** CPUs the process's cgroup may use per period (its CPU quota rounded
+** up), or 0 if it has no quota. Looks at the process's own cgroup (v2)
+** and at the root of the cgroup file system, which is the process's
+** cgroup in a container.
+*/
+static int cgroup_cpu_limit(void) {
+  char line[512], path[600], buf[64];
+  long long quota, period;
+  int n = 0;
+  FILE *f = fopen("/proc/self/cgroup", "r");
+  if (f != NULL) {
+    while (fgets(line, sizeof(line), f) != NULL) {
+      if (strncmp(line, "0::", 3) == 0) { /* unified hierarchy */
+        line[strcspn(line, "\n")] = '\0';
+        snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", line + 3);
+        n = cgroup2_limit(path);
+        break;
+      }
+    }
+    fclose(f);
+  }
+  if (n == 0)
+    n = cgroup2_limit("/sys/fs/cgroup/cpu.max");
+  if (n == 0 && /* cgroup v1 */
+      read_line("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", buf, sizeof(buf)) &&
+      sscanf(buf, "%lld", &quota) == 1 && quota > 0 &&
+      read_line("/sys/fs/cgroup/cpu/cpu.cfs_period_us", buf, sizeof(buf)) &&
+      sscanf(buf, "%lld", &period) == 1 && period > 0)
+    n = (int)((quota + period - 1) / period);
+  return n;
+}
+
+/* CPUs available to the process: online, in its affinity mask, and
+   within its cgroup quota */
+static int get_cpu_count(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  cpu_set_t set;
+  int limit;
+  if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0 &&
+      CPU_COUNT(&set) < n)
+    n = CPU_COUNT(&set);
+  limit = cgroup_cpu_limit();
+  if (limit > 0 && limit < n)
+    n = limit;
+  return (n > 0) ? (int)n : 1;
+}
+#elif defined(_SC_NPROCESSORS_ONLN)
 static int get_cpu_count(void) {
   long n = sysconf(_SC_NPROCESSORS_ONLN);
   return (n > 0) ? (int)n : 1;
@@ -56,6 +154,664 @@ static int get_cpu_count(void) {
 #endif
 #endif
 
+/*
+** 'clock_now' gives seconds on the clock 'cond_waituntil' uses for its
+** deadline. 'cond_waituntil' waits on 'c' until it is signaled or the
+** deadline passes; returns 0 on timeout.
+*/
+#if defined(LUS_PLATFORM_WINDOWS)
+static double clock_now(void) {
+  return (double)GetTickCount64() / 1000.0;
+}
+
+static int cond_waituntil(lus_cond_t *c, lus_mutex_t *m, double deadline) {
+  double left = deadline - clock_now();
+  if (left <= 0)
+    return 0;
+  return SleepConditionVariableCS(c, m, (DWORD)(left * 1000.0) + 1) ||
+         GetLastError() != ERROR_TIMEOUT;
+}
+#else
+#include <time.h>
+static double clock_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts); /* the clock of pthread_cond_t */
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int cond_waituntil(lus_cond_t *c, lus_mutex_t *m, double deadline) {
+  struct timespec ts;
+  double sec = floor(deadline);
+  ts.tv_sec = (time_t)sec;
+  ts.tv_nsec = (long)((deadline - sec) * 1e9);
+  if (ts.tv_nsec >= 1000000000L)
+    ts.tv_nsec = 999999999L;
+  return pthread_cond_timedwait(c, m, &ts) != ETIMEDOUT;
+}
+#endif
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Shared Heaps
+** =======================================================
+*/
+
+/* Metatable name of proxies over shared tables */
+#define SHARED_METATABLE "worker.shared"
+
+/* Registry field holding each state's proxies, by table (weak values) */
+#define SHARED_CACHE "worker.sharedcache"
+
+/* Maximum table nesting accepted by 'worker.share' */
+#define SHARED_MAXDEPTH 200
+
+/* Tags of shared values */
+#define SV_NIL 0 /* also marks a free hash slot */
+#define SV_FALSE 1
+#define SV_TRUE 2
+#define SV_INT 3
+#define SV_NUM 4
+#define SV_STRING 5
+#define SV_TABLE 6
+
+typedef struct SharedStr {
+  size_t len;
+  unsigned hash;
+  char data[1]; /* 'len' bytes plus a terminating zero */
+} SharedStr;
+
+typedef struct SharedValue {
+  int tt;
+  union {
+    lua_Integer i;
+    lua_Number n;
+    SharedStr *s;
+    struct SharedTable *t;
+  } u;
+} SharedValue;
+
+typedef struct SharedNode {
+  SharedValue key;
+  SharedValue val;
+  unsigned hash;
+} SharedNode;
+
+/*
+** Frozen table: keys 1..asize in 'array', every other key in an
+** open-addressing hash part that is at most half full, so a probe
+** always ends at a free slot.
+*/
+typedef struct SharedTable {
+  SharedValue *array;
+  SharedNode *node; /* NULL if there is no hash part */
+  size_t asize;
+  size_t hmask; /* hash part size - 1 */
+} SharedTable;
+
+/*
+** Immutable table graph built by 'worker.share'. Everything, the heap
+** header included, lives in one arena that is freed when the last
+** reference goes: one per proxy in any state, one per external string
+** over a long string of the heap, and one per queued message.
+*/
+typedef struct SharedHeap {
+  lus_atomic_t refcount;
+  StandaloneArena *arena;
+} SharedHeap;
+
+/* Userdata standing for a shared table in one state */
+typedef struct SharedProxy {
+  SharedHeap *heap; /* NULL until the heap is allocated */
+  SharedTable *t;
+} SharedProxy;
+
+static void shared_incref(SharedHeap *h) {
+  lus_atomic_add(&h->refcount, 1);
+}
+
+static void shared_decref(SharedHeap *h) {
+  if (lus_atomic_addfetch(&h->refcount, -1) == 0)
+    luaA_freestandalone(h->arena); /* 'h' is in the arena */
+}
+
+/* Deallocation function of external strings over a shared heap */
+static void *sharedheap_falloc(void *ud, void *ptr, size_t osize,
+                               size_t nsize) {
+  (void)ptr;
+  (void)osize;
+  (void)nsize; /* always 0: called only to free */
+  shared_decref((SharedHeap *)ud);
+  return NULL;
+}
+
+/* Hashes do not depend on any state's seed: every state probes them */
+static unsigned shared_strhash(const char *s, size_t l) {
+  unsigned h = 2166136261u ^ (unsigned)l; /* FNV-1a */
+  for (size_t i = 0; i < l; i++)
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  return h;
+}
+
+static unsigned shared_inthash(lua_Unsigned u) {
+  u ^= u >> 31;
+  u *= (lua_Unsigned)0x7fb5d329728ea185u;
+  u ^= u >> 27;
+  return (unsigned)u;
+}
+
+static unsigned shared_hash(const SharedValue *k) {
+  switch (k->tt) {
+    case SV_INT: return shared_inthash(l_castS2U(k->u.i));
+    case SV_NUM: {
+      int e;
+      lua_Number m = l_mathop(frexp)(k->u.n, &e) * -cast_num(INT_MIN);
+      return shared_inthash(l_castS2U((lua_Integer)m) + cast_uint(e));
+    }
+    case SV_STRING: return k->u.s->hash;
+    case SV_TABLE: return shared_inthash((lua_Unsigned)(size_t)k->u.t);
+    default: return cast_uint(k->tt); /* booleans */
+  }
+}
+
+static const SharedNode *shared_findstr(const SharedTable *t, const char *s,
+                                        size_t len) {
+  unsigned h;
+  size_t i;
+  if (t->node == NULL)
+    return NULL;
+  h = shared_strhash(s, len);
+  for (i = h & t->hmask;; i = (i + 1) & t->hmask) {
+    const SharedNode *n = &t->node[i];
+    if (n->key.tt == SV_NIL)
+      return NULL;
+    if (n->hash == h && n->key.tt == SV_STRING && n->key.u.s->len == len &&
+        memcmp(n->key.u.s->data, s, len) == 0)
+      return n;
+  }
+}
+
+/* Find a key that is not a string */
+static const SharedNode *shared_findkey(const SharedTable *t,
+                                        const SharedValue *k) {
+  unsigned h;
+  size_t i;
+  if (t->node == NULL)
+    return NULL;
+  h = shared_hash(k);
+  for (i = h & t->hmask;; i = (i + 1) & t->hmask) {
+    const SharedNode *n = &t->node[i];
+    if (n->key.tt == SV_NIL)
+      return NULL;
+    if (n->hash == h && n->key.tt == k->tt) {
+      switch (k->tt) {
+        case SV_INT:
+          if (n->key.u.i == k->u.i)
+            return n;
+          break;
+        case SV_NUM:
+          if (luai_numeq(n->key.u.n, k->u.n))
+            return n;
+          break;
+        case SV_TABLE:
+          if (n->key.u.t == k->u.t)
+            return n;
+          break;
+        default: return n; /* booleans */
+      }
+    }
+  }
+}
+
+/*
+** Look up the key at stack index 'k' in 't'. Returns NULL if absent,
+** including for keys that cannot be in a shared table.
+*/
+static const SharedValue *shared_get(lua_State *L, const SharedTable *t,
+                                     int k) {
+  SharedValue key;
+  const SharedNode *n;
+  switch (lua_type(L, k)) {
+    case LUA_TSTRING: {
+      size_t len;
+      const char *s = lua_tolstring(L, k, &len);
+      n = shared_findstr(t, s, len);
+      return (n != NULL) ? &n->val : NULL;
+    }
+    case LUA_TNUMBER: {
+      lua_Integer i;
+      if (!lua_isinteger(L, k)) {
+        lua_Number f = lua_tonumber(L, k);
+        if (f != l_mathop(floor)(f) || !lua_numbertointeger(f, &i)) {
+          if (luai_numisnan(f))
+            return NULL;
+          key.tt = SV_NUM;
+          key.u.n = f;
+          break;
+        }
+      }
+      else
+        i = lua_tointeger(L, k);
+      if (l_castS2U(i) - 1u < t->asize)
+        return &t->array[i - 1];
+      key.tt = SV_INT;
+      key.u.i = i;
+      break;
+    }
+    case LUA_TBOOLEAN:
+      key.tt = lua_toboolean(L, k) ? SV_TRUE : SV_FALSE;
+      break;
+    case LUA_TUSERDATA: {
+      SharedProxy *p = (SharedProxy *)luaL_testudata(L, k, SHARED_METATABLE);
+      if (p == NULL)
+        return NULL;
+      key.tt = SV_TABLE;
+      key.u.t = p->t;
+      break;
+    }
+    default: return NULL;
+  }
+  n = shared_findkey(t, &key);
+  return (n != NULL) ? &n->val : NULL;
+}
+
+static int shared_index(lua_State *L);
+static int shared_newindex(lua_State *L);
+static int shared_len(lua_State *L);
+static int shared_pairs(lua_State *L);
+static int shared_gc(lua_State *L);
+static int shared_tostring(lua_State *L);
+
+static const luaL_Reg shared_meta[] = {
+    {"__index", shared_index}, {"__newindex", shared_newindex},
+    {"__len", shared_len},     {"__pairs", shared_pairs},
+    {"__gc", shared_gc},       {"__tostring", shared_tostring},
+    {NULL, NULL}};
+
+/*
+** Push the state's proxy cache, creating it and the proxy metatable on
+** first use.
+*/
+static void shared_pushcache(lua_State *L) {
+  if (lua_getfield(L, LUA_REGISTRYINDEX, SHARED_CACHE) == LUA_TTABLE)
+    return;
+  lua_pop(L, 1);
+  lua_newtable(L);
+  lua_createtable(L, 0, 1);
+  lua_pushliteral(L, "v");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, LUA_REGISTRYINDEX, SHARED_CACHE);
+  luaL_newmetatable(L, SHARED_METATABLE);
+  lua_pushvalue(L, -2);
+  lua_pushvalue(L, -2);
+  luaL_setfuncs(L, shared_meta, 2); /* upvalues: cache and metatable */
+  lua_pop(L, 1);
+}
+
+/*
+** Push the proxy of table 't' of heap 'h'. A state has at most one live
+** proxy per shared table, so shared tables compare and index as keys
+** like ordinary ones. 'cache' is the index of the proxy cache.
+*/
+static void shared_pushproxy(lua_State *L, SharedHeap *h, SharedTable *t,
+                             int cache) {
+  SharedProxy *p;
+  if (lua_rawgetp(L, cache, t) == LUA_TUSERDATA)
+    return;
+  lua_pop(L, 1);
+  p = (SharedProxy *)lua_newuserdatauv(L, sizeof(SharedProxy), 0);
+  p->heap = h;
+  p->t = t;
+  shared_incref(h);
+  luaL_setmetatable(L, SHARED_METATABLE);
+  lua_pushvalue(L, -1);
+  lua_rawsetp(L, cache, t);
+}
+
+static void shared_pushvalue(lua_State *L, SharedHeap *h,
+                             const SharedValue *v, int cache) {
+  switch (v->tt) {
+    case SV_FALSE: lua_pushboolean(L, 0); break;
+    case SV_TRUE: lua_pushboolean(L, 1); break;
+    case SV_INT: lua_pushinteger(L, v->u.i); break;
+    case SV_NUM: lua_pushnumber(L, v->u.n); break;
+    case SV_STRING: {
+      SharedStr *s = v->u.s;
+      if (s->len <= LUAI_MAXSHORTLEN) /* interned anyway */
+        lua_pushlstring(L, s->data, s->len);
+      else { /* point into the heap */
+        shared_incref(h);
+        lua_pushexternalstring(L, s->data, s->len, sharedheap_falloc, h);
+      }
+      break;
+    }
+    case SV_TABLE: shared_pushproxy(L, h, v->u.t, cache); break;
+    default: lua_pushnil(L); break;
+  }
+}
+
+/*
+** Check that the first argument of a metamethod is a proxy. Metamethods
+** hold the proxy metatable as their second upvalue, which is cheaper
+** than a registry lookup and still works once a reset state has lost
+** its registry entry while proxies wait to be finalized.
+*/
+static SharedProxy *check_sharedself(lua_State *L) {
+  SharedProxy *p = (SharedProxy *)lua_touserdata(L, 1);
+  if (p == NULL || !lua_getmetatable(L, 1) ||
+      !lua_rawequal(L, -1, lua_upvalueindex(2)))
+    luaL_typeerror(L, 1, SHARED_METATABLE);
+  lua_pop(L, 1);
+  return p;
+}
+
+static int shared_index(lua_State *L) {
+  SharedProxy *p = check_sharedself(L);
+  const SharedValue *v = shared_get(L, p->t, 2);
+  if (v == NULL)
+    lua_pushnil(L);
+  else
+    shared_pushvalue(L, p->heap, v, lua_upvalueindex(1));
+  return 1;
+}
+
+static int shared_newindex(lua_State *L) {
+  return luaL_error(L, "attempt to modify a shared table");
+}
+
+static int shared_len(lua_State *L) {
+  SharedProxy *p = check_sharedself(L);
+  lua_pushinteger(L, (lua_Integer)p->t->asize);
+  return 1;
+}
+
+/* Traversal order: the array part, then the hash part by slot */
+static int shared_next(lua_State *L) {
+  SharedProxy *p = check_sharedself(L);
+  const SharedTable *t = p->t;
+  size_t i = 0; /* next position to visit */
+  lua_settop(L, 2);
+  if (!lua_isnil(L, 2)) {
+    const SharedValue *v = shared_get(L, t, 2);
+    if (v == NULL)
+      return luaL_error(L, "invalid key to 'next'");
+    if (v >= t->array && v < t->array + t->asize)
+      i = cast_sizet(v - t->array) + 1;
+    else {
+      const SharedNode *n =
+          (const SharedNode *)((const char *)v - offsetof(SharedNode, val));
+      i = t->asize + cast_sizet(n - t->node) + 1;
+    }
+  }
+  if (i < t->asize) {
+    lua_pushinteger(L, (lua_Integer)i + 1);
+    shared_pushvalue(L, p->heap, &t->array[i], lua_upvalueindex(1));
+    return 2;
+  }
+  if (t->node != NULL) {
+    for (i -= t->asize; i <= t->hmask; i++) {
+      const SharedNode *n = &t->node[i];
+      if (n->key.tt != SV_NIL) {
+        shared_pushvalue(L, p->heap, &n->key, lua_upvalueindex(1));
+        shared_pushvalue(L, p->heap, &n->val, lua_upvalueindex(1));
+        return 2;
+      }
+    }
+  }
+  lua_pushnil(L);
+  return 1;
+}
+
+static int shared_pairs(lua_State *L) {
+  check_sharedself(L);
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_pushvalue(L, lua_upvalueindex(2));
+  lua_pushcclosure(L, shared_next, 2);
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
+  return 3;
+}
+
+static int shared_gc(lua_State *L) {
+  SharedProxy *p = check_sharedself(L);
+  if (p->heap != NULL)
+    shared_decref(p->heap);
+  return 0;
+}
+
+static int shared_tostring(lua_State *L) {
+  SharedProxy *p = check_sharedself(L);
+  lua_pushfstring(L, "shared table: %p", (void *)p->t);
+  return 1;
+}
+
+/* State of a 'worker.share' call */
+typedef struct ShareState {
+  SharedHeap *heap;
+  int seen; /* stack index: table -> its SharedTable (light userdata) */
+  int strs; /* stack index: string -> its SharedStr (light userdata) */
+} ShareState;
+
+static void *share_alloc(lua_State *L, ShareState *S, size_t size) {
+  void *p = luaA_allocstandalone(S->heap->arena, size);
+  if (p == NULL)
+    luaL_error(L, "out of memory");
+  return p;
+}
+
+/* Strings are copied once per heap, however often they appear */
+static SharedStr *share_string(lua_State *L, ShareState *S, int idx) {
+  SharedStr *ss;
+  const char *s;
+  size_t len;
+  lua_pushvalue(L, idx);
+  lua_rawget(L, S->strs);
+  ss = (SharedStr *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  if (ss != NULL)
+    return ss;
+  s = lua_tolstring(L, idx, &len);
+  ss = (SharedStr *)share_alloc(L, S, offsetof(SharedStr, data) + len + 1);
+  ss->len = len;
+  ss->hash = shared_strhash(s, len);
+  memcpy(ss->data, s, len);
+  ss->data[len] = '\0';
+  lua_pushvalue(L, idx);
+  lua_pushlightuserdata(L, ss);
+  lua_rawset(L, S->strs);
+  return ss;
+}
+
+static SharedTable *share_table(lua_State *L, ShareState *S, int idx,
+                                int depth);
+
+static void share_value(lua_State *L, ShareState *S, int idx, SharedValue *v,
+                        int depth) {
+  switch (lua_type(L, idx)) {
+    case LUA_TBOOLEAN:
+      v->tt = lua_toboolean(L, idx) ? SV_TRUE : SV_FALSE;
+      break;
+    case LUA_TNUMBER:
+      if (lua_isinteger(L, idx)) {
+        v->tt = SV_INT;
+        v->u.i = lua_tointeger(L, idx);
+      }
+      else {
+        v->tt = SV_NUM;
+        v->u.n = lua_tonumber(L, idx);
+      }
+      break;
+    case LUA_TSTRING:
+      v->tt = SV_STRING;
+      v->u.s = share_string(L, S, idx);
+      break;
+    case LUA_TTABLE:
+      v->tt = SV_TABLE;
+      v->u.t = share_table(L, S, idx, depth + 1);
+      break;
+    default:
+      luaL_error(L, "cannot share a %s value", luaL_typename(L, idx));
+  }
+}
+
+static void shared_insert(SharedTable *t, const SharedValue *k,
+                          const SharedValue *v) {
+  unsigned h = shared_hash(k);
+  size_t i = h & t->hmask;
+  while (t->node[i].key.tt != SV_NIL) /* keys are distinct */
+    i = (i + 1) & t->hmask;
+  t->node[i].key = *k;
+  t->node[i].val = *v;
+  t->node[i].hash = h;
+}
+
+/* Is the key at 'idx' one of 1..n? */
+static int share_inarray(lua_State *L, int idx, size_t n) {
+  return lua_isinteger(L, idx) &&
+         l_castS2U(lua_tointeger(L, idx)) - 1u < (lua_Unsigned)n;
+}
+
+/*
+** Freeze the table at 'idx'. Tables reached twice (cycles included) are
+** frozen once; metatables are not shared.
+*/
+static SharedTable *share_table(lua_State *L, ShareState *S, int idx,
+                                int depth) {
+  SharedTable *t;
+  size_t n, nh = 0, i;
+  if (depth > SHARED_MAXDEPTH)
+    luaL_error(L, "table nesting too deep to share");
+  luaL_checkstack(L, 4, "too many nested tables");
+  idx = lua_absindex(L, idx);
+  lua_pushvalue(L, idx);
+  lua_rawget(L, S->seen);
+  t = (SharedTable *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  if (t != NULL)
+    return t;
+  t = luaA_standalone_obj(S->heap->arena, SharedTable);
+  if (t == NULL)
+    luaL_error(L, "out of memory");
+  lua_pushvalue(L, idx);
+  lua_pushlightuserdata(L, t);
+  lua_rawset(L, S->seen);
+  for (n = 0; lua_rawgeti(L, idx, (lua_Integer)n + 1) != LUA_TNIL; n++)
+    lua_pop(L, 1);
+  lua_pop(L, 1);
+  lua_pushnil(L);
+  while (lua_next(L, idx)) {
+    lua_pop(L, 1);
+    if (!share_inarray(L, -1, n))
+      nh++;
+  }
+  t->asize = n;
+  t->array = NULL;
+  t->node = NULL;
+  t->hmask = 0;
+  if (n > 0)
+    t->array = (SharedValue *)share_alloc(L, S, n * sizeof(SharedValue));
+  if (nh > 0) {
+    size_t size = 4;
+    while (size < nh * 2)
+      size *= 2;
+    t->node = (SharedNode *)share_alloc(L, S, size * sizeof(SharedNode));
+    memset(t->node, 0, size * sizeof(SharedNode)); /* all SV_NIL */
+    t->hmask = size - 1;
+  }
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, idx, (lua_Integer)i + 1);
+    share_value(L, S, -1, &t->array[i], depth);
+    lua_pop(L, 1);
+  }
+  lua_pushnil(L);
+  while (lua_next(L, idx)) {
+    if (!share_inarray(L, -2, n)) {
+      SharedValue k, v;
+      share_value(L, S, -2, &k, depth);
+      share_value(L, S, -1, &v, depth);
+      shared_insert(t, &k, &v);
+    }
+    lua_pop(L, 1);
+  }
+  return t;
+}
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Message Payloads
+** =======================================================
+*/
+
+/* Kinds of out-of-band payloads */
+#define MSG_VECTOR 0
+#define MSG_STRING 1
+#define MSG_SHARED 2
+#define MSG_CHANNEL 3
+#define MSG_SHAREDVEC 4
+
+static void chan_incref(Channel *c);
+static void chan_decref(Channel *c);
+
+/*
+** Long string shared by several states. Each state holds it through an
+** external string whose deallocation function drops one reference; a
+** queued message holds one reference too.
+*/
+typedef struct SharedString {
+  lus_atomic_t refcount;
+  size_t len;
+  char data[1]; /* 'len' bytes plus a terminating zero */
+} SharedString;
+
+static void sharedstr_decref(SharedString *ss) {
+  if (lus_atomic_addfetch(&ss->refcount, -1) == 0)
+    free(ss);
+}
+
+/* Deallocation function of external strings over a SharedString */
+static void *sharedstr_falloc(void *ud, void *ptr, size_t osize,
+                              size_t nsize) {
+  (void)ptr;
+  (void)osize;
+  (void)nsize; /* always 0: called only to free */
+  sharedstr_decref((SharedString *)ud);
+  return NULL;
+}
+
+/*
+** Vector buffers move between states as they are, so both ends must use
+** the default allocator; otherwise the receiver copies the buffer.
+*/
+static int default_alloc(lua_State *L) {
+  void *ud;
+  return lua_getallocf(L, &ud) == luaL_alloc && ud == NULL;
+}
+
+/* Release the payloads of a message that nobody adopted */
+static void msg_release(MessageNode *m) {
+  for (int i = 0; i < m->nattach; i++) {
+    MsgAttach *a = &m->attach[i];
+    if (a->taken || a->ptr == NULL)
+      continue;
+    if (a->kind == MSG_VECTOR)
+      luaL_alloc(NULL, a->ptr, a->alloc, 0);
+    else if (a->kind == MSG_STRING)
+      sharedstr_decref((SharedString *)a->ptr);
+    else if (a->kind == MSG_SHARED)
+      shared_decref((SharedHeap *)a->ptr);
+    else if (a->kind == MSG_SHAREDVEC)
+      luaV_decrefshared((VecShared *)a->ptr);
+    else
+      chan_decref((Channel *)a->ptr);
+  }
+  luaA_freestandalone(m->arena);
+}
+
 /* }====================================================== */
 
 /*
@@ -68,16 +824,15 @@ static void msgqueue_init(MessageQueue *q) {
   q->head = NULL;
   q->tail = NULL;
   q->count = 0;
+  q->total = 0;
 }
 
-static int msgqueue_push(MessageQueue *q, StandaloneArena *arena, char *data,
-                         size_t size) {
+/* Append a copy of message 'm'; ownership of its contents moves too */
+static int msgqueue_push(MessageQueue *q, const MessageNode *m) {
   MessageNode *node = (MessageNode *)malloc(sizeof(MessageNode));
   if (node == NULL)
     return 0;
-  node->arena = arena;
-  node->data = data;
-  node->size = size;
+  *node = *m;
   node->next = NULL;
   if (q->tail) {
     q->tail->next = node;
@@ -87,11 +842,11 @@ static int msgqueue_push(MessageQueue *q, StandaloneArena *arena, char *data,
   }
   q->tail = node;
   q->count++;
+  q->total++;
   return 1;
 }
 
-static int msgqueue_pop(MessageQueue *q, StandaloneArena **arena, char **data,
-                        size_t *size) {
+static int msgqueue_pop(MessageQueue *q, MessageNode *m) {
   MessageNode *node = q->head;
   if (!node)
     return 0;
@@ -99,19 +854,16 @@ static int msgqueue_pop(MessageQueue *q, StandaloneArena **arena, char **data,
   if (!q->head)
     q->tail = NULL;
   q->count--;
-  *arena = node->arena;
-  *data = node->data;
-  *size = node->size;
+  *m = *node;
+  m->next = NULL;
   free(node);
   return 1;
 }
 
 static void msgqueue_clear(MessageQueue *q) {
-  StandaloneArena *arena;
-  char *data;
-  size_t size;
-  while (msgqueue_pop(q, &arena, &data, &size)) {
-    luaA_freestandalone(arena);
+  MessageNode m;
+  while (msgqueue_pop(q, &m)) {
+    msg_release(&m);
   }
 }
 
@@ -123,23 +875,70 @@ static void msgqueue_clear(MessageQueue *q) {
 ** =======================================================
 */
 
+/*
+** Wire format (version 2). An encoded value is SER_VERSION followed by
+** one value. Integers and lengths are varints (7 bits per byte, low
+** bits first; integers zigzag-encoded so small negatives stay short).
+** A table is its array part 1..n as bare values, then its other
+** key/value pairs up to SER_END, in a single pass over the table; the
+** size of its hash part comes first, so the receiver can presize it.
+** Inside a table or enum, every string, table, enum and inline vector
+** is numbered in the order it is first written, and written again as a
+** SER_REF to that number, so repeated keys cost a few bytes and shared
+** subtables and cycles survive the trip. Such a value ends with the
+** count of numbered values (4 bytes, little-endian).
+*/
+#define SER_VERSION 2
+
 /* Serialization format tags */
 #define SER_NIL 0
-#define SER_BOOL 1
-#define SER_INT 2
-#define SER_NUM 3
-#define SER_STRING 4
-#define SER_TABLE 5
+#define SER_FALSE 1
+#define SER_TRUE 2
+#define SER_INT 3        /* zigzag varint */
+#define SER_NUM 4        /* lua_Number as is */
+#define SER_STRING 5     /* varint length, bytes */
+#define SER_REF 6        /* varint number of a value written before */
+#define SER_TABLE 7      /* varint n, varint h, values 1..n, pairs, SER_END */
+#define SER_END 8
+#define SER_ENUM 9       /* SER_ENUMROOT or SER_REF, varint member index */
+#define SER_ENUMROOT 10  /* varint n, n member names */
+#define SER_VECTOR 11    /* attachment index of a moved vector buffer */
+#define SER_SHAREDSTR 12 /* attachment index of a shared long string */
+#define SER_SHARED 13    /* attachment index of a shared heap, table address */
+#define SER_VECBYTES 14  /* varint length, bytes of a copied vector */
+#define SER_CHANNEL 15   /* attachment index of a channel */
+#define SER_SHAREDVEC 16 /* attachment index of a shared vector buffer */
+
+/* Nesting limit for tables, both ways */
+#define SER_MAXDEPTH 100
+
+/* Entry of the table from objects to their numbers (p == NULL: empty) */
+typedef struct SerRef {
+  const void *p;
+  unsigned int n;
+} SerRef;
 
 /*
 ** Buffer for serialization - uses standalone arena for cross-thread safety.
 ** Arena provides backing storage; we maintain a contiguous buffer within it.
+** Vectors and long strings are recorded as attachments and only taken
+** from the sender by 'serbuf_commit', once the whole value serialized.
+** A flat buffer has no attachments: vectors and long strings are copied
+** into it.
 */
 typedef struct {
   StandaloneArena *arena; /* arena for data storage */
   char *data;             /* contiguous buffer in arena */
   size_t size;            /* bytes written */
   size_t cap;             /* buffer capacity */
+  MsgAttach *attach;      /* attachments (in arena) */
+  int nattach;
+  int attachcap;
+  int flat;               /* 1 = copy everything into 'data' */
+  int seen;      /* stack index of the userdata holding 'refs' (0 = none) */
+  SerRef *refs;  /* open-addressing table, at most half full */
+  unsigned int refsize;
+  unsigned int nrefs;
 } SerBuffer;
 
 /* Default arena block size for serialization (4KB) */
@@ -147,12 +946,20 @@ typedef struct {
 /* Default initial buffer size */
 #define SERBUF_INIT_SIZE 256
 
-static void serbuf_init(SerBuffer *b) {
+static void serbuf_init(SerBuffer *b, int flat) {
   b->arena = luaA_newstandalone(SERBUF_ARENA_SIZE);
   /* Pre-allocate initial buffer from arena */
   b->data = (char *)luaA_allocstandalone(b->arena, SERBUF_INIT_SIZE);
   b->size = 0;
   b->cap = SERBUF_INIT_SIZE;
+  b->attach = NULL;
+  b->nattach = 0;
+  b->attachcap = 0;
+  b->flat = flat;
+  b->seen = 0;
+  b->refs = NULL;
+  b->refsize = 0;
+  b->nrefs = 0;
 }
 
 static void serbuf_free(SerBuffer *b) {
@@ -162,6 +969,8 @@ static void serbuf_free(SerBuffer *b) {
     b->data = NULL;
     b->size = 0;
     b->cap = 0;
+    b->attach = NULL;
+    b->nattach = 0;
   }
 }
 
@@ -194,76 +1003,440 @@ static void serbuf_write(lua_State *L, SerBuffer *b, const void *p, size_t n) {
 }
 
 static void serbuf_write_byte(lua_State *L, SerBuffer *b, unsigned char c) {
-  serbuf_write(L, b, &c, 1);
+  if (b->size == b->cap && !serbuf_ensure(b, 1))
+    luaL_error(L, "out of memory in worker serialization");
+  b->data[b->size++] = (char)c;
 }
 
-/* Forward declaration for recursive serialization */
-static int serialize_value(lua_State *L, int idx, SerBuffer *b, int depth);
-
-static int serialize_table(lua_State *L, int idx, SerBuffer *b, int depth) {
-  if (depth > 100) {
-    return luaL_error(L, "table nesting too deep for serialization");
+static void serbuf_write_varint(lua_State *L, SerBuffer *b, lua_Unsigned v) {
+  unsigned char *p;
+  if (!serbuf_ensure(b, 10)) /* 64 bits take at most 10 bytes */
+    luaL_error(L, "out of memory in worker serialization");
+  p = (unsigned char *)b->data + b->size;
+  while (v >= 0x80) {
+    *p++ = (unsigned char)(v | 0x80);
+    v >>= 7;
   }
-  idx = lua_absindex(L, idx);
-  serbuf_write_byte(L, b, SER_TABLE);
+  *p++ = (unsigned char)v;
+  b->size = (size_t)(p - (unsigned char *)b->data);
+}
 
-  /* Count entries first */
-  lua_Integer count = 0;
-  lua_pushnil(L);
-  while (lua_next(L, idx)) {
-    count++;
-    lua_pop(L, 1);
-  }
-  serbuf_write(L, b, &count, sizeof(count));
+/* Write a tag followed by a varint */
+static void serbuf_write_tagged(lua_State *L, SerBuffer *b, unsigned char tag,
+                                lua_Unsigned v) {
+  serbuf_write_byte(L, b, tag);
+  serbuf_write_varint(L, b, v);
+}
 
-  /* Serialize each key-value pair */
-  lua_pushnil(L);
-  while (lua_next(L, idx)) {
-    /* key at -2, value at -1 */
-    if (!serialize_value(L, -2, b, depth + 1))
-      return 0;
-    if (!serialize_value(L, -1, b, depth + 1))
-      return 0;
-    lua_pop(L, 1);
+static unsigned int serref_hash(const void *p, unsigned int size) {
+  /* Fibonacci hashing: objects are often laid out at a fixed stride */
+  unsigned long long h = (unsigned long long)(size_t)p;
+  return (unsigned int)((h * 0x9E3779B97F4A7C15ull) >> 32) & (size - 1);
+}
+
+/* Number of object 'p' if it was written already, 0 otherwise */
+static unsigned int serbuf_findref(SerBuffer *b, const void *p) {
+  unsigned int i;
+  if (b->refsize == 0)
+    return 0;
+  for (i = serref_hash(p, b->refsize); b->refs[i].p != NULL;
+       i = (i + 1) & (b->refsize - 1)) {
+    if (b->refs[i].p == p)
+      return b->refs[i].n;
   }
-  return 1;
+  return 0;
 }
 
-static int serialize_value(lua_State *L, int idx, SerBuffer *b, int depth) {
-  int t = lua_type(L, idx);
-  switch (t) {
-    case LUA_TNIL: serbuf_write_byte(L, b, SER_NIL); break;
-    case LUA_TBOOLEAN: {
-      serbuf_write_byte(L, b, SER_BOOL);
-      unsigned char v = lua_toboolean(L, idx) ? 1 : 0;
-      serbuf_write_byte(L, b, v);
-      break;
+/*
+** Give object 'p' the next number. The table lives in a userdata at
+** stack index 'seen', so that an error during serialization frees it.
+*/
+static void serbuf_addref(lua_State *L, SerBuffer *b, const void *p) {
+  unsigned int i;
+  if (b->seen == 0)
+    return;
+  if ((b->nrefs + 1) * 2 > b->refsize) { /* grow */
+    unsigned int newsize = (b->refsize == 0) ? 64 : b->refsize * 2;
+    SerRef *nr;
+    if (newsize > UINT_MAX / 2 / sizeof(SerRef))
+      luaL_error(L, "too many values in worker message");
+    nr = (SerRef *)lua_newuserdatauv(L, newsize * sizeof(SerRef), 0);
+    memset(nr, 0, newsize * sizeof(SerRef));
+    for (i = 0; i < b->refsize; i++) {
+      if (b->refs[i].p != NULL) {
+        unsigned int j = serref_hash(b->refs[i].p, newsize);
+        while (nr[j].p != NULL)
+          j = (j + 1) & (newsize - 1);
+        nr[j] = b->refs[i];
+      }
+    }
+    lua_replace(L, b->seen);
+    b->refs = nr;
+    b->refsize = newsize;
+  }
+  i = serref_hash(p, b->refsize);
+  while (b->refs[i].p != NULL)
+    i = (i + 1) & (b->refsize - 1);
+  b->refs[i].p = p;
+  b->refs[i].n = ++b->nrefs;
+}
+
+/*
+** Record 'obj' as an attachment and write its index. A shared heap,
+** channel or shared vector buffer that appears several times in a value
+** is attached once.
+*/
+static void serbuf_attach(lua_State *L, SerBuffer *b, int kind, void *obj) {
+  static const unsigned char tags[] = {SER_VECTOR, SER_SHAREDSTR, SER_SHARED,
+                                       SER_CHANNEL, SER_SHAREDVEC};
+  int i;
+  if (kind != MSG_VECTOR && kind != MSG_STRING) {
+    for (i = 0; i < b->nattach; i++) {
+      if (b->attach[i].obj == obj)
+        goto found;
+    }
+  }
+  if (b->nattach == b->attachcap) {
+    int newcap = (b->attachcap == 0) ? 4 : b->attachcap * 2;
+    MsgAttach *na = luaA_standalone_array(b->arena, newcap, MsgAttach);
+    if (na == NULL)
+      luaL_error(L, "out of memory in worker serialization");
+    if (b->nattach > 0)
+      memcpy(na, b->attach, b->nattach * sizeof(MsgAttach));
+    b->attach = na; /* old array stays in arena */
+    b->attachcap = newcap;
+  }
+  i = b->nattach++;
+  memset(&b->attach[i], 0, sizeof(MsgAttach));
+  b->attach[i].kind = kind;
+  b->attach[i].obj = obj;
+found:
+  serbuf_write_tagged(L, b, tags[kind], (lua_Unsigned)i);
+}
+
+/*
+** Take the attachments from the sender: move vector buffers out of
+** their vectors and put long strings in shared buffers (an external
+** string already over one just gains a reference). Raises no errors;
+** returns 0 if memory ran out, with every attachment taken so far given
+** back to the sender.
+*/
+static int serbuf_commit(lua_State *L, SerBuffer *b) {
+  int movevec = default_alloc(L);
+  int i;
+  for (i = 0; i < b->nattach; i++) {
+    MsgAttach *a = &b->attach[i];
+    if (a->kind == MSG_VECTOR) {
+      Vector *v = (Vector *)a->obj;
+      if (movevec)
+        a->ptr = luaV_detach(L, v, &a->len, &a->alloc);
+      else { /* copy into a default-allocator block */
+        a->len = a->alloc = v->len;
+        a->ptr = (v->len > 0) ? luaL_alloc(NULL, NULL, 0, v->len) : NULL;
+        if (v->len > 0 && a->ptr == NULL)
+          break;
+        if (v->len > 0)
+          memcpy(a->ptr, v->data, v->len);
+      }
+    }
+    else if (a->kind == MSG_SHARED) {
+      a->ptr = a->obj;
+      shared_incref((SharedHeap *)a->ptr);
+    }
+    else if (a->kind == MSG_CHANNEL) {
+      a->ptr = a->obj;
+      chan_incref((Channel *)a->ptr);
+    }
+    else if (a->kind == MSG_SHAREDVEC) {
+      a->ptr = a->obj;
+      luaV_increfshared((VecShared *)a->ptr);
+    }
+    else {
+      TString *ts = (TString *)a->obj;
+      SharedString *ss;
+      if (ts->shrlen == LSTRMEM && ts->falloc == sharedstr_falloc) {
+        ss = (SharedString *)ts->ud;
+        lus_atomic_add(&ss->refcount, 1);
+      }
+      else {
+        size_t len = tsslen(ts);
+        ss = (SharedString *)malloc(offsetof(SharedString, data) + len + 1);
+        if (ss == NULL)
+          break;
+        lus_atomic_store(&ss->refcount, 1);
+        ss->len = len;
+        memcpy(ss->data, getstr(ts), len);
+        ss->data[len] = '\0';
+      }
+      a->ptr = ss;
+    }
+  }
+  if (i < b->nattach) { /* out of memory: undo */
+    while (i-- > 0) {
+      MsgAttach *a = &b->attach[i];
+      if (a->kind == MSG_STRING)
+        sharedstr_decref((SharedString *)a->ptr);
+      else if (a->kind == MSG_SHARED)
+        shared_decref((SharedHeap *)a->ptr);
+      else if (a->kind == MSG_CHANNEL)
+        chan_decref((Channel *)a->ptr);
+      else if (a->kind == MSG_SHAREDVEC)
+        luaV_decrefshared((VecShared *)a->ptr);
+      else if (movevec) { /* give the buffer back */
+        Vector *v = (Vector *)a->obj;
+        v->data = (char *)a->ptr;
+        v->len = a->len;
+        v->alloc = a->alloc;
+        G(L)->GCdebt -= cast(l_mem, a->alloc);
+      }
+      else if (a->ptr != NULL)
+        luaL_alloc(NULL, a->ptr, a->alloc, 0);
+    }
+    return 0;
+  }
+  for (i = 0; i < b->nattach; i++)
+    b->attach[i].obj = NULL; /* the sender's objects are no longer needed */
+  return 1;
+}
+
+/* Value at (valid, non-pseudo) stack index 'idx' */
+#define ser_value(L, idx) s2v((L)->ci->func.p + lua_absindex(L, idx))
+
+static void serialize_string(lua_State *L, SerBuffer *b, TString *ts) {
+  size_t len = tsslen(ts);
+  unsigned int ref = serbuf_findref(b, ts);
+  if (ref != 0) {
+    serbuf_write_tagged(L, b, SER_REF, ref);
+    return;
+  }
+  serbuf_addref(L, b, ts);
+  if (len >= LUS_WORKER_SHAREDSTR && !b->flat) {
+    serbuf_attach(L, b, MSG_STRING, ts);
+    return;
+  }
+  serbuf_write_tagged(L, b, SER_STRING, len);
+  serbuf_write(L, b, getstr(ts), len);
+}
+
+static void serialize_enum(lua_State *L, SerBuffer *b, Enum *e) {
+  EnumRoot *root = e->root;
+  unsigned int ref = serbuf_findref(b, root);
+  serbuf_write_byte(L, b, SER_ENUM);
+  if (ref != 0)
+    serbuf_write_tagged(L, b, SER_REF, ref);
+  else {
+    serbuf_addref(L, b, root);
+    serbuf_write_tagged(L, b, SER_ENUMROOT, (lua_Unsigned)root->size);
+    for (int i = 0; i < root->size; i++)
+      serialize_string(L, b, root->names[i]);
+  }
+  serbuf_write_varint(L, b, (lua_Unsigned)e->idx);
+}
+
+static void serialize_vector(lua_State *L, SerBuffer *b, Vector *v) {
+  unsigned int ref = serbuf_findref(b, v);
+  if (ref != 0) {
+    serbuf_write_tagged(L, b, SER_REF, ref);
+    return;
+  }
+  serbuf_addref(L, b, v);
+  if (luaV_isshared(v)) { /* goes by reference */
+    if (b->flat)
+      luaL_error(L, "cannot serialize a shared vector outside messages");
+    serbuf_attach(L, b, MSG_SHAREDVEC, v->shared);
+    return;
+  }
+  if (!b->flat) {
+    serbuf_attach(L, b, MSG_VECTOR, v);
+    return;
+  }
+  serbuf_write_tagged(L, b, SER_VECBYTES, v->len);
+  serbuf_write(L, b, v->data, v->len);
+}
+
+/* Forward declaration for recursive serialization */
+static void serialize_value(lua_State *L, int idx, SerBuffer *b, int depth);
+
+static void serialize_table(lua_State *L, int idx, SerBuffer *b, int depth) {
+  const void *p = lua_topointer(L, idx);
+  unsigned int ref = serbuf_findref(b, p);
+  lua_Unsigned n;
+  if (ref != 0) { /* shared subtable or cycle */
+    serbuf_write_tagged(L, b, SER_REF, ref);
+    return;
+  }
+  if (depth > SER_MAXDEPTH)
+    luaL_error(L, "table nesting too deep for serialization");
+  luaL_checkstack(L, 3, "serialize");
+  idx = lua_absindex(L, idx);
+  serbuf_addref(L, b, p);
+  n = (lua_Unsigned)lua_rawlen(L, idx);
+  serbuf_write_tagged(L, b, SER_TABLE, n);
+  serbuf_write_varint(L, b, allocsizenode(hvalue(ser_value(L, idx))));
+  for (lua_Unsigned i = 1; i <= n; i++) {
+    lua_rawgeti(L, idx, (lua_Integer)i);
+    serialize_value(L, -1, b, depth + 1);
+    lua_pop(L, 1);
+  }
+  lua_pushnil(L);
+  while (lua_next(L, idx)) {
+    /* key at -2, value at -1; keys 1..n were written above */
+    if (!lua_isinteger(L, -2) ||
+        l_castS2U(lua_tointeger(L, -2)) - 1u >= n) {
+      serialize_value(L, -2, b, depth + 1);
+      serialize_value(L, -1, b, depth + 1);
     }
+    lua_pop(L, 1);
+  }
+  serbuf_write_byte(L, b, SER_END);
+}
+
+/* Append the value at 'idx' to 'b'; raises an error if it cannot be sent */
+static void serialize_value(lua_State *L, int idx, SerBuffer *b, int depth) {
+  int t = lua_type(L, idx);
+  switch (t) {
+    case LUA_TNIL: serbuf_write_byte(L, b, SER_NIL); break;
+    case LUA_TBOOLEAN:
+      serbuf_write_byte(L, b, lua_toboolean(L, idx) ? SER_TRUE : SER_FALSE);
+      break;
     case LUA_TNUMBER:
       if (lua_isinteger(L, idx)) {
-        serbuf_write_byte(L, b, SER_INT);
-        lua_Integer i = lua_tointeger(L, idx);
-        serbuf_write(L, b, &i, sizeof(i));
+        lua_Unsigned u = l_castS2U(lua_tointeger(L, idx));
+        serbuf_write_tagged(L, b, SER_INT, (u & 0x8000000000000000u)
+                                               ? ~(u << 1) : (u << 1));
       }
       else {
-        serbuf_write_byte(L, b, SER_NUM);
         lua_Number n = lua_tonumber(L, idx);
+        serbuf_write_byte(L, b, SER_NUM);
         serbuf_write(L, b, &n, sizeof(n));
       }
       break;
-    case LUA_TSTRING: {
-      size_t len;
-      const char *s = lua_tolstring(L, idx, &len);
-      serbuf_write_byte(L, b, SER_STRING);
-      serbuf_write(L, b, &len, sizeof(len));
-      serbuf_write(L, b, s, len);
+    case LUA_TSTRING: serialize_string(L, b, tsvalue(ser_value(L, idx))); break;
+    case LUA_TTABLE: serialize_table(L, idx, b, depth); break;
+    case LUA_TENUM: serialize_enum(L, b, enumvalue(ser_value(L, idx))); break;
+    case LUA_TVECTOR: serialize_vector(L, b, vecvalue(ser_value(L, idx))); break;
+    case LUA_TUSERDATA: {
+      SharedProxy *p = (SharedProxy *)luaL_testudata(L, idx, SHARED_METATABLE);
+      Channel **pc;
+      if (p != NULL) {
+        if (b->flat)
+          luaL_error(L, "cannot serialize a shared table outside messages");
+        serbuf_attach(L, b, MSG_SHARED, p->heap);
+        serbuf_write(L, b, &p->t, sizeof(p->t));
+        break;
+      }
+      pc = (Channel **)luaL_testudata(L, idx, CHANNEL_METATABLE);
+      if (pc == NULL || *pc == NULL)
+        luaL_error(L, "cannot serialize userdata to worker");
+      else if (b->flat)
+        luaL_error(L, "cannot serialize a channel outside messages");
+      serbuf_attach(L, b, MSG_CHANNEL, *pc);
       break;
     }
-    case LUA_TTABLE: return serialize_table(L, idx, b, depth);
     default:
-      return luaL_error(L, "cannot serialize %s to worker", lua_typename(L, t));
+      luaL_error(L, "cannot serialize %s to worker", lua_typename(L, t));
   }
-  return 1;
+}
+
+/*
+** Encode the value at 'idx' into 'b', which the caller initialized.
+** Values are only numbered when there can be more than one of them.
+*/
+static void serialize_root(lua_State *L, int idx, SerBuffer *b) {
+  int t = lua_type(L, idx);
+  idx = lua_absindex(L, idx);
+  serbuf_write_byte(L, b, SER_VERSION);
+  if (t == LUA_TTABLE || t == LUA_TENUM) {
+    lua_pushnil(L); /* slot for the table of numbered values */
+    b->seen = lua_gettop(L);
+  }
+  serialize_value(L, idx, b, 0);
+  if (b->seen != 0) {
+    unsigned char count[4];
+    for (int i = 0; i < 4; i++)
+      count[i] = (unsigned char)(b->nrefs >> (8 * i));
+    serbuf_write(L, b, count, sizeof(count));
+    lua_remove(L, b->seen);
+    b->seen = 0;
+    b->refs = NULL;
+    b->refsize = 0;
+  }
+}
+
+static int serialize_aux(lua_State *L) {
+  serialize_root(L, 1, (SerBuffer *)lua_touserdata(L, 2));
+  return 0;
+}
+
+/*
+** 'serialize_root' in protected mode, so that the buffer is freed if
+** the value cannot be serialized; the error is then raised again.
+*/
+static void serialize_protected(lua_State *L, int idx, SerBuffer *b) {
+  idx = lua_absindex(L, idx);
+  lua_pushcfunction(L, serialize_aux);
+  lua_pushvalue(L, idx);
+  lua_pushlightuserdata(L, b);
+  if (lua_pcall(L, 2, 0, 0) != LUA_OK) {
+    serbuf_free(b);
+    lua_error(L);
+  }
+}
+
+/*
+** Serialize the value at 'idx' into a message, taking its vectors and
+** long strings from L. Raises an error if the value cannot be sent.
+*/
+static WorkerCounters *my_counters(void);
+
+/*
+** Reading the clock costs about as much as encoding a small message, so
+** only one message in LUS_WORKER_STATSAMPLE is timed, and its time
+** counts for all of them.
+*/
+static l_threadlocal unsigned int t_sample = 0;
+
+#define sample_start() \
+  ((t_sample++ % LUS_WORKER_STATSAMPLE == 0) ? clock_now() : -1.0)
+
+static void sample_end(lus_atomic_t *total, double t0) {
+  if (t0 >= 0)
+    lus_atomic_add(total, (long long)((clock_now() - t0) * 1e9 *
+                                      LUS_WORKER_STATSAMPLE));
+}
+
+/* Size of a message: its bytes plus those of its vectors and strings */
+static size_t msg_bytes(const SerBuffer *b) {
+  size_t n = b->size;
+  for (int i = 0; i < b->nattach; i++) {
+    const MsgAttach *a = &b->attach[i];
+    if (a->kind == MSG_VECTOR)
+      n += a->len;
+    else if (a->kind == MSG_STRING)
+      n += ((const SharedString *)a->ptr)->len;
+  }
+  return n;
+}
+
+static void msg_build(lua_State *L, int idx, MessageNode *m) {
+  WorkerCounters *c = my_counters();
+  double t0 = sample_start();
+  SerBuffer buf;
+  serbuf_init(&buf, 0);
+  serialize_protected(L, idx, &buf);
+  if (!serbuf_commit(L, &buf)) {
+    serbuf_free(&buf);
+    luaL_error(L, "out of memory");
+  }
+  lus_atomic_add(&c->messages, 1);
+  lus_atomic_add(&c->bytes, (long long)msg_bytes(&buf));
+  sample_end(&c->sertime, t0);
+  m->arena = buf.arena;
+  m->data = buf.data;
+  m->size = buf.size;
+  m->attach = buf.attach;
+  m->nattach = buf.nattach;
+  m->next = NULL;
 }
 
 /* Deserialization */
@@ -271,6 +1444,10 @@ typedef struct {
   const char *data;
   size_t size;
   size_t pos;
+  MsgAttach *attach; /* message attachments */
+  int nattach;
+  int refs; /* stack index of the table of numbered values (0 = none) */
+  lua_Integer nrefs;
 } DeserBuffer;
 
 static int deser_read(DeserBuffer *b, void *out, size_t n) {
@@ -282,32 +1459,155 @@ static int deser_read(DeserBuffer *b, void *out, size_t n) {
 }
 
 static int deser_read_byte(DeserBuffer *b, unsigned char *out) {
-  return deser_read(b, out, 1);
+  if (b->pos >= b->size)
+    return 0;
+  *out = (unsigned char)b->data[b->pos++];
+  return 1;
+}
+
+static int deser_read_varint(DeserBuffer *b, lua_Unsigned *out) {
+  lua_Unsigned v = 0;
+  for (int shift = 0; shift < 70 && b->pos < b->size; shift += 7) {
+    unsigned char c = (unsigned char)b->data[b->pos++];
+    v |= (lua_Unsigned)(c & 0x7f) << shift;
+    if (!(c & 0x80)) {
+      *out = v;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Read a length that must fit in what is left of the buffer */
+static int deser_read_len(DeserBuffer *b, size_t *out) {
+  lua_Unsigned n;
+  if (!deser_read_varint(b, &n) || n > b->size - b->pos)
+    return 0;
+  *out = (size_t)n;
+  return 1;
+}
+
+/* Give the value on top the next number */
+static void deser_addref(lua_State *L, DeserBuffer *b) {
+  if (b->refs != 0) {
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, b->refs, ++b->nrefs);
+  }
+}
+
+/* Push the value with the number read from 'b' */
+static int deser_ref(lua_State *L, DeserBuffer *b) {
+  lua_Unsigned n;
+  if (b->refs == 0 || !deser_read_varint(b, &n) || n < 1 ||
+      n > l_castS2U(b->nrefs))
+    return 0;
+  return lua_rawgeti(L, b->refs, l_castU2S(n)) != LUA_TNIL;
 }
 
+/* Read an attachment index and return the attachment of kind 'kind' */
+static MsgAttach *deser_attach(DeserBuffer *b, int kind) {
+  lua_Unsigned i;
+  if (!deser_read_varint(b, &i) || i >= (lua_Unsigned)b->nattach)
+    return NULL;
+  if (b->attach[i].kind != kind)
+    return NULL;
+  return &b->attach[i];
+}
+
+/* Push the vector of attachment 'a', adopting its buffer if possible */
+static void deser_vector(lua_State *L, MsgAttach *a) {
+  Vector *v;
+  if (default_alloc(L)) {
+    v = luaV_adopt(L, (char *)a->ptr, a->len, a->alloc);
+    a->taken = 1;
+  }
+  else { /* copy; 'msg_release' frees the buffer */
+    v = luaV_newvec(L, a->len, 1);
+    if (a->len > 0)
+      memcpy(v->data, a->ptr, a->len);
+  }
+  setvecvalue(L, s2v(L->top.p), v);
+  L->top.p++;
+}
+
+static void chan_pushhandle(lua_State *L, Channel *c);
+
 /* Forward declaration */
 static int deserialize_value(lua_State *L, DeserBuffer *b, int depth);
 
 static int deserialize_table(lua_State *L, DeserBuffer *b, int depth) {
-  if (depth > 100)
-    return 0;
-  luaL_checkstack(L, 3, "deserialize");
-  lua_Integer count;
-  if (!deser_read(b, &count, sizeof(count)))
+  size_t n;
+  lua_Unsigned h;
+  if (depth > SER_MAXDEPTH || !lua_checkstack(L, 4))
     return 0;
-  if (count < 0 || count > 10000000)
+  /* every element takes at least a byte, so 'n' is bounded by the data;
+     'h' is only a hint, never trusted beyond what the data can hold */
+  if (!deser_read_len(b, &n) || !deser_read_varint(b, &h) || n > INT_MAX)
     return 0;
-  /* Do not presize the hash part from the (untrusted) declared count: a tiny
-  ** message can claim millions of entries and force a huge upfront alloc. Cap
-  ** the size hint; the table grows naturally as entries are actually read. */
-  lua_createtable(L, 0, count < 1024 ? (int)count : 1024);
-  for (lua_Integer i = 0; i < count; i++) {
+  if (h > (b->size - b->pos) / 2)
+    h = (b->size - b->pos) / 2;
+  lua_createtable(L, (int)n, (h < INT_MAX) ? (int)h : INT_MAX);
+  deser_addref(L, b);
+  for (size_t i = 1; i <= n; i++) {
     if (!deserialize_value(L, b, depth + 1))
-      return 0; /* key */
-    if (!deserialize_value(L, b, depth + 1))
-      return 0; /* value */
-    lua_settable(L, -3);
+      return 0;
+    lua_rawseti(L, -2, (lua_Integer)i);
+  }
+  for (;;) {
+    if (b->pos < b->size && (unsigned char)b->data[b->pos] == SER_END) {
+      b->pos++;
+      return 1;
+    }
+    if (!deserialize_value(L, b, depth + 1)) /* key */
+      return 0;
+    if (lua_isnil(L, -1) || (lua_type(L, -1) == LUA_TNUMBER &&
+                             !lua_isinteger(L, -1) &&
+                             luai_numisnan(lua_tonumber(L, -1))))
+      return 0;
+    if (!deserialize_value(L, b, depth + 1)) /* value */
+      return 0;
+    lua_rawset(L, -3);
+  }
+}
+
+/* Push a new enum with the names read from 'b' (as its first member) */
+static int deser_enumroot(lua_State *L, DeserBuffer *b, int depth) {
+  size_t n;
+  lua_Integer ref = 0;
+  if (!deser_read_len(b, &n) || n < 1 || n > INT_MAX / 2 ||
+      !lua_checkstack(L, (int)n * 2 + 1))
+    return 0;
+  if (b->refs != 0) /* numbered before its names, as when written */
+    ref = ++b->nrefs;
+  for (size_t i = 0; i < n; i++) {
+    if (!deserialize_value(L, b, depth) || lua_type(L, -1) != LUA_TSTRING)
+      return 0;
+    lua_pushinteger(L, (lua_Integer)(i + 1));
+  }
+  lua_pushenum(L, (int)n);
+  if (ref != 0) {
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, b->refs, ref);
+  }
+  return 1;
+}
+
+static int deser_enum(lua_State *L, DeserBuffer *b, int depth) {
+  unsigned char tag;
+  lua_Unsigned idx;
+  EnumRoot *root;
+  if (!deser_read_byte(b, &tag))
+    return 0;
+  if (tag == SER_REF) {
+    if (!deser_ref(L, b) || !lua_isenum(L, -1))
+      return 0;
   }
+  else if (tag != SER_ENUMROOT || !deser_enumroot(L, b, depth))
+    return 0;
+  root = enumvalue(s2v(L->top.p - 1))->root;
+  if (!deser_read_varint(b, &idx) || idx < 1 || idx > (lua_Unsigned)root->size)
+    return 0;
+  setenumvalue2s(L, L->top.p - 1, luaE_getbyidx(L, root, (int)idx));
   return 1;
 }
 
@@ -318,18 +1618,13 @@ static int deserialize_value(lua_State *L, DeserBuffer *b, int depth) {
 
   switch (tag) {
     case SER_NIL: lua_pushnil(L); break;
-    case SER_BOOL: {
-      unsigned char v;
-      if (!deser_read_byte(b, &v))
-        return 0;
-      lua_pushboolean(L, v);
-      break;
-    }
+    case SER_FALSE: lua_pushboolean(L, 0); break;
+    case SER_TRUE: lua_pushboolean(L, 1); break;
     case SER_INT: {
-      lua_Integer i;
-      if (!deser_read(b, &i, sizeof(i)))
+      lua_Unsigned u;
+      if (!deser_read_varint(b, &u))
         return 0;
-      lua_pushinteger(L, i);
+      lua_pushinteger(L, l_castU2S((u & 1) ? ~(u >> 1) : (u >> 1)));
       break;
     }
     case SER_NUM: {
@@ -341,82 +1636,458 @@ static int deserialize_value(lua_State *L, DeserBuffer *b, int depth) {
     }
     case SER_STRING: {
       size_t len;
-      if (!deser_read(b, &len, sizeof(len)))
-        return 0;
-      if (len > b->size - b->pos)
+      if (!deser_read_len(b, &len))
         return 0;
       lua_pushlstring(L, b->data + b->pos, len);
       b->pos += len;
+      deser_addref(L, b);
+      break;
+    }
+    case SER_REF: return deser_ref(L, b);
+    case SER_TABLE: return deserialize_table(L, b, depth);
+    case SER_ENUM: return deser_enum(L, b, depth);
+    case SER_VECTOR: {
+      MsgAttach *a = deser_attach(b, MSG_VECTOR);
+      if (a == NULL || a->taken)
+        return 0;
+      deser_vector(L, a);
+      deser_addref(L, b);
+      break;
+    }
+    case SER_VECBYTES: {
+      size_t len;
+      Vector *v;
+      if (!deser_read_len(b, &len))
+        return 0;
+      v = luaV_newvec(L, len, 1);
+      memcpy(v->data, b->data + b->pos, len);
+      b->pos += len;
+      setvecvalue(L, s2v(L->top.p), v);
+      L->top.p++;
+      deser_addref(L, b);
+      break;
+    }
+    case SER_SHAREDSTR: {
+      MsgAttach *a = deser_attach(b, MSG_STRING);
+      SharedString *ss;
+      if (a == NULL)
+        return 0;
+      ss = (SharedString *)a->ptr;
+      /* each string holds its own reference; the message keeps its one */
+      lus_atomic_add(&ss->refcount, 1);
+      lua_pushexternalstring(L, ss->data, ss->len, sharedstr_falloc, ss);
+      deser_addref(L, b);
+      break;
+    }
+    case SER_SHARED: {
+      MsgAttach *a = deser_attach(b, MSG_SHARED);
+      SharedTable *t;
+      if (a == NULL || !deser_read(b, &t, sizeof(t)))
+        return 0;
+      shared_pushcache(L);
+      shared_pushproxy(L, (SharedHeap *)a->ptr, t, lua_gettop(L));
+      lua_remove(L, -2);
+      break;
+    }
+    case SER_CHANNEL: {
+      MsgAttach *a = deser_attach(b, MSG_CHANNEL);
+      if (a == NULL)
+        return 0;
+      chan_pushhandle(L, (Channel *)a->ptr);
+      break;
+    }
+    case SER_SHAREDVEC: {
+      MsgAttach *a = deser_attach(b, MSG_SHAREDVEC);
+      if (a == NULL)
+        return 0;
+      /* each vector holds its own reference; the message keeps its one */
+      setvecvalue(L, s2v(L->top.p), luaV_openshared(L, (VecShared *)a->ptr));
+      L->top.p++;
+      deser_addref(L, b);
       break;
     }
-    case SER_TABLE: return deserialize_table(L, b, depth + 1);
     default: return 0;
   }
   return 1;
 }
 
+/*
+** Push the value encoded in 'b'. Returns 0, leaving the stack as it
+** was, if the data is malformed.
+*/
+static int deserialize_root(lua_State *L, DeserBuffer *b) {
+  int top = lua_gettop(L);
+  unsigned char v;
+  if (!deser_read_byte(b, &v) || v != SER_VERSION || !lua_checkstack(L, 2))
+    return 0;
+  if (b->pos < b->size && ((unsigned char)b->data[b->pos] == SER_TABLE ||
+                           (unsigned char)b->data[b->pos] == SER_ENUM)) {
+    const unsigned char *count;
+    size_t n = 0;
+    if (b->size - b->pos < 4)
+      return 0;
+    b->size -= 4;
+    count = (const unsigned char *)b->data + b->size;
+    for (int i = 0; i < 4; i++)
+      n |= (size_t)count[i] << (8 * i);
+    if (n > b->size - b->pos) /* each takes at least a byte */
+      n = b->size - b->pos;
+    lua_createtable(L, (n < INT_MAX) ? (int)n : INT_MAX, 0);
+    b->refs = lua_gettop(L);
+  }
+  if (!deserialize_value(L, b, 0) || b->pos != b->size) {
+    lua_settop(L, top);
+    return 0;
+  }
+  if (b->refs != 0)
+    lua_remove(L, b->refs);
+  return 1;
+}
+
+/*
+** Push the value carried by message 'm' and release the message.
+** Returns 0 if the message is malformed.
+*/
+static int msg_deliver(lua_State *L, MessageNode *m) {
+  DeserBuffer db = {m->data, m->size, 0, m->attach, m->nattach, 0, 0};
+  double t0 = sample_start();
+  int ok = deserialize_root(L, &db);
+  msg_release(m);
+  sample_end(&my_counters()->desertime, t0);
+  return ok;
+}
+
 /* }====================================================== */
 
 /*
 ** {======================================================
-** Worker State Management
+** Script Cache
 ** =======================================================
 */
 
-static WorkerState *worker_new(lua_State *parent, const char *path) {
-  WorkerState *w = (WorkerState *)malloc(sizeof(WorkerState));
-  if (!w)
-    return NULL;
-
-  memset(w, 0, sizeof(WorkerState));
-  w->parent = parent;
-  w->script_path = strdup(path);
-  w->status = LUS_WORKER_RUNNING;
-  w->refcount = 1;
-  w->recv_ctx = NULL;
+/*
+** Compiled worker scripts, shared by all pool threads. Each entry keeps
+** the dumped bytecode of a script with the modification time and size
+** of the file it was compiled from; a changed file is compiled again.
+** Entries are refcounted so that states can load from one outside the
+** cache lock while it is being replaced or evicted.
+*/
+typedef struct CodeEntry {
+  struct CodeEntry *next; /* most recently used first */
+  int refcount;           /* the cache's own reference plus one per load */
+  int textonly;           /* compiled from source under mode "t" */
+  char *path;             /* canonical path */
+  long long mtime;        /* modification time */
+  long long fsize;        /* file size */
+  char *code;             /* dumped chunk */
+  size_t size;
+} CodeEntry;
 
-  lus_mutex_init(&w->mutex);
-  lus_cond_init(&w->outbox_cond);
-  lus_cond_init(&w->inbox_cond);
-  msgqueue_init(&w->outbox);
-  msgqueue_init(&w->inbox);
+static lus_mutex_t g_codecache_mutex;
+static CodeEntry *g_codecache = NULL;
+static int g_codecache_count = 0;
 
-  return w;
+/* Canonical path and stamp of 'path'; returns NULL if it cannot be read */
+static char *script_stat(const char *path, long long *mtime,
+                         long long *fsize) {
+#if defined(LUS_PLATFORM_WINDOWS)
+  struct _stat64 st;
+  char *full = _fullpath(NULL, path, 0);
+  if (full == NULL || _stat64(full, &st) != 0) {
+    free(full);
+    return NULL;
+  }
+  *mtime = (long long)st.st_mtime;
+#else
+  struct stat st;
+  char *full = realpath(path, NULL);
+  if (full == NULL || stat(full, &st) != 0) {
+    free(full);
+    return NULL;
+  }
+  *mtime = (long long)st.st_mtime;
+#endif
+  *fsize = (long long)st.st_size;
+  return full;
 }
 
-static void worker_incref(WorkerState *w) {
-  lus_mutex_lock(&w->mutex);
-  w->refcount++;
-  lus_mutex_unlock(&w->mutex);
+static void codeentry_decref(CodeEntry *e) {
+  if (--e->refcount == 0) { /* only under the cache lock */
+    free(e->path);
+    free(e->code);
+    free(e);
+  }
 }
 
-static void worker_decref(WorkerState *w) {
-  int should_free = 0;
-  lus_mutex_lock(&w->mutex);
-  w->refcount--;
-  if (w->refcount <= 0)
-    should_free = 1;
-  lus_mutex_unlock(&w->mutex);
+static void codecache_init(void) {
+  lus_mutex_init(&g_codecache_mutex);
+}
 
-  if (should_free) {
-    if (w->L)
-      lua_close(w->L);
-    free(w->script_path);
-    free(w->error_msg);
-    msgqueue_clear(&w->outbox);
-    msgqueue_clear(&w->inbox);
-    lus_cond_destroy(&w->outbox_cond);
-    lus_cond_destroy(&w->inbox_cond);
-    lus_mutex_destroy(&w->mutex);
-    free(w);
+static void codecache_clear(void) {
+  while (g_codecache != NULL) {
+    CodeEntry *e = g_codecache;
+    g_codecache = e->next;
+    codeentry_decref(e);
   }
+  g_codecache_count = 0;
+  lus_mutex_destroy(&g_codecache_mutex);
 }
 
-/* }====================================================== */
-
 /*
-** Signal the receive context if a receiver is waiting.
-** Call with worker mutex already locked. Holds w->mutex while signaling
+** Find a fresh entry for 'path' and take a reference to it, dropping a
+** stale one. A "t" load may only use entries compiled from source.
+** Call with the cache lock held.
+*/
+static CodeEntry *codecache_get(const char *path, long long mtime,
+                                long long fsize, int textonly) {
+  CodeEntry **p;
+  for (p = &g_codecache; *p != NULL; p = &(*p)->next) {
+    CodeEntry *e = *p;
+    if (strcmp(e->path, path) != 0 || e->textonly != textonly)
+      continue;
+    *p = e->next;
+    if (e->mtime != mtime || e->fsize != fsize) { /* file changed */
+      g_codecache_count--;
+      codeentry_decref(e);
+      return NULL;
+    }
+    e->next = g_codecache; /* move to front */
+    g_codecache = e;
+    e->refcount++;
+    return e;
+  }
+  return NULL;
+}
+
+/* Insert 'e', evicting the least recently used entries over the limit */
+static void codecache_put(CodeEntry *e) {
+  CodeEntry **p;
+  int n = 0;
+  lus_mutex_lock(&g_codecache_mutex);
+  for (p = &g_codecache; *p != NULL;) { /* drop a concurrent compile */
+    CodeEntry *old = *p;
+    if (strcmp(old->path, e->path) == 0 && old->textonly == e->textonly) {
+      *p = old->next;
+      g_codecache_count--;
+      codeentry_decref(old);
+    }
+    else
+      p = &old->next;
+  }
+  e->next = g_codecache;
+  g_codecache = e;
+  g_codecache_count++;
+  for (p = &g_codecache; *p != NULL; n++) {
+    CodeEntry *old = *p;
+    if (n >= LUS_WORKER_CODECACHE) {
+      *p = old->next;
+      g_codecache_count--;
+      codeentry_decref(old);
+    }
+    else
+      p = &old->next;
+  }
+  lus_mutex_unlock(&g_codecache_mutex);
+}
+
+typedef struct CodeBuffer {
+  char *data;
+  size_t size;
+  size_t cap;
+} CodeBuffer;
+
+static int code_writer(lua_State *L, const void *p, size_t sz, void *ud) {
+  CodeBuffer *b = (CodeBuffer *)ud;
+  (void)L;
+  if (sz == 0)
+    return 0;
+  if (b->size + sz > b->cap) {
+    size_t newcap = (b->cap == 0) ? 4096 : b->cap * 2;
+    char *nd;
+    while (newcap < b->size + sz)
+      newcap *= 2;
+    nd = (char *)realloc(b->data, newcap);
+    if (nd == NULL)
+      return 1;
+    b->data = nd;
+    b->cap = newcap;
+  }
+  memcpy(b->data + b->size, p, sz);
+  b->size += sz;
+  return 0;
+}
+
+static const char *code_reader(lua_State *L, void *ud, size_t *size) {
+  CodeEntry **pe = (CodeEntry **)ud;
+  CodeEntry *e = *pe;
+  (void)L;
+  if (e == NULL)
+    return NULL;
+  *pe = NULL; /* the whole chunk in one piece */
+  *size = e->size;
+  return e->code;
+}
+
+/*
+** Check that 'lua_dump' can write every constant of 'f' and its nested
+** functions. Enum values that the parser puts in the constant table have
+** no binary form, so chunks using 'enum' are not cached.
+*/
+static int code_dumpable(const Proto *f) {
+  int i;
+  for (i = 0; i < f->sizek; i++) {
+    switch (ttypetag(&f->k[i])) {
+      case LUA_VNIL:
+      case LUA_VFALSE:
+      case LUA_VTRUE:
+      case LUA_VNUMFLT:
+      case LUA_VNUMINT:
+      case LUA_VSHRSTR:
+      case LUA_VLNGSTR:
+        break;
+      default:
+        return 0;
+    }
+  }
+  for (i = 0; i < f->sizep; i++) {
+    if (!code_dumpable(f->p[i]))
+      return 0;
+  }
+  return 1;
+}
+
+/*
+** Load the worker script 'path' like 'luaL_loadfilex' would, reusing
+** the chunk compiled by an earlier worker when the file is unchanged.
+** Cached chunks are dumps of what this process compiled itself under the
+** same mode, so a state that only accepts text never loads bytecode read
+** from a file.
+*/
+static int worker_loadscript(lua_State *L, const char *path,
+                             const char *mode) {
+  long long mtime, fsize;
+  int textonly = (strchr(mode, 'b') == NULL);
+  char *full = script_stat(path, &mtime, &fsize);
+  CodeEntry *e;
+  int status;
+  if (full == NULL) /* let the loader report the error */
+    return luaL_loadfilex(L, path, mode);
+  lus_mutex_lock(&g_codecache_mutex);
+  e = codecache_get(full, mtime, fsize, textonly);
+  lus_mutex_unlock(&g_codecache_mutex);
+  if (e != NULL) {
+    CodeEntry *rd = e;
+    free(full);
+    status = lua_load(L, code_reader, &rd, path, "b");
+    lus_mutex_lock(&g_codecache_mutex);
+    codeentry_decref(e);
+    lus_mutex_unlock(&g_codecache_mutex);
+    return status;
+  }
+  status = luaL_loadfilex(L, path, mode);
+  if (status == LUA_OK && code_dumpable(clLvalue(s2v(L->top.p - 1))->p)) {
+    CodeBuffer b = {NULL, 0, 0};
+    e = (CodeEntry *)malloc(sizeof(CodeEntry));
+    if (e != NULL && lua_dump(L, code_writer, &b, 0) == 0) {
+      e->refcount = 1;
+      e->textonly = textonly;
+      e->path = full;
+      e->mtime = mtime;
+      e->fsize = fsize;
+      e->code = b.data;
+      e->size = b.size;
+      codecache_put(e);
+      return status;
+    }
+    free(e); /* out of memory: just do not cache */
+    free(b.data);
+  }
+  free(full);
+  return status;
+}
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Worker State Management
+** =======================================================
+*/
+
+static WorkerState *worker_new(lua_State *parent, const char *path) {
+  WorkerState *w = (WorkerState *)malloc(sizeof(WorkerState));
+  if (!w)
+    return NULL;
+
+  memset(w, 0, sizeof(WorkerState));
+  w->parent = parent;
+  w->script_path = strdup(path);
+  w->status = LUS_WORKER_RUNNING;
+  w->refcount = 1;
+  w->last_thread = -1;
+  w->recv_ctx = NULL;
+
+  lus_mutex_init(&w->mutex);
+  lus_cond_init(&w->outbox_cond);
+  lus_cond_init(&w->inbox_cond);
+  lus_cond_init(&w->space_cond);
+  msgqueue_init(&w->outbox);
+  msgqueue_init(&w->inbox);
+  lus_atomic_add(&g_pool.nworkers, 1);
+
+  return w;
+}
+
+static void worker_incref(WorkerState *w) {
+  lus_mutex_lock(&w->mutex);
+  w->refcount++;
+  lus_mutex_unlock(&w->mutex);
+}
+
+static void worker_decref(WorkerState *w) {
+  int should_free = 0;
+  lus_mutex_lock(&w->mutex);
+  w->refcount--;
+  if (w->refcount <= 0)
+    should_free = 1;
+  else if (w->refcount == 1 && w->status == LUS_WORKER_BLOCKED) {
+    /* Only the pool's reference is left and the worker is parked waiting
+    ** for a message that nobody can send anymore: reclaim it. */
+    w->refcount = 0;
+    should_free = 1;
+  }
+  lus_mutex_unlock(&w->mutex);
+
+  if (should_free) {
+    if (w->status == LUS_WORKER_BLOCKED)
+      lus_atomic_add(&g_pool.nparked, -1);
+    if (w->status == LUS_WORKER_RUNNING || w->status == LUS_WORKER_BLOCKED)
+      lus_atomic_add(&g_pool.nworkers, -1); /* never finished */
+    if (w->L) {
+      t_closingworker++;
+      lua_close(w->L);
+      t_closingworker--;
+    }
+    free(w->script_path);
+    free(w->error_msg);
+    msgqueue_clear(&w->outbox);
+    msgqueue_clear(&w->inbox);
+    for (int i = 0; i < w->senders.n; i++)
+      worker_decref(w->senders.items[i].w);
+    free(w->senders.items);
+    lus_cond_destroy(&w->outbox_cond);
+    lus_cond_destroy(&w->inbox_cond);
+    lus_cond_destroy(&w->space_cond);
+    lus_mutex_destroy(&w->mutex);
+    free(w);
+  }
+}
+
+/* }====================================================== */
+
+/*
+** Signal the receive context if a receiver is waiting.
+** Call with worker mutex already locked. Holds w->mutex while signaling
 ** ctx to prevent lib_receive from destroying ctx on the stack before we
 ** finish accessing it. No deadlock: lib_receive never holds both mutexes.
 */
@@ -431,44 +2102,320 @@ static void signal_recv_ctx(WorkerState *w) {
   lus_mutex_unlock(&w->mutex);
 }
 
+static void worker_wake(WorkerState *w);
+
+/*
+** Bounded queues. A sender waits while the inbox of a worker holds
+** 'inbox_cap' messages, and a worker waits in 'worker.message' while its
+** outbox holds 'outbox_cap' messages. Waiting workers park when they
+** can: a worker waiting for room in another worker's inbox registers in
+** its 'senders', and one waiting for room in its own outbox is woken by
+** whoever takes a message out of it. Threads that cannot park wait on
+** 'space_cond' and 'inbox_cond' respectively. A finished worker never
+** reads its inbox, so sending to it does not wait.
+*/
+static int inbox_full(WorkerState *w) {
+  return w->inbox_cap > 0 && w->inbox.count >= w->inbox_cap &&
+         w->status != LUS_WORKER_DEAD && w->status != LUS_WORKER_ERROR;
+}
+
+static int outbox_full(WorkerState *w) {
+  return w->outbox_cap > 0 && w->outbox.count >= w->outbox_cap;
+}
+
+/* Register parked worker 'self' as waiting for room in the inbox of 'w'
+   (with 'w' locked); returns 0 if out of memory */
+static int senders_register(WorkerState *w, WorkerState *self) {
+  ChanWaitList *wl = &w->senders;
+  for (int i = 0; i < wl->n; i++) {
+    if (wl->items[i].w == self)
+      return 1;
+  }
+  if (wl->n == wl->cap) {
+    int newcap = (wl->cap == 0) ? 4 : wl->cap * 2;
+    ChanWaiter *ni = (ChanWaiter *)realloc(wl->items,
+                                           newcap * sizeof(ChanWaiter));
+    if (ni == NULL)
+      return 0;
+    wl->items = ni;
+    wl->cap = newcap;
+  }
+  worker_incref(self);
+  wl->items[wl->n].w = self;
+  wl->items[wl->n].ctx = NULL;
+  wl->n++;
+  return 1;
+}
+
+/*
+** Let senders waiting for room in the inbox of 'w' retry. Call with the
+** worker mutex locked; releases it.
+*/
+static void inbox_notify(WorkerState *w) {
+  ChanWaiter *items = w->senders.items;
+  int n = w->senders.n;
+  if (w->inbox_cap > 0)
+    lus_cond_broadcast(&w->space_cond);
+  w->senders.items = NULL;
+  w->senders.n = w->senders.cap = 0;
+  lus_mutex_unlock(&w->mutex);
+  for (int i = 0; i < n; i++) {
+    lus_mutex_lock(&items[i].w->mutex);
+    worker_wake(items[i].w); /* releases the mutex */
+    worker_decref(items[i].w);
+  }
+  free(items);
+}
+
+/*
+** Wake 'w' if it may be waiting for room in its outbox, after a message
+** was taken out of it. Call with the worker mutex locked; releases it.
+*/
+static void outbox_notify(WorkerState *w) {
+  if (w->outbox_cap > 0 && w->outbox.count == w->outbox_cap - 1)
+    worker_wake(w);
+  else
+    lus_mutex_unlock(&w->mutex);
+}
+
 /*
 ** {======================================================
 ** Thread Pool
 ** =======================================================
 */
 
-static void pool_enqueue(WorkerState *w) {
-  lus_mutex_lock(&g_pool.queue_mutex);
+/*
+** Scheduling. Each pool thread owns a work-stealing deque. A worker
+** made runnable on a pool thread goes to the deque of the thread that
+** last ran it when that is the current thread (its state is likely
+** still in cache), otherwise to that thread's remote queue; workers
+** that never ran, or that yield to let others run, go to the global
+** queue. An idle thread takes work from its deque, its remote queue,
+** the global queue, and finally steals from the other threads; it polls
+** LUS_POOL_SPINS times before going to sleep.
+**
+** Lost wakeups are avoided with 'nqueued' and 'nsleeping': an enqueuer
+** bumps 'nqueued' after publishing the worker and then reads
+** 'nsleeping'; a thread going to sleep bumps 'nsleeping' and then reads
+** 'nqueued'. With sequentially consistent atomics at least one of them
+** sees the other.
+*/
+
+/* Pool thread running the current OS thread (NULL outside the pool) */
+static l_threadlocal PoolThread *t_self = NULL;
+
+/* Counters of the calling thread */
+static WorkerCounters *my_counters(void) {
+  return (t_self != NULL) ? &t_self->counters : &g_pool.counters;
+}
+
+static int deque_push(WorkDeque *d, WorkerState *w) {
+  long long b = lus_atomic_load(&d->bottom);
+  long long t = lus_atomic_load(&d->top);
+  if (b - t >= LUS_DEQUE_SIZE)
+    return 0; /* full */
+  lus_atomic_store(&d->slots[b & (LUS_DEQUE_SIZE - 1)], (long long)(size_t)w);
+  lus_atomic_store(&d->bottom, b + 1);
+  return 1;
+}
+
+/* Owner side: take the most recently pushed worker */
+static WorkerState *deque_pop(WorkDeque *d) {
+  long long b = lus_atomic_load(&d->bottom) - 1;
+  long long t;
+  WorkerState *w = NULL;
+  lus_atomic_store(&d->bottom, b);
+  t = lus_atomic_load(&d->top);
+  if (t <= b) { /* non-empty */
+    w = (WorkerState *)(size_t)lus_atomic_load(
+        &d->slots[b & (LUS_DEQUE_SIZE - 1)]);
+    if (t == b) { /* last one: race against thieves */
+      if (!lus_atomic_cas(&d->top, t, t + 1))
+        w = NULL; /* a thief got it */
+      lus_atomic_store(&d->bottom, b + 1);
+    }
+  }
+  else
+    lus_atomic_store(&d->bottom, b + 1); /* was empty */
+  return w;
+}
+
+/* Thief side: take the oldest worker */
+static WorkerState *deque_steal(WorkDeque *d) {
+  long long t = lus_atomic_load(&d->top);
+  long long b = lus_atomic_load(&d->bottom);
+  WorkerState *w;
+  if (t >= b)
+    return NULL; /* empty */
+  w = (WorkerState *)(size_t)lus_atomic_load(
+      &d->slots[t & (LUS_DEQUE_SIZE - 1)]);
+  if (!lus_atomic_cas(&d->top, t, t + 1))
+    return NULL; /* lost the race */
+  return w;
+}
+
+/* Append to a locked singly linked queue */
+static void list_push(WorkerState **head, WorkerState **tail,
+                      WorkerState *w) {
   w->next = NULL;
-  if (g_pool.runnable_tail) {
-    g_pool.runnable_tail->next = w;
+  if (*tail)
+    (*tail)->next = w;
+  else
+    *head = w;
+  *tail = w;
+}
+
+static WorkerState *list_pop(WorkerState **head, WorkerState **tail) {
+  WorkerState *w = *head;
+  if (w) {
+    *head = w->next;
+    if (*head == NULL)
+      *tail = NULL;
+    w->next = NULL;
   }
-  else {
-    g_pool.runnable_head = w;
+  return w;
+}
+
+/* Wake 't' if it is sleeping; returns 1 if it was */
+static int pool_wakethread(PoolThread *t) {
+  int sleeping;
+  lus_mutex_lock(&t->mutex);
+  sleeping = t->sleeping;
+  if (sleeping) {
+    t->sleeping = 0;
+    lus_cond_signal(&t->cond);
+  }
+  lus_mutex_unlock(&t->mutex);
+  return sleeping;
+}
+
+/* Wake one sleeping thread, trying 'preferred' (if >= 0) first */
+static void pool_wakeone(int preferred) {
+  if (lus_atomic_load(&g_pool.nsleeping) == 0)
+    return; /* everyone is awake and will find the work */
+  if (preferred >= 0 && pool_wakethread(&g_pool.threads[preferred]))
+    return;
+  for (int i = 0; i < g_pool.nthreads; i++) {
+    if (i != preferred && pool_wakethread(&g_pool.threads[i]))
+      return;
   }
-  g_pool.runnable_tail = w;
-  lus_cond_signal(&g_pool.queue_cond);
-  lus_mutex_unlock(&g_pool.queue_mutex);
 }
 
-static WorkerState *pool_dequeue(void) {
+/* Put 'w' on the global queue */
+static void pool_inject(WorkerState *w) {
   lus_mutex_lock(&g_pool.queue_mutex);
-  while (!g_pool.runnable_head && !g_pool.shutdown) {
-    lus_cond_wait(&g_pool.queue_cond, &g_pool.queue_mutex);
+  list_push(&g_pool.runnable_head, &g_pool.runnable_tail, w);
+  lus_atomic_add(&g_pool.nglobal, 1);
+  lus_mutex_unlock(&g_pool.queue_mutex);
+  lus_atomic_add(&g_pool.nqueued, 1);
+  pool_wakeone(-1);
+}
+
+/* Make 'w' runnable, preferring the pool thread that last ran it */
+static void pool_enqueue(WorkerState *w) {
+  int target = w->last_thread;
+  if (target < 0) {
+    pool_inject(w);
+    return;
   }
-  if (g_pool.shutdown) {
-    lus_mutex_unlock(&g_pool.queue_mutex);
+  if (t_self == NULL || t_self->index != target ||
+      !deque_push(&t_self->deque, w)) {
+    PoolThread *t = &g_pool.threads[target];
+    lus_mutex_lock(&t->mutex);
+    list_push(&t->remote_head, &t->remote_tail, w);
+    lus_atomic_add(&t->nremote, 1);
+    lus_mutex_unlock(&t->mutex);
+  }
+  lus_atomic_add(&g_pool.nqueued, 1);
+  pool_wakeone(target);
+}
+
+static WorkerState *pool_takeremote(PoolThread *t) {
+  WorkerState *w;
+  if (lus_atomic_load(&t->nremote) == 0) /* avoid locking an empty queue */
     return NULL;
+  lus_mutex_lock(&t->mutex);
+  w = list_pop(&t->remote_head, &t->remote_tail);
+  if (w != NULL)
+    lus_atomic_add(&t->nremote, -1);
+  lus_mutex_unlock(&t->mutex);
+  return w;
+}
+
+/* Find a runnable worker for 'self', or NULL */
+static WorkerState *pool_findwork(PoolThread *self) {
+  WorkerState *w = deque_pop(&self->deque);
+  if (w == NULL)
+    w = pool_takeremote(self);
+  if (w == NULL && lus_atomic_load(&g_pool.nglobal) > 0) {
+    lus_mutex_lock(&g_pool.queue_mutex);
+    w = list_pop(&g_pool.runnable_head, &g_pool.runnable_tail);
+    if (w != NULL)
+      lus_atomic_add(&g_pool.nglobal, -1);
+    lus_mutex_unlock(&g_pool.queue_mutex);
   }
-  WorkerState *w = g_pool.runnable_head;
-  g_pool.runnable_head = w->next;
-  if (!g_pool.runnable_head)
-    g_pool.runnable_tail = NULL;
-  w->next = NULL;
-  lus_mutex_unlock(&g_pool.queue_mutex);
+  if (w == NULL && g_pool.nthreads > 1) { /* steal, from a random victim */
+    int n = g_pool.nthreads;
+    int start;
+    self->seed = self->seed * 1103515245u + 12345u;
+    start = (int)((self->seed >> 16) % (unsigned int)n);
+    for (int i = 0; i < n && w == NULL; i++) {
+      PoolThread *victim = &g_pool.threads[(start + i) % n];
+      if (victim == self)
+        continue;
+      w = deque_steal(&victim->deque);
+      if (w == NULL)
+        w = pool_takeremote(victim);
+    }
+  }
+  if (w != NULL)
+    lus_atomic_add(&g_pool.nqueued, -1);
   return w;
 }
 
+/* Wait for a runnable worker; returns NULL on shutdown */
+static WorkerState *pool_dequeue(PoolThread *self) {
+  for (;;) {
+    WorkerState *w;
+    for (int spin = 0; spin <= LUS_POOL_SPINS; spin++) {
+      if (lus_atomic_load(&g_pool.shutdown))
+        return NULL;
+      if (lus_atomic_load(&g_pool.nqueued) > 0 &&
+          (w = pool_findwork(self)) != NULL)
+        return w;
+      lus_cpu_relax();
+    }
+    lus_mutex_lock(&self->mutex);
+    self->sleeping = 1;
+    lus_atomic_add(&g_pool.nsleeping, 1);
+    while (self->sleeping && lus_atomic_load(&g_pool.nqueued) == 0 &&
+           !lus_atomic_load(&g_pool.shutdown))
+      lus_cond_wait(&self->cond, &self->mutex);
+    self->sleeping = 0;
+    lus_atomic_add(&g_pool.nsleeping, -1);
+    lus_mutex_unlock(&self->mutex);
+  }
+}
+
+/*
+** A worker parks (yields back to the pool) only from its own script
+** coroutine and outside any 'catch' body: a catch's recovery point lives
+** on the C stack of the pool thread, which does not survive the yield.
+** Elsewhere (inside a catch, a nested coroutine, a metamethod called
+** from C) 'worker.peek' blocks the pool thread, as it always did.
+*/
+static int can_park(lua_State *L, WorkerState *w) {
+  return L == w->co && L->activeCatch == NULL && lua_isyieldable(L);
+}
+
+static int worker_lib_message(lua_State *L);
+
+static int message_k(lua_State *L, int status, lua_KContext ctx) {
+  (void)status;
+  (void)ctx;
+  return worker_lib_message(L); /* woken up: retry */
+}
+
 /* Worker thread: get global worker object to call worker.message */
 static int worker_lib_message(lua_State *L) {
   /* Get worker state from registry */
@@ -478,19 +2425,28 @@ static int worker_lib_message(lua_State *L) {
   if (!w)
     return luaL_error(L, "worker.message called outside worker context");
 
-  /* Serialize the value */
-  SerBuffer buf;
-  serbuf_init(&buf);
-  if (!serialize_value(L, 1, &buf, 0)) {
-    serbuf_free(&buf);
-    return lua_error(L);
+  int park = can_park(L, w);
+  lus_mutex_lock(&w->mutex);
+  if (park && outbox_full(w)) {
+    /* Park until the receiver makes room; 'waiting' is set under the
+    ** mutex, so a receive before the yield keeps the worker runnable. */
+    w->waiting = 1;
+    lus_mutex_unlock(&w->mutex);
+    return lua_yieldk(L, 0, 0, message_k);
   }
+  lus_mutex_unlock(&w->mutex);
+
+  /* Serialize the value */
+  MessageNode m;
+  msg_build(L, 1, &m);
 
   /* Push to outbox - ownership of arena transfers to message queue */
   lus_mutex_lock(&w->mutex);
-  if (!msgqueue_push(&w->outbox, buf.arena, buf.data, buf.size)) {
+  while (!park && outbox_full(w))
+    lus_cond_wait(&w->inbox_cond, &w->mutex);
+  if (!msgqueue_push(&w->outbox, &m)) {
     lus_mutex_unlock(&w->mutex);
-    serbuf_free(&buf);
+    msg_release(&m);
     return luaL_error(L, "out of memory");
   }
   lus_cond_signal(&w->outbox_cond);
@@ -510,6 +2466,14 @@ static int worker_lib_message(lua_State *L) {
   return 0;
 }
 
+static int worker_lib_peek(lua_State *L);
+
+static int peek_k(lua_State *L, int status, lua_KContext ctx) {
+  (void)status;
+  (void)ctx;
+  return worker_lib_peek(L); /* woken up: retry */
+}
+
 /* Worker thread: peek message from inbox */
 static int worker_lib_peek(lua_State *L) {
   lua_getfield(L, LUA_REGISTRYINDEX, "_WORKER_STATE");
@@ -518,71 +2482,332 @@ static int worker_lib_peek(lua_State *L) {
   if (!w)
     return luaL_error(L, "worker.peek called outside worker context");
 
-  StandaloneArena *arena;
-  char *data;
-  size_t size;
+  MessageNode m;
 
   lus_mutex_lock(&w->mutex);
+  if (w->inbox.count == 0 && can_park(L, w)) {
+    /* Park: a message posted before the yield clears 'waiting', and the
+    ** pool thread then keeps the worker runnable. */
+    w->waiting = 1;
+    lus_mutex_unlock(&w->mutex);
+    return lua_yieldk(L, 0, 0, peek_k);
+  }
   while (w->inbox.count == 0) {
     /* Block until message arrives */
     lus_cond_wait(&w->inbox_cond, &w->mutex);
   }
-  msgqueue_pop(&w->inbox, &arena, &data, &size);
-  lus_mutex_unlock(&w->mutex);
+  msgqueue_pop(&w->inbox, &m);
+  inbox_notify(w); /* releases the mutex */
 
   /* Deserialize */
-  DeserBuffer db = {data, size, 0};
-  if (!deserialize_value(L, &db, 0)) {
-    luaA_freestandalone(arena);
+  if (!msg_deliver(L, &m))
     return luaL_error(L, "failed to deserialize message");
-  }
-  luaA_freestandalone(arena);
   return 1;
 }
 
-/* Run worker script in its own Lua state */
-static void worker_run(WorkerState *w) {
-  lua_State *L = luaL_newstate();
-  if (!L) {
-    lus_mutex_lock(&w->mutex);
-    w->status = LUS_WORKER_ERROR;
-    w->error_msg = strdup("failed to create Lua state");
+/*
+** Mark a worker as finished with 'status' (LUS_WORKER_DEAD or
+** LUS_WORKER_ERROR with message 'msg') and wake anyone receiving from it.
+*/
+static void worker_finish(WorkerState *w, int status, const char *msg) {
+  lus_atomic_add(&g_pool.nworkers, -1);
+  lus_mutex_lock(&w->mutex);
+  w->status = status;
+  if (status == LUS_WORKER_ERROR) {
+    w->error_msg = strdup(msg);
     if (!w->error_msg)
       w->status = LUS_WORKER_DEAD;
-    lus_cond_signal(&w->outbox_cond); /* wake blocked receive */
-    signal_recv_ctx(w);               /* wake multi-worker select */
-    return;
   }
-  w->L = L;
+  lus_cond_signal(&w->outbox_cond); /* wake blocked receive */
+  signal_recv_ctx(w);               /* wake multi-worker select */
+  lus_mutex_lock(&w->mutex);
+  lus_cond_broadcast(&w->space_cond); /* sends no longer wait */
+  inbox_notify(w);
+}
 
-  /* Call the setup callback if registered */
-  if (g_worker_setup) {
-    g_worker_setup(w->parent, L);
-  }
+/*
+** {======================================================
+** State Pool
+** =======================================================
+*/
 
-  /* Inherit the parent's pledges, then seal them. A worker must run with the
-  ** SAME permissions as its parent (it needs them e.g. to load its own script
-  ** file and to do whatever I/O the parent allowed) but must not be able to
-  ** grant itself MORE -- otherwise spawning a worker would be a sandbox escape
-  ** (the fresh state starts with an unsealed, empty store the worker could
-  ** pledge() itself out of). The copy uses the worker's own allocator. The
-  ** parent configures its pledges before spawning workers, so its store is
-  ** stable to read here. */
-  if (w->parent != NULL) {
-    PledgeStore *inherited = luaP_copypledges(L, w->parent->pledges);
-    if (inherited != NULL) {
-      luaP_freepledges(L, L->pledges); /* drop the fresh granter-only store */
-      L->pledges = inherited;
-    }
-  }
-  luaP_sealpledges(L); /* worker cannot escalate its own pledges */
+/*
+** States of finished workers are reset and kept for later workers, so
+** most spawns skip creating a state and opening its libraries. A state
+** records a snapshot of its environment right after setup: the globals,
+** the registry's named entries, and the fields and metatables of every
+** table directly reachable from them (the standard libraries, loaded
+** modules, library metatables). Resetting restores all of that, drops
+** the previous worker's garbage and takes back hooks and GC settings.
+*/
 
-  /* Store worker state pointer in registry */
-  lua_pushlightuserdata(L, w);
-  lua_setfield(L, LUA_REGISTRYINDEX, "_WORKER_STATE");
+#define WORKER_SNAPSHOT "_WORKER_SNAPSHOT"
 
-  /* Register worker.message and worker.peek in the worker table */
-  lua_getglobal(L, "worker");
+/* Snapshot layout */
+#define SNAP_GLOBALS 1
+#define SNAP_REGISTRY 2
+#define SNAP_TABLES 3 /* table -> copy of its fields */
+#define SNAP_METAS 4  /* table -> its metatable or false */
+#define SNAP_TYPEMT 5 /* basic type -> its metatable or false */
+
+static lus_mutex_t g_statepool_mutex;
+static lua_State *g_statepool[LUS_WORKER_STATEPOOL];
+static int g_statepool_count = 0;
+static lus_atomic_t g_statepool_max = LUS_WORKER_STATEPOOL;
+
+/* Push a shallow copy of the table at 'idx' */
+static void snap_copy(lua_State *L, int idx) {
+  idx = lua_absindex(L, idx);
+  lua_newtable(L);
+  lua_pushnil(L);
+  while (lua_next(L, idx)) {
+    lua_pushvalue(L, -2);
+    lua_insert(L, -2);
+    lua_rawset(L, -4);
+  }
+}
+
+/* Record the table at 'idx' in the snapshot at 'snap' */
+static void snap_table(lua_State *L, int snap, int idx) {
+  idx = lua_absindex(L, idx);
+  lua_rawgeti(L, snap, SNAP_TABLES);
+  lua_pushvalue(L, idx);
+  if (lua_rawget(L, -2) != LUA_TNIL) {
+    lua_pop(L, 2);
+    return;
+  }
+  lua_pop(L, 1);
+  lua_pushvalue(L, idx);
+  snap_copy(L, idx);
+  lua_rawset(L, -3);
+  lua_rawgeti(L, snap, SNAP_METAS);
+  lua_pushvalue(L, idx);
+  if (!lua_getmetatable(L, idx))
+    lua_pushboolean(L, 0);
+  lua_rawset(L, -3);
+  lua_pop(L, 2);
+}
+
+/* Record the tables among the values of the table at 'idx' */
+static void snap_fields(lua_State *L, int snap, int idx) {
+  idx = lua_absindex(L, idx);
+  lua_pushnil(L);
+  while (lua_next(L, idx)) {
+    if (lua_type(L, -1) == LUA_TTABLE)
+      snap_table(L, snap, -1);
+    lua_pop(L, 1);
+  }
+}
+
+static int typesample(lua_State *L) {
+  (void)L;
+  return 0;
+}
+
+/* Push a value of basic type 'i' (for its metatable) */
+static void push_typesample(lua_State *L, int i) {
+  switch (i) {
+    case 0: lua_pushnil(L); break;
+    case 1: lua_pushboolean(L, 0); break;
+    case 2: lua_pushinteger(L, 0); break;
+    case 3: lua_pushliteral(L, ""); break;
+    default: lua_pushcfunction(L, typesample); break;
+  }
+}
+
+#define NTYPESAMPLES 5
+
+static int worker_snapshot(lua_State *L) {
+  int snap, i;
+  lua_createtable(L, 5, 0);
+  snap = lua_gettop(L);
+  lua_pushvalue(L, snap);
+  lua_setfield(L, LUA_REGISTRYINDEX, WORKER_SNAPSHOT);
+  lua_newtable(L);
+  lua_rawseti(L, snap, SNAP_TABLES);
+  lua_newtable(L);
+  lua_rawseti(L, snap, SNAP_METAS);
+  lua_pushglobaltable(L);
+  snap_copy(L, -1);
+  lua_rawseti(L, snap, SNAP_GLOBALS);
+  snap_table(L, snap, -1);
+  snap_fields(L, snap, -1);
+  lua_pop(L, 1);
+  snap_copy(L, LUA_REGISTRYINDEX);
+  lua_rawseti(L, snap, SNAP_REGISTRY);
+  lua_pushnil(L);
+  while (lua_next(L, LUA_REGISTRYINDEX)) {
+    if (lua_type(L, -2) == LUA_TSTRING && lua_type(L, -1) == LUA_TTABLE &&
+        !lua_rawequal(L, -1, snap))
+      snap_table(L, snap, -1);
+    lua_pop(L, 1);
+  }
+  lua_createtable(L, NTYPESAMPLES, 0);
+  for (i = 0; i < NTYPESAMPLES; i++) {
+    push_typesample(L, i);
+    if (lua_getmetatable(L, -1)) {
+      snap_table(L, snap, -1);
+      lua_remove(L, -2);
+    }
+    else {
+      lua_pop(L, 1);
+      lua_pushboolean(L, 0);
+    }
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_rawseti(L, snap, SNAP_TYPEMT);
+  return 0;
+}
+
+/*
+** Give the table at 't' back the contents of its copy at 'c'. Only keys
+** that changed are written, so untouched read-only tables stay intact.
+** With 'strkeys', only string keys are considered.
+*/
+static void snap_restore(lua_State *L, int t, int c, int strkeys) {
+  lua_pushnil(L);
+  while (lua_next(L, t)) {
+    if (!strkeys || lua_type(L, -2) == LUA_TSTRING) {
+      lua_pushvalue(L, -2);
+      lua_rawget(L, c);
+      if (!lua_rawequal(L, -1, -2)) { /* changed or new: reset it */
+        lua_pushvalue(L, -3);
+        lua_insert(L, -2);
+        lua_rawset(L, t); /* assigning existing fields is safe here */
+      }
+      else
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+  lua_pushnil(L);
+  while (lua_next(L, c)) { /* put back removed keys */
+    lua_pushvalue(L, -2);
+    if (lua_rawget(L, t) == LUA_TNIL) {
+      lua_pushvalue(L, -3);
+      lua_pushvalue(L, -3);
+      lua_rawset(L, t);
+    }
+    lua_pop(L, 2);
+  }
+}
+
+static int worker_reset(lua_State *L) {
+  int snap, i;
+  lua_sethook(L, NULL, 0, 0);
+  lua_gc(L, LUA_GCRESTART);
+  if (lua_getfield(L, LUA_REGISTRYINDEX, WORKER_SNAPSHOT) != LUA_TTABLE)
+    return luaL_error(L, "state has no snapshot");
+  snap = lua_gettop(L);
+  lua_rawgeti(L, snap, SNAP_REGISTRY);
+  snap_restore(L, LUA_REGISTRYINDEX, lua_gettop(L), 1);
+  lua_pop(L, 1);
+  lua_pushglobaltable(L);
+  lua_rawgeti(L, snap, SNAP_GLOBALS);
+  snap_restore(L, snap + 1, snap + 2, 0);
+  lua_pop(L, 2);
+  lua_rawgeti(L, snap, SNAP_TABLES);
+  lua_rawgeti(L, snap, SNAP_METAS);
+  lua_pushnil(L);
+  while (lua_next(L, snap + 1)) { /* table, copy */
+    int tb = lua_gettop(L) - 1;
+    snap_restore(L, tb, tb + 1, 0);
+    lua_pushvalue(L, tb);
+    lua_rawget(L, snap + 2); /* recorded metatable or false */
+    if (!lua_getmetatable(L, tb))
+      lua_pushboolean(L, 0);
+    if (!lua_rawequal(L, -1, -2)) {
+      lua_pop(L, 1);
+      if (!lua_toboolean(L, -1)) {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+      }
+      lua_setmetatable(L, tb);
+    }
+    else
+      lua_pop(L, 2);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 2);
+  lua_rawgeti(L, snap, SNAP_TYPEMT);
+  for (i = 0; i < NTYPESAMPLES; i++) {
+    push_typesample(L, i);
+    lua_rawgeti(L, -2, i + 1);
+    if (!lua_toboolean(L, -1)) {
+      lua_pop(L, 1);
+      lua_pushnil(L);
+    }
+    lua_setmetatable(L, -2);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 2);
+  lua_gc(L, LUA_GCCOLLECT); /* free the previous worker's objects */
+  return 0;
+}
+
+static void statepool_init(void) {
+  lus_mutex_init(&g_statepool_mutex);
+  g_statepool_count = 0;
+}
+
+static void statepool_clear(void) {
+  t_closingworker++;
+  while (g_statepool_count > 0)
+    lua_close(g_statepool[--g_statepool_count]);
+  t_closingworker--;
+  lus_mutex_destroy(&g_statepool_mutex);
+}
+
+static lua_State *statepool_take(void) {
+  lua_State *L = NULL;
+  lus_mutex_lock(&g_statepool_mutex);
+  if (g_statepool_count > 0)
+    L = g_statepool[--g_statepool_count];
+  lus_mutex_unlock(&g_statepool_mutex);
+  return L;
+}
+
+/* Reset 'L' and keep it for a later worker; returns 0 if it was not */
+static int statepool_give(lua_State *L) {
+  int kept, room;
+  if (lus_atomic_load(&g_pool.shutdown))
+    return 0;
+  lus_mutex_lock(&g_statepool_mutex);
+  room = (g_statepool_count < lus_atomic_load(&g_statepool_max));
+  lus_mutex_unlock(&g_statepool_mutex);
+  if (!room) /* don't pay for a reset that would be thrown away */
+    return 0;
+  lua_settop(L, 0);
+  lua_pushcfunction(L, worker_reset);
+  if (lua_pcall(L, 0, 0, 0) != LUA_OK)
+    return 0;
+  lus_mutex_lock(&g_statepool_mutex);
+  kept = (g_statepool_count < lus_atomic_load(&g_statepool_max));
+  if (kept)
+    g_statepool[g_statepool_count++] = L;
+  lus_mutex_unlock(&g_statepool_mutex);
+  return kept;
+}
+
+/* }====================================================== */
+
+/*
+** Create a worker state: run the setup callback, add the worker-side
+** functions and take the snapshot that lets the state be recycled (a
+** state without one is closed after use).
+*/
+static lua_State *worker_newstate(lua_State *parent) {
+  lua_State *L = luaL_newstate();
+  if (!L)
+    return NULL;
+
+  /* Call the setup callback if registered */
+  if (g_worker_setup) {
+    g_worker_setup(parent, L);
+  }
+
+  /* Register worker.message and worker.peek in the worker table */
+  lua_getglobal(L, "worker");
   if (!lua_istable(L, -1)) {
     lua_pop(L, 1);
     lua_newtable(L);
@@ -595,67 +2820,271 @@ static void worker_run(WorkerState *w) {
   lua_setfield(L, -2, "peek");
   lua_pop(L, 1);
 
+  lua_pushcfunction(L, worker_snapshot);
+  if (lua_pcall(L, 0, 0, 0) != LUA_OK) {
+    lua_pushnil(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, WORKER_SNAPSHOT);
+  }
+  lua_settop(L, 0);
+  return L;
+}
+
+/*
+** Body of the workers of 'worker.map' and 'worker.reduce'. It loads the
+** user's script once, then takes jobs from the 'jobs' channel until it
+** is closed, sending each job's result (or error) to 'results'. A job
+** is {index, mode, items, offset, count, init}: mode 0 maps every item,
+** 1 folds them with the script's function, and 2 folds them with its
+** combining function (the second value it returns, defaulting to the
+** first).
+*/
+static const char map_driver[] =
+    "local load, path, jobs, results = ...\n"
+    "local ok, f, combine = catch load(path)\n"
+    "if not ok then\n"
+    "  results:send({0, nil, f})\n"
+    "  return\n"
+    "end\n"
+    "combine = combine or f\n"
+    "local function run(job)\n"
+    "  local mode, items, offset, n = job[2], job[3], job[4], job[5]\n"
+    "  if mode == 0 then\n"
+    "    local out = {}\n"
+    "    for i = 1, n do out[i] = f(items[offset + i]) end\n"
+    "    return out\n"
+    "  end\n"
+    "  local fn = (mode == 2) and combine or f\n"
+    "  local acc, first = job[6], 1\n"
+    "  if acc == nil then acc, first = items[offset + 1], 2 end\n"
+    "  for i = first, n do acc = fn(acc, items[offset + i]) end\n"
+    "  return acc\n"
+    "end\n"
+    "while true do\n"
+    "  local job = jobs:receive()\n"
+    "  if job == nil then break end\n"
+    "  local ok, r = catch run(job)\n"
+    "  if ok then ok, r = catch results:send({job[1], r}) end\n"
+    "  if not ok then\n"
+    "    local sent = catch results:send({job[1], nil, r})\n"
+    "    if not sent then results:send({job[1], nil, \"error object is not a valid message\"}) end\n"
+    "  end\n"
+    "end\n";
+
+/* load(path): run a map script, returning its function(s) */
+static int map_load(lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  if (worker_loadscript(L, path, lus_issealed(L) ? "t" : "bt") != LUA_OK)
+    return lua_error(L);
+  lua_call(L, 0, 2);
+  if (lua_type(L, -2) != LUA_TFUNCTION)
+    return luaL_error(L, "%s: map script must return a function", path);
+  return 2;
+}
+
+/*
+** Preemption. A worker's script coroutine gets a count hook that is
+** installed but disarmed (empty mask), so it costs nothing while the
+** worker runs. Every quantum the pool's ticker thread looks for workers
+** that have run longer than that while others wait for a pool thread,
+** and sets their 'preempt' flag with a relaxed atomic store. The VM
+** checks the flag at jumps and arms the hook on the worker's own thread,
+** which then yields the worker back to the pool, behind the waiting
+** workers. A worker is only preempted
+** where it could park: not inside a 'catch', a nested coroutine or a
+** Lua function called from C; elsewhere the hook disarms and the ticker
+** tries again on its next round.
+*/
+static int g_conf_quantum = -1; /* ms; 0 = off, -1 = not set */
+static double g_quantum = 0;    /* seconds, fixed when the pool starts */
+
+static void worker_preempt(lua_State *L, lua_Debug *ar) {
+  PoolThread *self = t_self;
+  (void)ar;
+  L->hookmask = 0; /* disarm */
+  if (self != NULL && self->running != NULL && can_park(L, self->running))
+    lua_yield(L, 0); /* 'worker_run' queues it again */
+}
+
+/* Install the disarmed preemption hook on a script coroutine */
+static void worker_sethook(lua_State *co) {
+  co->hook = worker_preempt;
+  co->basehookcount = 1;
+  co->hookcount = 1;
+  co->hookmask = 0;
+}
+
+/*
+** Create the worker's Lua state and its script coroutine, with the
+** chunk and its initial arguments ready to be resumed. Returns 0 (with
+** the worker marked as failed) on error.
+*/
+static int worker_start(WorkerState *w) {
+  lua_State *L = (w->parent != NULL) ? statepool_take() : NULL;
+  int recycled = (L != NULL);
+  if (!recycled && (L = worker_newstate(w->parent)) == NULL) {
+    worker_finish(w, LUS_WORKER_ERROR, "failed to create Lua state");
+    return 0;
+  }
+  w->L = L;
+
+  /* Inherit the parent's pledges, then seal them. A worker must run with the
+  ** SAME permissions as its parent (it needs them e.g. to load its own script
+  ** file and to do whatever I/O the parent allowed) but must not be able to
+  ** grant itself MORE -- otherwise spawning a worker would be a sandbox escape
+  ** (the fresh state starts with an unsealed, empty store the worker could
+  ** pledge() itself out of). The copy uses the worker's own allocator. The
+  ** parent configures its pledges before spawning workers, so its store is
+  ** stable to read here. */
+  if (w->parent != NULL) {
+    PledgeStore *inherited = luaP_copypledges(L, w->parent->pledges);
+    if (inherited != NULL) {
+      luaP_freepledges(L, L->pledges); /* drop the fresh granter-only store */
+      L->pledges = inherited;
+    }
+    else if (recycled) { /* must not keep the last worker's pledges */
+      worker_finish(w, LUS_WORKER_ERROR, "out of memory");
+      return 0;
+    }
+  }
+  luaP_sealpledges(L); /* worker cannot escalate its own pledges */
+
+  /* Store worker state pointer in registry */
+  lua_pushlightuserdata(L, w);
+  lua_setfield(L, LUA_REGISTRYINDEX, "_WORKER_STATE");
+
+  /* The script runs in a coroutine (anchored on the state's stack) so
+  ** that it can park without holding a pool thread. */
+  lua_State *co = lua_newthread(L);
+
+  /* Load the script (a map worker runs the driver, which loads it) */
+  int status;
+  if (w->mapper) {
+    status = luaL_loadbufferx(co, map_driver, sizeof(map_driver) - 1,
+                              "=worker.map", "t");
+    if (status == LUA_OK)
+      lua_pushcfunction(co, map_load);
+  }
+  else
+    status = worker_loadscript(co, w->script_path,
+                               lus_issealed(L) ? "t" : "bt");
+  if (status != LUA_OK) {
+    const char *err = lua_tostring(co, -1);
+    worker_finish(w, LUS_WORKER_ERROR, err ? err : "unknown load error");
+    return 0;
+  }
+
   /* Deserialize and push initial arguments from inbox */
   int nargs = w->nargs;
   for (int i = 0; i < nargs; i++) {
-    StandaloneArena *arena;
-    char *data;
-    size_t size;
+    MessageNode m;
     lus_mutex_lock(&w->mutex);
-    int got = msgqueue_pop(&w->inbox, &arena, &data, &size);
-    lus_mutex_unlock(&w->mutex);
-    if (!got)
-      break; /* shouldn't happen if nargs was set correctly */
-    DeserBuffer db = {data, size, 0};
-    if (!deserialize_value(L, &db, 0)) {
-      luaA_freestandalone(arena);
-      lus_mutex_lock(&w->mutex);
-      w->status = LUS_WORKER_ERROR;
-      w->error_msg = strdup("failed to deserialize initial argument");
-      if (!w->error_msg)
-        w->status = LUS_WORKER_DEAD;
-      lus_cond_signal(&w->outbox_cond);
-      signal_recv_ctx(w); /* wake multi-worker select */
-      return;
+    int got = msgqueue_pop(&w->inbox, &m);
+    inbox_notify(w); /* releases the mutex */
+    if (!got) { /* shouldn't happen if nargs was set correctly */
+      w->nargs = i;
+      break;
+    }
+    if (!msg_deliver(co, &m)) {
+      worker_finish(w, LUS_WORKER_ERROR,
+                    "failed to deserialize initial argument");
+      return 0;
     }
-    luaA_freestandalone(arena);
   }
+  if (w->mapper)
+    w->nargs++; /* 'map_load' */
+  if (g_quantum > 0)
+    worker_sethook(co);
+  w->co = co;
+  return 1;
+}
 
-  /* Load and run the script */
-  if (luaL_loadfilex(L, w->script_path, lus_issealed(L) ? "t" : "bt") !=
-      LUA_OK) {
-    lus_mutex_lock(&w->mutex);
-    w->status = LUS_WORKER_ERROR;
-    const char *err = lua_tostring(L, -1);
-    w->error_msg = strdup(err ? err : "unknown load error");
-    if (!w->error_msg)
-      w->status = LUS_WORKER_DEAD;
-    lus_cond_signal(&w->outbox_cond); /* wake blocked receive */
-    signal_recv_ctx(w);               /* wake multi-worker select */
+/*
+** Drop the state of a finished worker, recycling it when possible. The
+** handle only needs the worker's status and outbox from now on.
+*/
+static void worker_release(WorkerState *w) {
+  lua_State *L = w->L;
+  w->L = NULL;
+  w->co = NULL;
+  if (L == NULL || (w->parent != NULL && statepool_give(L)))
     return;
-  }
+  t_closingworker++;
+  lua_close(L);
+  t_closingworker--;
+}
 
-  /* Move function below arguments */
-  if (nargs > 0) {
-    lua_insert(L, -(nargs + 1)); /* move chunk under args */
+/*
+** Run a worker's script until it ends or parks. A worker that yields
+** while waiting (for a message, a channel or room in a queue) is parked
+** (status BLOCKED) unless it was woken in the meantime; whoever wakes it
+** re-enqueues it. Any other yield from the script (or from preemption)
+** just gives the pool thread to the next runnable worker. Returns 1 when
+** the worker is finished.
+*/
+static int worker_run(WorkerState *w) {
+  int nargs = 0, nres;
+  w->last_thread = t_self->index;
+  if (w->co == NULL) { /* first run? */
+    if (!worker_start(w))
+      return 1;
+    nargs = w->nargs;
   }
-
-  if (lua_pcall(L, nargs, 0, 0) != LUA_OK) {
+  double t0 = clock_now();
+  if (g_quantum > 0) { /* let the ticker watch it */
+    lus_mutex_lock(&t_self->mutex);
+    t_self->running = w;
+    t_self->slice_end = t0 + g_quantum;
+    lus_mutex_unlock(&t_self->mutex);
+  }
+  lus_atomic_store(&t_self->busy, 1);
+  int status = lua_resume(w->co, w->L, nargs, &nres);
+  lus_atomic_store(&t_self->busy, 0);
+  lus_atomic_add(&w->runs, 1);
+  lus_atomic_add(&w->runtime, (long long)((clock_now() - t0) * 1e9));
+  if (g_quantum > 0) {
+    lus_mutex_lock(&t_self->mutex);
+    t_self->running = NULL;
+    lus_atomic32_storerelaxed(&w->co->preempt, 0); /* too late for it */
+    lus_mutex_unlock(&t_self->mutex);
+  }
+  if (status == LUA_YIELD) {
+    lua_pop(w->co, nres); /* discard yielded values */
     lus_mutex_lock(&w->mutex);
-    w->status = LUS_WORKER_ERROR;
-    const char *err = lua_tostring(L, -1);
-    w->error_msg = strdup(err ? err : "unknown runtime error");
-    if (!w->error_msg)
-      w->status = LUS_WORKER_DEAD;
-    lus_cond_signal(&w->outbox_cond); /* wake blocked receive */
-    signal_recv_ctx(w);               /* wake multi-worker select */
-    return;
+    if (w->waiting) {
+      w->status = LUS_WORKER_BLOCKED; /* park until woken */
+      lus_atomic_add(&g_pool.nparked, 1);
+      lus_mutex_unlock(&w->mutex);
+      return 0;
+    }
+    lus_mutex_unlock(&w->mutex);
+    pool_inject(w); /* still runnable: queue behind the others */
+    return 0;
+  }
+  if (status != LUA_OK) {
+    const char *err = lua_tostring(w->co, -1);
+    worker_finish(w, LUS_WORKER_ERROR, err ? err : "unknown runtime error");
   }
+  else
+    worker_finish(w, LUS_WORKER_DEAD, NULL);
+  return 1;
+}
 
-  lus_mutex_lock(&w->mutex);
-  w->status = LUS_WORKER_DEAD;
-  lus_cond_signal(&w->outbox_cond); /* wake blocked receive */
-  signal_recv_ctx(w);               /* wake multi-worker select */
+/*
+** Wake a worker after a message was posted to its inbox, or a channel or
+** queue it waits on changed. Call with the worker mutex locked; releases
+** it.
+*/
+static void worker_wake(WorkerState *w) {
+  int parked = (w->status == LUS_WORKER_BLOCKED);
+  if (parked) {
+    w->status = LUS_WORKER_RUNNING;
+    lus_atomic_add(&g_pool.nparked, -1);
+  }
+  w->waiting = 0; /* so that a worker about to park stays runnable */
+  lus_cond_signal(&w->inbox_cond); /* wake a pool thread blocked in peek */
+  lus_mutex_unlock(&w->mutex);
+  if (parked)
+    pool_enqueue(w);
 }
 
 /* Pool thread function */
@@ -664,13 +3093,16 @@ static DWORD WINAPI pool_thread_func(LPVOID arg) {
 #else
 static void *pool_thread_func(void *arg) {
 #endif
-  (void)arg;
+  PoolThread *self = (PoolThread *)arg;
+  t_self = self;
   while (1) {
-    WorkerState *w = pool_dequeue();
+    WorkerState *w = pool_dequeue(self);
     if (!w)
       break; /* shutdown */
-    worker_run(w);
-    worker_decref(w);
+    if (worker_run(w)) { /* finished: drop the state and the reference */
+      worker_release(w);
+      worker_decref(w);
+    }
   }
 #if defined(LUS_PLATFORM_WINDOWS)
   return 0;
@@ -679,63 +3111,930 @@ static void *pool_thread_func(void *arg) {
 #endif
 }
 
+/*
+** Ticker thread: every quantum, ask the workers whose time slice is over
+** to yield if any worker waits for a pool thread.
+*/
+#if defined(LUS_PLATFORM_WINDOWS)
+static DWORD WINAPI pool_ticker_func(LPVOID arg) {
+#else
+static void *pool_ticker_func(void *arg) {
+#endif
+  (void)arg;
+  lus_mutex_lock(&g_pool.tick_mutex);
+  while (!lus_atomic_load(&g_pool.shutdown)) {
+    cond_waituntil(&g_pool.tick_cond, &g_pool.tick_mutex,
+                   clock_now() + g_quantum);
+    if (lus_atomic_load(&g_pool.nqueued) == 0)
+      continue;
+    double now = clock_now();
+    for (int i = 0; i < g_pool.nthreads; i++) {
+      PoolThread *t = &g_pool.threads[i];
+      lus_mutex_lock(&t->mutex); /* keeps 'running' from finishing */
+      if (t->running != NULL && now >= t->slice_end)
+        lus_atomic32_storerelaxed(&t->running->co->preempt, 1);
+      lus_mutex_unlock(&t->mutex);
+    }
+  }
+  lus_mutex_unlock(&g_pool.tick_mutex);
+#if defined(LUS_PLATFORM_WINDOWS)
+  return 0;
+#else
+  return NULL;
+#endif
+}
+
+/*
+** Pool configuration, read when the pool starts. Settings made through
+** the C API take precedence over the environment (LUS_WORKER_THREADS,
+** LUS_WORKER_PIN), which takes precedence over the defaults.
+*/
+static int g_conf_threads = 0; /* 0 = automatic */
+static int g_conf_pin = -1;    /* -1 = not set */
+
+/* Value of environment variable 'name', unless 'L' ignores the
+   environment (lus -E) */
+static const char *pool_getenv(lua_State *L, const char *name) {
+  if (L != NULL) {
+    int noenv = (lua_getfield(L, LUA_REGISTRYINDEX, "LUA_NOENV") != LUA_TNIL &&
+                 lua_toboolean(L, -1));
+    lua_pop(L, 1);
+    if (noenv)
+      return NULL;
+  }
+  return getenv(name);
+}
+
+#if defined(LUS_PLATFORM_LINUX)
+/* Parse a sysfs list ("0-3,8,10-11") into 'set'; returns its size */
+static int parse_cpulist(const char *s, cpu_set_t *set) {
+  CPU_ZERO(set);
+  while (*s != '\0') {
+    char *end;
+    long first = strtol(s, &end, 10), last;
+    if (end == s)
+      break;
+    last = first;
+    if (*end == '-') {
+      s = end + 1;
+      last = strtol(s, &end, 10);
+      if (end == s)
+        break;
+    }
+    for (long c = first; c <= last && c < CPU_SETSIZE; c++) {
+      if (c >= 0)
+        CPU_SET((int)c, set);
+    }
+    s = end;
+    if (*s != ',')
+      break;
+    s++;
+  }
+  return CPU_COUNT(set);
+}
+
+/*
+** Get into 'set' the CPUs pool thread 'i' is pinned to in 'mode', among
+** those the process may use: with LUS_WORKER_PIN_CORES each thread gets
+** one CPU, in turn; with LUS_WORKER_PIN_NUMA threads are dealt out to
+** NUMA nodes in turn and may use all the CPUs of their node. Returns 0
+** if the thread is not to be pinned.
+*/
+static int pool_cpuset(int mode, int i, cpu_set_t *set) {
+  cpu_set_t allowed, nodes;
+  char buf[1024], path[64];
+  int n;
+  if (mode == LUS_WORKER_PIN_NONE ||
+      sched_getaffinity(0, sizeof(allowed), &allowed) != 0 ||
+      (n = CPU_COUNT(&allowed)) == 0)
+    return 0;
+  if (mode == LUS_WORKER_PIN_NUMA) {
+    int nnodes = 0, pass, target = -1;
+    if (!read_line("/sys/devices/system/node/online", buf, sizeof(buf)) ||
+        parse_cpulist(buf, &nodes) == 0)
+      return 0;
+    for (pass = 0; pass < 2; pass++) { /* count usable nodes, then pick */
+      int k = 0;
+      for (int node = 0; node < CPU_SETSIZE; node++) {
+        if (!CPU_ISSET(node, &nodes))
+          continue;
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+                 node);
+        if (!read_line(path, buf, sizeof(buf)) || parse_cpulist(buf, set) == 0)
+          continue;
+        CPU_AND(set, set, &allowed);
+        if (CPU_COUNT(set) == 0)
+          continue;
+        if (k++ == target)
+          return 1;
+      }
+      if (pass == 0) {
+        nnodes = k;
+        if (nnodes == 0)
+          return 0;
+        target = i % nnodes;
+      }
+    }
+    return 0;
+  }
+  /* LUS_WORKER_PIN_CORES: the (i % n)-th allowed CPU */
+  n = i % n;
+  for (int c = 0; c < CPU_SETSIZE; c++) {
+    if (CPU_ISSET(c, &allowed) && n-- == 0) {
+      CPU_ZERO(set);
+      CPU_SET(c, set);
+      return 1;
+    }
+  }
+  return 0;
+}
+#endif
+
 LUA_API void lus_worker_pool_init(lua_State *L) {
-  (void)L;
+  const char *env;
+  int pin;
   if (g_pool.initialized)
     return;
 
-  g_pool.nthreads = get_cpu_count();
-  if (g_pool.nthreads < 1)
-    g_pool.nthreads = 1;
-  if (g_pool.nthreads > 32)
-    g_pool.nthreads = 32;
+  g_pool.nthreads = g_conf_threads;
+  if (g_pool.nthreads == 0 &&
+      (env = pool_getenv(L, "LUS_WORKER_THREADS")) != NULL)
+    g_pool.nthreads = atoi(env);
+  if (g_pool.nthreads <= 0)
+    g_pool.nthreads = get_cpu_count();
+  if (g_pool.nthreads > LUS_WORKER_MAXTHREADS)
+    g_pool.nthreads = LUS_WORKER_MAXTHREADS;
+  if (g_conf_quantum < 0) {
+    env = pool_getenv(L, "LUS_WORKER_QUANTUM");
+    g_conf_quantum = (env != NULL) ? atoi(env) : LUS_WORKER_QUANTUM;
+    if (g_conf_quantum < 0)
+      g_conf_quantum = 0;
+  }
+  g_quantum = (double)g_conf_quantum / 1000.0;
+  pin = g_conf_pin;
+  if (pin < 0) {
+    env = pool_getenv(L, "LUS_WORKER_PIN");
+    if (env != NULL && strcmp(env, "cores") == 0)
+      pin = LUS_WORKER_PIN_CORES;
+    else if (env != NULL && strcmp(env, "numa") == 0)
+      pin = LUS_WORKER_PIN_NUMA;
+    else
+      pin = LUS_WORKER_PIN_NONE;
+  }
 
   g_pool.threads =
-      (lus_thread_t *)malloc(sizeof(lus_thread_t) * g_pool.nthreads);
+      (PoolThread *)calloc((size_t)g_pool.nthreads, sizeof(PoolThread));
   lus_mutex_init(&g_pool.queue_mutex);
-  lus_cond_init(&g_pool.queue_cond);
+  codecache_init();
+  statepool_init();
   g_pool.runnable_head = NULL;
   g_pool.runnable_tail = NULL;
-  g_pool.shutdown = 0;
+  lus_atomic_store(&g_pool.nglobal, 0);
+  lus_atomic_store(&g_pool.nqueued, 0);
+  lus_atomic_store(&g_pool.nsleeping, 0);
+  lus_atomic_store(&g_pool.shutdown, 0);
 
   for (int i = 0; i < g_pool.nthreads; i++) {
+    PoolThread *t = &g_pool.threads[i];
+    t->index = i;
+    t->seed = (unsigned int)i * 2654435761u + 1;
+    lus_mutex_init(&t->mutex);
+    lus_cond_init(&t->cond);
+  }
+  for (int i = 0; i < g_pool.nthreads; i++) {
+    PoolThread *t = &g_pool.threads[i];
+#if defined(LUS_PLATFORM_WINDOWS)
+    t->thread = CreateThread(NULL, 0, pool_thread_func, t, 0, NULL);
+#else
+    pthread_create(&t->thread, NULL, pool_thread_func, t);
+#if defined(LUS_PLATFORM_LINUX)
+    cpu_set_t set;
+    if (pool_cpuset(pin, i, &set))
+      pthread_setaffinity_np(t->thread, sizeof(set), &set);
+#endif
+#endif
+  }
+  (void)pin; /* no pinning on other platforms */
+  if (g_quantum > 0) {
+    lus_mutex_init(&g_pool.tick_mutex);
+    lus_cond_init(&g_pool.tick_cond);
 #if defined(LUS_PLATFORM_WINDOWS)
-    g_pool.threads[i] = CreateThread(NULL, 0, pool_thread_func, NULL, 0, NULL);
+    g_pool.ticker = CreateThread(NULL, 0, pool_ticker_func, NULL, 0, NULL);
 #else
-    pthread_create(&g_pool.threads[i], NULL, pool_thread_func, NULL);
+    pthread_create(&g_pool.ticker, NULL, pool_ticker_func, NULL);
 #endif
   }
 
   g_pool.initialized = 1;
 }
 
+LUA_API int lus_worker_threads(int n) {
+  int old = g_conf_threads;
+  if (n >= 0)
+    g_conf_threads = (n > LUS_WORKER_MAXTHREADS) ? LUS_WORKER_MAXTHREADS : n;
+  return old;
+}
+
+LUA_API int lus_worker_quantum(int ms) {
+  int old = (g_conf_quantum < 0) ? LUS_WORKER_QUANTUM : g_conf_quantum;
+  if (ms >= 0)
+    g_conf_quantum = ms;
+  return old;
+}
+
+LUA_API int lus_worker_pinning(int mode) {
+  int old = (g_conf_pin < 0) ? LUS_WORKER_PIN_NONE : g_conf_pin;
+  if (mode >= 0)
+    g_conf_pin = (mode > LUS_WORKER_PIN_NUMA) ? LUS_WORKER_PIN_NONE : mode;
+  return old;
+}
+
+static void waitlot_clear(void);
+
 LUA_API void lus_worker_pool_shutdown(void) {
-  if (!g_pool.initialized)
+  if (!g_pool.initialized || t_closingworker)
     return;
 
-  lus_mutex_lock(&g_pool.queue_mutex);
-  g_pool.shutdown = 1;
-  lus_cond_broadcast(&g_pool.queue_cond);
-  lus_mutex_unlock(&g_pool.queue_mutex);
+  lus_atomic_store(&g_pool.shutdown, 1);
+  for (int i = 0; i < g_pool.nthreads; i++)
+    pool_wakethread(&g_pool.threads[i]);
+  if (g_quantum > 0) {
+    lus_mutex_lock(&g_pool.tick_mutex);
+    lus_cond_signal(&g_pool.tick_cond);
+    lus_mutex_unlock(&g_pool.tick_mutex);
+#if defined(LUS_PLATFORM_WINDOWS)
+    WaitForSingleObject(g_pool.ticker, INFINITE);
+    CloseHandle(g_pool.ticker);
+#else
+    pthread_join(g_pool.ticker, NULL);
+#endif
+    lus_cond_destroy(&g_pool.tick_cond);
+    lus_mutex_destroy(&g_pool.tick_mutex);
+  }
 
   for (int i = 0; i < g_pool.nthreads; i++) {
+    PoolThread *t = &g_pool.threads[i];
 #if defined(LUS_PLATFORM_WINDOWS)
-    WaitForSingleObject(g_pool.threads[i], INFINITE);
-    CloseHandle(g_pool.threads[i]);
+    WaitForSingleObject(t->thread, INFINITE);
+    CloseHandle(t->thread);
 #else
-    pthread_join(g_pool.threads[i], NULL);
+    pthread_join(t->thread, NULL);
 #endif
+    lus_cond_destroy(&t->cond);
+    lus_mutex_destroy(&t->mutex);
   }
 
   free(g_pool.threads);
-  lus_cond_destroy(&g_pool.queue_cond);
   lus_mutex_destroy(&g_pool.queue_mutex);
+  codecache_clear();
+  statepool_clear();
+  waitlot_clear();
   g_pool.initialized = 0;
 }
 
-LUA_API void lus_onworker(lua_State *L, lus_WorkerSetup fn) {
-  (void)L;
-  g_worker_setup = fn;
+LUA_API void lus_onworker(lua_State *L, lus_WorkerSetup fn) {
+  (void)L;
+  g_worker_setup = fn;
+}
+
+LUA_API int lus_worker_statepool(int max) {
+  int old = (int)lus_atomic_load(&g_statepool_max);
+  if (max >= 0)
+    lus_atomic_store(&g_statepool_max,
+                     (max < LUS_WORKER_STATEPOOL) ? max : LUS_WORKER_STATEPOOL);
+  return old;
+}
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Channels
+** =======================================================
+*/
+
+/*
+** The ring is Vyukov's bounded MPMC queue. Slot i is ready for a writer
+** at position p when its 'seq' is p, and for a reader when it is p + 1;
+** a reader hands it to the writer of position p + size. A writer first
+** claims a position by advancing 'tail', then serializes its value
+** straight into the slot, so a value that fails to serialize leaves an
+** empty message that readers skip. When the capacity is not a power of
+** 2, the ring is rounded up and writers also check the distance to
+** 'head'.
+**
+** Waiting: a waiter registers itself in a list and then checks the
+** channel again; whoever changes the channel wakes the whole list after
+** the change. Both sides use sequentially consistent atomics ('count'
+** of the list, slot 'seq'), so one of them sees the other. Registrations
+** are one-shot: waking removes them. Parked workers are referenced by
+** their registrations; blocked threads are signaled with the channel
+** mutex held, so they can unregister and drop their context safely.
+*/
+
+static Channel *chan_new(long long capacity) {
+  Channel *c = (Channel *)malloc(sizeof(Channel));
+  long long size = 2;
+  if (c == NULL)
+    return NULL;
+  while (size < capacity)
+    size *= 2;
+  memset(c, 0, sizeof(Channel));
+  c->slots = (ChanSlot *)malloc((size_t)size * sizeof(ChanSlot));
+  if (c->slots == NULL) {
+    free(c);
+    return NULL;
+  }
+  for (long long i = 0; i < size; i++)
+    lus_atomic_store(&c->slots[i].seq, i);
+  c->capacity = capacity;
+  c->mask = size - 1;
+  lus_atomic_store(&c->refcount, 1);
+  lus_mutex_init(&c->mutex);
+  return c;
+}
+
+/* Claim the next position for writing; returns its slot, or NULL if full */
+static ChanSlot *chan_claim(Channel *c, long long *ppos) {
+  long long pos = lus_atomic_load(&c->tail);
+  for (;;) {
+    ChanSlot *slot = &c->slots[pos & c->mask];
+    long long dif = lus_atomic_load(&slot->seq) - pos;
+    if (dif == 0) {
+      if (c->capacity <= c->mask &&
+          pos - lus_atomic_load(&c->head) >= c->capacity)
+        return NULL; /* full below the ring size */
+      if (lus_atomic_cas(&c->tail, pos, pos + 1)) {
+        *ppos = pos;
+        return slot;
+      }
+    }
+    else if (dif < 0)
+      return NULL; /* full */
+    pos = lus_atomic_load(&c->tail);
+  }
+}
+
+static void chan_publish(ChanSlot *slot, long long pos, const MessageNode *m) {
+  slot->msg = *m;
+  lus_atomic_store(&slot->seq, pos + 1);
+}
+
+/* Take the next message; returns 0 if there is none (yet) */
+static int chan_pop(Channel *c, MessageNode *m) {
+  long long pos = lus_atomic_load(&c->head);
+  for (;;) {
+    ChanSlot *slot = &c->slots[pos & c->mask];
+    long long dif = lus_atomic_load(&slot->seq) - (pos + 1);
+    if (dif == 0) {
+      if (lus_atomic_cas(&c->head, pos, pos + 1)) {
+        *m = slot->msg;
+        lus_atomic_store(&slot->seq, pos + c->mask + 1);
+        return 1;
+      }
+    }
+    else if (dif < 0)
+      return 0; /* empty */
+    pos = lus_atomic_load(&c->head);
+  }
+}
+
+/* Can a reader (or a writer) make progress? */
+static int chan_ready(Channel *c, int writing) {
+  long long pos;
+  if (lus_atomic_load(&c->closed))
+    return 1;
+  if (writing) {
+    pos = lus_atomic_load(&c->tail);
+    return lus_atomic_load(&c->slots[pos & c->mask].seq) == pos &&
+           pos - lus_atomic_load(&c->head) < c->capacity;
+  }
+  pos = lus_atomic_load(&c->head);
+  return lus_atomic_load(&c->slots[pos & c->mask].seq) == pos + 1;
+}
+
+static void chan_incref(Channel *c) {
+  lus_atomic_add(&c->refcount, 1);
+}
+
+static void chan_decref(Channel *c) {
+  MessageNode m;
+  if (lus_atomic_addfetch(&c->refcount, -1) != 0)
+    return;
+  while (chan_pop(c, &m)) {
+    if (m.arena != NULL)
+      msg_release(&m);
+  }
+  /* only parked workers can still be registered (threads hold a handle) */
+  for (int i = 0; i < c->readers.n; i++)
+    worker_decref(c->readers.items[i].w);
+  for (int i = 0; i < c->writers.n; i++)
+    worker_decref(c->writers.items[i].w);
+  free(c->readers.items);
+  free(c->writers.items);
+  lus_mutex_destroy(&c->mutex);
+  free(c->slots);
+  free(c);
+}
+
+/* Register a waiter unless it is already registered */
+static int chan_register(Channel *c, ChanWaitList *wl, WorkerState *w,
+                         ReceiveContext *ctx) {
+  int i;
+  lus_mutex_lock(&c->mutex);
+  for (i = 0; i < wl->n; i++) {
+    if (wl->items[i].w == w && wl->items[i].ctx == ctx) {
+      lus_mutex_unlock(&c->mutex);
+      return 1;
+    }
+  }
+  if (wl->n == wl->cap) {
+    int newcap = (wl->cap == 0) ? 4 : wl->cap * 2;
+    ChanWaiter *ni = (ChanWaiter *)realloc(wl->items,
+                                           newcap * sizeof(ChanWaiter));
+    if (ni == NULL) {
+      lus_mutex_unlock(&c->mutex);
+      return 0;
+    }
+    wl->items = ni;
+    wl->cap = newcap;
+  }
+  if (w != NULL)
+    worker_incref(w);
+  wl->items[wl->n].w = w;
+  wl->items[wl->n].ctx = ctx;
+  wl->n++;
+  lus_atomic_store(&wl->count, wl->n);
+  lus_mutex_unlock(&c->mutex);
+  return 1;
+}
+
+static void chan_unregister(Channel *c, ChanWaitList *wl, WorkerState *w,
+                            ReceiveContext *ctx) {
+  int found = 0;
+  lus_mutex_lock(&c->mutex);
+  for (int i = 0; i < wl->n; i++) {
+    if (wl->items[i].w == w && wl->items[i].ctx == ctx) {
+      wl->items[i] = wl->items[--wl->n];
+      lus_atomic_store(&wl->count, wl->n);
+      found = 1;
+      break;
+    }
+  }
+  lus_mutex_unlock(&c->mutex);
+  if (found && w != NULL)
+    worker_decref(w);
+}
+
+/* Wake and drop every waiter of 'wl' */
+static void chan_wake(Channel *c, ChanWaitList *wl) {
+  ChanWaiter *items;
+  int n;
+  if (lus_atomic_load(&wl->count) == 0)
+    return;
+  lus_mutex_lock(&c->mutex);
+  items = wl->items;
+  n = wl->n;
+  for (int i = 0; i < n; i++) {
+    if (items[i].w != NULL) {
+      lus_mutex_lock(&items[i].w->mutex);
+      worker_wake(items[i].w); /* releases the mutex */
+    }
+    else {
+      ReceiveContext *ctx = items[i].ctx;
+      lus_mutex_lock(&ctx->mutex);
+      ctx->ready = 1;
+      lus_cond_signal(&ctx->cond);
+      lus_mutex_unlock(&ctx->mutex);
+    }
+  }
+  wl->items = NULL;
+  wl->n = wl->cap = 0;
+  lus_atomic_store(&wl->count, 0);
+  lus_mutex_unlock(&c->mutex);
+  for (int i = 0; i < n; i++) {
+    if (items[i].w != NULL)
+      worker_decref(items[i].w);
+  }
+  free(items);
+}
+
+static WorkerState *current_worker(lua_State *L) {
+  WorkerState *w;
+  lua_getfield(L, LUA_REGISTRYINDEX, "_WORKER_STATE");
+  w = (WorkerState *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return w;
+}
+
+/*
+** Wait until one of the 'n' channels in 'cs' may let a reader (or a
+** writer) progress. A worker that can park yields and resumes in 'k',
+** which must drop its registrations with 'chan_unwait' and retry; other
+** callers block their thread and return, and then retry.
+*/
+static void chan_wait(lua_State *L, Channel **cs, int n, int writing,
+                      lua_KFunction k) {
+  WorkerState *w = current_worker(L);
+  ReceiveContext ctx;
+  int i, ready = 0;
+  if (w != NULL && can_park(L, w)) {
+    lus_mutex_lock(&w->mutex);
+    w->waiting = 1; /* a wake from now on keeps the worker runnable */
+    lus_mutex_unlock(&w->mutex);
+    for (i = 0; i < n && !ready; i++) {
+      if (!chan_register(cs[i], writing ? &cs[i]->writers : &cs[i]->readers,
+                         w, NULL))
+        ready = 1; /* out of memory: poll */
+      ready = ready || chan_ready(cs[i], writing);
+    }
+    if (!ready) {
+      lua_yieldk(L, 0, 0, k);
+      return; /* not reached */
+    }
+    lus_mutex_lock(&w->mutex);
+    w->waiting = 0;
+    lus_mutex_unlock(&w->mutex);
+    while (i-- > 0)
+      chan_unregister(cs[i], writing ? &cs[i]->writers : &cs[i]->readers, w,
+                      NULL);
+    return;
+  }
+  lus_mutex_init(&ctx.mutex);
+  lus_cond_init(&ctx.cond);
+  ctx.ready = 0;
+  for (i = 0; i < n && !ready; i++) {
+    if (!chan_register(cs[i], writing ? &cs[i]->writers : &cs[i]->readers,
+                       NULL, &ctx))
+      ready = 1;
+    ready = ready || chan_ready(cs[i], writing);
+  }
+  if (!ready) {
+    lus_mutex_lock(&ctx.mutex);
+    while (!ctx.ready)
+      lus_cond_wait(&ctx.cond, &ctx.mutex);
+    lus_mutex_unlock(&ctx.mutex);
+  }
+  while (i-- > 0)
+    chan_unregister(cs[i], writing ? &cs[i]->writers : &cs[i]->readers, NULL,
+                    &ctx);
+  lus_cond_destroy(&ctx.cond);
+  lus_mutex_destroy(&ctx.mutex);
+}
+
+/* Drop what a parked worker left registered when it was woken */
+static void chan_unwait(lua_State *L, Channel **cs, int n, int writing) {
+  WorkerState *w = current_worker(L);
+  for (int i = 0; i < n; i++)
+    chan_unregister(cs[i], writing ? &cs[i]->writers : &cs[i]->readers, w,
+                    NULL);
+}
+
+/*
+** Receive from 'c' without waiting: pushes the value and returns 1, or
+** returns 0 if it is empty, -1 if it is also closed.
+*/
+static int chan_tryreceive(lua_State *L, Channel *c) {
+  MessageNode m;
+  for (;;) {
+    int closed = (int)lus_atomic_load(&c->closed);
+    if (!chan_pop(c, &m))
+      return closed ? -1 : 0;
+    chan_wake(c, &c->writers);
+    if (m.arena == NULL)
+      continue; /* a failed send */
+    if (!msg_deliver(L, &m))
+      luaL_error(L, "failed to deserialize message");
+    return 1;
+  }
+}
+
+static int chan_buildaux(lua_State *L) {
+  msg_build(L, 1, (MessageNode *)lua_touserdata(L, 2));
+  return 0;
+}
+
+/* Send the value at 'idx' without waiting; returns 0 if 'c' is full */
+static int chan_trysend(lua_State *L, Channel *c, int idx) {
+  MessageNode m;
+  long long pos;
+  ChanSlot *slot;
+  if (lus_atomic_load(&c->closed))
+    luaL_error(L, "attempt to send on a closed channel");
+  slot = chan_claim(c, &pos);
+  if (slot == NULL)
+    return 0;
+  lua_pushcfunction(L, chan_buildaux);
+  lua_pushvalue(L, idx);
+  lua_pushlightuserdata(L, &m);
+  if (lua_pcall(L, 2, 0, 0) != LUA_OK) {
+    memset(&m, 0, sizeof(m)); /* the position is taken: fill it */
+    chan_publish(slot, pos, &m);
+    chan_wake(c, &c->readers);
+    lua_error(L);
+  }
+  chan_publish(slot, pos, &m);
+  chan_wake(c, &c->readers);
+  return 1;
+}
+
+static void chan_close(Channel *c) {
+  lus_atomic_store(&c->closed, 1);
+  chan_wake(c, &c->readers);
+  chan_wake(c, &c->writers);
+}
+
+/*
+** Push the handle of channel 'c', taking a new reference unless the
+** state already has one.
+*/
+static void chan_pushhandle(lua_State *L, Channel *c) {
+  Channel **pc;
+  if (lua_getfield(L, LUA_REGISTRYINDEX, CHANNEL_CACHE) != LUA_TTABLE) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, CHANNEL_CACHE);
+  }
+  if (lua_rawgetp(L, -1, c) == LUA_TUSERDATA) {
+    lua_remove(L, -2);
+    return;
+  }
+  lua_pop(L, 1);
+  pc = (Channel **)lua_newuserdatauv(L, sizeof(Channel *), 0);
+  *pc = c;
+  chan_incref(c);
+  luaL_setmetatable(L, CHANNEL_METATABLE);
+  lua_pushvalue(L, -1);
+  lua_rawsetp(L, -3, c);
+  lua_remove(L, -2);
+}
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Waiting on Shared Vectors
+** =======================================================
+*/
+
+/*
+** 'worker.wait' and 'worker.notify' work like futexes over the slots of
+** shared vectors, through a parking lot: waiters are listed in a bucket
+** picked by the address of their slot, and the bucket's lock makes
+** checking the slot and listing the waiter one step, so a notify cannot
+** slip in between. Notifying unlinks waiters, so a waiter still linked
+** was not notified. A parked worker's waiter is allocated and holds a
+** reference to the worker, which the notifier drops; a blocked thread's
+** waiter lives on its stack.
+*/
+
+#define WAITLOT_SIZE 64
+
+typedef struct LotWaiter {
+  struct LotWaiter *prev;
+  struct LotWaiter *next;
+  const char *addr;    /* slot waited on */
+  WorkerState *w;      /* parked worker, or NULL */
+  ReceiveContext *ctx; /* blocked thread, or NULL */
+  int linked;          /* 1 = in its bucket, not notified */
+} LotWaiter;
+
+typedef struct LotBucket {
+  lus_mutex_t mutex;
+  LotWaiter *head; /* oldest waiter: notified first */
+  LotWaiter *tail;
+} LotBucket;
+
+static LotBucket g_waitlot[WAITLOT_SIZE];
+static int g_waitlot_initialized = 0;
+
+/* Called by the host thread when the library opens, before any worker */
+static void waitlot_init(void) {
+  if (g_waitlot_initialized)
+    return;
+  for (int i = 0; i < WAITLOT_SIZE; i++) {
+    lus_mutex_init(&g_waitlot[i].mutex);
+    g_waitlot[i].head = g_waitlot[i].tail = NULL;
+  }
+  g_waitlot_initialized = 1;
+}
+
+static LotBucket *waitlot_bucket(const char *addr) {
+  return &g_waitlot[serref_hash(addr, WAITLOT_SIZE)];
+}
+
+static void waitlot_link(LotBucket *bk, LotWaiter *wt) {
+  wt->prev = bk->tail;
+  wt->next = NULL;
+  if (bk->tail != NULL)
+    bk->tail->next = wt;
+  else
+    bk->head = wt;
+  bk->tail = wt;
+  wt->linked = 1;
+}
+
+static void waitlot_unlink(LotBucket *bk, LotWaiter *wt) {
+  if (wt->prev != NULL)
+    wt->prev->next = wt->next;
+  else
+    bk->head = wt->next;
+  if (wt->next != NULL)
+    wt->next->prev = wt->prev;
+  else
+    bk->tail = wt->prev;
+  wt->linked = 0;
+}
+
+/*
+** Drop the workers still parked when the pool shuts down: nothing can
+** run them any more. (Threads are joined, so no waiter is blocked.)
+*/
+static void waitlot_clear(void) {
+  if (!g_waitlot_initialized)
+    return;
+  for (int i = 0; i < WAITLOT_SIZE; i++) {
+    LotBucket *bk = &g_waitlot[i];
+    while (bk->head != NULL) {
+      LotWaiter *wt = bk->head;
+      waitlot_unlink(bk, wt);
+      worker_decref(wt->w);
+      free(wt);
+    }
+  }
+}
+
+/*
+** Check that argument 1 is a shared vector and argument 2 the offset of
+** a slot in it, of 'size' bytes or of the size in argument 'sizearg'
+** (default 8) if that is not 0, and return the slot's address.
+*/
+static char *check_slot(lua_State *L, int sizearg, int *size) {
+  Vector *v;
+  lua_Integer offset, sz = *size;
+  luaL_argexpected(L, lua_isvector(L, 1), 1, "vector");
+  v = vecvalue(ser_value(L, 1));
+  luaL_argcheck(L, luaV_isshared(v), 1, "shared vector expected");
+  offset = luaL_checkinteger(L, 2);
+  if (sizearg != 0) {
+    sz = luaL_optinteger(L, sizearg, 8);
+    luaL_argcheck(L, sz == 4 || sz == 8, sizearg, "size must be 4 or 8");
+  }
+  luaL_argcheck(L, offset >= 0 && (size_t)offset <= v->len &&
+                   v->len - (size_t)offset >= (size_t)sz, 2,
+                "offset out of bounds");
+  luaL_argcheck(L, offset % sz == 0, 2, "offset is not aligned");
+  *size = (int)sz;
+  return v->data + offset;
+}
+
+static int lib_wait(lua_State *L);
+
+/* A parked waiter resumes here */
+static int wait_k(lua_State *L, int status, lua_KContext ctx) {
+  LotWaiter *wt = (LotWaiter *)ctx;
+  LotBucket *bk = waitlot_bucket(wt->addr);
+  int notified;
+  (void)status;
+  lus_mutex_lock(&bk->mutex);
+  notified = !wt->linked;
+  if (!notified)
+    waitlot_unlink(bk, wt);
+  lus_mutex_unlock(&bk->mutex);
+  if (!notified) { /* woken for some other reason: wait again */
+    worker_decref(wt->w);
+    free(wt);
+    return lib_wait(L);
+  }
+  free(wt);
+  lua_pushliteral(L, "ok");
+  return 1;
+}
+
+/*
+** worker.wait(v, offset, expected [, size [, timeout]]): sleep until a
+** notify on the slot, unless it does not hold 'expected'. A worker that
+** can park yields its thread meanwhile; with a timeout, it blocks it
+** like any other caller.
+*/
+static int lib_wait(lua_State *L) {
+  int size = 0, timedout = 0;
+  char *p = check_slot(L, 4, &size);
+  lua_Integer expected = luaL_checkinteger(L, 3);
+  double deadline = -1; /* no timeout */
+  WorkerState *w = current_worker(L);
+  LotBucket *bk = waitlot_bucket(p);
+  ReceiveContext ctx;
+  LotWaiter wt;
+  if (!lua_isnoneornil(L, 5)) {
+    lua_Number timeout = luaL_checknumber(L, 5);
+    luaL_argcheck(L, timeout >= 0, 5, "timeout must be non-negative");
+    deadline = clock_now() + (double)timeout;
+  }
+  lus_mutex_lock(&bk->mutex);
+  if (luaV_atomicload(p, size) != expected) {
+    lus_mutex_unlock(&bk->mutex);
+    lua_pushliteral(L, "not-equal");
+    return 1;
+  }
+  if (deadline < 0 && w != NULL && can_park(L, w)) {
+    LotWaiter *pw = (LotWaiter *)malloc(sizeof(LotWaiter));
+    if (pw != NULL) { /* else block the thread */
+      lus_mutex_lock(&w->mutex);
+      w->waiting = 1; /* a wake from now on keeps the worker runnable */
+      lus_mutex_unlock(&w->mutex);
+      worker_incref(w);
+      pw->addr = p;
+      pw->w = w;
+      pw->ctx = NULL;
+      waitlot_link(bk, pw);
+      lus_mutex_unlock(&bk->mutex);
+      return lua_yieldk(L, 0, (lua_KContext)pw, wait_k);
+    }
+  }
+  lus_mutex_init(&ctx.mutex);
+  lus_cond_init(&ctx.cond);
+  ctx.ready = 0;
+  wt.addr = p;
+  wt.w = NULL;
+  wt.ctx = &ctx;
+  waitlot_link(bk, &wt);
+  lus_mutex_unlock(&bk->mutex);
+  lus_mutex_lock(&ctx.mutex);
+  while (!ctx.ready && !timedout) {
+    if (deadline < 0)
+      lus_cond_wait(&ctx.cond, &ctx.mutex);
+    else
+      timedout = !cond_waituntil(&ctx.cond, &ctx.mutex, deadline);
+  }
+  lus_mutex_unlock(&ctx.mutex);
+  lus_mutex_lock(&bk->mutex);
+  timedout = wt.linked; /* a notify may have come in the meantime */
+  if (timedout)
+    waitlot_unlink(bk, &wt);
+  lus_mutex_unlock(&bk->mutex);
+  lus_cond_destroy(&ctx.cond);
+  lus_mutex_destroy(&ctx.mutex);
+  if (timedout)
+    lua_pushliteral(L, "timed-out");
+  else
+    lua_pushliteral(L, "ok");
+  return 1;
+}
+
+/*
+** worker.notify(v, offset [, count]): wake up to 'count' (default all)
+** waiters on the slot, oldest first; returns how many it woke.
+*/
+static int lib_notify(lua_State *L) {
+  int size = 4; /* the smallest slot */
+  char *p = check_slot(L, 0, &size);
+  lua_Integer count = luaL_optinteger(L, 3, LUA_MAXINTEGER);
+  LotBucket *bk = waitlot_bucket(p);
+  lua_Integer n = 0;
+  int more;
+  luaL_argcheck(L, count >= 0, 3, "count must be non-negative");
+  do { /* drop worker references in batches, outside the lock */
+    WorkerState *woken[32];
+    int nw = 0;
+    LotWaiter *wt, *next;
+    more = 0;
+    lus_mutex_lock(&bk->mutex);
+    for (wt = bk->head; wt != NULL && n < count; wt = next) {
+      next = wt->next;
+      if (wt->addr != p)
+        continue;
+      if (wt->w != NULL && nw == 32) {
+        more = 1;
+        break;
+      }
+      waitlot_unlink(bk, wt);
+      n++;
+      if (wt->w != NULL) { /* 'wt' is the worker's from now on */
+        WorkerState *ww = wt->w;
+        woken[nw++] = ww;
+        lus_mutex_lock(&ww->mutex);
+        worker_wake(ww); /* releases the mutex */
+      }
+      else {
+        ReceiveContext *ctx = wt->ctx;
+        lus_mutex_lock(&ctx->mutex);
+        ctx->ready = 1;
+        lus_cond_signal(&ctx->cond);
+        lus_mutex_unlock(&ctx->mutex);
+      }
+    }
+    lus_mutex_unlock(&bk->mutex);
+    while (nw > 0)
+      worker_decref(woken[--nw]);
+  } while (more);
+  lua_pushinteger(L, n);
+  return 1;
 }
 
 /* }====================================================== */
@@ -771,17 +4070,12 @@ static int lib_create(lua_State *L) {
   /* Serialize initial arguments (varargs after path) */
   int nargs = lua_gettop(L) - 1;
   for (int i = 2; i <= nargs + 1; i++) {
-    SerBuffer buf;
-    serbuf_init(&buf);
-    if (!serialize_value(L, i, &buf, 0)) {
-      worker_decref(w);
-      serbuf_free(&buf);
-      return lua_error(L);
-    }
+    MessageNode m;
+    msg_build(L, i, &m);
     lus_mutex_lock(&w->mutex);
-    if (!msgqueue_push(&w->inbox, buf.arena, buf.data, buf.size)) {
+    if (!msgqueue_push(&w->inbox, &m)) {
       lus_mutex_unlock(&w->mutex);
-      serbuf_free(&buf);
+      msg_release(&m);
       worker_decref(w);
       return luaL_error(L, "out of memory");
     }
@@ -817,16 +4111,81 @@ static int lib_status(lua_State *L) {
   return 1;
 }
 
-/* worker.receive(w1, w2, ...) - select-style */
+/*
+** worker.stats([w]): a snapshot of the pool, or of worker 'w'
+*/
+static int lib_stats(lua_State *L) {
+  if (lua_isnoneornil(L, 1)) {
+    lus_WorkerPoolStats s;
+    lus_worker_stats(&s);
+    lua_createtable(L, 0, 10);
+    lua_pushinteger(L, s.threads);
+    lua_setfield(L, -2, "threads");
+    lua_pushinteger(L, s.sleeping);
+    lua_setfield(L, -2, "sleeping");
+    lua_pushinteger(L, (lua_Integer)s.workers);
+    lua_setfield(L, -2, "workers");
+    lua_pushinteger(L, (lua_Integer)s.running);
+    lua_setfield(L, -2, "running");
+    lua_pushinteger(L, (lua_Integer)s.runnable);
+    lua_setfield(L, -2, "runnable");
+    lua_pushinteger(L, (lua_Integer)s.parked);
+    lua_setfield(L, -2, "parked");
+    lua_pushinteger(L, (lua_Integer)s.messages);
+    lua_setfield(L, -2, "messages");
+    lua_pushinteger(L, (lua_Integer)s.bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_pushnumber(L, (lua_Number)s.serialize);
+    lua_setfield(L, -2, "serialize");
+    lua_pushnumber(L, (lua_Number)s.deserialize);
+    lua_setfield(L, -2, "deserialize");
+  }
+  else {
+    static const char *const statusnames[] = {"running", "parked", "dead",
+                                              "error"};
+    lus_WorkerStats s;
+    lus_worker_getstats(check_worker(L, 1), &s);
+    lua_createtable(L, 0, 7);
+    lua_pushstring(L, statusnames[s.status]);
+    lua_setfield(L, -2, "status");
+    lua_pushinteger(L, s.inbox);
+    lua_setfield(L, -2, "inbox");
+    lua_pushinteger(L, s.outbox);
+    lua_setfield(L, -2, "outbox");
+    lua_pushinteger(L, (lua_Integer)s.received);
+    lua_setfield(L, -2, "received");
+    lua_pushinteger(L, (lua_Integer)s.sent);
+    lua_setfield(L, -2, "sent");
+    lua_pushinteger(L, (lua_Integer)s.runs);
+    lua_setfield(L, -2, "runs");
+    lua_pushnumber(L, (lua_Number)s.cpu);
+    lua_setfield(L, -2, "cpu");
+  }
+  return 1;
+}
+
+/* worker.receive([timeout,] w1, w2, ...) - select-style */
 static int lib_receive(lua_State *L) {
-  int nworkers = lua_gettop(L);
-  if (nworkers == 0)
+  int base = 1;
+  double deadline = -1; /* no timeout */
+  if (lua_type(L, 1) == LUA_TNUMBER) {
+    lua_Number timeout = lua_tonumber(L, 1);
+    luaL_argcheck(L, timeout >= 0, 1, "timeout must be non-negative");
+    deadline = clock_now() + (double)timeout;
+    base = 2;
+  }
+  int nworkers = lua_gettop(L) - base + 1;
+  if (nworkers <= 0)
     return luaL_error(L, "expected at least one worker");
 
+  for (int i = 0; i < nworkers; i++)
+    check_worker(L, base + i);
   WorkerState **workers =
       (WorkerState **)malloc(sizeof(WorkerState *) * nworkers);
+  if (workers == NULL)
+    return luaL_error(L, "out of memory");
   for (int i = 0; i < nworkers; i++) {
-    workers[i] = check_worker(L, i + 1);
+    workers[i] = check_worker(L, base + i);
   }
 
   /* Create shared receive context for multi-worker select */
@@ -874,18 +4233,14 @@ static int lib_receive(lua_State *L) {
         all_dead = 0;
       }
 
-      StandaloneArena *arena;
-      char *data;
-      size_t size;
-      if (msgqueue_pop(&w->outbox, &arena, &data, &size)) {
-        lus_mutex_unlock(&w->mutex);
-        /* Deserialize and return */
-        DeserBuffer db = {data, size, 0};
+      MessageNode m;
+      if (msgqueue_pop(&w->outbox, &m)) {
+        outbox_notify(w); /* releases the mutex */
         /* Push nils for workers before this one */
         for (int j = 0; j < i; j++)
           lua_pushnil(L);
-        if (!deserialize_value(L, &db, 0)) {
-          luaA_freestandalone(arena);
+        /* Deserialize and return */
+        if (!msg_deliver(L, &m)) {
           /* Cleanup */
           for (int k = 0; k < nworkers; k++) {
             lus_mutex_lock(&workers[k]->mutex);
@@ -897,7 +4252,6 @@ static int lib_receive(lua_State *L) {
           free(workers);
           return luaL_error(L, "failed to deserialize message");
         }
-        luaA_freestandalone(arena);
         /* Push nils for remaining workers */
         for (int j = i + 1; j < nworkers; j++)
           lua_pushnil(L);
@@ -917,12 +4271,25 @@ static int lib_receive(lua_State *L) {
 
     /* Wait on shared condition - any worker can wake us */
     /* Hold mutex during check-and-wait to prevent lost wakeup race */
+    int timedout = 0;
     lus_mutex_lock(&ctx.mutex);
-    while (!ctx.ready) {
-      lus_cond_wait(&ctx.cond, &ctx.mutex);
+    while (!ctx.ready && !timedout) {
+      if (deadline < 0)
+        lus_cond_wait(&ctx.cond, &ctx.mutex);
+      else
+        timedout = !cond_waituntil(&ctx.cond, &ctx.mutex, deadline);
     }
+    timedout = timedout && !ctx.ready;
     ctx.ready = 0; /* reset for next iteration */
     lus_mutex_unlock(&ctx.mutex);
+
+    /* Timed out: no worker has a message */
+    if (timedout) {
+      for (int i = 0; i < nworkers; i++)
+        lua_pushnil(L);
+      result = nworkers;
+      goto cleanup;
+    }
   }
 
 cleanup:
@@ -938,34 +4305,610 @@ cleanup:
   return result;
 }
 
-/* worker.send(w, value) */
-static int lib_send(lua_State *L) {
-  WorkerState *w = check_worker(L, 1);
+static WorkerState *current_worker(lua_State *L);
 
-  /* Serialize the value */
-  SerBuffer buf;
-  serbuf_init(&buf);
-  if (!serialize_value(L, 2, &buf, 0)) {
-    serbuf_free(&buf);
-    return lua_error(L);
+/*
+** Send the value at 'idx' to the inbox of 'w'. With 'wait' set, waits
+** for room on a condition variable; otherwise returns 0 if the inbox is
+** full. Returns -1 if out of memory.
+*/
+static int worker_post(lua_State *L, WorkerState *w, int idx, int wait) {
+  MessageNode m;
+  if (!wait) {
+    lus_mutex_lock(&w->mutex);
+    int full = inbox_full(w);
+    lus_mutex_unlock(&w->mutex);
+    if (full)
+      return 0;
   }
 
+  /* Serialize the value */
+  msg_build(L, idx, &m);
+
   /* Push to inbox - ownership of arena transfers to message queue */
   lus_mutex_lock(&w->mutex);
-  if (!msgqueue_push(&w->inbox, buf.arena, buf.data, buf.size)) {
+  while (wait && inbox_full(w))
+    lus_cond_wait(&w->space_cond, &w->mutex);
+  if (!msgqueue_push(&w->inbox, &m)) {
     lus_mutex_unlock(&w->mutex);
-    serbuf_free(&buf);
+    msg_release(&m);
+    return -1;
+  }
+  worker_wake(w); /* releases the mutex */
+  return 1;
+}
+
+static int lib_send(lua_State *L);
+
+static int send_k(lua_State *L, int status, lua_KContext ctx) {
+  (void)status;
+  (void)ctx;
+  return lib_send(L); /* woken up: retry */
+}
+
+/* worker.send(w, value) */
+static int lib_send(lua_State *L) {
+  WorkerState *w = check_worker(L, 1);
+  WorkerState *self = current_worker(L);
+  int park = (self != NULL && can_park(L, self));
+  luaL_checkany(L, 2);
+
+  if (park) {
+    /* Park while the inbox is full; 'waiting' is set before checking,
+    ** so room made before the yield keeps this worker runnable. */
+    lus_mutex_lock(&self->mutex);
+    self->waiting = 1;
+    lus_mutex_unlock(&self->mutex);
+    lus_mutex_lock(&w->mutex);
+    if (inbox_full(w) && senders_register(w, self)) {
+      lus_mutex_unlock(&w->mutex);
+      return lua_yieldk(L, 0, 0, send_k);
+    }
+    lus_mutex_unlock(&w->mutex);
+    lus_mutex_lock(&self->mutex);
+    self->waiting = 0;
+    lus_mutex_unlock(&self->mutex);
+  }
+  /* a parked sender found room: it is the only state sending to 'w', so
+  ** the room is still there */
+  if (worker_post(L, w, 2, !park) < 0)
+    return luaL_error(L, "out of memory");
+  return 0;
+}
+
+/* worker.trysend(w, value) */
+static int lib_trysend(lua_State *L) {
+  WorkerState *w = check_worker(L, 1);
+  luaL_checkany(L, 2);
+  int res = worker_post(L, w, 2, 0);
+  if (res < 0)
     return luaL_error(L, "out of memory");
+  lua_pushboolean(L, res);
+  return 1;
+}
+
+/* Set bounds of 'w' (0 = unbounded, negative = unchanged) */
+static void worker_setcapacity(WorkerState *w, int inbox, int outbox) {
+  lus_mutex_lock(&w->mutex);
+  if (inbox >= 0)
+    w->inbox_cap = inbox;
+  if (outbox >= 0)
+    w->outbox_cap = outbox;
+  lus_cond_broadcast(&w->space_cond);
+  inbox_notify(w); /* releases the mutex */
+  if (outbox >= 0) { /* the worker may be waiting for room */
+    lus_mutex_lock(&w->mutex);
+    worker_wake(w); /* releases the mutex */
   }
-  lus_cond_signal(&w->inbox_cond);
+}
+
+static int opt_capacity(lua_State *L, int arg) {
+  lua_Integer cap;
+  if (lua_isnoneornil(L, arg))
+    return -1;
+  cap = luaL_checkinteger(L, arg);
+  luaL_argcheck(L, cap >= 0 && cap <= INT_MAX, arg, "capacity out of range");
+  return (int)cap;
+}
+
+/* worker.capacity(w [, inbox [, outbox]]) */
+static int lib_capacity(lua_State *L) {
+  WorkerState *w = check_worker(L, 1);
+  int inbox = opt_capacity(L, 2);
+  int outbox = opt_capacity(L, 3);
+  if (inbox >= 0 || outbox >= 0)
+    worker_setcapacity(w, inbox, outbox);
+  lus_mutex_lock(&w->mutex);
+  lua_pushinteger(L, w->inbox_cap);
+  lua_pushinteger(L, w->outbox_cap);
   lus_mutex_unlock(&w->mutex);
+  return 2;
+}
+
+static Channel *check_channel(lua_State *L, int idx) {
+  Channel *c = *(Channel **)luaL_checkudata(L, idx, CHANNEL_METATABLE);
+  if (c == NULL)
+    luaL_error(L, "attempt to use a finalized channel");
+  return c;
+}
+
+/* worker.channel(capacity) */
+static int lib_channel(lua_State *L) {
+  lua_Integer cap = luaL_checkinteger(L, 1);
+  Channel *c;
+  luaL_argcheck(L, cap >= 1 && cap <= LUS_CHANNEL_MAXCAP, 1,
+                "capacity out of range");
+  c = chan_new((long long)cap);
+  if (c == NULL)
+    return luaL_error(L, "out of memory");
+  chan_pushhandle(L, c);
+  chan_decref(c); /* the handle holds it now */
+  return 1;
+}
+
+static int ch_send(lua_State *L);
+
+static int ch_send_k(lua_State *L, int status, lua_KContext ctx) {
+  Channel *c = check_channel(L, 1);
+  (void)status;
+  (void)ctx;
+  chan_unwait(L, &c, 1, 1);
+  return ch_send(L);
+}
+
+/* ch:send(value) */
+static int ch_send(lua_State *L) {
+  Channel *c = check_channel(L, 1);
+  luaL_checkany(L, 2);
+  while (!chan_trysend(L, c, 2))
+    chan_wait(L, &c, 1, 1, ch_send_k);
+  return 0;
+}
+
+/* ch:trysend(value) */
+static int ch_trysend(lua_State *L) {
+  Channel *c = check_channel(L, 1);
+  luaL_checkany(L, 2);
+  lua_pushboolean(L, chan_trysend(L, c, 2));
+  return 1;
+}
+
+static int ch_receive(lua_State *L);
+
+static int ch_receive_k(lua_State *L, int status, lua_KContext ctx) {
+  Channel *c = check_channel(L, 1);
+  (void)status;
+  (void)ctx;
+  chan_unwait(L, &c, 1, 0);
+  return ch_receive(L);
+}
+
+/* ch:receive() */
+static int ch_receive(lua_State *L) {
+  Channel *c = check_channel(L, 1);
+  int r;
+  lua_settop(L, 1);
+  while ((r = chan_tryreceive(L, c)) == 0)
+    chan_wait(L, &c, 1, 0, ch_receive_k);
+  if (r < 0)
+    lua_pushnil(L); /* closed and drained */
+  return 1;
+}
+
+/* ch:tryreceive() */
+static int ch_tryreceive(lua_State *L) {
+  Channel *c = check_channel(L, 1);
+  lua_settop(L, 1);
+  if (chan_tryreceive(L, c) <= 0) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  lua_pushboolean(L, 1);
+  lua_insert(L, -2);
+  return 2;
+}
+
+/* ch:close() */
+static int ch_close(lua_State *L) {
+  chan_close(check_channel(L, 1));
+  return 0;
+}
+
+/* ch:closed() */
+static int ch_closed(lua_State *L) {
+  lua_pushboolean(L, (int)lus_atomic_load(&check_channel(L, 1)->closed));
+  return 1;
+}
+
+/* #ch: messages queued (a snapshot) */
+static int ch_len(lua_State *L) {
+  Channel *c = check_channel(L, 1);
+  long long n = lus_atomic_load(&c->tail) - lus_atomic_load(&c->head);
+  lua_pushinteger(L, (n > 0) ? (lua_Integer)n : 0);
+  return 1;
+}
 
+static int ch_gc(lua_State *L) {
+  Channel **pc = (Channel **)luaL_checkudata(L, 1, CHANNEL_METATABLE);
+  if (*pc != NULL) {
+    chan_decref(*pc);
+    *pc = NULL;
+  }
   return 0;
 }
 
+static int ch_tostring(lua_State *L) {
+  lua_pushfstring(L, "channel: %p", (void *)check_channel(L, 1));
+  return 1;
+}
+
+static int lib_select(lua_State *L);
+
+/* The stack is as 'lib_select' left it: the channels, then their array */
+static int select_k(lua_State *L, int status, lua_KContext ctx) {
+  int n = lua_gettop(L) - 1;
+  (void)status;
+  (void)ctx;
+  chan_unwait(L, (Channel **)lua_touserdata(L, n + 1), n, 0);
+  lua_settop(L, n);
+  return lib_select(L);
+}
+
+/*
+** worker.select(ch1, ch2, ...): receive from whichever channel has a
+** message first; returns the channel and the value, or nothing once all
+** of them are closed and drained.
+*/
+static int lib_select(lua_State *L) {
+  static lus_atomic_t rotor = 0; /* start position, for fairness */
+  int n = lua_gettop(L);
+  Channel **cs;
+  luaL_argcheck(L, n > 0, 1, "channel expected");
+  cs = (Channel **)lua_newuserdatauv(L, n * sizeof(Channel *), 0);
+  for (int i = 0; i < n; i++)
+    cs[i] = check_channel(L, i + 1);
+  for (;;) {
+    int open = 0;
+    int start = (int)(lus_atomic_addfetch(&rotor, 1) % n);
+    for (int j = 0; j < n; j++) {
+      int i = (start + j) % n;
+      int r = chan_tryreceive(L, cs[i]);
+      if (r > 0) {
+        lua_pushvalue(L, i + 1);
+        lua_insert(L, -2);
+        return 2;
+      }
+      open += (r == 0);
+    }
+    if (open == 0)
+      return 0;
+    chan_wait(L, cs, n, 0, select_k);
+  }
+}
+
+/*
+** worker.map and worker.reduce. The items are split into chunks, which
+** are posted as jobs to a channel read by a few workers running
+** 'map_driver'; a worker takes the next chunk as soon as it is done with
+** one, which balances the load. Results come back through a second
+** channel, large enough that workers never wait on it, and are put back
+** in order. The stack of the caller is laid out as below, so that the
+** collecting loop can park and resume.
+*/
+#define MAP_PATH 1
+#define MAP_ITEMS 2
+#define MAP_INIT 3
+#define MAP_OPTS 4
+#define MAP_JOBS 5
+#define MAP_RESULTS 6
+#define MAP_OUT 7 /* results (map), partial results (reduce), or result */
+#define MAP_STATE 8
+
+/* kinds of items */
+#define MAP_TABLE 0
+#define MAP_SHARED 1 /* shared table: jobs carry the proxy and a range */
+#define MAP_VECTOR 2 /* each chunk of bytes is one item */
+
+/* Default number of chunks per worker */
+#define MAP_CHUNKSPERWORKER 4
+
+/* Smallest default chunk of a vector, in bytes */
+#define MAP_MINVECCHUNK 4096
+
+typedef struct MapState {
+  lua_Integer n;        /* number of items (bytes of a vector) */
+  lua_Integer chunk;    /* items per chunk */
+  lua_Integer nchunks;
+  lua_Integer got;      /* results received */
+  lua_Integer expected; /* results to receive */
+  int kind;
+  int reduce;
+  int final; /* 1 = combining the partial results */
+} MapState;
+
+static lua_Integer map_optfield(lua_State *L, const char *name,
+                                lua_Integer def) {
+  lua_Integer v;
+  if (lua_isnil(L, MAP_OPTS))
+    return def;
+  if (lua_getfield(L, MAP_OPTS, name) == LUA_TNIL) {
+    lua_pop(L, 1);
+    return def;
+  }
+  v = lua_tointeger(L, -1);
+  if (!lua_isinteger(L, -1) || v < 1)
+    luaL_error(L, "option '%s' must be a positive integer", name);
+  lua_pop(L, 1);
+  return v;
+}
+
+/* Push the job for chunk 'k' (1-based) */
+static void map_pushjob(lua_State *L, MapState *ms, lua_Integer k) {
+  lua_Integer first = (k - 1) * ms->chunk + 1;
+  lua_Integer count = ms->n - first + 1;
+  if (count > ms->chunk)
+    count = ms->chunk;
+  lua_createtable(L, 6, 0);
+  lua_pushinteger(L, (ms->reduce || ms->kind == MAP_VECTOR) ? k : first);
+  lua_rawseti(L, -2, 1);
+  lua_pushinteger(L, ms->reduce ? 1 : 0);
+  lua_rawseti(L, -2, 2);
+  switch (ms->kind) {
+    case MAP_TABLE:
+      lua_createtable(L, (int)count, 0);
+      for (lua_Integer i = 1; i <= count; i++) {
+        lua_rawgeti(L, MAP_ITEMS, first + i - 1);
+        lua_rawseti(L, -2, i);
+      }
+      lua_rawseti(L, -2, 3);
+      lua_pushinteger(L, 0);
+      break;
+    case MAP_SHARED:
+      lua_pushvalue(L, MAP_ITEMS);
+      lua_rawseti(L, -2, 3);
+      lua_pushinteger(L, first - 1);
+      break;
+    default: { /* MAP_VECTOR */
+      Vector *v = luaV_newvec(L, (size_t)count, 1);
+      memcpy(v->data, vecvalue(ser_value(L, MAP_ITEMS))->data + first - 1,
+             (size_t)count);
+      lua_createtable(L, 1, 0);
+      setvecvalue(L, s2v(L->top.p), v);
+      L->top.p++;
+      lua_rawseti(L, -2, 1);
+      lua_rawseti(L, -2, 3);
+      lua_pushinteger(L, 0);
+      count = 1;
+      break;
+    }
+  }
+  lua_rawseti(L, -2, 4);
+  lua_pushinteger(L, count);
+  lua_rawseti(L, -2, 5);
+  if (ms->reduce && ms->kind == MAP_VECTOR) { /* each chunk starts at init */
+    lua_pushvalue(L, MAP_INIT);
+    lua_rawseti(L, -2, 6);
+  }
+}
+
+/* Stop handing out jobs after an error */
+static void map_cancel(lua_State *L) {
+  Channel *jobs = check_channel(L, MAP_JOBS);
+  MessageNode m;
+  chan_close(jobs);
+  while (chan_pop(jobs, &m)) {
+    if (m.arena != NULL)
+      msg_release(&m);
+  }
+}
+
+/* Store the result message on the top of the stack, or raise its error */
+static void map_store(lua_State *L, MapState *ms) {
+  lua_Integer idx;
+  if (lua_rawgeti(L, -1, 3) != LUA_TNIL) {
+    map_cancel(L);
+    lua_error(L);
+  }
+  lua_pop(L, 1);
+  lua_rawgeti(L, -1, 1);
+  idx = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  lua_rawgeti(L, -1, 2);
+  if (ms->final)
+    lua_replace(L, MAP_OUT);
+  else if (ms->reduce)
+    lua_rawseti(L, MAP_OUT, idx);
+  else {
+    lua_Integer count = ms->n - idx + 1;
+    if (ms->kind == MAP_VECTOR) /* one item per chunk */
+      count = 1;
+    else if (count > ms->chunk)
+      count = ms->chunk;
+    for (lua_Integer i = 1; i <= count; i++) {
+      lua_rawgeti(L, -1, i);
+      lua_rawseti(L, MAP_OUT, idx + i - 1);
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1); /* message */
+}
+
+static int map_collect(lua_State *L);
+
+static int map_collect_k(lua_State *L, int status, lua_KContext ctx) {
+  Channel *c = check_channel(L, MAP_RESULTS);
+  (void)status;
+  (void)ctx;
+  chan_unwait(L, &c, 1, 0);
+  return map_collect(L);
+}
+
+/* Receive the results of all jobs; for a reduce, then combine them */
+static int map_collect(lua_State *L) {
+  MapState *ms = (MapState *)lua_touserdata(L, MAP_STATE);
+  Channel *results = check_channel(L, MAP_RESULTS);
+  for (;;) {
+    while (ms->got < ms->expected) {
+      lua_settop(L, MAP_STATE);
+      while (chan_tryreceive(L, results) == 0)
+        chan_wait(L, &results, 1, 0, map_collect_k);
+      ms->got++;
+      map_store(L, ms);
+    }
+    if (!ms->reduce || ms->final)
+      break;
+    ms->final = 1;
+    ms->expected++;
+    lua_createtable(L, 6, 0);
+    lua_pushinteger(L, 0);
+    lua_rawseti(L, -2, 1);
+    lua_pushinteger(L, 2);
+    lua_rawseti(L, -2, 2);
+    lua_pushvalue(L, MAP_OUT);
+    lua_rawseti(L, -2, 3);
+    lua_pushinteger(L, 0);
+    lua_rawseti(L, -2, 4);
+    lua_pushinteger(L, ms->nchunks);
+    lua_rawseti(L, -2, 5);
+    if (ms->kind != MAP_VECTOR) { /* chunks of items start from init here */
+      lua_pushvalue(L, MAP_INIT);
+      lua_rawseti(L, -2, 6);
+    }
+    chan_trysend(L, check_channel(L, MAP_JOBS), lua_gettop(L));
+  }
+  chan_close(check_channel(L, MAP_JOBS)); /* let the workers finish */
+  lua_pushvalue(L, MAP_OUT);
+  return 1;
+}
+
+static int map_start(lua_State *L, int reduce) {
+  const char *path = luaL_checkstring(L, MAP_PATH);
+  MapState *ms;
+  Channel *c;
+  lua_Integer nworkers;
+
+  lus_checkfsperm(L, "fs:read", path);
+  if (!lus_haspledge(L, "load", NULL))
+    return luaL_error(L, "permission denied: 'load' pledge required");
+  if (!reduce) { /* map has no init */
+    lua_settop(L, 3);
+    lua_pushnil(L);
+    lua_insert(L, MAP_INIT);
+  }
+  lua_settop(L, MAP_OPTS);
+  if (!lua_isnil(L, MAP_OPTS))
+    luaL_checktype(L, MAP_OPTS, LUA_TTABLE);
+  lus_worker_pool_init(L);
+
+  ms = (MapState *)lua_newuserdatauv(L, sizeof(MapState), 0);
+  memset(ms, 0, sizeof(MapState));
+  ms->reduce = reduce;
+  if (luaL_testudata(L, MAP_ITEMS, SHARED_METATABLE)) {
+    ms->kind = MAP_SHARED;
+    ms->n = luaL_len(L, MAP_ITEMS);
+  }
+  else if (lua_isvector(L, MAP_ITEMS)) {
+    ms->kind = MAP_VECTOR;
+    ms->n = (lua_Integer)vecvalue(ser_value(L, MAP_ITEMS))->len;
+  }
+  else {
+    luaL_argexpected(L, lua_istable(L, MAP_ITEMS), MAP_ITEMS,
+                     "table or vector");
+    ms->kind = MAP_TABLE;
+    ms->n = (lua_Integer)lua_rawlen(L, MAP_ITEMS);
+  }
+  nworkers = map_optfield(L, "workers", g_pool.nthreads);
+  ms->chunk = (ms->n + nworkers * MAP_CHUNKSPERWORKER - 1) /
+              (nworkers * MAP_CHUNKSPERWORKER);
+  if (ms->chunk < 1)
+    ms->chunk = 1;
+  if (ms->kind == MAP_VECTOR && ms->chunk < MAP_MINVECCHUNK)
+    ms->chunk = MAP_MINVECCHUNK;
+  ms->chunk = map_optfield(L, "chunk", ms->chunk);
+  if ((ms->n + ms->chunk - 1) / ms->chunk > LUS_CHANNEL_MAXCAP / 2)
+    ms->chunk = (ms->n + LUS_CHANNEL_MAXCAP / 2 - 1) / (LUS_CHANNEL_MAXCAP / 2);
+  ms->nchunks = (ms->n + ms->chunk - 1) / ms->chunk;
+  if (ms->nchunks == 0) { /* nothing to do */
+    if (reduce)
+      lua_pushvalue(L, MAP_INIT);
+    else
+      lua_newtable(L);
+    return 1;
+  }
+  if (nworkers > ms->nchunks)
+    nworkers = ms->nchunks;
+  ms->expected = ms->nchunks;
+
+  /* channels (jobs, results), result table, then the state */
+  if ((c = chan_new(ms->nchunks + 1)) == NULL)
+    return luaL_error(L, "out of memory");
+  chan_pushhandle(L, c);
+  chan_decref(c);
+  if ((c = chan_new(ms->nchunks + nworkers + 1)) == NULL)
+    return luaL_error(L, "out of memory");
+  chan_pushhandle(L, c);
+  chan_decref(c);
+  {
+    /* one result per chunk, except when mapping the items of a table */
+    lua_Integer nout =
+        (reduce || ms->kind == MAP_VECTOR) ? ms->nchunks : ms->n;
+    lua_createtable(L, (nout < INT_MAX) ? (int)nout : INT_MAX, 0);
+  }
+  lua_rotate(L, MAP_JOBS, -1); /* move the state up to MAP_STATE */
+
+  c = check_channel(L, MAP_JOBS);
+  for (lua_Integer k = 1; k <= ms->nchunks; k++) {
+    map_pushjob(L, ms, k);
+    chan_trysend(L, c, lua_gettop(L)); /* cannot be full */
+    lua_pop(L, 1);
+  }
+
+  for (lua_Integer i = 0; i < nworkers; i++) {
+    WorkerState *w = worker_new(L, path);
+    if (!w) {
+      map_cancel(L);
+      return luaL_error(L, "failed to allocate worker");
+    }
+    w->mapper = 1;
+    for (int a = MAP_PATH; a <= MAP_RESULTS; a++) {
+      MessageNode m;
+      if (a == MAP_ITEMS || a == MAP_INIT || a == MAP_OPTS)
+        continue;
+      msg_build(L, a, &m);
+      lus_mutex_lock(&w->mutex);
+      if (!msgqueue_push(&w->inbox, &m)) {
+        lus_mutex_unlock(&w->mutex);
+        msg_release(&m);
+        worker_decref(w);
+        map_cancel(L);
+        return luaL_error(L, "out of memory");
+      }
+      lus_mutex_unlock(&w->mutex);
+    }
+    w->nargs = 3;
+    pool_enqueue(w); /* the pool owns its reference */
+  }
+  return map_collect(L);
+}
+
+/* worker.map(path, items [, opts]) */
+static int lib_map(lua_State *L) {
+  return map_start(L, 0);
+}
+
+/* worker.reduce(path, items [, init [, opts]]) */
+static int lib_reduce(lua_State *L) {
+  return map_start(L, 1);
+}
+
 /* GC metamethod */
 static int worker_gc(lua_State *L) {
   WorkerState *w = check_worker(L, 1);
+  /* nobody receives from the worker anymore: stop bounding its outbox */
+  lus_mutex_lock(&w->mutex);
+  w->outbox_cap = 0;
+  lus_cond_signal(&w->inbox_cond);
+  lus_mutex_unlock(&w->mutex);
   worker_decref(w);
   return 0;
 }
@@ -977,20 +4920,82 @@ static int worker_tostring(lua_State *L) {
   return 1;
 }
 
+/* worker.share(t) */
+static int lib_share(lua_State *L) {
+  ShareState S;
+  SharedProxy *p;
+  StandaloneArena *arena;
+  if (luaL_testudata(L, 1, SHARED_METATABLE)) { /* already shared? */
+    lua_settop(L, 1);
+    return 1;
+  }
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  shared_pushcache(L); /* 2 */
+  /* the root proxy owns the heap from the start, so an error while
+     freezing leaves the heap to its finalizer */
+  p = (SharedProxy *)lua_newuserdatauv(L, sizeof(SharedProxy), 0); /* 3 */
+  p->heap = NULL;
+  p->t = NULL;
+  luaL_setmetatable(L, SHARED_METATABLE);
+  arena = luaA_newstandalone(LUAA_DEFAULT_BLOCKSIZE);
+  if (arena == NULL)
+    return luaL_error(L, "out of memory");
+  p->heap = luaA_standalone_obj(arena, SharedHeap); /* fits the 1st block */
+  p->heap->arena = arena;
+  lus_atomic_store(&p->heap->refcount, 1);
+  lua_newtable(L); /* 4: tables frozen so far */
+  lua_newtable(L); /* 5: strings copied so far */
+  S.heap = p->heap;
+  S.seen = 4;
+  S.strs = 5;
+  p->t = share_table(L, &S, 1, 0);
+  lua_settop(L, 3);
+  lua_pushvalue(L, 3);
+  lua_rawsetp(L, 2, p->t);
+  return 1;
+}
+
 static const luaL_Reg worker_methods[] = {{"create", lib_create},
                                           {"status", lib_status},
+                                          {"stats", lib_stats},
                                           {"receive", lib_receive},
                                           {"send", lib_send},
+                                          {"trysend", lib_trysend},
+                                          {"capacity", lib_capacity},
+                                          {"share", lib_share},
+                                          {"channel", lib_channel},
+                                          {"select", lib_select},
+                                          {"map", lib_map},
+                                          {"reduce", lib_reduce},
+                                          {"wait", lib_wait},
+                                          {"notify", lib_notify},
                                           {NULL, NULL}};
 
 static const luaL_Reg worker_meta[] = {
     {"__gc", worker_gc}, {"__tostring", worker_tostring}, {NULL, NULL}};
 
+static const luaL_Reg channel_methods[] = {
+    {"send", ch_send},       {"trysend", ch_trysend}, {"receive", ch_receive},
+    {"tryreceive", ch_tryreceive}, {"close", ch_close}, {"closed", ch_closed},
+    {NULL, NULL}};
+
+static const luaL_Reg channel_meta[] = {{"__gc", ch_gc},
+                                        {"__len", ch_len},
+                                        {"__tostring", ch_tostring},
+                                        {NULL, NULL}};
+
 LUAMOD_API int luaopen_worker(lua_State *L) {
+  waitlot_init();
   /* Create metatable */
   luaL_newmetatable(L, WORKER_METATABLE);
   luaL_setfuncs(L, worker_meta, 0);
   lua_pop(L, 1);
+  luaL_newmetatable(L, CHANNEL_METATABLE);
+  luaL_setfuncs(L, channel_meta, 0);
+  luaL_newlib(L, channel_methods);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
 
   /* Create library table */
   luaL_newlib(L, worker_methods);
@@ -1021,37 +5026,44 @@ LUA_API WorkerState *lus_worker_create(lua_State *L, const char *path) {
 LUA_API int lus_worker_send(lua_State *L, WorkerState *w, int idx) {
   if (w == NULL)
     return 0;
-  SerBuffer buf;
-  serbuf_init(&buf);
-  if (!serialize_value(L, idx, &buf, 0)) {
-    serbuf_free(&buf);
-    return 0;
-  }
-  lus_mutex_lock(&w->mutex);
-  if (!msgqueue_push(&w->inbox, buf.arena, buf.data, buf.size)) {
-    lus_mutex_unlock(&w->mutex);
-    serbuf_free(&buf);
+  return worker_post(L, w, idx, 1) > 0;
+}
+
+LUA_API int lus_worker_trysend(lua_State *L, WorkerState *w, int idx) {
+  if (w == NULL)
     return 0;
-  }
-  lus_cond_signal(&w->inbox_cond);
-  lus_mutex_unlock(&w->mutex);
-  return 1;
+  return worker_post(L, w, idx, 0) > 0;
+}
+
+LUA_API void lus_worker_capacity(WorkerState *w, int inbox, int outbox) {
+  worker_setcapacity(w, inbox, outbox);
 }
 
 LUA_API int lus_worker_receive(lua_State *L, WorkerState *w) {
-  StandaloneArena *arena;
-  char *data;
-  size_t size;
+  MessageNode m;
   lus_mutex_lock(&w->mutex);
-  int got = msgqueue_pop(&w->outbox, &arena, &data, &size);
-  lus_mutex_unlock(&w->mutex);
+  int got = msgqueue_pop(&w->outbox, &m);
+  if (got)
+    outbox_notify(w); /* releases the mutex */
+  else
+    lus_mutex_unlock(&w->mutex);
   if (!got)
     return 0;
+  return msg_deliver(L, &m);
+}
 
-  DeserBuffer db = {data, size, 0};
-  int ok = deserialize_value(L, &db, 0);
-  luaA_freestandalone(arena);
-  return ok;
+LUA_API void lus_worker_serialize(lua_State *L, int idx) {
+  SerBuffer buf;
+  serbuf_init(&buf, 1);
+  serialize_protected(L, idx, &buf);
+  lua_pushlstring(L, buf.data, buf.size);
+  serbuf_free(&buf);
+}
+
+LUA_API int lus_worker_deserialize(lua_State *L, const char *data,
+                                   size_t len) {
+  DeserBuffer db = {data, len, 0, NULL, 0, 0, 0};
+  return deserialize_root(L, &db);
 }
 
 LUA_API int lus_worker_status(WorkerState *w) {
@@ -1061,4 +5073,40 @@ LUA_API int lus_worker_status(WorkerState *w) {
   return status;
 }
 
+static void counters_add(lus_WorkerPoolStats *s, WorkerCounters *c) {
+  s->messages += lus_atomic_load(&c->messages);
+  s->bytes += lus_atomic_load(&c->bytes);
+  s->serialize += (double)lus_atomic_load(&c->sertime) / 1e9;
+  s->deserialize += (double)lus_atomic_load(&c->desertime) / 1e9;
+}
+
+LUA_API void lus_worker_stats(lus_WorkerPoolStats *s) {
+  memset(s, 0, sizeof(*s));
+  s->workers = lus_atomic_load(&g_pool.nworkers);
+  s->parked = lus_atomic_load(&g_pool.nparked);
+  counters_add(s, &g_pool.counters);
+  if (!g_pool.initialized)
+    return;
+  s->threads = g_pool.nthreads;
+  s->sleeping = (int)lus_atomic_load(&g_pool.nsleeping);
+  s->runnable = lus_atomic_load(&g_pool.nqueued);
+  for (int i = 0; i < g_pool.nthreads; i++) {
+    PoolThread *t = &g_pool.threads[i];
+    s->running += lus_atomic_load(&t->busy);
+    counters_add(s, &t->counters);
+  }
+}
+
+LUA_API void lus_worker_getstats(WorkerState *w, lus_WorkerStats *s) {
+  lus_mutex_lock(&w->mutex);
+  s->status = w->status;
+  s->inbox = w->inbox.count;
+  s->outbox = w->outbox.count;
+  s->received = w->inbox.total;
+  s->sent = w->outbox.total;
+  lus_mutex_unlock(&w->mutex);
+  s->runs = lus_atomic_load(&w->runs);
+  s->cpu = (double)lus_atomic_load(&w->runtime) / 1e9;
+}
+
 /* }====================================================== */
@@ -7,6 +7,7 @@
 #define lworkerlib_h
 
 #include "larena.h"
+#include "latomic.h"
 #include "lua.h"
 
 /* Platform-specific threading primitives */
@@ -48,9 +49,51 @@ typedef pthread_cond_t lus_cond_t;
 
 /* Forward declarations */
 typedef struct WorkerPool WorkerPool;
+typedef struct PoolThread PoolThread;
 typedef struct WorkerState WorkerState;
 typedef struct MessageNode MessageNode;
 
+/* Long strings of at least this many bytes cross workers without copies */
+#define LUS_WORKER_SHAREDSTR 4096
+
+/* Maximum number of compiled worker scripts kept for later spawns */
+#define LUS_WORKER_CODECACHE 64
+
+/* Maximum number of finished worker states kept for reuse */
+#define LUS_WORKER_STATEPOOL 32
+
+/* Maximum number of pool threads */
+#define LUS_WORKER_MAXTHREADS 1024
+
+/* Default time slice of a worker before it may be preempted, in ms */
+#define LUS_WORKER_QUANTUM 10
+
+/* Messages per one timed for the serialize/deserialize statistics */
+#define LUS_WORKER_STATSAMPLE 16
+
+/* How pool threads are pinned to CPUs (see lus_worker_pinning) */
+#define LUS_WORKER_PIN_NONE 0  /* not pinned */
+#define LUS_WORKER_PIN_CORES 1 /* each thread on one CPU */
+#define LUS_WORKER_PIN_NUMA 2  /* each thread on the CPUs of one NUMA node */
+
+/*
+** Payload carried beside a message's serialized bytes instead of being
+** copied into them: a vector buffer moved out of the sender, a long
+** string in a refcounted buffer shared by every state holding it, or a
+** reference to a shared heap, a channel or a shared vector buffer.
+*/
+typedef struct MsgAttach {
+  int kind;     /* MSG_VECTOR, MSG_STRING, MSG_SHARED, MSG_CHANNEL or
+                   MSG_SHAREDVEC */
+  int taken;    /* 1 = adopted by the receiver */
+  void *obj;    /* sender's Vector, TString, SharedHeap, Channel or
+                   VecShared (until committed) */
+  void *ptr;    /* vector buffer, SharedString, SharedHeap, Channel or
+                   VecShared (committed) */
+  size_t len;   /* vector length */
+  size_t alloc; /* vector buffer size */
+} MsgAttach;
+
 /*
 ** Message queue node - holds serialized Lua value in arena
 */
@@ -58,6 +101,8 @@ struct MessageNode {
   StandaloneArena *arena; /* arena containing serialized data */
   char *data;             /* pointer into arena (first block data) */
   size_t size;            /* serialized data size */
+  MsgAttach *attach;      /* out-of-band payloads (in arena) */
+  int nattach;
   MessageNode *next;      /* linked list */
 };
 
@@ -68,6 +113,7 @@ typedef struct MessageQueue {
   MessageNode *head;
   MessageNode *tail;
   int count;
+  long long total; /* messages ever pushed */
 } MessageQueue;
 
 /*
@@ -79,40 +125,179 @@ typedef struct ReceiveContext {
   int ready; /* set by workers when message posted, prevents lost wakeup */
 } ReceiveContext;
 
+/*
+** Parked worker or blocked thread waiting for a channel (or a worker's
+** inbox) to change. A parked worker is referenced by its registration.
+*/
+typedef struct ChanWaiter {
+  WorkerState *w;      /* parked worker, or NULL */
+  ReceiveContext *ctx; /* blocked thread, or NULL */
+} ChanWaiter;
+
+typedef struct ChanWaitList {
+  ChanWaiter *items;
+  int n;
+  int cap;
+  lus_atomic_t count; /* 'n', readable without the lock */
+} ChanWaitList;
+
+/* Slot of a channel's ring; 'seq' tells whose turn it is (see lworkerlib.c) */
+typedef struct ChanSlot {
+  lus_atomic_t seq;
+  MessageNode msg; /* 'arena' == NULL: dropped by a failed send */
+} ChanSlot;
+
+/*
+** Channel: bounded multi-producer multi-consumer queue of messages,
+** owned by no worker. The ring is lock-free; 'mutex' only guards the
+** lists of waiters.
+*/
+typedef struct Channel {
+  lus_atomic_t tail; /* next position to write */
+  char pad1[64];     /* keep producers and consumers on separate lines */
+  lus_atomic_t head; /* next position to read */
+  char pad2[64];
+  lus_atomic_t refcount;
+  lus_atomic_t closed;
+  long long capacity; /* messages it can hold */
+  long long mask;     /* size of 'slots' minus 1 (size is a power of 2) */
+  ChanSlot *slots;
+  lus_mutex_t mutex;
+  ChanWaitList readers; /* waiting for a message */
+  ChanWaitList writers; /* waiting for room */
+} Channel;
+
+/* Largest capacity of a channel */
+#define LUS_CHANNEL_MAXCAP (1 << 24)
+
 /*
 ** Worker state (N workers scheduled onto M threads)
 */
 struct WorkerState {
   lua_State *L;             /* worker's Lua state */
+  lua_State *co;            /* coroutine running the script (NULL = not
+                               started); yields to park the worker */
   lua_State *parent;        /* parent state (for permission inheritance) */
   struct WorkerState *next; /* for runnable queue or GC list */
   lus_mutex_t mutex;        /* protects this worker's state */
   lus_cond_t outbox_cond;   /* signal: message in outbox */
-  lus_cond_t inbox_cond;    /* signal: message in inbox */
+  lus_cond_t inbox_cond;    /* signal: message in inbox, room in outbox */
+  lus_cond_t space_cond;    /* signal: room in inbox */
   MessageQueue outbox;      /* worker → main */
   MessageQueue inbox;       /* main → worker */
-  int status;               /* LUS_WORKER_* status */
+  int inbox_cap;            /* messages the inbox holds (0 = unbounded) */
+  int outbox_cap;           /* messages the outbox holds (0 = unbounded) */
+  ChanWaitList senders;     /* parked workers waiting for room in inbox */
+  int status;               /* LUS_WORKER_* status; BLOCKED = parked */
+  int waiting;              /* yielded to wait for a message or for room */
   char *error_msg;          /* error message if status == ERROR */
   char *script_path;        /* path to worker script */
   int nargs;                /* number of arguments (for initial varargs) */
+  int mapper;               /* runs the driver of worker.map on its script */
   int refcount;             /* reference count */
+  int last_thread;          /* pool thread that last ran it (-1 = none) */
   ReceiveContext *recv_ctx; /* context for multi-worker select (NULL if none) */
+  lus_atomic_t runs;        /* times resumed on a pool thread */
+  lus_atomic_t runtime;     /* ns spent running on pool threads */
+};
+
+/* Capacity of a pool thread's run deque (power of 2) */
+#define LUS_DEQUE_SIZE 256
+
+/* Idle rounds a pool thread polls for work before going to sleep */
+#define LUS_POOL_SPINS 64
+
+/*
+** Work-stealing deque (Chase-Lev, fixed capacity). The owning pool
+** thread pushes and pops runnable workers at 'bottom'; other threads
+** steal them from 'top'.
+*/
+typedef struct WorkDeque {
+  lus_atomic_t top;
+  lus_atomic_t bottom;
+  lus_atomic_t slots[LUS_DEQUE_SIZE]; /* WorkerState pointers */
+} WorkDeque;
+
+/*
+** Message counters of one thread, added up by 'lus_worker_stats'. Each
+** thread only adds to its own, so they cost no contention.
+*/
+typedef struct WorkerCounters {
+  lus_atomic_t messages;  /* messages built */
+  lus_atomic_t bytes;     /* their size, attachments included */
+  lus_atomic_t sertime;   /* ns spent building them */
+  lus_atomic_t desertime; /* ns spent delivering messages */
+} WorkerCounters;
+
+/*
+** Pool thread: its deque plus a locked queue for workers handed to it
+** by other threads (a woken worker goes back to the thread that last
+** ran it).
+*/
+struct PoolThread {
+  lus_thread_t thread;
+  int index;                /* position in 'g_pool.threads' */
+  unsigned int seed;        /* victim selection for stealing */
+  WorkDeque deque;
+  lus_mutex_t mutex;        /* protects 'remote_*', 'sleeping', 'running' */
+  lus_cond_t cond;          /* signaled to wake a sleeping thread */
+  WorkerState *remote_head; /* workers handed over by other threads */
+  WorkerState *remote_tail;
+  lus_atomic_t nremote;     /* length of the remote queue */
+  int sleeping;             /* 1 = waiting on 'cond' */
+  WorkerState *running;     /* worker being run (NULL = none) */
+  double slice_end;         /* when its time slice ends */
+  lus_atomic_t busy;        /* 1 = running a worker */
+  WorkerCounters counters;
 };
 
 /*
 ** Global thread pool (M threads servicing N workers)
 */
 struct WorkerPool {
-  lus_thread_t *threads;      /* array of M OS threads */
+  PoolThread *threads;        /* array of M OS threads */
   int nthreads;               /* M = num CPU cores */
-  lus_mutex_t queue_mutex;    /* protects runnable queue */
-  lus_cond_t queue_cond;      /* signal when work available */
-  WorkerState *runnable_head; /* queue of runnable workers */
+  lus_mutex_t queue_mutex;    /* protects the global queue */
+  WorkerState *runnable_head; /* global queue: new and yielding workers */
   WorkerState *runnable_tail;
-  int shutdown;    /* 1 = shutting down */
-  int initialized; /* 1 = pool is ready */
+  lus_atomic_t nglobal;       /* length of the global queue */
+  lus_atomic_t nqueued;       /* runnable workers in all queues */
+  lus_atomic_t nsleeping;     /* pool threads sleeping */
+  lus_atomic_t shutdown;      /* 1 = shutting down */
+  lus_thread_t ticker;        /* arms preemption (see 'worker_preempt') */
+  lus_mutex_t tick_mutex;
+  lus_cond_t tick_cond;       /* signaled to stop the ticker */
+  lus_atomic_t nworkers;      /* workers created and not finished */
+  lus_atomic_t nparked;       /* workers parked until woken */
+  WorkerCounters counters;    /* of the threads outside the pool */
+  int initialized;            /* 1 = pool is ready */
 };
 
+/* Snapshot of the worker pool (see lus_worker_stats) */
+typedef struct lus_WorkerPoolStats {
+  int threads;        /* pool threads */
+  int sleeping;       /* pool threads with nothing to run */
+  long long workers;  /* workers created and not finished */
+  long long running;  /* workers on a pool thread */
+  long long runnable; /* workers queued for a pool thread */
+  long long parked;   /* workers parked until woken */
+  long long messages; /* messages sent so far */
+  long long bytes;    /* their encoded size, attachments included */
+  double serialize;   /* seconds spent encoding messages */
+  double deserialize; /* seconds spent decoding messages */
+} lus_WorkerPoolStats;
+
+/* Snapshot of one worker (see lus_worker_getstats) */
+typedef struct lus_WorkerStats {
+  int status;         /* LUS_WORKER_* */
+  int inbox;          /* messages waiting in its inbox */
+  int outbox;         /* messages waiting in its outbox */
+  long long received; /* messages sent to it so far */
+  long long sent;     /* messages it sent to its outbox so far */
+  long long runs;     /* times it was resumed on a pool thread */
+  double cpu;         /* seconds it spent running on pool threads */
+} lus_WorkerStats;
+
 /*
 ** Worker setup callback - called when a new worker state is created
 */
@@ -133,16 +318,58 @@ LUA_API void lus_worker_pool_shutdown(void);
 /* Set callback invoked when a worker state is created */
 LUA_API void lus_onworker(lua_State *L, lus_WorkerSetup fn);
 
+/* Set how many threads the pool starts (0 = as many as the CPUs the
+   process may use); returns the previous setting (a negative 'n' only
+   queries it). Only affects a pool not started yet */
+LUA_API int lus_worker_threads(int n);
+
+/* Set the time slice (ms) a worker runs before yielding its pool thread to
+   waiting workers (0 = never preempt); returns the previous setting (a
+   negative 'ms' only queries it). Only affects a pool not started yet */
+LUA_API int lus_worker_quantum(int ms);
+
+/* Set how pool threads are pinned to CPUs (LUS_WORKER_PIN_*); returns the
+   previous mode (a negative 'mode' only queries it). Only affects a pool
+   not started yet */
+LUA_API int lus_worker_pinning(int mode);
+
+/* Set how many finished worker states are kept for reuse; returns the
+   previous limit (a negative 'max' only queries it) */
+LUA_API int lus_worker_statepool(int max);
+
 /* Create a worker from C (path on stack at idx, returns userdata) */
 LUA_API WorkerState *lus_worker_create(lua_State *L, const char *path);
 
-/* Send value at stack index to worker's inbox */
+/* Send value at stack index to worker's inbox, waiting while it is full */
 LUA_API int lus_worker_send(lua_State *L, WorkerState *w, int idx);
 
+/* Send value at stack index unless the worker's inbox is full (returns 1
+   if sent) */
+LUA_API int lus_worker_trysend(lua_State *L, WorkerState *w, int idx);
+
+/* Bound the worker's inbox and outbox to the given number of messages
+   (0 = unbounded, negative = unchanged) */
+LUA_API void lus_worker_capacity(WorkerState *w, int inbox, int outbox);
+
 /* Pop message from worker's outbox, push to stack (returns 1 if got msg) */
 LUA_API int lus_worker_receive(lua_State *L, WorkerState *w);
 
+/* Encode value at stack index with the message format and push it as a
+   string; vectors and long strings are copied into it */
+LUA_API void lus_worker_serialize(lua_State *L, int idx);
+
+/* Push the value encoded in 'data' (returns 0 and pushes nothing if the
+   data is malformed) */
+LUA_API int lus_worker_deserialize(lua_State *L, const char *data, size_t len);
+
 /* Get worker status */
 LUA_API int lus_worker_status(WorkerState *w);
 
+/* Fill 's' with a snapshot of the pool; counters of messages add up the
+   whole process */
+LUA_API void lus_worker_stats(lus_WorkerPoolStats *s);
+
+/* Fill 's' with a snapshot of worker 'w' */
+LUA_API void lus_worker_getstats(WorkerState *w, lus_WorkerStats *s);
+
 #endif